@@ -10,6 +10,7 @@
 #include "bloom.h"
 
 #include <assert.h>
+#include <immintrin.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -35,6 +36,11 @@
 #define HSHIFT0 ((31))
 #define HSHIFT1 ((64 - HSHIFT0))
 
+// V2 marker in place of nr_bytes, followed by version and nr_bytes
+#define BLOOMTABLE_MAGIC ((UINT32_MAX))
+// V2 v2_bits trailer of BloomContainer meta
+#define BLOOMCONTAINER_MAGIC ((UINT64_C(0x3276656e69617463)))
+
 // 字节转位
 static inline uint64_t bloom_bytes_to_bits(const uint32_t len)
 {
@@ -43,24 +49,115 @@ static inline uint64_t bloom_bytes_to_bits(const uint32_t len)
 	return (len << 3) - 3;
 }
 
+// salts of the 8 probes (one per 32-bit word of a block)
+static const uint32_t bloom_salts[8] __attribute__((aligned(32))) = {
+	0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+	0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u,
+};
+
+// 选块: fastrange over a multiplicative mix of hv
+static inline uint64_t bloom_block_id(const uint64_t hv, const uint32_t bytes)
+{
+	const uint64_t nr_blocks = bytes / BLOOM_BLOCK_SIZE;
+	const uint64_t x = hv * UINT64_C(0x9e3779b97f4a7c15);
+	return ((x >> 32) * nr_blocks) >> 32;
+}
+
+static bool bloom_block_match_scalar(const uint8_t *const block,
+				     const uint32_t h)
+{
+	// blocks are packed, not aligned
+	uint32_t words[8];
+	memcpy(words, block, sizeof(words));
+	for (uint32_t i = 0u; i < 8u; i++) {
+		const uint32_t bit = (h * bloom_salts[i]) >> 27;
+		if ((words[i] & (UINT32_C(1) << bit)) == 0u) {
+			return false;
+		}
+	}
+	return true;
+}
+
+__attribute__((target("avx2"))) static bool
+bloom_block_match_avx2(const uint8_t *const block, const uint32_t h)
+{
+	const __m256i salts = _mm256_load_si256((const __m256i *)bloom_salts);
+	const __m256i hv = _mm256_set1_epi32((int)h);
+	const __m256i bits =
+		_mm256_srli_epi32(_mm256_mullo_epi32(hv, salts), 27);
+	const __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), bits);
+	const __m256i words = _mm256_loadu_si256((const __m256i *)block);
+	// (~words & mask) == 0
+	return _mm256_testc_si256(words, mask) ? true : false;
+}
+
+static bool (*bloom_block_match)(const uint8_t *const, const uint32_t) =
+	bloom_block_match_scalar;
+
+__attribute__((constructor)) static void bloom_simd_initial(void)
+{
+	bloom_simd_enable(true);
+}
+
+// pick the probe kernel; return true if AVX2 is in use
+bool bloom_simd_enable(const bool enable)
+{
+	__builtin_cpu_init();
+	if (enable && __builtin_cpu_supports("avx2")) {
+		bloom_block_match = bloom_block_match_avx2;
+		return true;
+	}
+	bloom_block_match = bloom_block_match_scalar;
+	return false;
+}
+
 // 创建并初始化过滤器
-struct BloomFilter *bloom_create(const uint32_t nr_keys,
-				 struct Mempool *const mempool)
+struct BloomFilter *bloom_create_version(const uint32_t nr_keys,
+					 const uint32_t version,
+					 struct Mempool *const mempool)
 {
-	const uint32_t bytes0 = (nr_keys * BITS_PER_KEY + 7) >> 3;
-	const uint32_t bytes = (bytes0 < 8u) ? 8u : bytes0; // align
+	uint32_t bytes = 0;
+	if (version == BLOOM_V2) {
+		// nearest whole blocks: on average the same space as V1
+		const uint32_t nr_bits = nr_keys * BITS_PER_KEY;
+		const uint32_t nr_blocks =
+			(nr_bits + (BLOOM_BLOCK_SIZE * 4u)) /
+			(BLOOM_BLOCK_SIZE * 8u);
+		bytes = ((nr_blocks < 1u) ? 1u : nr_blocks) * BLOOM_BLOCK_SIZE;
+	} else {
+		const uint32_t bytes0 = (nr_keys * BITS_PER_KEY + 7) >> 3;
+		bytes = (bytes0 < 8u) ? 8u : bytes0; // align
+	}
 
 	struct BloomFilter *const bf =
 		(typeof(bf))mempool_alloc(mempool, sizeof(*bf) + bytes);
 	bf->bytes = bytes;
 	bf->nr_keys = 0;
+	bf->version = version;
 	bzero(bf->filter, bytes);
 	return bf;
 }
 
+struct BloomFilter *bloom_create(const uint32_t nr_keys,
+				 struct Mempool *const mempool)
+{
+	return bloom_create_version(nr_keys, BLOOM_VERSION, mempool);
+}
+
 // 更性 hv 对应的映射位置
 void bloom_update(struct BloomFilter *const bf, const uint64_t hv)
 {
+	bf->nr_keys++;
+	if (bf->version == BLOOM_V2) {
+		const uint64_t bid = bloom_block_id(hv, bf->bytes);
+		uint32_t *const words =
+			(typeof(words))(bf->filter + (bid * BLOOM_BLOCK_SIZE));
+		const uint32_t h = (uint32_t)hv;
+		for (uint32_t i = 0u; i < 8u; i++) {
+			words[i] |= UINT32_C(1) << ((h * bloom_salts[i]) >> 27);
+		}
+		return;
+	}
 	uint64_t h = hv;
 	const uint64_t delta = (h >> HSHIFT0) | (h << HSHIFT1);
 	// bytes 转位
@@ -73,7 +170,6 @@ void bloom_update(struct BloomFilter *const bf, const uint64_t hv)
 		bf->filter[bitpos >> 3u] |= (1u << (bitpos % 8u));
 		h += delta;
 	}
-	bf->nr_keys++;
 }
 
 // 查询是否存在, 返回布尔
@@ -95,10 +191,32 @@ static inline bool bloom_match_raw(const uint8_t *const filter,
 	return true;
 }
 
+// tables built by older versions put (len % 32) padding bytes in front
+static inline bool bloom_match_blocked(const uint8_t *const filter,
+				       const uint32_t len, const uint64_t hv)
+{
+	const uint32_t pad = len % BLOOM_BLOCK_SIZE;
+	const uint32_t bytes = len - pad;
+	const uint64_t bid = bloom_block_id(hv, bytes);
+	return bloom_block_match(filter + pad + (bid * BLOOM_BLOCK_SIZE),
+				 (uint32_t)hv);
+}
+
+static inline bool bloom_match_version(const uint32_t version,
+				       const uint8_t *const filter,
+				       const uint32_t len, const uint64_t hv)
+{
+	if (version == BLOOM_V2) {
+		return bloom_match_blocked(filter, len, hv);
+	} else {
+		return bloom_match_raw(filter, len, hv);
+	}
+}
+
 // 是否存在 hv
 bool bloom_match(const struct BloomFilter *const bf, const uint64_t hv)
 {
-	return bloom_match_raw(bf->filter, bf->bytes, hv);
+	return bloom_match_version(bf->version, bf->filter, bf->bytes, hv);
 }
 
 // format: <length> <raw_bf> <length> <raw_bf> ...
@@ -114,6 +232,7 @@ struct BloomTable *bloomtable_build(struct BloomFilter *const *const bfs,
 		sizeof(*bt) + (nr_offsets * sizeof(bt->offsets[0])));
 	// 断言
 	assert(bt);
+	const uint32_t version = nr_bf ? bfs[0]->version : BLOOM_VERSION;
 
 	// 布隆过滤器总大小
 	uint32_t all_bytes = 0;
@@ -122,6 +241,7 @@ struct BloomTable *bloomtable_build(struct BloomFilter *const *const bfs,
 	// counting bytes
 	for (uint64_t i = 0; i < nr_bf; i++) {
 		struct BloomFilter *const bf = bfs[i];
+		assert(bf->version == version);
 		const uint8_t *p = encode_uint64(buf, bf->bytes);
 		// p - buf 得到 bf->bytes 占用多少个 uint8_t
 		const uint32_t bytes = p + bf->bytes - buf;
@@ -145,17 +265,26 @@ struct BloomTable *bloomtable_build(struct BloomFilter *const *const bfs,
 		// 偏移填充映射内存数据的位置
 		ptr = pfilter + bf->bytes;
 	}
+	assert(ptr == (raw_bf + all_bytes));
 	// 布隆过滤器数量断言
 	assert(nr_bf < UINT64_C(0x100000000));
 	bt->nr_bf = (typeof(bt->nr_bf))nr_bf;
 	bt->raw_bf = raw_bf;
+	bt->version = version;
 	return bt;
 }
 
 // 把布隆过滤器表写入文件
+// V1: <nr_bytes> <raw_bf>
+// V2: <BLOOMTABLE_MAGIC> <version> <nr_bytes> <raw_bf>
 bool bloomtable_dump(struct BloomTable *const bt, FILE *const fo)
 {
 	assert(bt);
+	if (bt->version != BLOOM_V1) {
+		const uint32_t head[2] = { BLOOMTABLE_MAGIC, bt->version };
+		const size_t nh = fwrite(head, sizeof(head), 1, fo);
+		assert(nh == 1);
+	}
 	const size_t nb = fwrite(&(bt->nr_bytes), sizeof(bt->nr_bytes), 1, fo);
 	assert(nb == 1);
 
@@ -172,6 +301,14 @@ struct BloomTable *bloomtable_load(FILE *const fi)
 	uint32_t raw_size;
 	const size_t ns = fread(&raw_size, sizeof(raw_size), 1, fi);
 	assert(ns == 1);
+	uint32_t version = BLOOM_V1;
+	if (raw_size == BLOOMTABLE_MAGIC) {
+		const size_t nv = fread(&version, sizeof(version), 1, fi);
+		assert(nv == 1);
+		assert(version == BLOOM_V2);
+		const size_t ns2 = fread(&raw_size, sizeof(raw_size), 1, fi);
+		assert(ns2 == 1);
+	}
 
 	uint8_t *const raw_bf = (typeof(raw_bf))malloc(raw_size + 8);
 	assert(raw_bf);
@@ -200,6 +337,7 @@ struct BloomTable *bloomtable_load(FILE *const fi)
 	struct BloomTable *const bt = (typeof(bt))malloc(
 		sizeof(*bt) + (nr_offsets * sizeof(bt->offsets[0])));
 	assert(bt);
+	bt->version = version;
 	bt->raw_bf = raw_bf;
 	bt->nr_bf = nr_bf;
 	bt->nr_bytes = raw_size;
@@ -228,7 +366,7 @@ bool bloomtable_match(struct BloomTable *const bt, const uint32_t index,
 	assert(pbf > ptr);
 	assert(bytes);
 
-	return bloom_match_raw(pbf, bytes, hv);
+	return bloom_match_version(bt->version, pbf, bytes, hv);
 }
 
 void bloomtable_free(struct BloomTable *const bt)
@@ -323,6 +461,7 @@ struct BloomContainer *bloomcontainer_build(struct BloomTable *const bt,
 	bc->off_raw = off_raw;
 	bc->nr_barrels = bt->nr_bf;
 	bc->nr_bf_per_box = 1;
+	bc->v2_bits = (bt->version == BLOOM_V2) ? 1u : 0u;
 	bc->nr_index = current_page;
 	memcpy(bc->index_last, index_last,
 	       sizeof(index_last[0]) * current_page);
@@ -451,6 +590,11 @@ struct BloomContainer *bloomcontainer_update(struct BloomContainer *const bc,
 	bc_new->off_raw = new_off_raw;
 	bc_new->nr_barrels = bc->nr_barrels;
 	bc_new->nr_bf_per_box = bc->nr_bf_per_box + 1; // ++
+	// the new filter is the newest one: bit nr_bf_per_box
+	bc_new->v2_bits =
+		bc->v2_bits | ((bt->version == BLOOM_V2) ?
+				       (UINT64_C(1) << bc->nr_bf_per_box) :
+				       0u);
 	bc_new->nr_index = current_page;
 	memcpy(bc_new->index_last, index_last,
 	       sizeof(index_last[0]) * current_page);
@@ -493,6 +637,12 @@ bool bloomcontainer_dump_meta(struct BloomContainer *const bc, FILE *const fo)
 	const size_t nidx = fwrite(bc->index_last, sizeof(bc->index_last[0]),
 				   bc->nr_index, fo);
 	assert(nidx == bc->nr_index);
+	// trailer, absent in V1-only metadata
+	if (bc->v2_bits) {
+		const uint64_t tail[2] = { BLOOMCONTAINER_MAGIC, bc->v2_bits };
+		const size_t nt = fwrite(tail, sizeof(tail), 1, fo);
+		assert(nt == 1);
+	}
 	return true;
 }
 
@@ -522,6 +672,10 @@ struct BloomContainer *bloomcontainer_load_meta(FILE *const fi,
 	const size_t nidx = fread(bc->index_last, sizeof(bc->index_last[0]),
 				  bc->nr_index, fi);
 	assert(nidx == bc->nr_index);
+	uint64_t tail[2];
+	const size_t nt = fread(tail, sizeof(tail), 1, fi);
+	bc->v2_bits =
+		((nt == 1) && (tail[0] == BLOOMCONTAINER_MAGIC)) ? tail[1] : 0u;
 	return bc;
 }
 
@@ -538,10 +692,12 @@ static uint64_t bloomcontainer_match_nr(struct BloomContainer *const bc,
 		const uint8_t *const pbf = decode_uint32(ptr, &blen);
 		assert(pbf > ptr);
 		assert(blen);
-		const bool match = bloom_match_raw(pbf, blen, hv);
+		const uint64_t l = (nr_bf - i - 1); // nr_bf = x+1; 0-x => x-0
+		const bool v2 = (bc->v2_bits & (UINT64_C(1) << l)) ? true :
+								      false;
+		const uint32_t version = v2 ? BLOOM_V2 : BLOOM_V1;
+		const bool match = bloom_match_version(version, pbf, blen, hv);
 		if (match) {
-			const uint64_t l =
-				(nr_bf - i - 1); // nr_bf = x+1; 0-x => x-0
 			bits |= (UINT64_C(1) << l);
 		}
 		ptr = pbf + blen;
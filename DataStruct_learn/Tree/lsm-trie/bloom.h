@@ -12,11 +12,22 @@
 #include "mempool.h"
 #include "stat.h"
 
+// V1: NR_PROBES bit probes spread over the whole filter
+// V2: blocked, 8 probes of one key land in one 32-byte block
+// V2 filters are rounded to the nearest whole block and packed like V1 in
+// a BloomTable, so both take the same space on average; see
+// 'bloom_test bench' for fp at equal bits/key.
+#define BLOOM_V1 ((1u))
+#define BLOOM_V2 ((2u))
+#define BLOOM_VERSION ((BLOOM_V2))
+#define BLOOM_BLOCK_SIZE ((32u))
+
 struct BloomFilter {
 	// 可以存大小
 	uint32_t bytes; // bytes = bits >> 3 (length of filter)
 	// 键计数器
 	uint32_t nr_keys;
+	uint32_t version;
 	// 映射内存
 	uint8_t filter[];
 };
@@ -25,6 +36,7 @@ struct BloomFilter {
 // format: encoded bits, bits
 #define BLOOMTABLE_INTERVAL ((16u))
 struct BloomTable {
+	uint32_t version;
 	// 布隆过滤器内存指针
 	uint8_t *raw_bf;
 	// 布隆过滤器个数
@@ -45,13 +57,21 @@ struct BloomContainer {
 	// 桶个数
 	uint32_t nr_index;
 	uint64_t mtid;
+	// bit l set: the filter of metatable l is BLOOM_V2
+	uint64_t v2_bits;
 	// 每个桶 id
 	uint16_t index_last[]; // the LAST barrel_id in each box
 };
 
+bool bloom_simd_enable(const bool enable);
+
 struct BloomFilter *bloom_create(const uint32_t nr_keys,
 				 struct Mempool *const mempool);
 
+struct BloomFilter *bloom_create_version(const uint32_t nr_keys,
+					 const uint32_t version,
+					 struct Mempool *const mempool);
+
 void bloom_update(struct BloomFilter *const bf, const uint64_t hv);
 
 bool bloom_match(const struct BloomFilter *const bf, const uint64_t hv);
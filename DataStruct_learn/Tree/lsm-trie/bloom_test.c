@@ -43,6 +43,7 @@ void uncached_probe_test(void)
 		struct BloomFilter *const bf = (typeof(bf))(bf0 + (i * usize));
 		memset(bf, -1, usize);
 		bf->bytes = 4000;
+		bf->version = BLOOM_V1;
 		bfs[i] = bf;
 		// printf("%ld\n", sizeof(*bf));
 	}
@@ -336,13 +337,142 @@ void containertest(void)
 	printf("containertest: passed\n");
 }
 
+// V1 and V2 tables must survive dump/load with identical answers
+void format_test(void)
+{
+	struct Mempool *const mp = mempool_new(4096 * 4096);
+	const uint32_t versions[2] = { BLOOM_V1, BLOOM_V2 };
+	for (uint64_t v = 0; v < 2; v++) {
+		struct BloomFilter *bfs[64];
+		for (uint64_t i = 0; i < 64; i++) {
+			bfs[i] = bloom_create_version(i, versions[v], mp);
+			for (uint64_t j = 0; j < i; j++) {
+				const uint64_t h = (i << 32) + j * 0x9e3779b9u;
+				bloom_update(bfs[i], h);
+			}
+		}
+		struct BloomTable *const bt = bloomtable_build(bfs, 64);
+		FILE *const fo = fopen("/tmp/bttest", "wb");
+		assert(fo);
+		bloomtable_dump(bt, fo);
+		fclose(fo);
+		FILE *const fi = fopen("/tmp/bttest", "rb");
+		assert(fi);
+		struct BloomTable *const bt2 = bloomtable_load(fi);
+		fclose(fi);
+		assert(bt2->version == versions[v]);
+		assert(bt2->nr_bf == 64);
+		for (uint64_t i = 0; i < 64; i++) {
+			for (uint64_t j = 0; j < i; j++) {
+				const uint64_t h = (i << 32) + j * 0x9e3779b9u;
+				assert(bloomtable_match(bt, i, h));
+				assert(bloomtable_match(bt2, i, h));
+			}
+			for (uint64_t j = 0; j < 256; j++) {
+				const uint64_t h = random_uint64();
+				assert(bloomtable_match(bt, i, h) ==
+				       bloomtable_match(bt2, i, h));
+			}
+		}
+		printf("format V%u: %u bytes ok\n", versions[v], bt->nr_bytes);
+		bloomtable_free(bt);
+		bloomtable_free(bt2);
+	}
+	mempool_free(mp);
+}
+
+// false-positive rate and negative probes/sec: V1, V2 scalar, V2 AVX2
+// bits/key counts the whole BloomTable (length bytes included), so the
+// rows compare fp at equal space. "mixed" gives every filter 16 to 48
+// keys: V2 rounds each filter to whole blocks, V1 to bytes
+void blocked_benchmark(void)
+{
+	srandom(debug_time_usec());
+	// about one table: 8191 barrels x 32 keys
+	const uint64_t nr_bf = 8191;
+	const uint64_t nr_probes = UINT64_C(20000000);
+	uint64_t *const probes = malloc(sizeof(probes[0]) * nr_probes);
+	assert(probes);
+	for (uint64_t i = 0; i < nr_probes; i++) {
+		probes[i] = random_uint64();
+	}
+	uint32_t *const nr_keys = malloc(sizeof(nr_keys[0]) * nr_bf);
+	assert(nr_keys);
+
+	const char *const tags[3] = { "V1", "V2-scalar", "V2-avx2" };
+	const uint32_t versions[3] = { BLOOM_V1, BLOOM_V2, BLOOM_V2 };
+	const bool simd[3] = { false, false, true };
+	for (uint64_t m = 0; m < 2; m++) {
+		uint64_t nr_all = 0;
+		for (uint64_t i = 0; i < nr_bf; i++) {
+			nr_keys[i] = m ? (16u + (random_uint64() % 33u)) : 32u;
+			nr_all += nr_keys[i];
+		}
+		for (uint64_t c = 0; c < 3; c++) {
+			const bool using_simd = bloom_simd_enable(simd[c]);
+			if (simd[c] && (using_simd == false)) {
+				printf("%-9s skipped (no AVX2)\n", tags[c]);
+				continue;
+			}
+			struct Mempool *const mp = mempool_new(nr_bf * 4096);
+			struct BloomFilter *bfs[nr_bf];
+			for (uint64_t i = 0; i < nr_bf; i++) {
+				bfs[i] = bloom_create_version(nr_keys[i],
+							      versions[c], mp);
+				for (uint64_t j = 0; j < nr_keys[i]; j++) {
+					// keys are odd, probes below are even
+					const uint64_t h =
+						(random_uint64() << 1) | 1u;
+					bloom_update(bfs[i], h);
+				}
+			}
+			struct BloomTable *const bt =
+				bloomtable_build(bfs, nr_bf);
+
+			// BloomFilter probes
+			uint64_t fp = 0;
+			const double t0 = debug_time_sec();
+			for (uint64_t i = 0; i < nr_probes; i++) {
+				const uint64_t h = probes[i] & (~UINT64_C(1));
+				fp += bloom_match(bfs[i % nr_bf], h) ? 1u : 0u;
+			}
+			const double t1 = debug_time_sec();
+			// BloomTable probes (includes locating the filter)
+			uint64_t fp2 = 0;
+			for (uint64_t i = 0; i < nr_probes; i++) {
+				const uint64_t h = probes[i] & (~UINT64_C(1));
+				const uint32_t index =
+					(uint32_t)(probes[i] % nr_bf);
+				fp2 += bloomtable_match(bt, index, h) ? 1u : 0u;
+			}
+			const double t2 = debug_time_sec();
+			printf("%-5s %-9s bytes %8u bits/key %5.2lf fp %.4lf%% ",
+			       m ? "mixed" : "32", tags[c], bt->nr_bytes,
+			       ((double)bt->nr_bytes) * 8.0 / ((double)nr_all),
+			       ((double)(fp + fp2)) * 50.0 /
+				       ((double)nr_probes));
+			printf("filter %12.0lf p/s table %12.0lf p/s\n",
+			       ((double)nr_probes) / (t1 - t0),
+			       ((double)nr_probes) / (t2 - t1));
+			bloomtable_free(bt);
+			mempool_free(mp);
+		}
+	}
+	bloom_simd_enable(true);
+	free(nr_keys);
+	free(probes);
+}
+
 int main(int argc, char **argv)
 {
-	(void)argc;
-	(void)argv;
 	// // 未缓存测试
 	// uncached_probe_test();
 	// false_positive_test();
 	// multi_level_false_positive_test();
+	format_test();
 	containertest();
+	// bloom_test bench
+	if ((argc > 1) && (strcmp(argv[1], "bench") == 0)) {
+		blocked_benchmark();
+	}
 }
@@ -213,10 +213,23 @@ void containermap_dump(struct ContainerMap *const cm, const char *const meta_fn)
 	assert(nby == nr_bytes);
 	// 解锁
 	pthread_mutex_unlock(&(cm->mutex_cm));
+	// durable before the META symlinks point to it
+	fflush(cmap_out);
+	const int rs = fsync(fileno(cmap_out));
+	assert(rs == 0);
 	// 关闭文件
 	fclose(cmap_out);
 }
 
+// 刷写 raw container 中已写入的数据
+void containermap_sync(struct ContainerMap *const cm)
+{
+	if (cm->raw_fd >= 0) {
+		const int rs = fdatasync(cm->raw_fd);
+		assert(rs == 0);
+	}
+}
+
 // 打印使用状态
 void containermap_show(struct ContainerMap *const cm)
 {
@@ -43,3 +43,5 @@ bool containermap_release(struct ContainerMap *const cm, const uint64_t offset);
 void containermap_destroy(struct ContainerMap *const cm);
 
 uint64_t containermap_unused(const struct ContainerMap *const cm);
+
+void containermap_sync(struct ContainerMap *const cm);
@@ -30,8 +30,13 @@
 #include "conc.h"
 #include "debug.h"
 #include "generator.h"
+#include "hist.h"
+#include "iobatch.h"
+#include "ordered.h"
+#include "ratelimit.h"
 #include "rwlock.h"
 #include "table.h"
+#include "wal.h"
 
 #include "db.h"
 
@@ -70,6 +75,8 @@ struct VirtualContainer {
 #define DB_FEED_NR ((TABLE_MAX_BARRELS / DB_FEED_UNIT))
 // db 层数
 #define DB_NR_LEVELS ((5))
+// io_uring depth for db_multi_lookup
+#define DB_MULTI_IO_DEPTH ((256u))
 
 struct ContainerMapConf {
 	// 配置设备
@@ -84,6 +91,7 @@ struct ContainerMapConf {
 struct DB {
 	// 目录
 	char *persist_dir;
+	struct DBConf conf;
 	double sec_start;
 	FILE *log;
 	// 零是活动的
@@ -122,6 +130,17 @@ struct DB {
 	uint64_t next_mtid;
 	uint64_t compaction_token;
 	uint64_t compaction_running_counter;
+	// 预写日志, NULL if WAL_OFF
+	struct WAL *wal;
+	// segments <= wal_retired hold dumped tables only
+	uint64_t wal_retired;
+	// compaction I/O 限速
+	struct RateLimiter *limiter;
+	// lookups doing barrel I/O right now (limiter pressure)
+	uint64_t nr_lookup_io;
+	// 延迟直方图, NULL unless conf.latency_stats
+	struct Hist *hist;
+	struct HistServer *hist_server;
 	// stat
 	struct Stat stat;
 };
@@ -162,6 +181,9 @@ struct Compaction {
 #define DB_META_ACTIVE_TABLE ("ACTIVE_TABLE")
 #define DB_META_LOG ("LOG")
 #define DB_META_BACKUP_DIR ("META_BACKUP")
+#define DB_META_KEYS_SUFFIX (".keys")
+#define DB_META_WAL_DIR ("WAL")
+#define DB_META_STATS_SOCK ("stats.sock")
 
 // free metafn after use!
 static void db_generate_meta_fn(struct DB *const db, const uint64_t mtid,
@@ -170,6 +192,28 @@ static void db_generate_meta_fn(struct DB *const db, const uint64_t mtid,
 	sprintf(path, "%s/%02lx/%016lx", db->persist_dir, mtid % 256, mtid);
 }
 
+static void db_generate_keys_fn(struct DB *const db, const uint64_t mtid,
+				char *const path)
+{
+	db_generate_meta_fn(db, mtid, path);
+	strcat(path, DB_META_KEYS_SUFFIX);
+}
+
+// sorted keys of a table, the barrels are read if no .keys file
+static struct KeyRun *db_load_keyrun(struct DB *const db,
+				     struct MetaTable *const mt)
+{
+	char keysfn[2048];
+	db_generate_keys_fn(db, mt->mtid, keysfn);
+	struct KeyRun *run = keyrun_load(keysfn);
+	if (run == NULL) {
+		run = metatable_build_keyrun(mt);
+		keyrun_sort(run);
+		keyrun_dump(run, keysfn);
+	}
+	return run;
+}
+
 static struct MetaTable *db_load_metatable(struct DB *const db,
 					   const uint64_t mtid,
 					   const int raw_fd, const bool load_bf)
@@ -180,6 +224,10 @@ static struct MetaTable *db_load_metatable(struct DB *const db,
 		metatable_load(metafn, raw_fd, load_bf, &(db->stat));
 	assert(mt);
 	mt->mtid = mtid;
+	mt->hist = db->hist;
+	if (db->conf.ordered_index) {
+		mt->keyrun = db_load_keyrun(db, mt);
+	}
 	return mt;
 }
 
@@ -188,6 +236,8 @@ static void db_destory_metatable(struct DB *const db, const uint64_t mtid)
 	char metafn[2048];
 	db_generate_meta_fn(db, mtid, metafn);
 	unlink(metafn);
+	db_generate_keys_fn(db, mtid, metafn);
+	unlink(metafn);
 }
 
 static struct BloomContainer *db_load_bloomcontainer_meta(struct DB *const db,
@@ -214,6 +264,9 @@ static bool db_dump_bloomcontainer_meta(struct DB *const db,
 	FILE *const fo = fopen(bcmeta_fn, "wb");
 	assert(fo);
 	const bool r = bloomcontainer_dump_meta(bc, fo);
+	fflush(fo);
+	const int rs = fsync(fileno(fo));
+	assert(rs == 0);
 	fclose(fo);
 	return r;
 }
@@ -449,14 +502,31 @@ recursive_parse(FILE *const in, const uint64_t start_bit, struct DB *const db)
 	return vc;
 }
 
+// 新表; compressed if configured
+static struct Table *db_table_new(struct DB *const db,
+				  const double mempool_factor)
+{
+	struct Table *const table = table_alloc_default(mempool_factor);
+	if (table && db->conf.compress) {
+		table_set_lz4(table, true);
+	}
+	return table;
+}
+
 // db 初始化
 static void db_initial(struct DB *const db, const char *const meta_dir,
-		       struct ContainerMapConf *const cm_conf)
+		       struct ContainerMapConf *const cm_conf,
+		       const struct DBConf *const conf)
 {
 	// Load Meta
 	// dir (for dump)
 	// 分配内存，返回指针，赋值给 persist_dir
 	db->persist_dir = strdup(meta_dir);
+	db->conf = *conf;
+	if (conf->compress && (table_lz4_available() == false)) {
+		// built without LSMTRIE_LZ4
+		db->conf.compress = false;
+	}
 
 	// set cms
 	assert(cm_conf);
@@ -468,7 +538,7 @@ static void db_initial(struct DB *const db, const char *const meta_dir,
 	assert(db->cm_bc);
 
 	// active tables
-	db->active_table[0] = table_alloc_default(15.0);
+	db->active_table[0] = db_table_new(db, 15.0);
 	db->active_table[1] = NULL;
 
 	// threading vars
@@ -498,25 +568,76 @@ static void db_initial(struct DB *const db, const char *const meta_dir,
 	FILE *const log = fopen(path, "a"); // NULL is OK
 	db->log = log;
 
+	// wal
+	if (conf->wal_mode != WAL_OFF) {
+		sprintf(path, "%s/%s", db->persist_dir, DB_META_WAL_DIR);
+		mkdir(path, 00755);
+		db->wal = wal_open(path, conf->wal_mode, conf->wal_sync_ms,
+				   &(db->stat));
+		assert(db->wal);
+	}
+	db->limiter = ratelimit_new(conf->compaction_mbps << 20,
+				    &(db->nr_lookup_io),
+				    conf->compaction_backoff, &(db->stat));
+	if (conf->latency_stats) {
+		db->hist = hist_new();
+		sprintf(path, "%s/%s", db->persist_dir, DB_META_STATS_SOCK);
+		// NULL if the path is unusable, the histograms still work
+		db->hist_server = hist_serve(db->hist, path);
+	}
+
 	// running
 	db->sec_start = debug_time_sec();
 	db->closing = false;
 }
 
+// fsync a directory: new entries and symlinks in it become durable
+static void db_sync_dir(const char *const path)
+{
+	const int fd = open(path, O_RDONLY | O_DIRECTORY);
+	assert(fd >= 0);
+	const int rs = fsync(fd);
+	assert(rs == 0);
+	close(fd);
+}
+
+// point <persist_dir>/<name> to ./META_BACKUP/<name>-<sec0>
+static void db_link_meta(struct DB *const db, const char *const name,
+			 const double sec0)
+{
+	char path_sym[256];
+	char path_target[256];
+	sprintf(path_sym, "%s/%s", db->persist_dir, name);
+	if (access(path_sym, F_OK) == 0) {
+		const int ru = unlink(path_sym);
+		assert(ru == 0);
+	}
+	sprintf(path_target, "./%s/%s-%018.6lf", DB_META_BACKUP_DIR, name,
+		sec0);
+	const int rs = symlink(path_target, path_sym);
+	assert(rs == 0);
+}
+
 // backup db metadata
+// 持久化顺序: the META and cmap files are written under the reader lock;
+// then the raw containers (data of every table META refers to), the table
+// meta directories and the backup directory are synced; only then the
+// symlinks are switched and the persist directory synced. WAL segments of
+// the dumped tables are purged last, so an acknowledged insert is always
+// in a durable table or in the WAL
 static bool db_dump_meta(struct DB *const db)
 {
-	char path_meta[256];
-	char path_sym[256];
+	char path[256];
 
 	const double sec0 = debug_time_sec();
 	// prepare files
-	sprintf(path_meta, "%s/%s/%s-%018.6lf", db->persist_dir,
-		DB_META_BACKUP_DIR, DB_META_MAIN, sec0);
-	FILE *const meta_out = fopen(path_meta, "w");
+	sprintf(path, "%s/%s/%s-%018.6lf", db->persist_dir, DB_META_BACKUP_DIR,
+		DB_META_MAIN, sec0);
+	FILE *const meta_out = fopen(path, "w");
 	assert(meta_out);
 
 	const uint64_t ticket = rwlock_reader_lock(&(db->rwlock));
+	const uint64_t wal_retired = db->wal_retired;
 	// dump meta
 	// write vc
 	const bool r_meta = recursive_dump(db->vcroot, meta_out);
@@ -524,40 +645,44 @@ static bool db_dump_meta(struct DB *const db)
 	// write mtid
 	const uint64_t db_next_mtid = db->next_mtid;
 	fprintf(meta_out, "%lu\n", db_next_mtid);
+	fflush(meta_out);
+	const int rs = fsync(fileno(meta_out));
+	assert(rs == 0);
 	fclose(meta_out);
 
-	// create symlink for newest meta
-	sprintf(path_sym, "%s/%s", db->persist_dir, DB_META_MAIN);
-	if (access(path_sym, F_OK) == 0) {
-		const int ru = unlink(path_sym);
-		assert(ru == 0);
-	}
-	sprintf(path_meta, "./%s/%s-%018.6lf", DB_META_BACKUP_DIR, DB_META_MAIN,
-		sec0);
-	const int rsm = symlink(path_meta, path_sym);
-	assert(rsm == 0);
-
 	// dump container-maps
 	for (int i = 0; db->cms_dump[i]; i++) {
-		char path_cm_dump[256];
-		sprintf(path_cm_dump, "%s/%s/%s-%01d-%018.6lf", db->persist_dir,
-			DB_META_BACKUP_DIR, DB_META_CMAP_PREFIX, i, sec0);
-		containermap_dump(db->cms_dump[i], path_cm_dump);
-		// create symlink for newest meta
-		sprintf(path_sym, "%s/%s-%01d", db->persist_dir,
-			DB_META_CMAP_PREFIX, i);
-		if (access(path_sym, F_OK) == 0) {
-			const int ru = unlink(path_sym);
-			assert(ru == 0);
-		}
-		sprintf(path_cm_dump, "./%s/%s-%01d-%018.6lf",
+		sprintf(path, "%s/%s/%s-%01d-%018.6lf", db->persist_dir,
 			DB_META_BACKUP_DIR, DB_META_CMAP_PREFIX, i, sec0);
-		const int rs = symlink(path_cm_dump, path_sym);
-		assert(rs == 0);
+		containermap_dump(db->cms_dump[i], path);
 	}
-
 	// done
 	rwlock_reader_unlock(&(db->rwlock), ticket);
+
+	// table data and table meta files
+	for (int i = 0; db->cms_dump[i]; i++) {
+		containermap_sync(db->cms_dump[i]);
+	}
+	for (uint64_t i = 0; i < 256; i++) {
+		sprintf(path, "%s/%02lx", db->persist_dir, i);
+		db_sync_dir(path);
+	}
+	sprintf(path, "%s/%s", db->persist_dir, DB_META_BACKUP_DIR);
+	db_sync_dir(path);
+
+	// create symlinks for newest meta
+	db_link_meta(db, DB_META_MAIN, sec0);
+	for (int i = 0; db->cms_dump[i]; i++) {
+		char name[64];
+		sprintf(name, "%s-%01d", DB_META_CMAP_PREFIX, i);
+		db_link_meta(db, name, sec0);
+	}
+	db_sync_dir(db->persist_dir);
+
+	// the dumped tables are reachable from a durable META now
+	if (db->wal && wal_retired) {
+		wal_purge(db->wal, wal_retired);
+	}
 	db_log_diff(db, sec0, "Dumping Metadata Finished (%06lx)",
 		    db_next_mtid);
 	fflush(db->log);
@@ -574,6 +699,16 @@ static void db_free(struct DB *const db)
 		table_free(db->active_table[1]);
 	}
 	vc_recursive_free(db->vcroot);
+	if (db->wal) {
+		wal_close(db->wal);
+	}
+	ratelimit_free(db->limiter);
+	if (db->hist_server) {
+		hist_serve_stop(db->hist_server);
+	}
+	if (db->hist) {
+		hist_free(db->hist);
+	}
 	fclose(db->log);
 	for (int i = 0; db->cms_dump[i]; i++) {
 		containermap_destroy(db->cms_dump[i]);
@@ -656,6 +791,15 @@ static uint64_t db_table_dump(struct DB *const db, struct Table *const table,
 	// 表元索引持久化
 	const bool rdm = table_dump_meta(table, metafn, off_main);
 	assert(rdm);
+	// 有序键, loaded back with the metatable
+	if (db->conf.ordered_index) {
+		struct KeyRun *const run = table_build_keyrun(table);
+		keyrun_sort(run);
+		db_generate_keys_fn(db, mtid, metafn);
+		const bool rdk = keyrun_dump(run, metafn);
+		assert(rdk);
+		keyrun_release(run);
+	}
 	db_log_diff(db, sec0, "DUMP @%lu [%8lx #%08lx] [%08lu] %s",
 		    start_bit / 3, mtid, off_main / TABLE_ALIGN, nr_items,
 		    buffer);
@@ -703,9 +847,19 @@ static void compaction_initial(struct Compaction *const comp,
 	}
 
 	// new tables
+	// compressed values stay compressed (they may not fit once inflated)
+	bool lz4 = false;
+	for (uint64_t i = 0; (i < nr_feed) && (lz4 == false); i++) {
+		lz4 = metatable_lz4(comp->mts_old[i]);
+	}
 	for (uint64_t i = 0; i < 8u; i++) {
-		struct Table *const table = table_alloc_default(1.8);
+		struct Table *const table = db_table_new(db, 1.8);
 		assert(table);
+		if (lz4) {
+			table_set_lz4(table, true);
+		}
+		// dump writes go through the limiter
+		table->limiter = db->limiter;
 		comp->tables[i] = table;
 	}
 
@@ -732,6 +886,7 @@ static bool compaction_feed(struct Compaction *const comp)
 					  DB_FEED_UNIT;
 	uint8_t *const arena = comp->arena + (token * BARREL_ALIGN);
 	assert((token + nr_fetch) <= TABLE_NR_BARRELS);
+	ratelimit_request(comp->db->limiter, nr_fetch * BARREL_ALIGN);
 	metatable_feed_barrels_to_tables(mt, token, nr_fetch, arena,
 					 comp->tables, compaction_select_table,
 					 comp->sub_bit);
@@ -886,13 +1041,26 @@ static void compaction_update_vc(struct Compaction *const comp)
 	rwlock_writer_unlock(&(comp->db->rwlock), ticket);
 }
 
+// 释放一个 MetaTable 引用; 最后一个引用释放表, 如果表已被 compaction
+// 丢弃, 同时归还它在 container 中的空间 (迭代器可能还在读它的桶)
+static void db_metatable_put(struct MetaTable *const mt)
+{
+	if (metatable_release(mt) == false) {
+		return;
+	}
+	if (mt->retired_cm) {
+		containermap_release(mt->retired_cm, mt->mfh.off);
+	}
+	metatable_free(mt);
+}
+
 static void compaction_free_old(struct Compaction *const comp)
 {
 	// free n
 	for (uint64_t i = 0; i < comp->nr_feed; i++) {
-		containermap_release(comp->db->cms[comp->start_bit / 3],
-				     comp->mts_old[i]->mfh.off);
-		metatable_free(comp->mts_old[i]);
+		comp->mts_old[i]->retired_cm =
+			comp->db->cms[comp->start_bit / 3];
+		db_metatable_put(comp->mts_old[i]);
 		db_destory_metatable(comp->db, comp->mtids_old[i]);
 	}
 
@@ -918,11 +1086,20 @@ static void compaction_main(struct DB *const db,
 	const double sec0 = debug_time_sec();
 	compaction_initial(&comp, db, vc, nr_feed);
 	// feed (must sequential)
+	const uint64_t t0 = debug_time_nsec();
 	compaction_feed_all(&comp);
 	// build bt
+	const uint64_t t1 = debug_time_nsec();
 	compaction_build_bt_all(&comp);
 	// dump table and bc
+	const uint64_t t2 = debug_time_nsec();
 	compaction_dump_and_bc_all(&comp);
+	if (db->hist) {
+		const uint64_t t3 = debug_time_nsec();
+		hist_record(db->hist, HIST_COMP_FEED, t1 - t0);
+		hist_record(db->hist, HIST_COMP_BT, t2 - t1);
+		hist_record(db->hist, HIST_COMP_DUMP, t3 - t2);
+	}
 	// apply changes
 	compaction_update_vc(&comp);
 	// free old
@@ -1089,6 +1266,8 @@ static void *thread_active_dumper(void *ptr)
 		// shift active table
 		// 获取 db 写锁
 		const uint64_t ticket1 = rwlock_writer_lock(&(db->rwlock));
+		// 日志分段, 与表一一对应
+		const uint64_t wal_seq = db->wal ? wal_rotate(db->wal) : 0;
 		// 移动表零到表一
 		db->active_table[1] = db->active_table[0];
 		if (db->closing) {
@@ -1096,10 +1275,14 @@ static void *thread_active_dumper(void *ptr)
 			db->active_table[0] = NULL;
 		} else {
 			// 重新分配初始化表,赋值给零
-			db->active_table[0] = table_alloc_default(15.0);
+			db->active_table[0] = db_table_new(db, 15.0);
 		}
 		// 释放 db 写锁
 		rwlock_writer_unlock(&(db->rwlock), ticket1);
+		// 旧日志段的写出与 fdatasync 放在锁外
+		if (db->wal) {
+			wal_rotate_finish(db->wal);
+		}
 		// notify writers
 		// 通知等待 cond_writer 的堵塞写线程
 		pthread_cond_broadcast(&(db->cond_writer));
@@ -1108,6 +1291,10 @@ static void *thread_active_dumper(void *ptr)
 
 		// 备份
 		struct Table *const table1 = db->active_table[1];
+		if (db->conf.concurrent_insert) {
+			// no writer left on table1
+			table_seal(table1);
+		}
 		if (containermap_unused(db->cms[0]) < 8u) {
 			// cms[0] 空间准备用完了
 			// 写日志（正在删除活动表）
@@ -1117,6 +1304,7 @@ static void *thread_active_dumper(void *ptr)
 			const uint64_t ticket2 =
 				rwlock_writer_lock(&(db->rwlock));
 			db->active_table[1] = NULL;
+			db->wal_retired = wal_seq;
 			rwlock_writer_unlock(&(db->rwlock), ticket2);
 		} else if (table1->volume > 0) {
 			// build bt
@@ -1158,10 +1346,18 @@ static void *thread_active_dumper(void *ptr)
 				pthread_mutex_unlock(&(db->mutex_current));
 			}
 			db->active_table[1] = NULL;
+			db->wal_retired = wal_seq;
 			rwlock_writer_unlock(&(db->rwlock), ticket2);
 
 			// post process
 			table1->bt = NULL;
+		} else {
+			// nothing to dump, but don't leave it to db_free()
+			const uint64_t ticket2 =
+				rwlock_writer_lock(&(db->rwlock));
+			db->active_table[1] = NULL;
+			db->wal_retired = wal_seq;
+			rwlock_writer_unlock(&(db->rwlock), ticket2);
 		}
 		table_free(table1);
 	}
@@ -1182,6 +1378,7 @@ static void db_wait_active_table(struct DB *const db)
 }
 
 static struct KeyValue *recursive_lookup(struct Stat *const stat,
+					 struct Hist *const hist,
 					 struct VirtualContainer *const vc,
 					 const uint64_t klen,
 					 const uint8_t *const key,
@@ -1198,7 +1395,11 @@ static struct KeyValue *recursive_lookup(struct Stat *const stat,
 		assert(index < UINT64_C(0x100000000));
 		const uint64_t *phv = ((const uint64_t *)(&(hash[12])));
 		const uint64_t hv = *phv;
+		const uint64_t t0 = hist ? debug_time_nsec() : 0;
 		bitmap = bloomcontainer_match(vc->cc.bc, (uint32_t)index, hv);
+		if (hist) {
+			hist_record(hist, HIST_BLOOM, debug_time_nsec() - t0);
+		}
 		stat_inc(&(stat->nr_fetch_bc));
 	}
 	for (int64_t j = vc->cc.count - 1; j >= 0; j--) {
@@ -1224,8 +1425,8 @@ static struct KeyValue *recursive_lookup(struct Stat *const stat,
 	const uint64_t sub_id =
 		compaction_select_table(hash, vc->start_bit + 3);
 	if (vc->sub_vc[sub_id]) {
-		return recursive_lookup(stat, vc->sub_vc[sub_id], klen, key,
-					hash);
+		return recursive_lookup(stat, hist, vc->sub_vc[sub_id], klen,
+					key, hash);
 	} else {
 		return NULL;
 	}
@@ -1234,6 +1435,7 @@ static struct KeyValue *recursive_lookup(struct Stat *const stat,
 struct KeyValue *db_lookup(struct DB *const db, const uint16_t klen,
 			   const uint8_t *const key)
 {
+	const uint64_t t0 = db->hist ? debug_time_nsec() : 0;
 	// hash 获取
 	uint8_t hash[HASHBYTES] __attribute__((aligned(8)));
 	SHA1(key, klen, hash);
@@ -1258,36 +1460,450 @@ struct KeyValue *db_lookup(struct DB *const db, const uint16_t klen,
 			rwlock_reader_unlock(&(db->rwlock), ticket);
 			// 查询到 key 加一
 			stat_inc(&(db->stat.nr_get_at_hit[i]));
+			if (db->hist) {
+				hist_record(db->hist, HIST_LOOKUP_HIT,
+					    debug_time_nsec() - t0);
+			}
 			return kv;
 		}
 	}
 
 	// 3rd lookup into vcroot
-	struct KeyValue *const kv2 =
-		recursive_lookup(&(db->stat), db->vcroot, klen, key, hash);
+	__sync_add_and_fetch(&(db->nr_lookup_io), 1);
+	struct KeyValue *const kv2 = recursive_lookup(
+		&(db->stat), db->hist, db->vcroot, klen, key, hash);
+	__sync_sub_and_fetch(&(db->nr_lookup_io), 1);
 	rwlock_reader_unlock(&(db->rwlock), ticket);
 	if (kv2 == NULL) {
 		stat_inc(&(db->stat.nr_get_miss));
 	}
+	if (db->hist) {
+		hist_record(db->hist, kv2 ? HIST_LOOKUP_HIT : HIST_LOOKUP_MISS,
+			    debug_time_nsec() - t0);
+	}
 	return kv2;
 }
 
-static bool db_insert_try(struct DB *const db, struct KeyValue *const kv)
+// one candidate barrel read of db_multi_lookup
+struct MultiProbe {
+	struct MetaProbe probe;
+	uint64_t key_id;
+	uint64_t start_bit;
+};
+
+struct MultiProbes {
+	uint64_t nr;
+	uint64_t cap;
+	struct MultiProbe *mps;
+};
+
+static pthread_key_t db_iobatch_key;
+static pthread_once_t db_iobatch_once = PTHREAD_ONCE_INIT;
+
+static void db_iobatch_destroy(void *const p)
+{
+	iobatch_free((struct IOBatch *)p);
+}
+
+static void db_iobatch_key_create(void)
+{
+	const int r = pthread_key_create(&db_iobatch_key, db_iobatch_destroy);
+	assert(r == 0);
+}
+
+// io_uring is not thread-safe: one ring per caller thread
+static struct IOBatch *db_iobatch(void)
+{
+	pthread_once(&db_iobatch_once, db_iobatch_key_create);
+	struct IOBatch *iob = pthread_getspecific(db_iobatch_key);
+	if (iob == NULL) {
+		iob = iobatch_new(DB_MULTI_IO_DEPTH);
+		pthread_setspecific(db_iobatch_key, iob);
+	}
+	return iob;
+}
+
+static void multi_probes_push(struct MultiProbes *const mp,
+			      const struct MetaProbe *const probe,
+			      const uint64_t key_id, const uint64_t start_bit)
+{
+	if (mp->nr == mp->cap) {
+		mp->cap = mp->cap ? (mp->cap << 1) : 64;
+		mp->mps = realloc(mp->mps, sizeof(mp->mps[0]) * mp->cap);
+		assert(mp->mps);
+	}
+	struct MultiProbe *const p = &(mp->mps[mp->nr]);
+	p->probe = *probe;
+	p->key_id = key_id;
+	p->start_bit = start_bit;
+	mp->nr++;
+}
+
+// same path as recursive_lookup(), but keep every candidate in order
+static void multi_collect(struct Stat *const stat,
+			  struct VirtualContainer *const vc0,
+			  const uint64_t key_id, const uint16_t klen,
+			  const uint8_t *const key, const uint8_t *const hash,
+			  struct MultiProbes *const mp)
+{
+	struct VirtualContainer *vc = vc0;
+	while (vc) {
+		uint64_t bitmap = UINT64_MAX;
+		if (vc->cc.bc) {
+			const uint64_t index = table_select_barrel(hash);
+			const uint64_t *phv = ((const uint64_t *)(&(hash[12])));
+			bitmap = bloomcontainer_match(vc->cc.bc,
+						      (uint32_t)index, *phv);
+			stat_inc(&(stat->nr_fetch_bc));
+		}
+		for (int64_t j = vc->cc.count - 1; j >= 0; j--) {
+			struct MetaTable *const mt = vc->cc.metatables[j];
+			if (mt == NULL) {
+				continue;
+			}
+			if ((bitmap & (1u << j)) == 0u) {
+				stat_inc(&(stat->nr_true_negative));
+				continue;
+			}
+			struct MetaProbe probe;
+			if (metatable_probe_initial(&probe, mt, klen, key,
+						    hash)) {
+				multi_probes_push(mp, &probe, key_id,
+						  vc->start_bit);
+			}
+		}
+		const uint64_t sub_id =
+			compaction_select_table(hash, vc->start_bit + 3);
+		vc = vc->sub_vc[sub_id];
+	}
+}
+
+// fetch every pending barrel in one batch, repeat for overflown barrels
+static void multi_fetch_all(struct MultiProbes *const mp)
+{
+	if (mp->nr == 0) {
+		return;
+	}
+	uint8_t *const arena =
+		aligned_alloc(BARREL_ALIGN, BARREL_ALIGN * mp->nr);
+	struct IORequest *const reqs = malloc(sizeof(reqs[0]) * mp->nr);
+	uint64_t *const ids = malloc(sizeof(ids[0]) * mp->nr);
+	assert(arena && reqs && ids);
+	struct IOBatch *const iob = db_iobatch();
+
+	for (;;) {
+		uint64_t nr_req = 0;
+		for (uint64_t i = 0; i < mp->nr; i++) {
+			struct MetaProbe *const probe = &(mp->mps[i].probe);
+			if (probe->done) {
+				continue;
+			}
+			struct IORequest *const req = &(reqs[nr_req]);
+			req->fd = probe->mt->raw_fd;
+			req->len = BARREL_ALIGN;
+			req->off = metatable_probe_offset(probe);
+			req->buf = &(arena[BARREL_ALIGN * i]);
+			req->res = 0;
+			ids[nr_req] = i;
+			nr_req++;
+		}
+		if (nr_req == 0) {
+			break;
+		}
+		iobatch_read(iob, nr_req, reqs);
+		for (uint64_t r = 0; r < nr_req; r++) {
+			assert(reqs[r].res == ((ssize_t)BARREL_ALIGN));
+			metatable_probe_feed(&(mp->mps[ids[r]].probe),
+					     reqs[r].buf);
+		}
+	}
+	free(ids);
+	free(reqs);
+	free(arena);
+}
+
+// kvs[i] is the result of keys[i] (NULL if missing); return the number found
+uint64_t db_multi_lookup(struct DB *const db, const uint64_t nr_keys,
+			 const struct KeyValue *const keys,
+			 struct KeyValue **const kvs)
 {
-	const uint64_t ticket = rwlock_writer_lock(&(db->rwlock));
+	// one sample per key: each key waits for the whole batch
+	const uint64_t t0 = db->hist ? debug_time_nsec() : 0;
+	uint8_t *const hashes = malloc(HASHBYTES * nr_keys);
+	assert(hashes);
+	for (uint64_t i = 0; i < nr_keys; i++) {
+		SHA1(keys[i].pk, keys[i].klen, &(hashes[HASHBYTES * i]));
+		kvs[i] = NULL;
+	}
+	stat_inc_n(&(db->stat.nr_get), nr_keys);
+
+	const uint64_t ticket = rwlock_reader_lock(&(db->rwlock));
+	struct MultiProbes mp = { 0, 0, NULL };
+	for (uint64_t i = 0; i < nr_keys; i++) {
+		const uint8_t *const hash = &(hashes[HASHBYTES * i]);
+		for (uint64_t t = 0; t < 2; t++) {
+			struct Table *const table = db->active_table[t];
+			if (table == NULL) {
+				continue;
+			}
+			kvs[i] = table_lookup(table, keys[i].klen, keys[i].pk,
+					      hash);
+			if (kvs[i]) {
+				stat_inc(&(db->stat.nr_get_at_hit[t]));
+				break;
+			}
+		}
+		if (kvs[i] == NULL) {
+			multi_collect(&(db->stat), db->vcroot, i, keys[i].klen,
+				      keys[i].pk, hash, &mp);
+		}
+	}
+
+	__sync_add_and_fetch(&(db->nr_lookup_io), 1);
+	multi_fetch_all(&mp);
+	__sync_sub_and_fetch(&(db->nr_lookup_io), 1);
+	// the first hit in (level, age) order wins, as in recursive_lookup()
+	for (uint64_t i = 0; i < mp.nr; i++) {
+		struct MultiProbe *const p = &(mp.mps[i]);
+		struct KeyValue *const kv = p->probe.kv;
+		if (kv == NULL) {
+			continue;
+		}
+		if (kvs[p->key_id] == NULL) {
+			kvs[p->key_id] = kv;
+			stat_inc(&(db->stat.nr_get_vc_hit[p->start_bit]));
+		} else {
+			free(kv);
+		}
+	}
+	rwlock_reader_unlock(&(db->rwlock), ticket);
+	free(mp.mps);
+	free(hashes);
+
+	uint64_t nr_found = 0;
+	for (uint64_t i = 0; i < nr_keys; i++) {
+		if (kvs[i]) {
+			nr_found++;
+		}
+	}
+	stat_inc_n(&(db->stat.nr_get_miss), nr_keys - nr_found);
+	if (db->hist) {
+		const uint64_t dt = debug_time_nsec() - t0;
+		for (uint64_t i = 0; i < nr_keys; i++) {
+			hist_record(db->hist,
+				    kvs[i] ? HIST_LOOKUP_HIT : HIST_LOOKUP_MISS,
+				    dt);
+		}
+	}
+	return nr_found;
+}
+
+// a snapshot of the key set, values are read at db_iterator_next()
+struct DBIterator {
+	struct DB *db;
+	uint32_t flags;
+	struct KeyMerge *km;
+};
+
+struct IterRuns {
+	uint64_t nr;
+	uint64_t cap;
+	struct KeyRun **runs;
+	// runs[i] still needs keyrun_sort()
+	bool *unsorted;
+	// pinned tables whose barrels are read after the lock is dropped
+	uint64_t nr_mts;
+	uint64_t cap_mts;
+	struct MetaTable **mts;
+};
+
+static void iter_runs_push(struct IterRuns *const ir, struct KeyRun *const run,
+			   const bool unsorted)
+{
+	if (ir->nr == ir->cap) {
+		ir->cap = ir->cap ? (ir->cap << 1) : 64;
+		ir->runs = realloc(ir->runs, sizeof(ir->runs[0]) * ir->cap);
+		ir->unsorted = realloc(ir->unsorted,
+				       sizeof(ir->unsorted[0]) * ir->cap);
+		assert(ir->runs && ir->unsorted);
+	}
+	ir->runs[ir->nr] = run;
+	ir->unsorted[ir->nr] = unsorted;
+	ir->nr++;
+}
+
+static void iter_mts_push(struct IterRuns *const ir, struct MetaTable *const mt)
+{
+	if (ir->nr_mts == ir->cap_mts) {
+		ir->cap_mts = ir->cap_mts ? (ir->cap_mts << 1) : 64;
+		ir->mts = realloc(ir->mts, sizeof(ir->mts[0]) * ir->cap_mts);
+		assert(ir->mts);
+	}
+	ir->mts[ir->nr_mts] = metatable_acquire(mt);
+	ir->nr_mts++;
+}
+
+static void iter_collect(struct VirtualContainer *const vc, const bool walk,
+			 struct IterRuns *const ir)
+{
+	if (vc == NULL) {
+		return;
+	}
+	for (uint64_t j = 0; j < vc->cc.count; j++) {
+		struct MetaTable *const mt = vc->cc.metatables[j];
+		if (mt == NULL) {
+			continue;
+		}
+		if ((walk == false) && mt->keyrun) {
+			iter_runs_push(ir, keyrun_acquire(mt->keyrun), false);
+		} else {
+			iter_mts_push(ir, mt);
+		}
+	}
+	for (uint64_t i = 0; i < 8; i++) {
+		iter_collect(vc->sub_vc[i], walk, ir);
+	}
+}
+
+// the lock is held only to copy the active tables and pin the KeyRuns and
+// MetaTables; without the ordered index (or with DB_ITER_WALK) every barrel
+// of the pinned tables is read after the lock is dropped
+struct DBIterator *db_iterator_new(struct DB *const db, const uint32_t flags)
+{
+	const bool walk = (flags & DB_ITER_WALK) ? true : false;
+	struct IterRuns ir = { 0, 0, NULL, NULL, 0, 0, NULL };
+	const uint64_t ticket = rwlock_reader_lock(&(db->rwlock));
+	for (uint64_t i = 0; i < 2; i++) {
+		if (db->active_table[i]) {
+			iter_runs_push(&ir,
+				       table_build_keyrun(db->active_table[i]),
+				       true);
+		}
+	}
+	iter_collect(db->vcroot, walk, &ir);
+	rwlock_reader_unlock(&(db->rwlock), ticket);
+
+	for (uint64_t i = 0; i < ir.nr_mts; i++) {
+		iter_runs_push(&ir, metatable_build_keyrun(ir.mts[i]), true);
+		db_metatable_put(ir.mts[i]);
+	}
+	free(ir.mts);
+	for (uint64_t i = 0; i < ir.nr; i++) {
+		if (ir.unsorted[i]) {
+			keyrun_sort(ir.runs[i]);
+		}
+	}
+	struct DBIterator *const iter = (typeof(iter))malloc(sizeof(*iter));
+	assert(iter);
+	iter->db = db;
+	iter->flags = flags;
+	iter->km = keymerge_new(ir.runs, ir.nr);
+	free(ir.runs);
+	free(ir.unsorted);
+	return iter;
+}
+
+// to the first key >= key
+void db_iterator_seek(struct DBIterator *const iter, const uint16_t klen,
+		      const uint8_t *const key)
+{
+	keymerge_seek(iter->km, klen, key);
+}
+
+// return the current item (free it after use) and move on; NULL at the end
+struct KeyValue *db_iterator_next(struct DBIterator *const iter)
+{
+	while (keymerge_valid(iter->km)) {
+		uint16_t klen;
+		const uint8_t *const key = keymerge_key(iter->km, &klen);
+		struct KeyValue *kv = NULL;
+		if (iter->flags & DB_ITER_KEYS_ONLY) {
+			kv = (typeof(kv))malloc(sizeof(*kv) + klen);
+			assert(kv);
+			kv->klen = klen;
+			kv->vlen = 0;
+			kv->pk = kv->kv;
+			kv->pv = kv->kv + klen;
+			memcpy(kv->pk, key, klen);
+		} else {
+			kv = db_lookup(iter->db, klen, key);
+		}
+		keymerge_next(iter->km);
+		if (kv) {
+			return kv;
+		}
+	}
+	return NULL;
+}
+
+void db_iterator_free(struct DBIterator *const iter)
+{
+	keymerge_free(iter->km);
+	free(iter);
+}
+
+// insert into the active table, return the number of items inserted
+// the reader lock is enough to pin active_table[0] for concurrent inserts
+static uint64_t db_insert_active(struct DB *const db, const uint64_t nr_items,
+				 const struct KeyValue *const kvs,
+				 uint64_t *const lsn)
+{
+	const bool mt = db->conf.concurrent_insert;
+	const uint64_t ticket = mt ? rwlock_reader_lock(&(db->rwlock)) :
+				     rwlock_writer_lock(&(db->rwlock));
 	struct Table *at = db->active_table[0];
-	const bool ri = table_insert_kv_safe(at, kv);
-	rwlock_writer_unlock(&(db->rwlock), ticket);
-	return ri;
+	uint64_t i = 0;
+	// concurrent inserts log their insert order, see wal_append()
+	uint32_t seqs_local[64];
+	uint32_t *seqs = NULL;
+	if (mt && db->wal) {
+		seqs = (nr_items <= 64u) ? seqs_local :
+					   malloc(sizeof(seqs[0]) * nr_items);
+		assert(seqs);
+	}
+	if (mt) {
+		i = table_multi_insert_kv_mt(at, nr_items, kvs, seqs);
+	} else {
+		while ((i < nr_items) && table_insert_kv_safe(at, &(kvs[i]))) {
+			i++;
+		}
+	}
+	if (db->wal && i) {
+		*lsn = wal_append(db->wal, i, kvs, seqs);
+	}
+	if (mt) {
+		rwlock_reader_unlock(&(db->rwlock), ticket);
+	} else {
+		rwlock_writer_unlock(&(db->rwlock), ticket);
+	}
+	if (seqs && (seqs != seqs_local)) {
+		free(seqs);
+	}
+	return i;
+}
+
+static bool db_insert_try(struct DB *const db, struct KeyValue *const kv,
+			  uint64_t *const lsn)
+{
+	return db_insert_active(db, 1, kv, lsn) ? true : false;
 }
 
 bool db_insert(struct DB *const db, struct KeyValue *const kv)
 {
+	const uint64_t t0 = db->hist ? debug_time_nsec() : 0;
+	uint64_t lsn = 0;
 	stat_inc(&(db->stat.nr_set));
-	while (false == db_insert_try(db, kv)) {
+	while (false == db_insert_try(db, kv, &lsn)) {
 		db_wait_active_table(db);
 		stat_inc(&(db->stat.nr_set_retry));
 	}
+	// group commit, outside of the lock
+	if (db->wal) {
+		wal_commit(db->wal, lsn);
+	}
+	if (db->hist) {
+		hist_record(db->hist, HIST_INSERT, debug_time_nsec() - t0);
+	}
 	return true;
 }
 
@@ -1295,25 +1911,13 @@ bool db_insert(struct DB *const db, struct KeyValue *const kv)
 bool db_multi_insert(struct DB *const db, const uint64_t nr_items,
 		     const struct KeyValue *const kvs)
 {
+	// one sample per call
+	const uint64_t t0 = db->hist ? debug_time_nsec() : 0;
 	uint64_t i = 0;
+	uint64_t lsn = 0;
 	while (i < nr_items) {
-		// 加读锁
-		const uint64_t ticket = rwlock_writer_lock(&(db->rwlock));
-		struct Table *at = db->active_table[0];
-		while (i < nr_items) {
-			const struct KeyValue *const kv = &(kvs[i]);
-			// 添加元素
-			const bool ri = table_insert_kv_safe(at, kv);
-			if (ri == true) {
-				// 添加成功 ++
-				i++;
-			} else {
-				// 添加失败退出
-				break;
-			}
-		}
-		// 解读锁
-		rwlock_writer_unlock(&(db->rwlock), ticket);
+		// 添加元素, 满了退出
+		i += db_insert_active(db, nr_items - i, &(kvs[i]), &lsn);
 
 		if (i < nr_items) {
 			db_wait_active_table(db);
@@ -1321,6 +1925,12 @@ bool db_multi_insert(struct DB *const db, const uint64_t nr_items,
 			stat_inc(&(db->stat.nr_set_retry));
 		}
 	}
+	if (db->wal) {
+		wal_commit(db->wal, lsn);
+	}
+	if (db->hist) {
+		hist_record(db->hist, HIST_INSERT, debug_time_nsec() - t0);
+	}
 	// 加 nr_items
 	stat_inc_n(&(db->stat.nr_set), nr_items);
 	return true;
@@ -1352,7 +1962,8 @@ static bool db_touch_dir(const char *const root_dir, const char *const sub_dir)
 
 // create empty db
 static struct DB *db_create(const char *const meta_dir,
-			    struct ContainerMapConf *const cm_conf)
+			    struct ContainerMapConf *const cm_conf,
+			    const struct DBConf *const conf)
 {
 	const double sec0 = debug_time_sec();
 	// touch dir
@@ -1389,7 +2000,7 @@ static struct DB *db_create(const char *const meta_dir,
 	}
 
 	// db 初始化
-	db_initial(db, meta_dir, cm_conf);
+	db_initial(db, meta_dir, cm_conf, conf);
 
 	// empty vc
 	// 虚拟容器创建
@@ -1405,7 +2016,8 @@ static struct DB *db_create(const char *const meta_dir,
 }
 
 static struct DB *db_load(const char *const meta_dir,
-			  struct ContainerMapConf *const cm_conf)
+			  struct ContainerMapConf *const cm_conf,
+			  const struct DBConf *const conf)
 {
 	// 获取时间
 	const double sec0 = debug_time_sec();
@@ -1451,7 +2063,7 @@ static struct DB *db_load(const char *const meta_dir,
 	}
 
 	// db 初始化
-	db_initial(db, meta_dir, cm_conf);
+	db_initial(db, meta_dir, cm_conf, conf);
 
 	//// LOAD META
 	// parse vc
@@ -1581,7 +2193,35 @@ static struct ContainerMapConf *db_load_cm_conf(const char *const fn)
 	return cm_conf;
 }
 
+static bool db_wal_apply(void *const p, const uint64_t nr_items,
+			 const struct KeyValue *const kvs)
+{
+	return db_multi_insert((struct DB *)p, nr_items, kvs);
+}
+
+void db_conf_default(struct DBConf *const conf)
+{
+	bzero(conf, sizeof(*conf));
+	conf->ordered_index = false;
+	conf->wal_mode = WAL_OFF;
+	conf->wal_sync_ms = 10;
+	conf->compress = false;
+	conf->concurrent_insert = false;
+	conf->compaction_mbps = 0;
+	conf->compaction_backoff = 4;
+	conf->latency_stats = false;
+}
+
 struct DB *db_touch(const char *const meta_dir, const char *const cm_conf_fn)
+{
+	struct DBConf conf;
+	db_conf_default(&conf);
+	return db_touch_conf(meta_dir, cm_conf_fn, &conf);
+}
+
+struct DB *db_touch_conf(const char *const meta_dir,
+			 const char *const cm_conf_fn,
+			 const struct DBConf *const conf)
 {
 	// cm conf
 	// 断言
@@ -1599,15 +2239,22 @@ struct DB *db_touch(const char *const meta_dir, const char *const cm_conf_fn)
 	if (r_dir == 0) { // has dir
 		// 目录不存在
 		// try load DB
-		db = db_load(meta_dir, cm_conf);
+		db = db_load(meta_dir, cm_conf, conf);
 	}
 	// create anyway
 	if (db == NULL) {
 		// 创建 db
-		db = db_create(meta_dir, cm_conf);
+		db = db_create(meta_dir, cm_conf, conf);
 	}
 	if (db) {
 		db_spawn_threads(db);
+		// after a crash (also before the first META)
+		if (db->wal) {
+			const double sec0 = debug_time_sec();
+			const uint64_t nr =
+				wal_replay(db->wal, db_wal_apply, db);
+			db_log_diff(db, sec0, "WAL Replayed %lu items", nr);
+		}
 	}
 	return db;
 }
@@ -1658,6 +2305,9 @@ void db_force_dump_meta(struct DB *const db)
 void db_stat_show(struct DB *const db, FILE *const fo)
 {
 	stat_show(&(db->stat), fo);
+	if (db->hist) {
+		hist_report(db->hist, false, fo);
+	}
 }
 
 void db_stat_clean(struct DB *const db)
@@ -10,9 +10,44 @@
 #include <stdio.h>
 
 #include "table.h"
+#include "wal.h"
+
+struct DBConf {
+	// 有序索引: keep the sorted keys of every table for db_iterator_*
+	bool ordered_index;
+	// WAL_OFF, WAL_SYNC_NONE, WAL_SYNC_BATCH or WAL_SYNC_INTERVAL
+	uint32_t wal_mode;
+	// for WAL_SYNC_INTERVAL
+	uint64_t wal_sync_ms;
+	// LZ4 value compression in new tables (make LZ4=1)
+	bool compress;
+	// 并发写入: writers share the active table (CAS into barrels) under
+	// the reader side of the db lock; racing writes to a key are unordered
+	bool concurrent_insert;
+	// compaction I/O budget in MB/s, 0 for no limit
+	uint64_t compaction_mbps;
+	// 1/4 of the budget while more lookups than this wait on barrel I/O
+	uint64_t compaction_backoff;
+	// 延迟直方图 per operation, served on <meta_dir>/stats.sock
+	bool latency_stats;
+};
+
+// db_iterator_new() flags
+// only keys, vlen == 0
+#define DB_ITER_KEYS_ONLY ((UINT32_C(1)))
+// ignore the ordered index, read all barrels of every table
+#define DB_ITER_WALK ((UINT32_C(2)))
+
+struct DBIterator;
+
+void db_conf_default(struct DBConf *const conf);
 
 struct DB *db_touch(const char *const meta_dir, const char *const cm_conf_fn);
 
+struct DB *db_touch_conf(const char *const meta_dir,
+			 const char *const cm_conf_fn,
+			 const struct DBConf *const conf);
+
 void db_close(struct DB *const db);
 
 bool db_insert(struct DB *const db, struct KeyValue *const kv);
@@ -23,6 +58,24 @@ bool db_multi_insert(struct DB *const db, const uint64_t nr_items,
 struct KeyValue *db_lookup(struct DB *const db, const uint16_t klen,
 			   const uint8_t *const key);
 
+uint64_t db_multi_lookup(struct DB *const db, const uint64_t nr_keys,
+			 const struct KeyValue *const keys,
+			 struct KeyValue **const kvs);
+
+//----iterator
+
+// 快照只包含键: the set of keys is fixed at db_iterator_new(), values are
+// looked up in db_iterator_next() and so reflect the latest insert; keys
+// whose lookup fails are skipped. free the iterator before db_close().
+struct DBIterator *db_iterator_new(struct DB *const db, const uint32_t flags);
+
+void db_iterator_seek(struct DBIterator *const iter, const uint16_t klen,
+		      const uint8_t *const key);
+
+struct KeyValue *db_iterator_next(struct DBIterator *const iter);
+
+void db_iterator_free(struct DBIterator *const iter);
+
 //----misc
 
 void db_force_dump_meta(struct DB *const db);
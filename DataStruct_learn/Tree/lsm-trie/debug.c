@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <time.h>
 
 // 获取时间,单位微秒
 uint64_t debug_time_usec(void)
@@ -22,6 +23,14 @@ uint64_t debug_time_usec(void)
 	return tv.tv_sec * 1000000lu + tv.tv_usec;
 }
 
+// 单调时钟, 单位纳秒
+uint64_t debug_time_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000lu + ts.tv_nsec;
+}
+
 // 获取时间, 单位秒
 double debug_time_sec(void)
 {
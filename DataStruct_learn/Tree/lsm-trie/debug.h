@@ -10,6 +10,8 @@
 
 uint64_t debug_time_usec(void);
 
+uint64_t debug_time_nsec(void);
+
 double debug_time_sec(void);
 
 uint64_t debug_diff_usec(const uint64_t last);
@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+// 延迟直方图: 每个线程只写自己的 shard, 读者合并所有 shard
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include "hist.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define HIST_SUB_BITS ((5))
+#define HIST_SUB ((UINT64_C(1) << HIST_SUB_BITS))
+// up to 2^40 ns (~18 minutes)
+#define HIST_MAX_BITS ((40))
+#define HIST_NR (((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_SUB))
+
+// single writer: the owner thread
+struct HistShard {
+	struct HistShard *next;
+	pthread_t owner;
+	uint64_t sum[HIST_NR_OPS];
+	uint64_t counts[HIST_NR_OPS][HIST_NR];
+} __attribute__((aligned(64)));
+
+struct Hist {
+	uint64_t serial;
+	pthread_mutex_t mutex;
+	struct HistShard *shards;
+	// merged counts at the last hist_report(interval)
+	uint64_t base_sum[HIST_NR_OPS];
+	uint64_t base[HIST_NR_OPS][HIST_NR];
+};
+
+struct HistServer {
+	struct Hist *hist;
+	int fd;
+	bool closing;
+	char path[108];
+	pthread_t thread;
+};
+
+struct HistCache {
+	uint64_t serial;
+	struct HistShard *shard;
+};
+
+static uint64_t __hist_serial = 0;
+
+static __thread struct HistCache __hist_cache = { 0, NULL };
+
+static const char *const __hist_names[HIST_NR_OPS] = {
+	"insert", "lookup_hit", "lookup_miss", "bloom",
+	"barrel_read", "comp_feed", "comp_bt", "comp_dump",
+};
+
+static inline uint64_t hist_index(const uint64_t v)
+{
+	if (v < HIST_SUB) {
+		return v;
+	}
+	const uint64_t e = 63u - (uint64_t)__builtin_clzl(v);
+	if (e > HIST_MAX_BITS) {
+		return HIST_NR - 1;
+	}
+	const uint64_t shift = e - HIST_SUB_BITS;
+	return ((e - HIST_SUB_BITS + 1) * HIST_SUB) + (v >> shift) - HIST_SUB;
+}
+
+// lowest value of bucket idx
+static inline uint64_t hist_value(const uint64_t idx)
+{
+	if (idx < (HIST_SUB << 1)) {
+		return idx;
+	}
+	const uint64_t e = (idx / HIST_SUB) + HIST_SUB_BITS - 1;
+	const uint64_t sub = (idx % HIST_SUB) + HIST_SUB;
+	return sub << (e - HIST_SUB_BITS);
+}
+
+struct Hist *hist_new(void)
+{
+	struct Hist *const h = (typeof(h))malloc(sizeof(*h));
+	assert(h);
+	bzero(h, sizeof(*h));
+	h->serial = __sync_add_and_fetch(&__hist_serial, 1);
+	pthread_mutex_init(&(h->mutex), NULL);
+	return h;
+}
+
+static struct HistShard *hist_shard(struct Hist *const h)
+{
+	struct HistCache *const c = &__hist_cache;
+	if (c->serial == h->serial) {
+		return c->shard;
+	}
+	const pthread_t self = pthread_self();
+	pthread_mutex_lock(&(h->mutex));
+	struct HistShard *shard = h->shards;
+	while (shard && (pthread_equal(shard->owner, self) == 0)) {
+		shard = shard->next;
+	}
+	if (shard == NULL) {
+		shard = (typeof(shard))aligned_alloc(64, sizeof(*shard));
+		assert(shard);
+		bzero(shard, sizeof(*shard));
+		shard->owner = self;
+		shard->next = h->shards;
+		h->shards = shard;
+	}
+	pthread_mutex_unlock(&(h->mutex));
+	c->serial = h->serial;
+	c->shard = shard;
+	return shard;
+}
+
+// no lock prefix: only the owner writes, readers may see a stale count
+static inline void hist_add(uint64_t *const p, const uint64_t n)
+{
+	__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n,
+			 __ATOMIC_RELAXED);
+}
+
+void hist_record(struct Hist *const h, const uint32_t op,
+		 const uint64_t nsec)
+{
+	assert(op < HIST_NR_OPS);
+	struct HistShard *const shard = hist_shard(h);
+	hist_add(&(shard->counts[op][hist_index(nsec)]), 1);
+	hist_add(&(shard->sum[op]), nsec);
+}
+
+// caller holds h->mutex
+static void hist_merge(struct Hist *const h, const uint32_t op,
+		       uint64_t *const counts, uint64_t *const sum)
+{
+	bzero(counts, sizeof(counts[0]) * HIST_NR);
+	*sum = 0;
+	for (struct HistShard *s = h->shards; s; s = s->next) {
+		for (uint64_t i = 0; i < HIST_NR; i++) {
+			counts[i] += __atomic_load_n(&(s->counts[op][i]),
+						     __ATOMIC_RELAXED);
+		}
+		*sum += __atomic_load_n(&(s->sum[op]), __ATOMIC_RELAXED);
+	}
+}
+
+static void hist_summarize(const uint64_t *const counts, const uint64_t sum,
+			   struct HistSummary *const out)
+{
+	bzero(out, sizeof(*out));
+	for (uint64_t i = 0; i < HIST_NR; i++) {
+		out->count += counts[i];
+	}
+	if (out->count == 0) {
+		return;
+	}
+	out->mean = sum / out->count;
+	const uint64_t r50 = (out->count * 500u + 999u) / 1000u;
+	const uint64_t r99 = (out->count * 990u + 999u) / 1000u;
+	const uint64_t r999 = (out->count * 999u + 999u) / 1000u;
+	uint64_t acc = 0;
+	for (uint64_t i = 0; i < HIST_NR; i++) {
+		if (counts[i] == 0) {
+			continue;
+		}
+		const uint64_t acc0 = acc;
+		acc += counts[i];
+		// report the highest value of the bucket
+		const uint64_t v = hist_value(i + 1) - 1;
+		if ((acc0 < r50) && (acc >= r50)) {
+			out->p50 = v;
+		}
+		if ((acc0 < r99) && (acc >= r99)) {
+			out->p99 = v;
+		}
+		if ((acc0 < r999) && (acc >= r999)) {
+			out->p999 = v;
+		}
+		out->max = v;
+	}
+}
+
+// interval: since the last hist_report(interval == true)
+void hist_summary(struct Hist *const h, const uint32_t op,
+		  const bool interval, struct HistSummary *const sum)
+{
+	assert(op < HIST_NR_OPS);
+	uint64_t *const counts =
+		(typeof(counts))malloc(sizeof(counts[0]) * HIST_NR);
+	assert(counts);
+	uint64_t total = 0;
+	pthread_mutex_lock(&(h->mutex));
+	hist_merge(h, op, counts, &total);
+	if (interval) {
+		for (uint64_t i = 0; i < HIST_NR; i++) {
+			counts[i] -= h->base[op][i];
+		}
+		total -= h->base_sum[op];
+	}
+	pthread_mutex_unlock(&(h->mutex));
+	hist_summarize(counts, total, sum);
+	free(counts);
+}
+
+// interval: report since the last interval report, then start a new one
+void hist_report(struct Hist *const h, const bool interval, FILE *const out)
+{
+	uint64_t *const counts =
+		(typeof(counts))malloc(sizeof(counts[0]) * HIST_NR);
+	assert(counts);
+	fprintf(out, "%-12s %12s %12s %12s %12s %12s %12s\n", "op(ns)",
+		"count", "mean", "p50", "p99", "p999", "max");
+	for (uint32_t op = 0; op < HIST_NR_OPS; op++) {
+		uint64_t total = 0;
+		pthread_mutex_lock(&(h->mutex));
+		hist_merge(h, op, counts, &total);
+		if (interval) {
+			for (uint64_t i = 0; i < HIST_NR; i++) {
+				const uint64_t c = counts[i];
+				counts[i] -= h->base[op][i];
+				h->base[op][i] = c;
+			}
+			const uint64_t t = total;
+			total -= h->base_sum[op];
+			h->base_sum[op] = t;
+		}
+		pthread_mutex_unlock(&(h->mutex));
+		struct HistSummary sum;
+		hist_summarize(counts, total, &sum);
+		fprintf(out, "%-12s %12lu %12lu %12lu %12lu %12lu %12lu\n",
+			__hist_names[op], sum.count, sum.mean, sum.p50,
+			sum.p99, sum.p999, sum.max);
+	}
+	free(counts);
+}
+
+void hist_free(struct Hist *const h)
+{
+	struct HistShard *s = h->shards;
+	while (s) {
+		struct HistShard *const next = s->next;
+		free(s);
+		s = next;
+	}
+	pthread_mutex_destroy(&(h->mutex));
+	free(h);
+}
+
+// a client that stalls can't hold up the server thread or db_close()
+#define HIST_SERVE_TIMEOUT_MS ((1000))
+
+// 一个连接一个请求
+static void hist_serve_one(struct HistServer *const hs, const int cfd)
+{
+	const struct timeval tv = { HIST_SERVE_TIMEOUT_MS / 1000,
+				    (HIST_SERVE_TIMEOUT_MS % 1000) * 1000 };
+	setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	char req[64];
+	const ssize_t nr = read(cfd, req, sizeof(req) - 1);
+	req[(nr > 0) ? nr : 0] = '\0';
+	const bool interval = (strncmp(req, "interval", 8) == 0) ? true : false;
+	// format first, then send(MSG_NOSIGNAL): a client gone early must
+	// not kill the process with SIGPIPE
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *const out = open_memstream(&buf, &len);
+	if (out) {
+		hist_report(hs->hist, interval, out);
+		fclose(out);
+		size_t done = 0;
+		while (done < len) {
+			const ssize_t ns =
+				send(cfd, buf + done, len - done, MSG_NOSIGNAL);
+			if ((ns < 0) && (errno == EINTR)) {
+				continue;
+			}
+			if (ns <= 0) {
+				break;
+			}
+			done += (size_t)ns;
+		}
+		free(buf);
+	}
+	close(cfd);
+}
+
+static void *thread_hist_server(void *const p)
+{
+	struct HistServer *const hs = (typeof(hs))p;
+	while (hs->closing == false) {
+		const int cfd = accept(hs->fd, NULL, NULL);
+		if (cfd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		hist_serve_one(hs, cfd);
+	}
+	return NULL;
+}
+
+struct HistServer *hist_serve(struct Hist *const h, const char *const path)
+{
+	struct sockaddr_un addr;
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return NULL;
+	}
+	unlink(path);
+	if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+	    (listen(fd, 16) != 0)) {
+		close(fd);
+		return NULL;
+	}
+	struct HistServer *const hs = (typeof(hs))malloc(sizeof(*hs));
+	assert(hs);
+	bzero(hs, sizeof(*hs));
+	hs->hist = h;
+	hs->fd = fd;
+	strcpy(hs->path, path);
+	const int rc = pthread_create(&(hs->thread), NULL, thread_hist_server,
+				      hs);
+	assert(rc == 0);
+	pthread_setname_np(hs->thread, "Hist-Server");
+	return hs;
+}
+
+void hist_serve_stop(struct HistServer *const hs)
+{
+	hs->closing = true;
+	// wake up accept()
+	shutdown(hs->fd, SHUT_RDWR);
+	pthread_join(hs->thread, NULL);
+	close(hs->fd);
+	unlink(hs->path);
+	free(hs);
+}
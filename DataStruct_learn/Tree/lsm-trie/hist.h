@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// 延迟直方图: 每线程一份, 读时合并
+// log-linear buckets (HdrHistogram style), 32 per power of two, in ns
+#define HIST_INSERT ((UINT32_C(0)))
+#define HIST_LOOKUP_HIT ((UINT32_C(1)))
+#define HIST_LOOKUP_MISS ((UINT32_C(2)))
+#define HIST_BLOOM ((UINT32_C(3)))
+#define HIST_BARREL_READ ((UINT32_C(4)))
+#define HIST_COMP_FEED ((UINT32_C(5)))
+#define HIST_COMP_BT ((UINT32_C(6)))
+#define HIST_COMP_DUMP ((UINT32_C(7)))
+#define HIST_NR_OPS ((UINT32_C(8)))
+
+struct HistSummary {
+	uint64_t count;
+	uint64_t mean;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+};
+
+struct Hist;
+
+// unix socket endpoint, one request line per connection:
+// "total" (since hist_new) or "interval" (since the last "interval")
+struct HistServer;
+
+struct Hist *hist_new(void);
+
+void hist_record(struct Hist *const h, const uint32_t op,
+		 const uint64_t nsec);
+
+void hist_summary(struct Hist *const h, const uint32_t op,
+		  const bool interval, struct HistSummary *const sum);
+
+void hist_report(struct Hist *const h, const bool interval, FILE *const out);
+
+void hist_free(struct Hist *const h);
+
+struct HistServer *hist_serve(struct Hist *const h, const char *const path);
+
+void hist_serve_stop(struct HistServer *const hs);
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include "iobatch.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "conc.h"
+
+// fallback: 每个线程至少负责的请求数
+#define IOBATCH_PER_THREAD ((UINT64_C(8)))
+#define IOBATCH_THREADS_NR ((UINT64_C(16)))
+
+// raw io_uring, no liburing needed
+struct Ring {
+	int fd;
+	uint32_t nr_sqes;
+	// sq
+	void *sq_map;
+	size_t sq_map_size;
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t *sq_mask;
+	uint32_t *sq_array;
+	struct io_uring_sqe *sqes;
+	// cq
+	void *cq_map;
+	size_t cq_map_size;
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+struct IOBatch {
+	bool using_uring;
+	struct Ring ring;
+};
+
+// shared by the fallback threads
+struct PreadWork {
+	uint64_t token;
+	uint64_t nr;
+	struct IORequest *reqs;
+};
+
+static int sys_io_uring_setup(const uint32_t entries,
+			      struct io_uring_params *const p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(const int fd, const uint32_t to_submit,
+			      const uint32_t min_complete, const uint32_t flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			    flags, NULL, 0);
+}
+
+static void ring_unmap(struct Ring *const ring)
+{
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->nr_sqes * sizeof(ring->sqes[0]));
+	}
+	if (ring->cq_map && (ring->cq_map != ring->sq_map)) {
+		munmap(ring->cq_map, ring->cq_map_size);
+	}
+	if (ring->sq_map) {
+		munmap(ring->sq_map, ring->sq_map_size);
+	}
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+}
+
+static bool ring_initial(struct Ring *const ring, const uint32_t depth)
+{
+	struct io_uring_params p;
+	bzero(&p, sizeof(p));
+	bzero(ring, sizeof(*ring));
+	ring->fd = sys_io_uring_setup(depth, &p);
+	if (ring->fd < 0) {
+		return false;
+	}
+	ring->nr_sqes = p.sq_entries;
+
+	ring->sq_map_size = p.sq_off.array + (p.sq_entries * sizeof(uint32_t));
+	ring->cq_map_size = p.cq_off.cqes +
+			    (p.cq_entries * sizeof(struct io_uring_cqe));
+	const bool single = (p.features & IORING_FEAT_SINGLE_MMAP) ? true :
+								      false;
+	if (single && (ring->cq_map_size > ring->sq_map_size)) {
+		ring->sq_map_size = ring->cq_map_size;
+	}
+	void *const sq_map = mmap(NULL, ring->sq_map_size,
+				  PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, ring->fd,
+				  IORING_OFF_SQ_RING);
+	if (sq_map == MAP_FAILED) {
+		close(ring->fd);
+		return false;
+	}
+	ring->sq_map = sq_map;
+	if (single) {
+		ring->cq_map = sq_map;
+	} else {
+		void *const cq_map = mmap(NULL, ring->cq_map_size,
+					  PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, ring->fd,
+					  IORING_OFF_CQ_RING);
+		if (cq_map == MAP_FAILED) {
+			ring_unmap(ring);
+			return false;
+		}
+		ring->cq_map = cq_map;
+	}
+	void *const sqes = mmap(NULL, p.sq_entries * sizeof(ring->sqes[0]),
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd,
+				IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		ring_unmap(ring);
+		return false;
+	}
+	ring->sqes = (typeof(ring->sqes))sqes;
+
+	uint8_t *const sq = (typeof(sq))ring->sq_map;
+	ring->sq_head = (uint32_t *)(sq + p.sq_off.head);
+	ring->sq_tail = (uint32_t *)(sq + p.sq_off.tail);
+	ring->sq_mask = (uint32_t *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (uint32_t *)(sq + p.sq_off.array);
+	uint8_t *const cq = (typeof(cq))ring->cq_map;
+	ring->cq_head = (uint32_t *)(cq + p.cq_off.head);
+	ring->cq_tail = (uint32_t *)(cq + p.cq_off.tail);
+	ring->cq_mask = (uint32_t *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return true;
+}
+
+// 取出 cq 中所有已完成的请求, 返回个数
+static uint64_t ring_reap(struct Ring *const ring, const uint64_t nr,
+			  struct IORequest *const reqs)
+{
+	uint64_t nr_reaped = 0;
+	uint32_t head = *(ring->cq_head);
+	const uint32_t cq_tail =
+		__atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != cq_tail) {
+		const struct io_uring_cqe *const cqe =
+			&(ring->cqes[head & *(ring->cq_mask)]);
+		assert(cqe->user_data < nr);
+		reqs[cqe->user_data].res = cqe->res;
+		nr_reaped++;
+		head++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return nr_reaped;
+}
+
+// submit up to nr_sqes reads and wait for all of them
+// 返回通过 ring 完成的请求数 (reqs 的前缀); 小于 nr 时 ring 已不可用,
+// 但内核接收过的请求都已完成, 不会再写 buf
+static uint64_t ring_read_some(struct Ring *const ring, const uint64_t nr,
+			       struct IORequest *const reqs)
+{
+	assert(nr <= ring->nr_sqes);
+	const uint32_t mask = *(ring->sq_mask);
+	const uint32_t tail0 = *(ring->sq_tail);
+	uint32_t tail = tail0;
+	for (uint64_t i = 0; i < nr; i++) {
+		const uint32_t idx = tail & mask;
+		struct io_uring_sqe *const sqe = &(ring->sqes[idx]);
+		bzero(sqe, sizeof(*sqe));
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = reqs[i].fd;
+		sqe->off = reqs[i].off;
+		sqe->addr = (uint64_t)(uintptr_t)reqs[i].buf;
+		sqe->len = reqs[i].len;
+		sqe->user_data = i;
+		ring->sq_array[idx] = idx;
+		tail++;
+	}
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	uint64_t nr_done = 0;
+	uint32_t to_submit = (uint32_t)nr;
+	while (nr_done < nr) {
+		const int re = sys_io_uring_enter(ring->fd, to_submit, 1,
+						  IORING_ENTER_GETEVENTS);
+		if (re < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		to_submit = ((uint32_t)re >= to_submit) ? 0 :
+							   (to_submit - (uint32_t)re);
+		nr_done += ring_reap(ring, nr, reqs);
+	}
+	if (nr_done == nr) {
+		return nr;
+	}
+
+	// 中途出错: 内核按顺序取走 sqe, sq_head 之前的已经提交, 可能还在执行.
+	// 收回没提交的 sqe, 等已提交的全部完成后才能放弃 ring
+	const uint32_t head =
+		__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	const uint64_t nr_submitted = (uint32_t)(head - tail0);
+	__atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+	while (nr_done < nr_submitted) {
+		nr_done += ring_reap(ring, nr, reqs);
+		if (nr_done < nr_submitted &&
+		    sys_io_uring_enter(ring->fd, 0, 1,
+				       IORING_ENTER_GETEVENTS) < 0) {
+			sched_yield();
+		}
+	}
+	return nr_submitted;
+}
+
+static void pread_one(struct IORequest *const req)
+{
+	const ssize_t r =
+		pread(req->fd, req->buf, req->len, (off_t)(req->off));
+	req->res = (r < 0) ? -errno : r;
+}
+
+static void *thread_pread(void *const p)
+{
+	struct PreadWork *const work = (typeof(work))p;
+	for (;;) {
+		const uint64_t i = __sync_fetch_and_add(&(work->token), 1);
+		if (i >= work->nr) {
+			break;
+		}
+		pread_one(&(work->reqs[i]));
+	}
+	return NULL;
+}
+
+static void pread_all(const uint64_t nr, struct IORequest *const reqs)
+{
+	if (nr <= IOBATCH_PER_THREAD) {
+		for (uint64_t i = 0; i < nr; i++) {
+			pread_one(&(reqs[i]));
+		}
+		return;
+	}
+	struct PreadWork work = { .token = 0, .nr = nr, .reqs = reqs };
+	const uint64_t nr_th0 = nr / IOBATCH_PER_THREAD;
+	const uint64_t nr_th =
+		(nr_th0 > IOBATCH_THREADS_NR) ? IOBATCH_THREADS_NR : nr_th0;
+	conc_fork_reduce(nr_th, thread_pread, &work);
+}
+
+struct IOBatch *iobatch_new(const uint32_t depth)
+{
+	struct IOBatch *const iob = (typeof(iob))malloc(sizeof(*iob));
+	assert(iob);
+	bzero(iob, sizeof(*iob));
+	iob->using_uring = ring_initial(&(iob->ring), depth);
+	return iob;
+}
+
+bool iobatch_using_uring(const struct IOBatch *const iob)
+{
+	return iob->using_uring;
+}
+
+// 所有请求完成后返回; 短读会用 pread 补一次
+void iobatch_read(struct IOBatch *const iob, const uint64_t nr,
+		  struct IORequest *const reqs)
+{
+	if (iob->using_uring == false) {
+		pread_all(nr, reqs);
+		return;
+	}
+	const uint64_t depth = iob->ring.nr_sqes;
+	uint64_t nr_ring = 0;
+	while (nr_ring < nr) {
+		const uint64_t n =
+			((nr - nr_ring) < depth) ? (nr - nr_ring) : depth;
+		const uint64_t done =
+			ring_read_some(&(iob->ring), n, &(reqs[nr_ring]));
+		nr_ring += done;
+		if (done < n) {
+			// the ring state is unknown, drop it for good;
+			// nothing submitted is in flight any more
+			ring_unmap(&(iob->ring));
+			iob->using_uring = false;
+			pread_all(nr - nr_ring, &(reqs[nr_ring]));
+			break;
+		}
+	}
+	// e.g. -EINVAL on kernels without IORING_OP_READ
+	for (uint64_t i = 0; i < nr_ring; i++) {
+		if (reqs[i].res != (ssize_t)reqs[i].len) {
+			pread_one(&(reqs[i]));
+		}
+	}
+}
+
+void iobatch_free(struct IOBatch *const iob)
+{
+	if (iob->using_uring) {
+		ring_unmap(&(iob->ring));
+	}
+	free(iob);
+}
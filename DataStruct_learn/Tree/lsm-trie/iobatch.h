@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// one positional read
+struct IORequest {
+	int fd;
+	uint32_t len;
+	uint64_t off;
+	uint8_t *buf;
+	// bytes read, or -errno
+	ssize_t res;
+};
+
+// 批量读: io_uring 不可用时退化为 pread 线程
+struct IOBatch;
+
+struct IOBatch *iobatch_new(const uint32_t depth);
+
+bool iobatch_using_uring(const struct IOBatch *const iob);
+
+void iobatch_read(struct IOBatch *const iob, const uint64_t nr,
+		  struct IORequest *const reqs);
+
+void iobatch_free(struct IOBatch *const iob);
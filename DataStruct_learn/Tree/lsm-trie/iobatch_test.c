@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+
+#define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
+
+#include "iobatch.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "generator.h"
+
+#define FILE_SIZE ((UINT64_C(4) << 20))
+#define MAX_LEN ((UINT32_C(65536)))
+
+// 随机的读请求: 包括越过文件尾的短读和无效的 fd
+static void make_reqs(const int fd, const uint64_t nr,
+		      struct IORequest *const reqs, uint8_t *const bufs)
+{
+	for (uint64_t i = 0; i < nr; i++) {
+		reqs[i].fd = ((random_uint64() % 64) == 0) ? -1 : fd;
+		reqs[i].len = (uint32_t)(1 + (random_uint64() % MAX_LEN));
+		reqs[i].off = random_uint64() % (FILE_SIZE + MAX_LEN);
+		reqs[i].buf = bufs + (i * MAX_LEN);
+		reqs[i].res = 0;
+	}
+}
+
+// 和逐个 pread 的结果比较
+static uint64_t check_reqs(const uint64_t nr,
+			   const struct IORequest *const reqs,
+			   uint8_t *const tmp)
+{
+	uint64_t nr_bad = 0;
+	for (uint64_t i = 0; i < nr; i++) {
+		const struct IORequest *const req = &(reqs[i]);
+		const ssize_t r = pread(req->fd, tmp, req->len, (off_t)req->off);
+		const ssize_t exp = (r < 0) ? -errno : r;
+		if ((req->res != exp) ||
+		    ((exp > 0) && memcmp(req->buf, tmp, (size_t)exp))) {
+			printf("req %lu fd %d off %lu len %u: res %zd, pread %zd\n",
+			       i, req->fd, req->off, req->len, req->res, exp);
+			nr_bad++;
+		}
+	}
+	return nr_bad;
+}
+
+int main(int argc, char **argv)
+{
+	const char *const fn = (argc > 1) ? argv[1] : "iobatch_test.tmp";
+	const int fd = open(fn, O_CREAT | O_TRUNC | O_RDWR, 0644);
+	assert(fd >= 0);
+	uint8_t *const data = malloc(FILE_SIZE);
+	for (uint64_t i = 0; i < FILE_SIZE; i += sizeof(uint64_t)) {
+		*(uint64_t *)(data + i) = random_uint64();
+	}
+	const ssize_t w = pwrite(fd, data, FILE_SIZE, 0);
+	assert(w == (ssize_t)FILE_SIZE);
+	free(data);
+
+	// 批大小小于、等于、大于 ring 的深度
+	const uint32_t depth = 32;
+	const uint64_t nrs[] = { 1, 7, 32, 33, 100, 1000 };
+	const uint64_t max_nr = 1000;
+	struct IORequest *const reqs = malloc(sizeof(reqs[0]) * max_nr);
+	uint8_t *const bufs = malloc(MAX_LEN * max_nr);
+	uint8_t *const tmp = malloc(MAX_LEN);
+	struct IOBatch *const iob = iobatch_new(depth);
+	printf("io_uring: %s\n", iobatch_using_uring(iob) ? "yes" : "no");
+
+	uint64_t nr_bad = 0;
+	for (uint64_t round = 0; round < 20; round++) {
+		for (uint64_t j = 0; j < (sizeof(nrs) / sizeof(nrs[0])); j++) {
+			make_reqs(fd, nrs[j], reqs, bufs);
+			iobatch_read(iob, nrs[j], reqs);
+			nr_bad += check_reqs(nrs[j], reqs, tmp);
+		}
+	}
+	printf("io_uring after test: %s\n",
+	       iobatch_using_uring(iob) ? "yes" : "no");
+	iobatch_free(iob);
+	free(tmp);
+	free(bufs);
+	free(reqs);
+	close(fd);
+	unlink(fn);
+
+	if (nr_bad) {
+		printf("FAILED: %lu mismatches\n", nr_bad);
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
@@ -21,6 +21,8 @@
 #include <unistd.h>
 
 #define MEMPOOL_UNIT (1024 * 1024 * 2)
+// 线程本地分配块
+#define MEMPOOL_ARENA (1024 * 64)
 
 struct Mempool {
 	// 是否是 mmap 分配
@@ -30,8 +32,21 @@ struct Mempool {
 	uint64_t max;
 	// 内存分配返回的起始地址
 	uint8_t *space;
+	// unique, never reused (an address may be)
+	uint64_t serial;
 };
 
+// per-thread bump region carved from one Mempool
+struct MempoolArena {
+	uint64_t serial;
+	uint8_t *pos;
+	uint8_t *end;
+};
+
+static uint64_t __mempool_serial = 0;
+
+static __thread struct MempoolArena __arena = { 0, NULL, NULL };
+
 static const bool USING_MALLOC = false;
 
 void *huge_alloc(const uint64_t cap)
@@ -103,6 +118,7 @@ struct Mempool *mempool_new(const size_t cap)
 	}
 
 	p->pos = 0;
+	p->serial = __sync_add_and_fetch(&__mempool_serial, 1);
 	const bool r = space_alloc_mmap(p, cap);
 	if (r == false) {
 		free(p);
@@ -139,6 +155,32 @@ uint8_t *mempool_alloc(struct Mempool *const p, const size_t cap)
 	return r;
 }
 
+// thread-local bump allocation, one atomic op per MEMPOOL_ARENA bytes
+uint8_t *mempool_alloc_local(struct Mempool *const p, const size_t cap)
+{
+	const size_t hcap = ((cap + 8u) & (~7u));
+	if (hcap > (MEMPOOL_ARENA >> 2)) {
+		return mempool_alloc(p, cap);
+	}
+	struct MempoolArena *const a = &__arena;
+	if ((a->serial != p->serial) || ((a->pos + hcap) > a->end)) {
+		// 剩余空间不足一块时直接分配
+		if ((p->pos + MEMPOOL_ARENA + 8u) > p->max) {
+			return mempool_alloc(p, cap);
+		}
+		uint8_t *const m = mempool_alloc(p, MEMPOOL_ARENA);
+		if (m == NULL) {
+			return mempool_alloc(p, cap);
+		}
+		a->serial = p->serial;
+		a->pos = m;
+		a->end = m + MEMPOOL_ARENA;
+	}
+	uint8_t *const r = a->pos;
+	a->pos += hcap;
+	return r;
+}
+
 // 内存池内存释放
 void mempool_free(struct Mempool *const p)
 {
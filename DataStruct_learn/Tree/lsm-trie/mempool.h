@@ -19,6 +19,8 @@ struct Mempool *mempool_new(const size_t cap);
 
 uint8_t *mempool_alloc(struct Mempool *const p, const size_t cap);
 
+uint8_t *mempool_alloc_local(struct Mempool *const p, const size_t cap);
+
 void mempool_free(struct Mempool *const p);
 
 void mempool_show(struct Mempool *const p);
@@ -44,14 +44,35 @@ struct DBParams {
 	uint64_t range;
 	uint64_t sec; // run time
 	uint64_t nr_report;
+	// read with db_multi_lookup(), one batch per 100 ops
+	bool multi_get;
+	// keep the ordered index (DBConf.ordered_index)
+	bool ordered;
+	// items per range scan after the run, 0 for no scan benchmark
+	uint64_t nr_scan;
+	// DBConf.wal_mode and wal_sync_ms
+	uint32_t wal_mode;
+	uint64_t wal_sync_ms;
+	// DBConf.compress
+	bool compress;
+	// DBConf.concurrent_insert
+	bool concurrent;
+	// thread counts for back-to-back rounds, e.g. "1,4,16,64"
+	char *sweep;
+	// DBConf.compaction_mbps
+	uint64_t compaction_mbps;
+	// DBConf.latency_stats
+	bool latency_stats;
 };
 
 static const uint64_t nr_configs = 1;
 static struct DBParams pstable[] = {
 	// tag    vlen  meta_dir       cm_conf_fn     th  pw   gen        range sec
-	// nr
+	// nr multi_get ordered nr_scan wal_mode wal_sync_ms compress
+	// concurrent sweep compaction_mbps latency_stats
 	{ "Dummy", 100, "lsmtrie_tmp", "cm_conf1.txt", 1, 100, "uniform",
-	  UINT64_C(0x100000000000), 3000, 100000 },
+	  UINT64_C(0x100000000000), 3000, 100000, false, false, 0, WAL_OFF,
+	  0, false, false, NULL, 0, false },
 };
 
 // singleton
@@ -97,6 +118,21 @@ static void show_dbparams(const struct DBParams *const ps)
 	printf("    -r #range:      %lu\n", ps->range);
 	printf("    -t #sec:        %lu\n", ps->sec);
 	printf("    -n #nr_report:  %lu\n", ps->nr_report);
+	printf("    -b #multi_get:  %s\n", ps->multi_get ? "yes" : "no");
+	printf("    -o #ordered:    %s\n", ps->ordered ? "yes" : "no");
+	printf("    -s #nr_scan:    %lu\n", ps->nr_scan);
+	static const char *const wal_names[4] = { "off", "none", "batch",
+						  "interval" };
+	printf("    -L #wal:        %s", wal_names[ps->wal_mode]);
+	if (ps->wal_mode == WAL_SYNC_INTERVAL) {
+		printf(" %lums", ps->wal_sync_ms);
+	}
+	printf("\n");
+	printf("    -z #compress:   %s\n", ps->compress ? "lz4" : "no");
+	printf("    -m #concurrent: %s\n", ps->concurrent ? "yes" : "no");
+	printf("    -T #sweep:      %s\n", ps->sweep ? ps->sweep : "-");
+	printf("    -R #comp_MB/s:  %lu\n", ps->compaction_mbps);
+	printf("    -H #histograms: %s\n", ps->latency_stats ? "yes" : "no");
 	fflush(stdout);
 }
 
@@ -138,8 +174,25 @@ static void mixed_worker(const struct DBParams *const ps)
 			assert(r);
 		}
 
+		// read keys in one batch
+		if (ps->multi_get && (ps->p_writer < 100u)) {
+			struct KeyValue *results[100];
+			const uint64_t nr_get = 100u - ps->p_writer;
+			const uint64_t t0 = debug_time_usec();
+			db_multi_lookup(__ts.db, nr_get, &(kvs[ps->p_writer]),
+					results);
+			const uint64_t t1 = debug_time_usec();
+			latency_record(t1 - t0, __ts.latency);
+			for (uint64_t i = 0; i < nr_get; i++) {
+				if (results[i]) {
+					free(results[i]);
+				}
+			}
+		}
+
 		// read keys
-		for (uint64_t i = ps->p_writer; i < 100u; i++) {
+		const uint64_t i0 = ps->multi_get ? 100u : ps->p_writer;
+		for (uint64_t i = i0; i < 100u; i++) {
 			const uint64_t t0 = debug_time_usec();
 			struct KeyValue *const kv =
 				db_lookup(__ts.db, sizeof(keys[i]),
@@ -173,6 +226,66 @@ static void mixed_worker(const struct DBParams *const ps)
 	}
 }
 
+// ordered scans: the index against reading every barrel (DB_ITER_WALK)
+static void scan_benchmark(const struct DBParams *const ps)
+{
+	static const uint32_t modes[2] = { 0, DB_ITER_WALK };
+	static const char *const names[2] = { "INDEX", "WALK" };
+	while (db_doing_compaction(__ts.db)) {
+		sleep(1);
+	}
+	for (uint64_t m = 0; m < 2; m++) {
+		// full scan, keys only
+		const uint64_t t0 = debug_time_usec();
+		struct DBIterator *const it1 =
+			db_iterator_new(__ts.db, modes[m] | DB_ITER_KEYS_ONLY);
+		const uint64_t t1 = debug_time_usec();
+		uint64_t nr_keys = 0;
+		for (;;) {
+			struct KeyValue *const kv = db_iterator_next(it1);
+			if (kv == NULL) {
+				break;
+			}
+			nr_keys++;
+			free(kv);
+		}
+		const uint64_t t2 = debug_time_usec();
+		db_iterator_free(it1);
+
+		// 100 range scans with values
+		struct DBIterator *const it2 =
+			db_iterator_new(__ts.db, modes[m]);
+		const uint64_t t3 = debug_time_usec();
+		uint64_t nr_items = 0;
+		for (uint64_t i = 0; i < 100u; i++) {
+			const uint64_t rkey = __ts.gi->next(__ts.gi);
+			db_iterator_seek(it2, sizeof(rkey),
+					 (const uint8_t *)(&rkey));
+			for (uint64_t j = 0; j < ps->nr_scan; j++) {
+				struct KeyValue *const kv =
+					db_iterator_next(it2);
+				if (kv == NULL) {
+					break;
+				}
+				nr_items++;
+				free(kv);
+			}
+		}
+		const uint64_t t4 = debug_time_usec();
+		db_iterator_free(it2);
+
+		const double snap = ((double)(t1 - t0)) / 1000000.0;
+		const double kps = ((double)nr_keys) * 1000000.0 /
+				   ((double)(t2 - t0 + 1));
+		const double ips = ((double)nr_items) * 1000000.0 /
+				   ((double)(t4 - t3 + 1));
+		printf("SCAN %-5s snapshot %.3lfs keys %lu %.0lf keys/s "
+		       "range %lu items %.0lf items/s\n",
+		       names[m], snap, nr_keys, kps, nr_items, ips);
+		fflush(stdout);
+	}
+}
+
 static void *mixed_thread(void *p)
 {
 	const uint64_t token = __sync_fetch_and_add(&(__ts.token), 1u);
@@ -261,19 +374,12 @@ static void sig_install_all(void)
 	sigaction(SIGUSR1, &sa, NULL);
 }
 
-static void mixed_test(const struct DBParams *const p)
+// run nth workers for p->sec seconds, return QPS
+static double mixed_round(const struct DBParams *const p, const uint64_t nth)
 {
-	sig_install_all();
-	srandom(debug_time_usec());
-	show_dbparams(p);
-	__ts.gi = gen_initial(p->generator, p->range);
-	__ts.db = db_touch(p->meta_dir, p->cm_conf_fn);
-	assert(__ts.db);
-	memset(__ts.buf, 0x5au, BARREL_ALIGN);
-	__ts.latency = latency_initial();
-
-	const uint64_t nth = p->nr_threads;
 	pthread_t pth[nth];
+	__ts.nr_100 = 0;
+	__ts.token = 0;
 
 	// 设置线程允许 join 堵塞等待线程退出
 	pthread_attr_t attr;
@@ -295,13 +401,63 @@ static void mixed_test(const struct DBParams *const p)
 	}
 	printf("Op %lu\n", __ts.nr_100 * 100u);
 	printf("time_usec %lu\n", dur);
-	printf("QPS %.4lf\n",
-	       ((double)__ts.nr_100) * 100000000.0 / ((double)dur));
+	const double qps =
+		((double)__ts.nr_100) * 100000000.0 / ((double)dur);
+	printf("QPS %.4lf\n", qps);
+	fflush(stdout);
+	return qps;
+}
+
+static void mixed_test(const struct DBParams *const p)
+{
+	sig_install_all();
+	srandom(debug_time_usec());
+	show_dbparams(p);
+	__ts.gi = gen_initial(p->generator, p->range);
+	struct DBConf conf;
+	db_conf_default(&conf);
+	conf.ordered_index = p->ordered;
+	conf.wal_mode = p->wal_mode;
+	conf.wal_sync_ms = p->wal_sync_ms;
+	conf.compress = p->compress;
+	conf.concurrent_insert = p->concurrent;
+	conf.compaction_mbps = p->compaction_mbps;
+	conf.latency_stats = p->latency_stats;
+	__ts.db = db_touch_conf(p->meta_dir, p->cm_conf_fn, &conf);
+	assert(__ts.db);
+	memset(__ts.buf, 0x5au, BARREL_ALIGN);
+	__ts.latency = latency_initial();
+
+	if (p->sweep) {
+		// one round per thread count on the same db
+		double qps[64];
+		uint64_t nths[64];
+		uint64_t nr = 0;
+		char *const list = strdup(p->sweep);
+		char *save = NULL;
+		for (char *tok = strtok_r(list, ",", &save); tok && (nr < 64);
+		     tok = strtok_r(NULL, ",", &save)) {
+			nths[nr] = strtoull(tok, NULL, 10);
+			qps[nr] = mixed_round(p, nths[nr]);
+			nr++;
+		}
+		free(list);
+		printf("SWEEP %s\n", p->concurrent ? "concurrent" : "locked");
+		for (uint64_t i = 0; i < nr; i++) {
+			printf("SWEEP threads %3lu QPS %12.2lf\n", nths[i],
+			       qps[i]);
+		}
+	} else {
+		mixed_round(p, p->nr_threads);
+	}
+	if (p->nr_scan) {
+		scan_benchmark(p);
+	}
 	generator_destroy(__ts.gi);
 	__ts.gi = NULL;
 
 	db_stat_show(__ts.db, stdout);
-	latency_show("GET", __ts.latency, stdout);
+	latency_show(p->multi_get ? "MULTI-GET" : "GET", __ts.latency, stdout);
 	free(__ts.latency);
 	fflush(stdout);
 	db_close(__ts.db);
@@ -339,6 +495,15 @@ int main(int argc, char **argv)
 			"d:" // meta dir: either load existing db or create new db
 			"c:" // cm_conf_fn: the stroage config file
 			"g:" // generator c,e,z,x,u
+			"b" // batched reads with db_multi_lookup()
+			"o" // keep the ordered index
+			"s:" // scan benchmark: items per range scan
+			"L:" // wal: off, none, batch or N (sync every N ms)
+			"z" // lz4 value compression (make LZ4=1)
+			"m" // concurrent inserts into the active table
+			"T:" // thread sweep, e.g. 1,4,16,64
+			"R:" // compaction I/O budget in MB/s
+			"H" // latency histograms on <meta_dir>/stats.sock
 			"h" // help
 			"l" // list pre-defined params
 			)) != -1) {
@@ -378,6 +543,42 @@ int main(int argc, char **argv)
 		case 'g':
 			ps.generator = strdup(optarg);
 			break;
+		case 'b':
+			ps.multi_get = true;
+			break;
+		case 'o':
+			ps.ordered = true;
+			break;
+		case 's':
+			ps.nr_scan = strtoull(optarg, NULL, 10);
+			break;
+		case 'L':
+			if (0 == strcmp(optarg, "off")) {
+				ps.wal_mode = WAL_OFF;
+			} else if (0 == strcmp(optarg, "none")) {
+				ps.wal_mode = WAL_SYNC_NONE;
+			} else if (0 == strcmp(optarg, "batch")) {
+				ps.wal_mode = WAL_SYNC_BATCH;
+			} else {
+				ps.wal_mode = WAL_SYNC_INTERVAL;
+				ps.wal_sync_ms = strtoull(optarg, NULL, 10);
+			}
+			break;
+		case 'z':
+			ps.compress = true;
+			break;
+		case 'm':
+			ps.concurrent = true;
+			break;
+		case 'T':
+			ps.sweep = strdup(optarg);
+			break;
+		case 'R':
+			ps.compaction_mbps = strtoull(optarg, NULL, 10);
+			break;
+		case 'H':
+			ps.latency_stats = true;
+			break;
 		case 'h': {
 			show_dbparams(&ps);
 			exit(1);
@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+// 有序索引: 每个表一组有序键, 扫描时多路归并
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include "ordered.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KEYRUN_MAGIC ((UINT64_C(0x6e75722d7379656b)))
+
+struct KeyRun {
+	uint64_t refcount;
+	// 键个数
+	uint64_t nr;
+	uint64_t cap;
+	uint64_t nr_bytes;
+	uint64_t cap_bytes;
+	// entry offsets into blob, in key order after keyrun_sort()
+	uint32_t *pos;
+	uint8_t *blob;
+};
+
+struct KeyCursor {
+	const struct KeyRun *run;
+	uint64_t idx;
+};
+
+struct KeyMerge {
+	uint64_t nr_runs;
+	struct KeyRun **runs;
+	// min-heap of cursors, heap[0] is the current key
+	uint64_t nr_heap;
+	struct KeyCursor heap[];
+};
+
+static inline const uint8_t *keyrun_entry(const struct KeyRun *const run,
+					  const uint64_t i, uint16_t *const klen)
+{
+	const uint8_t *const p = run->blob + run->pos[i];
+	memcpy(klen, p, sizeof(*klen));
+	return p + sizeof(*klen);
+}
+
+static inline int key_compare(const uint16_t l1, const uint8_t *const k1,
+			      const uint16_t l2, const uint8_t *const k2)
+{
+	const int c = memcmp(k1, k2, (l1 < l2) ? l1 : l2);
+	if (c) {
+		return c;
+	}
+	return (l1 < l2) ? -1 : ((l1 > l2) ? 1 : 0);
+}
+
+struct KeyRun *keyrun_new(const uint64_t nr_hint)
+{
+	struct KeyRun *const run = (typeof(run))malloc(sizeof(*run));
+	assert(run);
+	bzero(run, sizeof(*run));
+	run->refcount = 1;
+	run->cap = nr_hint ? nr_hint : 64;
+	run->cap_bytes = run->cap * 16;
+	run->pos = (typeof(run->pos))malloc(sizeof(run->pos[0]) * run->cap);
+	run->blob = (typeof(run->blob))malloc(run->cap_bytes);
+	assert(run->pos && run->blob);
+	return run;
+}
+
+void keyrun_append(struct KeyRun *const run, const uint16_t klen,
+		   const uint8_t *const key)
+{
+	const uint64_t esize = sizeof(klen) + klen;
+	if (run->nr == run->cap) {
+		run->cap <<= 1;
+		run->pos = realloc(run->pos, sizeof(run->pos[0]) * run->cap);
+		assert(run->pos);
+	}
+	while ((run->nr_bytes + esize) > run->cap_bytes) {
+		run->cap_bytes <<= 1;
+		run->blob = realloc(run->blob, run->cap_bytes);
+		assert(run->blob);
+	}
+	assert((run->nr_bytes + esize) < UINT32_MAX);
+	uint8_t *const p = run->blob + run->nr_bytes;
+	memcpy(p, &klen, sizeof(klen));
+	memcpy(p + sizeof(klen), key, klen);
+	run->pos[run->nr] = (uint32_t)run->nr_bytes;
+	run->nr++;
+	run->nr_bytes += esize;
+}
+
+static int __compare_pos(const void *const p1, const void *const p2,
+			 void *const arg)
+{
+	const uint8_t *const blob = (typeof(blob))arg;
+	const uint8_t *const e1 = blob + *((const uint32_t *)p1);
+	const uint8_t *const e2 = blob + *((const uint32_t *)p2);
+	uint16_t l1, l2;
+	memcpy(&l1, e1, sizeof(l1));
+	memcpy(&l2, e2, sizeof(l2));
+	return key_compare(l1, e1 + sizeof(l1), l2, e2 + sizeof(l2));
+}
+
+// sort and drop duplicates (the blob is left as is)
+void keyrun_sort(struct KeyRun *const run)
+{
+	if (run->nr < 2) {
+		return;
+	}
+	qsort_r(run->pos, run->nr, sizeof(run->pos[0]), __compare_pos,
+		run->blob);
+	uint64_t nr = 1;
+	for (uint64_t i = 1; i < run->nr; i++) {
+		if (__compare_pos(&(run->pos[nr - 1]), &(run->pos[i]),
+				  run->blob) != 0) {
+			run->pos[nr++] = run->pos[i];
+		}
+	}
+	run->nr = nr;
+}
+
+uint64_t keyrun_nr_keys(const struct KeyRun *const run)
+{
+	return run->nr;
+}
+
+// format: <magic> <nr> <nr_bytes> <entries in key order>
+bool keyrun_dump(const struct KeyRun *const run, const char *const fn)
+{
+	FILE *const fo = fopen(fn, "wb");
+	if (fo == NULL) {
+		return false;
+	}
+	uint64_t nr_bytes = 0;
+	for (uint64_t i = 0; i < run->nr; i++) {
+		uint16_t klen;
+		keyrun_entry(run, i, &klen);
+		nr_bytes += sizeof(klen) + klen;
+	}
+	const uint64_t head[3] = { KEYRUN_MAGIC, run->nr, nr_bytes };
+	const size_t nh = fwrite(head, sizeof(head), 1, fo);
+	assert(nh == 1);
+	for (uint64_t i = 0; i < run->nr; i++) {
+		uint16_t klen;
+		const uint8_t *const key = keyrun_entry(run, i, &klen);
+		const size_t nw = fwrite(key - sizeof(klen),
+					 sizeof(klen) + klen, 1, fo);
+		assert(nw == 1);
+	}
+	fclose(fo);
+	return true;
+}
+
+// NULL if missing or broken
+struct KeyRun *keyrun_load(const char *const fn)
+{
+	FILE *const fi = fopen(fn, "rb");
+	if (fi == NULL) {
+		return NULL;
+	}
+	uint64_t head[3];
+	const size_t nh = fread(head, sizeof(head), 1, fi);
+	if ((nh != 1) || (head[0] != KEYRUN_MAGIC)) {
+		fclose(fi);
+		return NULL;
+	}
+	struct KeyRun *const run = keyrun_new(head[1]);
+	free(run->blob);
+	run->cap_bytes = head[2] ? head[2] : 16;
+	run->blob = (typeof(run->blob))malloc(run->cap_bytes);
+	assert(run->blob);
+	const size_t nb = fread(run->blob, 1, head[2], fi);
+	fclose(fi);
+	if (nb != head[2]) {
+		keyrun_release(run);
+		return NULL;
+	}
+	run->nr_bytes = head[2];
+	uint64_t off = 0;
+	for (uint64_t i = 0; i < head[1]; i++) {
+		uint16_t klen;
+		memcpy(&klen, run->blob + off, sizeof(klen));
+		run->pos[i] = (uint32_t)off;
+		off += sizeof(klen) + klen;
+	}
+	assert(off == head[2]);
+	run->nr = head[1];
+	return run;
+}
+
+struct KeyRun *keyrun_acquire(struct KeyRun *const run)
+{
+	__sync_add_and_fetch(&(run->refcount), 1);
+	return run;
+}
+
+void keyrun_release(struct KeyRun *const run)
+{
+	if (__sync_sub_and_fetch(&(run->refcount), 1) == 0) {
+		free(run->pos);
+		free(run->blob);
+		free(run);
+	}
+}
+
+static inline int cursor_compare(const struct KeyCursor *const c1,
+				 const struct KeyCursor *const c2)
+{
+	uint16_t l1, l2;
+	const uint8_t *const k1 = keyrun_entry(c1->run, c1->idx, &l1);
+	const uint8_t *const k2 = keyrun_entry(c2->run, c2->idx, &l2);
+	return key_compare(l1, k1, l2, k2);
+}
+
+static void heap_sift_down(struct KeyMerge *const km, uint64_t i)
+{
+	for (;;) {
+		const uint64_t l = (i << 1) + 1;
+		const uint64_t r = l + 1;
+		uint64_t min = i;
+		if ((l < km->nr_heap) &&
+		    (cursor_compare(&(km->heap[l]), &(km->heap[min])) < 0)) {
+			min = l;
+		}
+		if ((r < km->nr_heap) &&
+		    (cursor_compare(&(km->heap[r]), &(km->heap[min])) < 0)) {
+			min = r;
+		}
+		if (min == i) {
+			return;
+		}
+		const struct KeyCursor tmp = km->heap[i];
+		km->heap[i] = km->heap[min];
+		km->heap[min] = tmp;
+		i = min;
+	}
+}
+
+struct KeyMerge *keymerge_new(struct KeyRun *const *const runs,
+			      const uint64_t nr_runs)
+{
+	struct KeyMerge *const km = (typeof(km))malloc(
+		sizeof(*km) + (sizeof(km->heap[0]) * nr_runs));
+	assert(km);
+	km->nr_runs = nr_runs;
+	km->runs = (typeof(km->runs))malloc(sizeof(km->runs[0]) *
+					    (nr_runs ? nr_runs : 1));
+	assert(km->runs);
+	memcpy(km->runs, runs, sizeof(runs[0]) * nr_runs);
+	km->nr_heap = 0;
+	keymerge_seek(km, 0, NULL);
+	return km;
+}
+
+// first key >= key
+static uint64_t keyrun_lower_bound(const struct KeyRun *const run,
+				   const uint16_t klen, const uint8_t *const key)
+{
+	uint64_t lo = 0;
+	uint64_t hi = run->nr;
+	while (lo < hi) {
+		const uint64_t mid = (lo + hi) >> 1;
+		uint16_t l;
+		const uint8_t *const k = keyrun_entry(run, mid, &l);
+		if (key_compare(l, k, klen, key) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+void keymerge_seek(struct KeyMerge *const km, const uint16_t klen,
+		   const uint8_t *const key)
+{
+	km->nr_heap = 0;
+	for (uint64_t i = 0; i < km->nr_runs; i++) {
+		const struct KeyRun *const run = km->runs[i];
+		const uint64_t idx =
+			key ? keyrun_lower_bound(run, klen, key) : 0;
+		if (idx < run->nr) {
+			km->heap[km->nr_heap].run = run;
+			km->heap[km->nr_heap].idx = idx;
+			km->nr_heap++;
+		}
+	}
+	for (uint64_t i = km->nr_heap; i > 0; i--) {
+		heap_sift_down(km, i - 1);
+	}
+}
+
+bool keymerge_valid(const struct KeyMerge *const km)
+{
+	return km->nr_heap ? true : false;
+}
+
+const uint8_t *keymerge_key(const struct KeyMerge *const km,
+			    uint16_t *const klen)
+{
+	assert(km->nr_heap);
+	return keyrun_entry(km->heap[0].run, km->heap[0].idx, klen);
+}
+
+// skip the current key in every run holding it
+void keymerge_next(struct KeyMerge *const km)
+{
+	assert(km->nr_heap);
+	const struct KeyCursor cur = km->heap[0];
+	do {
+		struct KeyCursor *const top = &(km->heap[0]);
+		top->idx++;
+		if (top->idx >= top->run->nr) {
+			km->nr_heap--;
+			km->heap[0] = km->heap[km->nr_heap];
+		}
+		heap_sift_down(km, 0);
+	} while (km->nr_heap && (cursor_compare(&(km->heap[0]), &cur) == 0));
+}
+
+void keymerge_free(struct KeyMerge *const km)
+{
+	for (uint64_t i = 0; i < km->nr_runs; i++) {
+		keyrun_release(km->runs[i]);
+	}
+	free(km->runs);
+	free(km);
+}
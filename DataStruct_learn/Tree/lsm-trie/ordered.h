@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// sorted, de-duplicated keys of one table (keys only, no values)
+// entries: <klen:uint16_t> <key>
+struct KeyRun;
+
+// k-way merge over several KeyRuns
+struct KeyMerge;
+
+// ----KeyRun
+struct KeyRun *keyrun_new(const uint64_t nr_hint);
+
+void keyrun_append(struct KeyRun *const run, const uint16_t klen,
+		   const uint8_t *const key);
+
+void keyrun_sort(struct KeyRun *const run);
+
+uint64_t keyrun_nr_keys(const struct KeyRun *const run);
+
+bool keyrun_dump(const struct KeyRun *const run, const char *const fn);
+
+struct KeyRun *keyrun_load(const char *const fn);
+
+struct KeyRun *keyrun_acquire(struct KeyRun *const run);
+
+void keyrun_release(struct KeyRun *const run);
+
+// ----KeyMerge
+// takes over one reference of each run
+struct KeyMerge *keymerge_new(struct KeyRun *const *const runs,
+			      const uint64_t nr_runs);
+
+void keymerge_seek(struct KeyMerge *const km, const uint16_t klen,
+		   const uint8_t *const key);
+
+bool keymerge_valid(const struct KeyMerge *const km);
+
+const uint8_t *keymerge_key(const struct KeyMerge *const km,
+			    uint16_t *const klen);
+
+void keymerge_next(struct KeyMerge *const km);
+
+void keymerge_free(struct KeyMerge *const km);
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+// 令牌桶: requests may overdraw, the caller then sleeps off the debt
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include "ratelimit.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+
+// 前台查询排队时的降速倍数
+#define RATELIMIT_BACKOFF ((UINT64_C(4)))
+// burst: 100ms worth of tokens
+#define RATELIMIT_BURST_USEC ((UINT64_C(100000)))
+
+struct RateLimiter {
+	pthread_mutex_t mutex;
+	uint64_t rate; // bytes per second
+	uint64_t burst;
+	// may go negative (debt)
+	int64_t tokens;
+	uint64_t usec_last;
+	const uint64_t *pressure;
+	uint64_t pressure_thresh;
+	struct Stat *stat;
+};
+
+struct RateLimiter *ratelimit_new(const uint64_t bytes_per_sec,
+				  const uint64_t *const pressure,
+				  const uint64_t pressure_thresh,
+				  struct Stat *const stat)
+{
+	struct RateLimiter *const rl = (typeof(rl))malloc(sizeof(*rl));
+	assert(rl);
+	bzero(rl, sizeof(*rl));
+	pthread_mutex_init(&(rl->mutex), NULL);
+	rl->rate = bytes_per_sec;
+	rl->burst = bytes_per_sec * RATELIMIT_BURST_USEC / 1000000u;
+	rl->tokens = (int64_t)rl->burst;
+	rl->usec_last = debug_time_usec();
+	rl->pressure = pressure;
+	rl->pressure_thresh = pressure_thresh;
+	rl->stat = stat;
+	return rl;
+}
+
+// take bytes from the bucket, sleep until the debt is paid
+void ratelimit_request(struct RateLimiter *const rl, const uint64_t bytes)
+{
+	if (rl->rate == 0) {
+		// 不限速, 只计数
+		if (rl->stat) {
+			stat_inc_n(&(rl->stat->nr_compaction_bytes), bytes);
+		}
+		return;
+	}
+	const bool backoff =
+		(rl->pressure && ((*rl->pressure) > rl->pressure_thresh)) ?
+			true :
+			false;
+	const uint64_t cost = backoff ? (bytes * RATELIMIT_BACKOFF) : bytes;
+
+	pthread_mutex_lock(&(rl->mutex));
+	const uint64_t now = debug_time_usec();
+	// no more than it takes to fill the bucket, so that a long idle
+	// period can't overflow elapsed * rate
+	const uint64_t usec_full =
+		((uint64_t)((int64_t)rl->burst - rl->tokens)) * 1000000u /
+		rl->rate;
+	const uint64_t elapsed = now - rl->usec_last;
+	const uint64_t refill =
+		((elapsed < usec_full) ? elapsed : (usec_full + 1u)) *
+		rl->rate / 1000000u;
+	rl->usec_last = now;
+	rl->tokens += (int64_t)refill;
+	if (rl->tokens > (int64_t)rl->burst) {
+		rl->tokens = (int64_t)rl->burst;
+	}
+	rl->tokens -= (int64_t)cost;
+	// 欠的令牌按速率换算成等待时间
+	const uint64_t wait = (rl->tokens < 0) ?
+				      (((uint64_t)(-rl->tokens)) * 1000000u /
+				       rl->rate) :
+				      0;
+	pthread_mutex_unlock(&(rl->mutex));
+
+	if (rl->stat) {
+		stat_inc_n(&(rl->stat->nr_compaction_bytes), bytes);
+		if (backoff) {
+			stat_inc(&(rl->stat->nr_compaction_backoff));
+		}
+	}
+	if (wait) {
+		usleep(wait);
+		if (rl->stat) {
+			stat_inc_n(&(rl->stat->compaction_stall_usec), wait);
+		}
+	}
+}
+
+void ratelimit_free(struct RateLimiter *const rl)
+{
+	pthread_mutex_destroy(&(rl->mutex));
+	free(rl);
+}
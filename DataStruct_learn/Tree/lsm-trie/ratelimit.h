@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include "stat.h"
+
+// 令牌桶限速 (compaction I/O); bytes_per_sec == 0: count only
+// while *pressure > pressure_thresh every byte costs RATELIMIT_BACKOFF tokens
+struct RateLimiter;
+
+struct RateLimiter *ratelimit_new(const uint64_t bytes_per_sec,
+				  const uint64_t *const pressure,
+				  const uint64_t pressure_thresh,
+				  struct Stat *const stat);
+
+void ratelimit_request(struct RateLimiter *const rl, const uint64_t bytes);
+
+void ratelimit_free(struct RateLimiter *const rl);
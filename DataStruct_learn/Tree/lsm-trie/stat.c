@@ -120,6 +120,25 @@ void stat_show(struct Stat *const stat, FILE *const out)
 		fprintf(out, "nr_4K_write_all*       %10lu\n", nr_write_all);
 		fprintf(out, "write_amplification*   %10.4lf\n", write_amp);
 	}
+	if (snapshot.nr_wal_write) {
+		const double group = ((double)snapshot.nr_set) /
+				     ((double)snapshot.nr_wal_write);
+		fprintf(out, "nr_wal_write           %10lu\n",
+			snapshot.nr_wal_write);
+		fprintf(out, "nr_wal_sync            %10lu\n",
+			snapshot.nr_wal_sync);
+		fprintf(out, "nr_wal_bytes           %10lu\n",
+			snapshot.nr_wal_bytes);
+		fprintf(out, "wal_group_size*        %10.4lf\n", group);
+	}
+	if (snapshot.nr_compaction_bytes) {
+		fprintf(out, "nr_compaction_MB       %10lu\n",
+			snapshot.nr_compaction_bytes >> 20);
+		fprintf(out, "nr_compaction_backoff  %10lu\n",
+			snapshot.nr_compaction_backoff);
+		fprintf(out, "compaction_stall_ms    %10lu\n",
+			snapshot.compaction_stall_usec / 1000u);
+	}
 }
 
 #define STAT_COUNTER_CAP ((UINT64_C(100000)))
@@ -33,6 +33,17 @@ struct Stat {
 
 	uint64_t nr_write[64];
 	uint64_t nr_write_bc;
+
+	// 预写日志
+	uint64_t nr_wal_write;
+	uint64_t nr_wal_sync;
+	uint64_t nr_wal_bytes;
+
+	// compaction 限速
+	uint64_t nr_compaction_bytes;
+	uint64_t nr_compaction_backoff;
+	// summed over the compaction threads
+	uint64_t compaction_stall_usec;
 };
 
 void stat_inc(uint64_t *const p);
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+// 读取运行中 db 的延迟直方图 (DBConf.latency_stats)
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		printf("usage: %s <meta_dir>/stats.sock [total|interval]\n",
+		       argv[0]);
+		exit(0);
+	}
+	struct sockaddr_un addr;
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((fd < 0) ||
+	    (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)) {
+		perror("connect");
+		exit(1);
+	}
+	const char *const req = (argc > 2) ? argv[2] : "total";
+	const ssize_t nw = write(fd, req, strlen(req));
+	if (nw != (ssize_t)strlen(req)) {
+		perror("write");
+		exit(1);
+	}
+	char buf[4096];
+	ssize_t nr;
+	while ((nr = read(fd, buf, sizeof(buf))) > 0) {
+		fwrite(buf, 1, nr, stdout);
+	}
+	close(fd);
+	return 0;
+}
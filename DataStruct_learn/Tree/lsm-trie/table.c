@@ -24,10 +24,17 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef LSMTRIE_LZ4
+#include <lz4.h>
+#endif
+
 #include "bloom.h"
 #include "coding.h"
 #include "debug.h"
+#include "hist.h"
 #include "mempool.h"
+#include "ordered.h"
+#include "ratelimit.h"
 #include "stat.h"
 
 // 4088
@@ -36,6 +43,11 @@
 // 元索引占比
 #define METAINDEX_PERCENT ((0.99))
 #define METAINDEX_MAX_NR ((UINT64_C(2048)))
+// MetaIndex.rid in a barrel trailer: the barrel uses the lz4 item format,
+// <klen> <key> <vlen << 1 | compressed> <value>
+#define METAINDEX_LZ4 ((UINT16_C(0x8000)))
+// values shorter than this are never compressed
+#define LZ4_MIN_VLEN ((UINT16_C(32)))
 
 struct Item {
 	struct Item *next;
@@ -45,8 +57,10 @@ struct Item {
 	uint16_t volume;
 	// 键长度
 	uint16_t klen;
-	// 值长度
+	// 值长度 (stored bytes)
 	uint16_t vlen;
+	// value is <raw vlen> <lz4 block>
+	bool lz4;
 	// 使用键计算出来的 hash
 	uint8_t hash[HASHBYTES];
 	uint8_t kv[]; // len(kv) == klen + vlen
@@ -56,6 +70,10 @@ struct Item {
 struct RawItem {
 	uint16_t klen;
 	uint16_t vlen;
+	// the barrel uses the lz4 item format
+	bool lz4_fmt;
+	// this value is compressed
+	bool lz4;
 	const uint8_t *pk;
 	const uint8_t *pv;
 	const uint8_t *limit;
@@ -78,6 +96,8 @@ struct Barrel { // a barrel of items
 
 	//
 	uint32_t min;
+	// 并发插入的序号, see barrel_insert_mt()
+	uint32_t seq;
 };
 
 struct MetaIndex {
@@ -217,16 +237,97 @@ static struct Item *item_lookup(struct Item *const items, const uint16_t klen,
 	return NULL;
 }
 
+// compress into dst (at least value_compress_bound(vlen) bytes);
+// return the stored length, or 0 if it does not pay off
+static uint64_t value_compress(const uint16_t vlen, const uint8_t *const pv,
+			       uint8_t *const dst)
+{
+#ifdef LSMTRIE_LZ4
+	if (vlen < LZ4_MIN_VLEN) {
+		return 0;
+	}
+	uint8_t *const pz = encode_uint16(dst, vlen);
+	const int nz = LZ4_compress_default((const char *)pv, (char *)pz,
+					    vlen, LZ4_compressBound(vlen));
+	if (nz <= 0) {
+		return 0;
+	}
+	const uint64_t stored = (uint64_t)(pz - dst) + (uint64_t)nz;
+	return (stored < vlen) ? stored : 0;
+#else
+	(void)vlen;
+	(void)pv;
+	(void)dst;
+	return 0;
+#endif
+}
+
+static inline uint64_t value_compress_bound(const uint16_t vlen)
+{
+	// varint + lz4 worst case
+	return 3u + vlen + (vlen / 255u) + 16u;
+}
+
+// raw length of a compressed value
+static inline uint16_t value_raw_vlen(const uint8_t *const pv)
+{
+	uint16_t vlen = 0;
+	decode_uint16(pv, &vlen);
+	return vlen;
+}
+
+// dst must hold value_raw_vlen() bytes
+static void value_decompress(const uint16_t stored, const uint8_t *const pv,
+			     uint8_t *const dst)
+{
+#ifdef LSMTRIE_LZ4
+	uint16_t vlen = 0;
+	const uint8_t *const pz = decode_uint16(pv, &vlen);
+	const int nz = (int)(stored - (pz - pv));
+	const int r = LZ4_decompress_safe((const char *)pz, (char *)dst, nz,
+					  vlen);
+	assert(r == (int)vlen);
+#else
+	(void)stored;
+	(void)pv;
+	(void)dst;
+	// built without LSMTRIE_LZ4
+	assert(false);
+#endif
+}
+
+static inline uint8_t *encode_vlen(uint8_t *const ptr, const uint16_t vlen,
+				   const bool lz4, const bool lz4_fmt)
+{
+	if (lz4_fmt) {
+		return encode_uint32(ptr, (((uint32_t)vlen) << 1) |
+						  (lz4 ? 1u : 0u));
+	}
+	assert(lz4 == false);
+	return encode_uint16(ptr, vlen);
+}
+
+// 编码后的大小
+static inline uint16_t item_encoded_volume(const struct Item *const item,
+					   const bool lz4_fmt)
+{
+	uint8_t buf[16];
+	uint8_t *const p1 = encode_uint16(buf, item->klen);
+	uint8_t *const p2 = encode_vlen(p1, item->vlen, item->lz4, lz4_fmt);
+	return item->klen + item->vlen + (p2 - buf);
+}
+
 // return ptr to the end of raw bytes
 // 把 item 数据写入 ptr, 返回下一个 uint8_t 的指针
-static uint8_t *item_encode(struct Item *item, uint8_t *const ptr)
+static uint8_t *item_encode(struct Item *item, uint8_t *const ptr,
+			    const bool lz4_fmt)
 {
 	uint8_t *const pklen = ptr;
 	uint8_t *const pk = encode_uint16(pklen, item->klen);
 	memcpy(pk, item->kv, item->klen);
 
 	uint8_t *const pvlen = pk + item->klen;
-	uint8_t *const pv = encode_uint16(pvlen, item->vlen);
+	uint8_t *const pv = encode_vlen(pvlen, item->vlen, item->lz4, lz4_fmt);
 	memcpy(pv, item->kv + item->klen, item->vlen);
 
 	uint8_t *const pnext = pv + item->vlen;
@@ -237,140 +338,191 @@ static uint8_t *item_encode(struct Item *item, uint8_t *const ptr)
 // 根据 item 创建新的 kv 返回
 static struct KeyValue *item_to_keyvalue(struct Item *const item)
 {
+	const uint8_t *const pv = item->kv + item->klen;
+	const uint16_t vlen = item->lz4 ? value_raw_vlen(pv) : item->vlen;
 	// make a copy using malloc
 	// 键的长度加上值的长度加上对象大小
-	const size_t msize = sizeof(struct KeyValue) + item->klen + item->vlen;
+	const size_t msize = sizeof(struct KeyValue) + item->klen + vlen;
 	// 分配内存
 	struct KeyValue *const kv = (typeof(kv))malloc(msize);
 	assert(kv);
 	kv->klen = item->klen;
-	kv->vlen = item->vlen;
+	kv->vlen = vlen;
 	kv->pk = kv->kv;
 	kv->pv = kv->kv + kv->klen;
-	memcpy(kv->pk, item->kv, kv->klen + kv->vlen);
+	memcpy(kv->pk, item->kv, kv->klen);
+	if (item->lz4) {
+		value_decompress(item->vlen, pv, kv->pv);
+	} else {
+		memcpy(kv->pv, pv, vlen);
+	}
 	return kv;
 }
 
-static bool rawitem_init(struct RawItem *const raw, const uint8_t *const ptr)
+// pklen: start of an item; false at the end of the barrel
+static bool rawitem_decode(struct RawItem *const raw,
+			   const uint8_t *const pklen)
 {
-	assert(raw);
-	assert(ptr);
-	bzero(raw, sizeof(*raw));
-	uint16_t klen = 0, vlen = 0;
-	const uint8_t *const pk = decode_uint16(ptr, &klen);
-	if ((pk == ptr) || (klen == 0)) {
+	uint16_t klen = 0;
+	const uint8_t *const pk = decode_uint16(pklen, &klen);
+	if ((pk == pklen) || (klen == 0)) {
 		return false;
 	}
 	const uint8_t *const pvlen = pk + klen;
-	const uint8_t *const pv = decode_uint16(pvlen, &vlen);
+	uint32_t vfield = 0;
+	const uint8_t *const pv = decode_uint32(pvlen, &vfield);
 	// assume pv is ok
 	raw->klen = klen;
-	raw->vlen = vlen;
+	raw->vlen = (uint16_t)(raw->lz4_fmt ? (vfield >> 1) : vfield);
+	raw->lz4 = (raw->lz4_fmt && (vfield & 1u)) ? true : false;
 	raw->pk = pk;
 	raw->pv = pv;
-	raw->limit = ptr + ((long)BARREL_CAP);
 	return true;
 }
 
+static bool rawitem_init(struct RawItem *const raw, const uint8_t *const ptr)
+{
+	assert(raw);
+	assert(ptr);
+	bzero(raw, sizeof(*raw));
+	// the format is recorded in the trailing MetaIndex
+	const struct MetaIndex *const mi =
+		(typeof(mi))(ptr + ((long)BARREL_CAP));
+	raw->lz4_fmt = (mi->rid & METAINDEX_LZ4) ? true : false;
+	raw->limit = ptr + ((long)BARREL_CAP);
+	return rawitem_decode(raw, ptr);
+}
+
 static bool rawitem_next(struct RawItem *const rawitem)
 {
 	const uint8_t *const pklen = rawitem->pv + rawitem->vlen;
-	if (pklen >= rawitem->limit) {
+	if ((pklen >= rawitem->limit) ||
+	    (rawitem_decode(rawitem, pklen) == false)) {
 		rawitem->klen = 0;
 		rawitem->vlen = 0;
 		return false;
 	}
-	uint16_t klen = 0, vlen = 0;
-	const uint8_t *const pk = decode_uint16(pklen, &klen);
-	if ((pk == pklen) || (klen == 0)) {
-		return false;
-	}
-	const uint8_t *const pvlen = pk + klen;
-	const uint8_t *const pv = decode_uint16(pvlen, &vlen);
-	// assume pv is ok
-	rawitem->klen = klen;
-	rawitem->vlen = vlen;
-	rawitem->pk = pk;
-	rawitem->pv = pv;
 	return true;
 }
 
 static struct KeyValue *rawitem_to_keyvalue(struct RawItem *const ri)
 {
+	const uint16_t vlen = ri->lz4 ? value_raw_vlen(ri->pv) : ri->vlen;
 	// make a copy using malloc
-	const size_t msize = sizeof(struct KeyValue) + ri->klen + ri->vlen;
+	const size_t msize = sizeof(struct KeyValue) + ri->klen + vlen;
 	struct KeyValue *const kv = (typeof(kv))malloc(msize);
 	assert(kv);
 	kv->klen = ri->klen;
-	kv->vlen = ri->vlen;
+	kv->vlen = vlen;
 	kv->pk = kv->kv;
 	kv->pv = kv->kv + kv->klen;
 	memcpy(kv->pk, ri->pk, kv->klen);
-	memcpy(kv->pv, ri->pv, kv->vlen);
+	if (ri->lz4) {
+		value_decompress(ri->vlen, ri->pv, kv->pv);
+	} else {
+		memcpy(kv->pv, ri->pv, kv->vlen);
+	}
 	return kv;
 }
 
-// no hash!
-static struct Item *rawitem_to_item(const struct RawItem *const ri,
-				    struct Mempool *const mempool,
-				    const uint8_t *const hash)
+// store the value as given; hash == NULL: compute it
+// local: from the thread's own arena (concurrent inserts)
+static struct Item *item_new(struct Mempool *const mempool, const bool local,
+			     const uint16_t klen, const uint8_t *const pk,
+			     const uint16_t vlen, const uint8_t *const pv,
+			     const bool lz4, const uint8_t *const hash,
+			     const bool lz4_fmt)
 {
 	assert(mempool);
-	const size_t msize = sizeof(struct Item) + ri->klen + ri->vlen;
-	struct Item *const item = (typeof(item))mempool_alloc(mempool, msize);
+	const size_t msize = sizeof(struct Item) + klen + vlen;
+	struct Item *const item =
+		(typeof(item))(local ? mempool_alloc_local(mempool, msize) :
+				       mempool_alloc(mempool, msize));
 	if (item == NULL) {
 		return NULL;
 	}
 	bzero(item, msize);
 	// rb leave empty
-	item->klen = ri->klen;
-	item->vlen = ri->vlen;
-	memcpy(item->kv, ri->pk, item->klen);
-	memcpy(item->kv + item->klen, ri->pv, item->vlen);
-	// SHA1
+	item->klen = klen;
+	item->vlen = vlen;
+	item->lz4 = lz4;
+	// 填充 pk 长度 klen 到 item->kv
+	memcpy(item->kv, pk, klen);
+	// 填充 pv 长度 vlen 到 item->kv 偏移 klen
+	memcpy(item->kv + klen, pv, vlen);
+	// SHA1 计算，结果存入item->hash
 	if (hash) {
 		memcpy(item->hash, hash, HASHBYTES);
 	} else {
 		SHA1(item->kv, item->klen, item->hash);
 	}
-	uint8_t buf[16];
-	uint8_t *const p1 = encode_uint16(buf, item->klen);
-	uint8_t *const p2 = encode_uint16(p1, item->vlen);
-	const uint16_t volume = item->klen + item->vlen + (p2 - buf);
-	item->volume = volume;
+	// 空间使用量
+	item->volume = item_encoded_volume(item, lz4_fmt);
 	return item;
 }
 
+// compress (lz4_fmt) or store the value as is
+static struct Item *item_new_raw_value(struct Mempool *const mempool,
+				       const bool local, const uint16_t klen,
+				       const uint8_t *const pk,
+				       const uint16_t vlen,
+				       const uint8_t *const pv,
+				       const uint8_t *const hash,
+				       const bool lz4_fmt)
+{
+	if (lz4_fmt && (vlen >= LZ4_MIN_VLEN)) {
+		uint8_t *const buf = (typeof(buf))malloc(
+			value_compress_bound(vlen));
+		assert(buf);
+		const uint64_t stored = value_compress(vlen, pv, buf);
+		if (stored) {
+			struct Item *const item =
+				item_new(mempool, local, klen, pk,
+					 (uint16_t)stored, buf, true, hash,
+					 lz4_fmt);
+			free(buf);
+			return item;
+		}
+		free(buf);
+	}
+	return item_new(mempool, local, klen, pk, vlen, pv, false, hash,
+			lz4_fmt);
+}
+
+// no hash!
+static struct Item *rawitem_to_item(const struct RawItem *const ri,
+				    struct Mempool *const mempool,
+				    const uint8_t *const hash,
+				    const bool lz4_fmt)
+{
+	if (ri->lz4 == lz4_fmt) {
+		// as is: compressed into lz4_fmt, or raw into raw
+		return item_new(mempool, false, ri->klen, ri->pk, ri->vlen,
+				ri->pv, ri->lz4, hash, lz4_fmt);
+	}
+	if (ri->lz4) {
+		// into a table without compression
+		const uint16_t vlen = value_raw_vlen(ri->pv);
+		uint8_t *const buf = (typeof(buf))malloc(vlen ? vlen : 1);
+		assert(buf);
+		value_decompress(ri->vlen, ri->pv, buf);
+		struct Item *const item =
+			item_new(mempool, false, ri->klen, ri->pk, vlen, buf,
+				 false, hash, lz4_fmt);
+		free(buf);
+		return item;
+	}
+	return item_new_raw_value(mempool, false, ri->klen, ri->pk, ri->vlen,
+				  ri->pv, hash, lz4_fmt);
+}
+
 // for insert
 static struct Item *keyvalue_to_item(const struct KeyValue *const kv,
-				     struct Mempool *const mempool)
+				     struct Mempool *const mempool,
+				     const bool local, const bool lz4_fmt)
 {
-	assert(mempool);
-	const size_t msize = sizeof(struct Item) + kv->klen + kv->vlen;
-	struct Item *const item = (typeof(item))mempool_alloc(mempool, msize);
-	if (item == NULL) {
-		return NULL;
-	}
-	bzero(item, msize);
-	// rb leave empty
-	item->klen = kv->klen;
-	item->vlen = kv->vlen;
-	// 填充 pk 长度 klen 到 item->kv
-	memcpy(item->kv, kv->pk, item->klen);
-	// 填充 pv 长度 vlen 到 item->kv 偏移 klen
-	memcpy(item->kv + item->klen, kv->pv, item->vlen);
-	// SHA1 计算，结果存入item->hash
-	SHA1(item->kv, item->klen, item->hash);
-	// 初始化编码 buf
-	uint8_t buf[16];
-	uint8_t *const p1 = encode_uint16(buf, item->klen);
-	uint8_t *const p2 = encode_uint16(p1, item->vlen);
-	// p2 - buf 是 klen 8 的整数倍加上 vlen 8 的整数倍
-	// 17 就是 24
-	// 空间使用量
-	const uint16_t volume = item->klen + item->vlen + (p2 - buf);
-	item->volume = volume;
-	return item;
+	return item_new_raw_value(mempool, local, kv->klen, kv->pk, kv->vlen,
+				  kv->pv, NULL, lz4_fmt);
 }
 
 // 计算桶 item 总数
@@ -440,6 +592,46 @@ static inline void barrel_insert(struct Barrel *const barrel,
 	barrel->volume -= victim_volume;
 }
 
+// lock-free: push in front, an older identical item stays shadowed behind it
+// until barrel_seal(). return the seq of the push
+static inline uint32_t barrel_insert_mt(struct Barrel *const barrel,
+					struct Item *const item)
+{
+	struct Item **const head = &(barrel->items[item_hash_ht(item)]);
+	uint32_t seq;
+	do {
+		item->next = *head;
+		// taken after reading the head: whoever wins the CAS after us
+		// on this chain read our item first and gets a larger seq
+		seq = __sync_add_and_fetch(&(barrel->seq), 1);
+	} while (!__sync_bool_compare_and_swap(head, item->next, item));
+	__sync_add_and_fetch(&(barrel->volume), item->volume);
+	return seq;
+}
+
+// drop shadowed items; return the volume removed
+static uint16_t barrel_seal(struct Barrel *const barrel)
+{
+	uint16_t removed = 0;
+	for (uint64_t i = 0; i < BARREL_NR_HT; i++) {
+		for (struct Item *iter = barrel->items[i]; iter;
+		     iter = iter->next) {
+			// later ones are older
+			struct Item **pp = &(iter->next);
+			while (*pp) {
+				if (item_identical(*pp, iter)) {
+					removed += (*pp)->volume;
+					*pp = (*pp)->next;
+				} else {
+					pp = &((*pp)->next);
+				}
+			}
+		}
+	}
+	barrel->volume -= removed;
+	return removed;
+}
+
 // keyhead: need kv (only need key), klen
 // 查询桶键为 pk 的元素并返回
 // 没有返回 NULL
@@ -455,7 +647,7 @@ static inline struct Item *barrel_lookup(struct Barrel *const barrel,
 
 // 把桶写入到 buffer 中, 返回写入的 item 数
 static uint16_t barrel_dump_buffer(struct Barrel *const barrel,
-				   uint8_t *const buffer)
+				   uint8_t *const buffer, const bool lz4_fmt)
 {
 	// serialize data
 	uint8_t *ptr = buffer;
@@ -466,7 +658,8 @@ static uint16_t barrel_dump_buffer(struct Barrel *const barrel,
 		struct Item *iter = barrel->items[i];
 		// 遍历 item 列表
 		while (iter) {
-			uint8_t *const pnext = item_encode(iter, ptr);
+			uint8_t *const pnext =
+				item_encode(iter, ptr, lz4_fmt);
 			assert(pnext <= (buffer + (long)BARREL_CAP));
 			// 循环
 			ptr = pnext;
@@ -490,7 +683,7 @@ static uint16_t barrel_dump_buffer(struct Barrel *const barrel,
 	// 填充元索引数据到 ptr
 	struct MetaIndex *const mi = (typeof(mi))ptr;
 	mi->id = barrel->id;
-	mi->rid = barrel->rid;
+	mi->rid = barrel->rid | (lz4_fmt ? METAINDEX_LZ4 : 0);
 	mi->min = barrel->min;
 	// 返回写入的 item 数
 	return nr_items;
@@ -623,6 +816,23 @@ struct Table *table_alloc_default(const double mempool_factor)
 	return table_alloc_new(TABLE_VOLUME_PERCENT, mempool_factor);
 }
 
+bool table_lz4_available(void)
+{
+#ifdef LSMTRIE_LZ4
+	return true;
+#else
+	return false;
+#endif
+}
+
+// 只能在空表上设置; false if built without LSMTRIE_LZ4
+bool table_set_lz4(struct Table *const table, const bool lz4)
+{
+	assert(table->volume == 0);
+	table->lz4 = lz4 && table_lz4_available();
+	return (table->lz4 == lz4) ? true : false;
+}
+
 void table_free(struct Table *const table)
 {
 	mempool_free(table->mempool);
@@ -676,7 +886,8 @@ static inline void table_insert_rawitem_mt(struct Table *const table,
 					   const struct RawItem *const ri,
 					   const uint8_t *const hash)
 {
-	struct Item *const item = rawitem_to_item(ri, table->mempool, hash);
+	struct Item *const item =
+		rawitem_to_item(ri, table->mempool, hash, table->lz4);
 	assert(item);
 	table_insert_item_mt(table, item);
 }
@@ -691,7 +902,8 @@ bool table_insert_kv_safe(struct Table *const table,
 		// 退出
 		return false;
 	}
-	struct Item *const item = keyvalue_to_item(kv, table->mempool);
+	struct Item *const item =
+		keyvalue_to_item(kv, table->mempool, false, table->lz4);
 	if (item == NULL) {
 		// 退出
 		return false;
@@ -701,6 +913,55 @@ bool table_insert_kv_safe(struct Table *const table,
 	return true;
 }
 
+// thread-safe against other table_multi_insert_kv_mt() and table_lookup()
+// return the number of items inserted (< nr_items on full).
+// seqs (optional) gets the order of each item among the writes to its
+// barrel: for one key a larger seq is the newer value
+uint64_t table_multi_insert_kv_mt(struct Table *const table,
+				  const uint64_t nr_items,
+				  const struct KeyValue *const kvs,
+				  uint32_t *const seqs)
+{
+	uint64_t i = 0;
+	// 每 64 个检查一次, may overshoot the capacity by a batch/thread
+	while ((i < nr_items) && (table_full(table) == false)) {
+		const uint64_t i1 = ((nr_items - i) > 64u) ? (i + 64u) :
+							     nr_items;
+		uint64_t volume = 0;
+		for (; i < i1; i++) {
+			struct Item *const item = keyvalue_to_item(
+				&(kvs[i]), table->mempool, true, table->lz4);
+			if (item == NULL) {
+				break;
+			}
+			const uint16_t barrel_id =
+				table_select_barrel(item->hash);
+			const uint32_t seq = barrel_insert_mt(
+				&(table->barrels[barrel_id]), item);
+			if (seqs) {
+				seqs[i] = seq;
+			}
+			volume += item->volume;
+		}
+		__sync_add_and_fetch(&(table->volume), volume);
+		if (i < i1) {
+			break;
+		}
+	}
+	return i;
+}
+
+// after the last table_multi_insert_kv_mt(): drop the shadowed items
+// lookups may run concurrently
+void table_seal(struct Table *const table)
+{
+	uint64_t removed = 0;
+	for (uint64_t i = 0; i < TABLE_NR_BARRELS; i++) {
+		removed += barrel_seal(&(table->barrels[i]));
+	}
+	table->volume -= removed;
+}
+
 // build a BloomTable for itself
 bool table_build_bloomtable(struct Table *const table)
 {
@@ -721,6 +982,23 @@ bool table_build_bloomtable(struct Table *const table)
 }
 
 // 对表查询键 pk
+// unsorted copy of all keys in the table
+struct KeyRun *table_build_keyrun(struct Table *const table)
+{
+	struct KeyRun *const run = keyrun_new(0);
+	for (uint64_t i = 0; i < TABLE_NR_BARRELS; i++) {
+		struct Barrel *const barrel = &(table->barrels[i]);
+		for (uint64_t j = 0; j < BARREL_NR_HT; j++) {
+			struct Item *iter = barrel->items[j];
+			while (iter) {
+				keyrun_append(run, iter->klen, iter->kv);
+				iter = iter->next;
+			}
+		}
+	}
+	return run;
+}
+
 struct KeyValue *table_lookup(struct Table *const table, const uint16_t klen,
 			      const uint8_t *const pk,
 			      const uint8_t *const hash)
@@ -978,7 +1256,7 @@ uint64_t table_dump_barrels(struct Table *const table, const int fd,
 				&(table->io_buffer[BARREL_ALIGN * i]);
 			// 把桶数据写入 ptr
 			const uint64_t nr_items = barrel_dump_buffer(
-				&(table->barrels[j + i]), ptr);
+				&(table->barrels[j + i]), ptr, table->lz4);
 			// 计数器
 			nr_all_items += nr_items;
 		}
@@ -989,6 +1267,9 @@ uint64_t table_dump_barrels(struct Table *const table, const int fd,
 		}
 		const size_t nr_bytes = (size_t)(TABLE_NR_IO * BARREL_ALIGN);
 		const uint64_t off_j = off + (BARREL_ALIGN * j);
+		if (table->limiter) {
+			ratelimit_request(table->limiter, nr_bytes);
+		}
 		// 写文件
 		const ssize_t nw =
 			pwrite(fd, table->io_buffer, nr_bytes, (off_t)(off_j));
@@ -1024,6 +1305,10 @@ bool table_dump_meta(struct Table *const table, const char *const metafn,
 	// dump BloomTable
 	// 布隆过滤器持久化
 	bloomtable_dump(table->bt, fo);
+	// durable before META refers to the table
+	fflush(fo);
+	const int rs = fsync(fileno(fo));
+	assert(rs == 0);
 	// 关闭文件
 	fclose(fo);
 	return true;
@@ -1156,10 +1441,6 @@ static bool raw_barrel_fetch(struct MetaTable *const mt,
 	const uint64_t off_barrel = (barrel_id * BARREL_ALIGN) + mt->mfh.off;
 	const ssize_t r =
 		pread(mt->raw_fd, buf, BARREL_ALIGN, (off_t)off_barrel);
-
-	if (mt->stat) {
-		__sync_add_and_fetch(&(mt->stat->nr_fetch_barrel), 1);
-	}
 	return (r == BARREL_ALIGN) ? true : false;
 }
 
@@ -1174,10 +1455,13 @@ static bool raw_barrel_fetch_multiple(struct MetaTable *const mt,
 	return (r == BARREL_ALIGN) ? true : false;
 }
 
-static const struct MetaIndex *raw_barrel_metaindex(const uint8_t *const buf)
+// a copy without the format flag
+static struct MetaIndex raw_barrel_metaindex(const uint8_t *const buf)
 {
 	const uint8_t *const pmi = (buf + BARREL_CAP);
-	const struct MetaIndex *const mi = (typeof(mi))pmi;
+	struct MetaIndex mi;
+	memcpy(&mi, pmi, sizeof(mi));
+	mi.rid &= (uint16_t)(~METAINDEX_LZ4);
 	return mi;
 }
 
@@ -1213,6 +1497,7 @@ struct MetaTable *metatable_load(const char *const metafn, const int raw_fd,
 	struct MetaTable *const mt = (typeof(mt))malloc(sizeof(*mt));
 	bzero(mt, sizeof(*mt));
 	assert(mt);
+	mt->nr_refs = 1;
 	const size_t nh = fread(&(mt->mfh), sizeof(mt->mfh), 1, fi);
 	assert(nh == 1);
 	// load overflowner metadata
@@ -1243,66 +1528,98 @@ struct MetaTable *metatable_load(const char *const metafn, const int raw_fd,
 	return mt;
 }
 
-static struct KeyValue *
-metatable_recursive_lookup(struct MetaTable *const mt, const uint16_t bid,
-			   uint8_t *const buf, const uint16_t klen,
-			   const uint8_t *const key, const uint8_t *const hash)
+// follow in-memory MetaIndex without any I/O
+static void metatable_probe_route(struct MetaProbe *const probe)
 {
-	assert(bid < TABLE_NR_BARRELS);
-	const uint32_t hash32 = __hash_order(hash, bid);
-
-	const struct MetaIndex *const mi0 =
-		__find_metaindex(mt->mfh.nr_mi, mt->mis, bid);
-	const bool fetch0 = (mi0 == NULL) || (hash32 >= mi0->min);
-	if (fetch0) {
-		const bool rf = raw_barrel_fetch(mt, bid, buf);
-		assert(rf);
-	}
-	const struct MetaIndex *const mi = mi0 ? mi0 :
-						 raw_barrel_metaindex(buf);
-	if (hash32 < mi->min) { // mast be in another barrel
-		assert(mi->id != mi->rid);
-		return metatable_recursive_lookup(mt, mi->rid, buf, klen, key,
-						  hash);
-	}
-
-	if (fetch0 == false) {
-		const bool rf = raw_barrel_fetch(mt, bid, buf);
-		assert(rf);
-	}
-	struct KeyValue *const kv = raw_barrel_lookup(klen, key, buf);
-	if ((kv == NULL) && (hash32 == mi->min) &&
-	    (mi->id != mi->rid)) { // maybe in another barrel
-		return metatable_recursive_lookup(mt, mi->rid, buf, klen, key,
-						  hash);
-	} else { // must in current barrel
-		return kv;
+	struct MetaTable *const mt = probe->mt;
+	for (;;) {
+		assert(probe->bid < TABLE_NR_BARRELS);
+		const uint32_t hash32 = __hash_order(probe->hash, probe->bid);
+		const struct MetaIndex *const mi0 =
+			__find_metaindex(mt->mfh.nr_mi, mt->mis, probe->bid);
+		if ((mi0 == NULL) || (hash32 >= mi0->min)) {
+			return;
+		}
+		// must be in another barrel
+		assert(mi0->id != mi0->rid);
+		probe->bid = mi0->rid;
 	}
 }
 
-struct KeyValue *metatable_lookup(struct MetaTable *const mt,
-				  const uint16_t klen, const uint8_t *const key,
-				  const uint8_t *const hash)
+// return false if the bloom-filter rules the key out
+bool metatable_probe_initial(struct MetaProbe *const probe,
+			     struct MetaTable *const mt, const uint16_t klen,
+			     const uint8_t *const key,
+			     const uint8_t *const hash)
 {
 	// 桶 id
 	const uint16_t bid = table_select_barrel(hash);
 	if (mt->bt) {
 		// 布隆表存在
-
 		const uint64_t hv = __hash_bf(hash);
+		const uint64_t t0 = mt->hist ? debug_time_nsec() : 0;
 		const bool exist = bloomtable_match(mt->bt, bid, hv);
+		if (mt->hist) {
+			hist_record(mt->hist, HIST_BLOOM,
+				    debug_time_nsec() - t0);
+		}
 		if (exist == false) {
 			if (mt->stat) {
 				__sync_add_and_fetch(
 					&(mt->stat->nr_true_negative), 1);
 			}
-			return NULL;
+			return false;
 		}
 	}
-	uint8_t *buf = aligned_alloc(BARREL_ALIGN, BARREL_ALIGN);
+	probe->mt = mt;
+	probe->klen = klen;
+	probe->key = key;
+	probe->hash = hash;
+	probe->bid = bid;
+	probe->done = false;
+	probe->kv = NULL;
+	metatable_probe_route(probe);
+	return true;
+}
+
+// raw offset of the barrel the probe is waiting for
+uint64_t metatable_probe_offset(const struct MetaProbe *const probe)
+{
+	return (probe->bid * BARREL_ALIGN) + probe->mt->mfh.off;
+}
+
+// buf holds barrel probe->bid; return true when the probe is done
+bool metatable_probe_feed(struct MetaProbe *const probe,
+			  const uint8_t *const buf)
+{
+	struct MetaTable *const mt = probe->mt;
+	assert(probe->done == false);
+	if (mt->stat) {
+		__sync_add_and_fetch(&(mt->stat->nr_fetch_barrel), 1);
+	}
+	const uint32_t hash32 = __hash_order(probe->hash, probe->bid);
+	const struct MetaIndex *const mi0 =
+		__find_metaindex(mt->mfh.nr_mi, mt->mis, probe->bid);
+	const struct MetaIndex mi_raw = raw_barrel_metaindex(buf);
+	const struct MetaIndex *const mi = mi0 ? mi0 : &mi_raw;
+	if (hash32 < mi->min) { // mast be in another barrel
+		assert(mi->id != mi->rid);
+		probe->bid = mi->rid;
+		metatable_probe_route(probe);
+		return false;
+	}
+
 	struct KeyValue *const kv =
-		metatable_recursive_lookup(mt, bid, buf, klen, key, hash);
-	free(buf);
+		raw_barrel_lookup(probe->klen, probe->key, buf);
+	if ((kv == NULL) && (hash32 == mi->min) &&
+	    (mi->id != mi->rid)) { // maybe in another barrel
+		probe->bid = mi->rid;
+		metatable_probe_route(probe);
+		return false;
+	}
+	// must in current barrel
+	probe->kv = kv;
+	probe->done = true;
 	if (mt->stat) {
 		if (kv) {
 			__sync_add_and_fetch(&(mt->stat->nr_true_positive), 1);
@@ -1310,11 +1627,89 @@ struct KeyValue *metatable_lookup(struct MetaTable *const mt,
 			__sync_add_and_fetch(&(mt->stat->nr_false_positive), 1);
 		}
 	}
-	return kv;
+	return true;
+}
+
+struct KeyValue *metatable_lookup(struct MetaTable *const mt,
+				  const uint16_t klen, const uint8_t *const key,
+				  const uint8_t *const hash)
+{
+	struct MetaProbe probe;
+	if (false == metatable_probe_initial(&probe, mt, klen, key, hash)) {
+		return NULL;
+	}
+	uint8_t *buf = aligned_alloc(BARREL_ALIGN, BARREL_ALIGN);
+	do {
+		const uint64_t t0 = mt->hist ? debug_time_nsec() : 0;
+		const bool rf = raw_barrel_fetch(mt, probe.bid, buf);
+		assert(rf);
+		if (mt->hist) {
+			hist_record(mt->hist, HIST_BARREL_READ,
+				    debug_time_nsec() - t0);
+		}
+	} while (false == metatable_probe_feed(&probe, buf));
+	free(buf);
+	return probe.kv;
+}
+
+// walk all barrels on disk, unsorted
+// every barrel of a table has the same format, check the first one
+bool metatable_lz4(struct MetaTable *const mt)
+{
+	uint8_t *const buf =
+		(typeof(buf))aligned_alloc(BARREL_ALIGN, BARREL_ALIGN);
+	assert(buf);
+	const bool r = raw_barrel_fetch(mt, 0, buf);
+	assert(r);
+	const struct MetaIndex *const mi = (typeof(mi))(buf + BARREL_CAP);
+	const bool lz4 = (mi->rid & METAINDEX_LZ4) ? true : false;
+	free(buf);
+	return lz4;
+}
+
+struct KeyRun *metatable_build_keyrun(struct MetaTable *const mt)
+{
+	uint8_t *const arena = (typeof(arena))aligned_alloc(
+		BARREL_ALIGN, BARREL_ALIGN * TABLE_NR_IO);
+	assert(arena);
+	struct KeyRun *const run = keyrun_new(0);
+	for (uint64_t j = 0; j < TABLE_NR_BARRELS; j += TABLE_NR_IO) {
+		const uint64_t nr =
+			((j + TABLE_NR_IO) > TABLE_NR_BARRELS) ?
+				(TABLE_NR_BARRELS - j) :
+				TABLE_NR_IO;
+		raw_barrel_fetch_multiple(mt, j, nr, arena);
+		for (uint64_t i = 0; i < nr; i++) {
+			struct RawItem ri;
+			if (rawitem_init(&ri, &(arena[i * BARREL_ALIGN])) ==
+			    false) {
+				continue;
+			}
+			do {
+				keyrun_append(run, ri.klen, ri.pk);
+			} while (rawitem_next(&ri));
+		}
+	}
+	free(arena);
+	return run;
+}
+
+struct MetaTable *metatable_acquire(struct MetaTable *const mt)
+{
+	__sync_add_and_fetch(&(mt->nr_refs), 1);
+	return mt;
+}
+
+bool metatable_release(struct MetaTable *const mt)
+{
+	return (__sync_sub_and_fetch(&(mt->nr_refs), 1) == 0) ? true : false;
 }
 
 void metatable_free(struct MetaTable *const mt)
 {
+	if (mt->keyrun) {
+		keyrun_release(mt->keyrun);
+	}
 	if (mt->bt) {
 		bloomtable_free(mt->bt);
 	}
@@ -12,6 +12,12 @@
 #include "mempool.h"
 #include "stat.h"
 
+struct ContainerMap;
+
+struct Hist;
+struct KeyRun;
+struct RateLimiter;
+
 struct KeyValue {
 	// 键长度
 	uint16_t klen;
@@ -57,6 +63,10 @@ struct Table {
 	struct MetaIndex *mis;
 	// 布隆过滤器表
 	struct BloomTable *bt;
+	// 值压缩 (LZ4), see table_set_lz4()
+	bool lz4;
+	// throttles table_dump_barrels(), optional
+	struct RateLimiter *limiter;
 	pthread_mutex_t
 		ilocks[TABLE_ILOCKS_NR]; // used for parallel compaction feed
 };
@@ -76,7 +86,27 @@ struct MetaTable {
 	struct MetaIndex *mis;
 	// 布隆过滤器表
 	struct BloomTable *bt;
+	// 有序键 (optional, see db ordered index)
+	struct KeyRun *keyrun;
 	struct Stat *stat;
+	// bloom and barrel read latency, optional
+	struct Hist *hist;
+	// 引用计数: db 持有一个, 迭代器在锁外读桶时再持有一个
+	uint64_t nr_refs;
+	// 被 compaction 丢弃但仍被引用时, 由最后一个引用释放其 container 空间
+	struct ContainerMap *retired_cm;
+};
+
+// a lookup in one MetaTable, the barrel I/O is left to the caller
+struct MetaProbe {
+	struct MetaTable *mt;
+	const uint8_t *key;
+	const uint8_t *hash;
+	uint16_t klen;
+	// 下一个需要读取的桶 id
+	uint16_t bid;
+	bool done;
+	struct KeyValue *kv;
 };
 
 // ----Table
@@ -89,17 +119,30 @@ struct Table *table_alloc_new(const double cap_percent,
 
 struct Table *table_alloc_default(const double mempool_factor);
 
+bool table_lz4_available(void);
+
+bool table_set_lz4(struct Table *const table, const bool lz4);
+
 bool table_insert_kv_safe(struct Table *const table,
 			  const struct KeyValue *const kv);
 
 bool table_full(const struct Table *const table);
 
+uint64_t table_multi_insert_kv_mt(struct Table *const table,
+				  const uint64_t nr_items,
+				  const struct KeyValue *const kvs,
+				  uint32_t *const seqs);
+
+void table_seal(struct Table *const table);
+
 struct KeyValue *table_lookup(struct Table *const table, const uint16_t klen,
 			      const uint8_t *const key,
 			      const uint8_t *const hash);
 
 bool table_build_bloomtable(struct Table *const table);
 
+struct KeyRun *table_build_keyrun(struct Table *const table);
+
 bool table_dump_meta(struct Table *const table, const char *const metafn,
 		     const uint64_t off);
 
@@ -122,6 +165,25 @@ struct KeyValue *metatable_lookup(struct MetaTable *const mt,
 				  const uint16_t klen, const uint8_t *const key,
 				  const uint8_t *const hash);
 
+bool metatable_probe_initial(struct MetaProbe *const probe,
+			     struct MetaTable *const mt, const uint16_t klen,
+			     const uint8_t *const key,
+			     const uint8_t *const hash);
+
+uint64_t metatable_probe_offset(const struct MetaProbe *const probe);
+
+bool metatable_probe_feed(struct MetaProbe *const probe,
+			  const uint8_t *const buf);
+
+bool metatable_lz4(struct MetaTable *const mt);
+
+struct KeyRun *metatable_build_keyrun(struct MetaTable *const mt);
+
+struct MetaTable *metatable_acquire(struct MetaTable *const mt);
+
+// true: 最后一个引用已释放, 调用者负责 metatable_free()
+bool metatable_release(struct MetaTable *const mt);
+
 void metatable_free(struct MetaTable *const mt);
 
 bool metatable_feed_barrels_to_tables(
@@ -135,10 +135,114 @@ static void table_test(const uint64_t max_value_size)
 	metatable_free(mt);
 }
 
+// JSON-like value of about vlen bytes
+static uint16_t compress_value(uint8_t *const value, const uint64_t i,
+			       const uint16_t vlen)
+{
+	int n = sprintf((char *)value,
+			"{\"id\":%lu,\"name\":\"user%08lu\",\"email\":"
+			"\"user%08lu@example.com\",\"active\":%s,\"tags\":[",
+			i, i, i, (i & 1) ? "true" : "false");
+	while (n < (vlen - 24)) {
+		n += sprintf((char *)value + n, "\"t%03lu\",",
+			     (uint64_t)(random() % 1000));
+	}
+	n += sprintf((char *)value + n, "\"end\"],\"score\":%lu}",
+		     (uint64_t)(random() % 100000));
+	return (uint16_t)n;
+}
+
+// raw vs lz4: items per table, space amplification, lookup latency
+static void compress_benchmark(const bool lz4, const uint16_t vlen)
+{
+	srandom(42);
+	uint8_t key[64] __attribute__((aligned(8)));
+	uint8_t hash[HASHBYTES] __attribute__((aligned(8)));
+	uint8_t value[1024] __attribute__((aligned(8)));
+	struct Table *const table = table_alloc_default(1.5);
+	if (table_set_lz4(table, lz4) == false) {
+		printf("lz4 not available, make LZ4=1\n");
+		table_free(table);
+		return;
+	}
+	struct KeyValue kv;
+	kv.klen = 16;
+	kv.pk = key;
+	kv.pv = value;
+	uint64_t count = 0;
+	uint64_t logical = 0;
+	const double t0 = debug_time_sec();
+	while (true) {
+		sprintf((char *)key, "%016lx", count);
+		kv.vlen = compress_value(value, count, vlen);
+		if (table_insert_kv_safe(table, &kv) == false) {
+			break;
+		}
+		logical += kv.klen + kv.vlen;
+		count++;
+	}
+	const double t1 = debug_time_sec();
+	const bool rbt = table_build_bloomtable(table);
+	assert(rbt);
+	const bool rre = table_retain(table);
+	assert(rre);
+	const char *const rawfn = lz4 ? "/tmp/raw_lz4" : "/tmp/raw";
+	const char *const metafn = lz4 ? "/tmp/meta_lz4" : "/tmp/meta";
+	const int fd_out = open(
+		rawfn, O_CREAT | O_TRUNC | O_WRONLY | O_LARGEFILE, 00666);
+	assert(fd_out >= 0);
+	const uint64_t nr_dump = table_dump_barrels(table, fd_out, 0);
+	assert(nr_dump == count);
+	close(fd_out);
+	const bool rdm = table_dump_meta(table, metafn, 0);
+	assert(rdm);
+	table_free(table);
+
+	const int fd_in = open(rawfn, O_RDONLY | O_LARGEFILE, 00666);
+	struct Stat stat;
+	bzero(&stat, sizeof(stat));
+	struct MetaTable *const mt = metatable_load(metafn, fd_in, true, &stat);
+	assert(mt);
+	uint32_t *const latency = latency_initial();
+	uint64_t found = 0;
+	const double t2 = debug_time_sec();
+	for (uint64_t i = 0; i < count; i++) {
+		sprintf((char *)key, "%016lx", i);
+		SHA1(key, 16, hash);
+		const uint64_t u0 = debug_time_usec();
+		struct KeyValue *const kv = metatable_lookup(mt, 16, key, hash);
+		latency_record(debug_time_usec() - u0, latency);
+		if (kv) {
+			const int np =
+				sprintf((char *)value, "{\"id\":%lu,", i);
+			assert(memcmp(kv->pv, value, np) == 0);
+			found++;
+			free(kv);
+		}
+	}
+	const double t3 = debug_time_sec();
+	// 数据文件大小固定: 一个表所有桶
+	const uint64_t disk = TABLE_NR_BARRELS * BARREL_ALIGN;
+	printf("[%s] vlen %u items %lu found %lu\n", lz4 ? "lz4" : "raw", vlen,
+	       count, found);
+	printf("logical %lu disk %lu amplification %.3lf\n", logical, disk,
+	       ((double)disk) / ((double)logical));
+	printf("insert %.3lf lookup %.3lf (%.0lf ops/s)\n", t1 - t0, t3 - t2,
+	       ((double)count) / (t3 - t2));
+	latency_show(lz4 ? "lookup lz4" : "lookup raw", latency, stdout);
+	free(latency);
+	metatable_free(mt);
+	close(fd_in);
+}
+
 int main(int argc, char **argv)
 {
-	(void)argc;
-	(void)argv;
+	if ((argc > 1) && (strcmp(argv[1], "lz4") == 0)) {
+		const uint16_t vlen = (argc > 2) ? atoi(argv[2]) : 300;
+		compress_benchmark(false, vlen);
+		compress_benchmark(true, vlen);
+		return 0;
+	}
 	table_test(200);
 	table_test(300);
 	table_test(400);
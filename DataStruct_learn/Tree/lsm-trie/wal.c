@@ -0,0 +1,538 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+// 预写日志: group commit, 一个 leader 写出整组并 fdatasync
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include "wal.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "coding.h"
+
+// 1MB, grows on demand
+#define WAL_BUF_SIZE ((UINT64_C(0x100000)))
+
+struct WALRecord {
+	uint32_t nr_bytes;
+	uint32_t nr_items;
+	// fnv-1a of the payload
+	uint64_t sum;
+} __attribute__((packed));
+
+struct WAL {
+	char *dir;
+	uint32_t mode;
+	uint64_t interval_ms;
+	struct Stat *stat;
+	int fd;
+	// current segment
+	uint64_t seq;
+	// segments < seq_start are left to wal_replay()
+	uint64_t seq_start;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	// appenders fill buf while the leader writes spare
+	uint8_t *buf;
+	uint64_t cap;
+	uint64_t used;
+	uint8_t *spare;
+	uint64_t spare_cap;
+	// the old segment between wal_rotate() and wal_rotate_finish()
+	int sealed_fd;
+	uint8_t *sealed_buf;
+	uint64_t sealed_cap;
+	uint64_t sealed_used;
+	uint64_t sealed_lsn;
+	// a leader is writing
+	bool flushing;
+	bool closing;
+	// logical bytes: appended >= written >= synced
+	uint64_t lsn_appended;
+	uint64_t lsn_written;
+	uint64_t lsn_synced;
+
+	pthread_t t_sync;
+};
+
+static uint64_t wal_checksum(const uint8_t *const p, const uint64_t len)
+{
+	uint64_t h = UINT64_C(0xcbf29ce484222325);
+	for (uint64_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= UINT64_C(0x100000001b3);
+	}
+	return h;
+}
+
+static void wal_segment_fn(const struct WAL *const wal, const uint64_t seq,
+			   char *const path)
+{
+	sprintf(path, "%s/%016lx", wal->dir, seq);
+}
+
+static int wal_segment_open(const struct WAL *const wal, const uint64_t seq)
+{
+	char path[2048];
+	wal_segment_fn(wal, seq, path);
+	const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+	assert(fd >= 0);
+	// the segment must survive a crash, not only its data
+	const int dfd = open(wal->dir, O_RDONLY | O_DIRECTORY);
+	assert(dfd >= 0);
+	const int rs = fsync(dfd);
+	assert(rs == 0);
+	close(dfd);
+	return fd;
+}
+
+static int __compare_seq(const void *const p1, const void *const p2)
+{
+	const uint64_t v1 = *((const uint64_t *)p1);
+	const uint64_t v2 = *((const uint64_t *)p2);
+	return (v1 < v2) ? -1 : ((v1 > v2) ? 1 : 0);
+}
+
+// sorted ids of all segments < limit; free it after use
+static uint64_t wal_list(const struct WAL *const wal, const uint64_t limit,
+			 uint64_t **const seqs)
+{
+	uint64_t nr = 0;
+	uint64_t cap = 16;
+	uint64_t *ids = (typeof(ids))malloc(sizeof(ids[0]) * cap);
+	assert(ids);
+	DIR *const dir = opendir(wal->dir);
+	assert(dir);
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		char *end = NULL;
+		const uint64_t seq = strtoull(ent->d_name, &end, 16);
+		if ((end == ent->d_name) || (*end != '\0') || (seq == 0) ||
+		    (seq >= limit)) {
+			continue;
+		}
+		if (nr == cap) {
+			cap <<= 1;
+			ids = realloc(ids, sizeof(ids[0]) * cap);
+			assert(ids);
+		}
+		ids[nr++] = seq;
+	}
+	closedir(dir);
+	qsort(ids, nr, sizeof(ids[0]), __compare_seq);
+	*seqs = ids;
+	return nr;
+}
+
+static void write_all(const int fd, const uint8_t *const buf,
+		      const uint64_t len)
+{
+	uint64_t done = 0;
+	while (done < len) {
+		const ssize_t nw = write(fd, buf + done, len - done);
+		if ((nw < 0) && (errno == EINTR)) {
+			continue;
+		}
+		assert(nw > 0);
+		done += (uint64_t)nw;
+	}
+}
+
+// called and returns with the mutex held, no other leader running
+static void wal_group_write(struct WAL *const wal, const bool sync)
+{
+	assert(wal->flushing == false);
+	wal->flushing = true;
+	uint8_t *const buf = wal->buf;
+	const uint64_t cap = wal->cap;
+	const uint64_t used = wal->used;
+	const uint64_t lsn = wal->lsn_appended;
+	const int fd = wal->fd;
+	wal->buf = wal->spare;
+	wal->cap = wal->spare_cap;
+	wal->used = 0;
+	pthread_mutex_unlock(&(wal->mutex));
+
+	if (used) {
+		write_all(fd, buf, used);
+		stat_inc(&(wal->stat->nr_wal_write));
+		stat_inc_n(&(wal->stat->nr_wal_bytes), used);
+	}
+	if (sync) {
+		const int rs = fdatasync(fd);
+		assert(rs == 0);
+		stat_inc(&(wal->stat->nr_wal_sync));
+	}
+
+	pthread_mutex_lock(&(wal->mutex));
+	wal->spare = buf;
+	wal->spare_cap = cap;
+	wal->lsn_written = lsn;
+	if (sync) {
+		wal->lsn_synced = lsn;
+	}
+	wal->flushing = false;
+	pthread_cond_broadcast(&(wal->cond));
+}
+
+static void *thread_wal_sync(void *const p)
+{
+	struct WAL *const wal = (typeof(wal))p;
+	while (wal->closing == false) {
+		usleep(wal->interval_ms * 1000u);
+		pthread_mutex_lock(&(wal->mutex));
+		if ((wal->flushing == false) &&
+		    (wal->lsn_synced < wal->lsn_appended)) {
+			wal_group_write(wal, true);
+		}
+		pthread_mutex_unlock(&(wal->mutex));
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+// new segment after all existing ones
+struct WAL *wal_open(const char *const dir, const uint32_t mode,
+		     const uint64_t interval_ms, struct Stat *const stat)
+{
+	assert(mode != WAL_OFF);
+	struct WAL *const wal = (typeof(wal))malloc(sizeof(*wal));
+	assert(wal);
+	bzero(wal, sizeof(*wal));
+	wal->dir = strdup(dir);
+	wal->mode = mode;
+	wal->interval_ms = interval_ms ? interval_ms : 1;
+	wal->stat = stat;
+
+	uint64_t *seqs = NULL;
+	const uint64_t nr = wal_list(wal, UINT64_MAX, &seqs);
+	wal->seq = nr ? (seqs[nr - 1] + 1) : 1;
+	wal->seq_start = wal->seq;
+	free(seqs);
+	wal->fd = wal_segment_open(wal, wal->seq);
+
+	wal->cap = WAL_BUF_SIZE;
+	wal->spare_cap = WAL_BUF_SIZE;
+	wal->buf = (typeof(wal->buf))malloc(wal->cap);
+	wal->spare = (typeof(wal->spare))malloc(wal->spare_cap);
+	assert(wal->buf && wal->spare);
+	pthread_mutex_init(&(wal->mutex), NULL);
+	pthread_cond_init(&(wal->cond), NULL);
+
+	if (mode == WAL_SYNC_INTERVAL) {
+		const int pc = pthread_create(&(wal->t_sync), NULL,
+					      thread_wal_sync, (void *)wal);
+		assert(pc == 0);
+		pthread_setname_np(wal->t_sync, "WAL-Sync");
+	}
+	return wal;
+}
+
+// copy items into the group buffer, return the lsn to wait for.
+// call it under the same lock as the table insert, so that the items
+// land in the segment of their table. seqs (optional) is the insert
+// order from table_multi_insert_kv_mt(): records of racing writers may
+// be appended in any order, replay puts each key back in seq order
+uint64_t wal_append(struct WAL *const wal, const uint64_t nr_items,
+		    const struct KeyValue *const kvs,
+		    const uint32_t *const seqs)
+{
+	uint64_t max = sizeof(struct WALRecord);
+	for (uint64_t i = 0; i < nr_items; i++) {
+		max += (15u + kvs[i].klen + kvs[i].vlen);
+	}
+	pthread_mutex_lock(&(wal->mutex));
+	if ((wal->used + max) > wal->cap) {
+		while ((wal->used + max) > wal->cap) {
+			wal->cap <<= 1;
+		}
+		wal->buf = realloc(wal->buf, wal->cap);
+		assert(wal->buf);
+	}
+	uint8_t *const head = wal->buf + wal->used;
+	uint8_t *const payload = head + sizeof(struct WALRecord);
+	uint8_t *ptr = payload;
+	for (uint64_t i = 0; i < nr_items; i++) {
+		ptr = encode_uint32(ptr, seqs ? seqs[i] : 0);
+		ptr = encode_uint16(ptr, kvs[i].klen);
+		memcpy(ptr, kvs[i].pk, kvs[i].klen);
+		ptr += kvs[i].klen;
+		ptr = encode_uint16(ptr, kvs[i].vlen);
+		memcpy(ptr, kvs[i].pv, kvs[i].vlen);
+		ptr += kvs[i].vlen;
+	}
+	struct WALRecord rec;
+	rec.nr_bytes = (uint32_t)(ptr - payload);
+	rec.nr_items = (uint32_t)nr_items;
+	rec.sum = wal_checksum(payload, rec.nr_bytes);
+	memcpy(head, &rec, sizeof(rec));
+	const uint64_t size = (uint64_t)(ptr - head);
+	wal->used += size;
+	wal->lsn_appended += size;
+	const uint64_t lsn = wal->lsn_appended;
+	pthread_mutex_unlock(&(wal->mutex));
+	return lsn;
+}
+
+// wait until lsn is durable as the mode promises; the first waiter
+// becomes the leader and writes out everyone appended so far
+void wal_commit(struct WAL *const wal, const uint64_t lsn)
+{
+	if (wal->mode == WAL_SYNC_INTERVAL) {
+		return;
+	}
+	const bool sync = (wal->mode == WAL_SYNC_BATCH) ? true : false;
+	pthread_mutex_lock(&(wal->mutex));
+	for (;;) {
+		const uint64_t done = sync ? wal->lsn_synced : wal->lsn_written;
+		if (done >= lsn) {
+			break;
+		}
+		if (wal->flushing) {
+			pthread_cond_wait(&(wal->cond), &(wal->mutex));
+		} else {
+			wal_group_write(wal, sync);
+		}
+	}
+	pthread_mutex_unlock(&(wal->mutex));
+}
+
+// seal the current segment (always synced) and start a new one, in two
+// steps so that the caller's lock covers only the switch: wal_rotate()
+// takes the buffered records of the old segment and the leader slot,
+// wal_rotate_finish() writes, syncs and closes the old segment and opens
+// the new one. no appends may run concurrently with wal_rotate().
+// return the sealed segment id
+uint64_t wal_rotate(struct WAL *const wal)
+{
+	pthread_mutex_lock(&(wal->mutex));
+	while (wal->flushing) {
+		pthread_cond_wait(&(wal->cond), &(wal->mutex));
+	}
+	wal->flushing = true;
+	wal->sealed_fd = wal->fd;
+	wal->sealed_buf = wal->buf;
+	wal->sealed_cap = wal->cap;
+	wal->sealed_used = wal->used;
+	wal->sealed_lsn = wal->lsn_appended;
+	wal->buf = wal->spare;
+	wal->cap = wal->spare_cap;
+	wal->used = 0;
+	wal->fd = -1;
+	const uint64_t seq = wal->seq;
+	wal->seq++;
+	pthread_mutex_unlock(&(wal->mutex));
+	return seq;
+}
+
+// call it once after wal_rotate(), without the caller's lock
+void wal_rotate_finish(struct WAL *const wal)
+{
+	// no other leader runs until flushing is cleared
+	assert(wal->flushing);
+	if (wal->sealed_used) {
+		write_all(wal->sealed_fd, wal->sealed_buf, wal->sealed_used);
+		stat_inc(&(wal->stat->nr_wal_write));
+		stat_inc_n(&(wal->stat->nr_wal_bytes), wal->sealed_used);
+	}
+	const int rs = fdatasync(wal->sealed_fd);
+	assert(rs == 0);
+	stat_inc(&(wal->stat->nr_wal_sync));
+	close(wal->sealed_fd);
+	const int fd = wal_segment_open(wal, wal->seq);
+
+	pthread_mutex_lock(&(wal->mutex));
+	wal->fd = fd;
+	wal->spare = wal->sealed_buf;
+	wal->spare_cap = wal->sealed_cap;
+	wal->lsn_written = wal->sealed_lsn;
+	wal->lsn_synced = wal->sealed_lsn;
+	wal->sealed_fd = -1;
+	wal->sealed_buf = NULL;
+	wal->flushing = false;
+	pthread_cond_broadcast(&(wal->cond));
+	pthread_mutex_unlock(&(wal->mutex));
+}
+
+// remove sealed segments [seq_start, seq] whose tables are persisted
+void wal_purge(struct WAL *const wal, const uint64_t seq)
+{
+	char path[2048];
+	pthread_mutex_lock(&(wal->mutex));
+	const uint64_t limit = (seq < wal->seq) ? (seq + 1) : wal->seq;
+	for (uint64_t i = wal->seq_start; i < limit; i++) {
+		wal_segment_fn(wal, i, path);
+		unlink(path);
+	}
+	if (limit > wal->seq_start) {
+		wal->seq_start = limit;
+	}
+	pthread_mutex_unlock(&(wal->mutex));
+}
+
+struct WALItem {
+	uint32_t seq;
+	// position in the segment
+	uint64_t pos;
+	struct KeyValue kv;
+};
+
+static int __compare_item(const void *const p1, const void *const p2)
+{
+	const struct WALItem *const i1 = (typeof(i1))p1;
+	const struct WALItem *const i2 = (typeof(i2))p2;
+	if (i1->seq != i2->seq) {
+		return (i1->seq < i2->seq) ? -1 : 1;
+	}
+	return (i1->pos < i2->pos) ? -1 : ((i1->pos > i2->pos) ? 1 : 0);
+}
+
+// apply the items of one segment in insert order, stop at a torn tail
+static uint64_t wal_replay_segment(const char *const path,
+				   bool (*apply)(void *const, const uint64_t,
+						 const struct KeyValue *const),
+				   void *const arg)
+{
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	struct stat st;
+	const int rs = fstat(fd, &st);
+	assert(rs == 0);
+	const uint64_t size = (uint64_t)st.st_size;
+	uint8_t *const data = (typeof(data))malloc(size ? size : 1);
+	assert(data);
+	uint64_t nr_read = 0;
+	while (nr_read < size) {
+		const ssize_t r = read(fd, data + nr_read, size - nr_read);
+		if (r <= 0) {
+			break;
+		}
+		nr_read += (uint64_t)r;
+	}
+	close(fd);
+
+	uint64_t nr_all = 0;
+	uint64_t cap = 0;
+	struct WALItem *items = NULL;
+	uint64_t off = 0;
+	while ((off + sizeof(struct WALRecord)) <= nr_read) {
+		struct WALRecord rec;
+		memcpy(&rec, data + off, sizeof(rec));
+		const uint8_t *const payload = data + off + sizeof(rec);
+		if (((off + sizeof(rec) + rec.nr_bytes) > nr_read) ||
+		    (wal_checksum(payload, rec.nr_bytes) != rec.sum)) {
+			break;
+		}
+		if ((nr_all + rec.nr_items) > cap) {
+			while ((nr_all + rec.nr_items) > cap) {
+				cap = cap ? (cap << 1) : 1024;
+			}
+			items = realloc(items, sizeof(items[0]) * cap);
+			assert(items);
+		}
+		const uint8_t *ptr = payload;
+		for (uint64_t i = 0; i < rec.nr_items; i++) {
+			struct WALItem *const item = &(items[nr_all]);
+			ptr = decode_uint32(ptr, &(item->seq));
+			item->pos = nr_all;
+			ptr = decode_uint16(ptr, &(item->kv.klen));
+			item->kv.pk = (uint8_t *)ptr;
+			ptr += item->kv.klen;
+			ptr = decode_uint16(ptr, &(item->kv.vlen));
+			item->kv.pv = (uint8_t *)ptr;
+			ptr += item->kv.vlen;
+			nr_all++;
+		}
+		assert(ptr == (payload + rec.nr_bytes));
+		off += sizeof(rec) + rec.nr_bytes;
+	}
+
+	if (nr_all) {
+		// (seq, pos): concurrent inserts by seq, the others as logged
+		qsort(items, nr_all, sizeof(items[0]), __compare_item);
+		struct KeyValue *const kvs =
+			(typeof(kvs))malloc(sizeof(kvs[0]) * nr_all);
+		assert(kvs);
+		for (uint64_t i = 0; i < nr_all; i++) {
+			kvs[i] = items[i].kv;
+		}
+		const bool ra = apply(arg, nr_all, kvs);
+		assert(ra);
+		free(kvs);
+	}
+	free(items);
+	free(data);
+	return nr_all;
+}
+
+// re-insert what the segments left by an earlier run hold, then drop
+// them. apply() must log through this WAL again (e.g. db_multi_insert)
+uint64_t wal_replay(struct WAL *const wal,
+		    bool (*apply)(void *const, const uint64_t,
+				  const struct KeyValue *const),
+		    void *const arg)
+{
+	uint64_t *seqs = NULL;
+	const uint64_t nr = wal_list(wal, wal->seq_start, &seqs);
+	char path[2048];
+	uint64_t nr_items = 0;
+	for (uint64_t i = 0; i < nr; i++) {
+		wal_segment_fn(wal, seqs[i], path);
+		nr_items += wal_replay_segment(path, apply, arg);
+	}
+	if (nr) {
+		// make the re-inserted items durable before dropping the old
+		pthread_mutex_lock(&(wal->mutex));
+		while (wal->flushing) {
+			pthread_cond_wait(&(wal->cond), &(wal->mutex));
+		}
+		wal_group_write(wal, true);
+		pthread_mutex_unlock(&(wal->mutex));
+		for (uint64_t i = 0; i < nr; i++) {
+			wal_segment_fn(wal, seqs[i], path);
+			unlink(path);
+		}
+	}
+	free(seqs);
+	return nr_items;
+}
+
+void wal_close(struct WAL *const wal)
+{
+	wal->closing = true;
+	if (wal->mode == WAL_SYNC_INTERVAL) {
+		pthread_join(wal->t_sync, NULL);
+	}
+	pthread_mutex_lock(&(wal->mutex));
+	while (wal->flushing) {
+		pthread_cond_wait(&(wal->cond), &(wal->mutex));
+	}
+	wal_group_write(wal, wal->mode != WAL_SYNC_NONE);
+	pthread_mutex_unlock(&(wal->mutex));
+	close(wal->fd);
+	pthread_mutex_destroy(&(wal->mutex));
+	pthread_cond_destroy(&(wal->cond));
+	free(wal->buf);
+	free(wal->spare);
+	free(wal->dir);
+	free(wal);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stat.h"
+#include "table.h"
+
+// 预写日志同步模式
+// no WAL at all
+#define WAL_OFF ((UINT32_C(0)))
+// write(2) per group, no fdatasync
+#define WAL_SYNC_NONE ((UINT32_C(1)))
+// one fdatasync per group, inserts wait for it
+#define WAL_SYNC_BATCH ((UINT32_C(2)))
+// fdatasync every N ms in the background, inserts don't wait
+#define WAL_SYNC_INTERVAL ((UINT32_C(3)))
+
+// one segment file per active table
+struct WAL;
+
+struct WAL *wal_open(const char *const dir, const uint32_t mode,
+		     const uint64_t interval_ms, struct Stat *const stat);
+
+uint64_t wal_append(struct WAL *const wal, const uint64_t nr_items,
+		    const struct KeyValue *const kvs,
+		    const uint32_t *const seqs);
+
+void wal_commit(struct WAL *const wal, const uint64_t lsn);
+
+uint64_t wal_rotate(struct WAL *const wal);
+
+void wal_rotate_finish(struct WAL *const wal);
+
+void wal_purge(struct WAL *const wal, const uint64_t seq);
+
+uint64_t wal_replay(struct WAL *const wal,
+		    bool (*apply)(void *const, const uint64_t,
+				  const struct KeyValue *const),
+		    void *const arg);
+
+void wal_close(struct WAL *const wal);
@@ -34,9 +34,11 @@
 
 #include <errno.h>
 #include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
@@ -49,6 +51,16 @@
  * The following should be ordered by performances, descending. */
 
 #include "ae_epoll.h"
+#include "ae_uring.h"
+
+// aeCreateRecvEvent 模拟时每次最多读的字节数
+#define AE_RECV_BUF_SIZE (16 * 1024)
+
+// 新建事件循环使用的后端，为 NULL 时看环境变量 AE_API，默认 epoll
+static const aeApi *aeDefaultApi = NULL;
+
+static void aeProcessTasks(aeEventLoop *eventLoop, int fd, void *clientData,
+			   int mask);
 
 /*
  * 初始化事件处理器状态
@@ -71,18 +83,39 @@ aeEventLoop *aeCreateEventLoop(int setsize)
 	}
 	// 设置数组大小
 	eventLoop->setsize = setsize;
-	// 初始化执行最近一次执行时间
-	eventLoop->lastTime = time(NULL);
-
 	// 初始化时间事件结构
-	eventLoop->timeEventHead = NULL;
+	eventLoop->timeEvents = NULL;
+	eventLoop->timeEventNum = 0;
+	eventLoop->timeEventCap = 0;
+	eventLoop->timeEventTable = NULL;
+	eventLoop->timeEventTableSize = 0;
 	eventLoop->timeEventNextId = 0;
 
 	eventLoop->stop = 0;
 	eventLoop->maxfd = -1;
 	eventLoop->beforesleep = NULL;
-	if (aeApiCreate(eventLoop) == -1) {
-		goto err;
+	eventLoop->taskHead = NULL;
+	eventLoop->taskTail = NULL;
+	eventLoop->recvbuf = NULL;
+	eventLoop->syscalls = 0;
+
+	// 选定的后端不可用时（比如内核不支持 io_uring）退回 epoll
+	if (aeDefaultApi == NULL) {
+		const char *name = getenv("AE_API");
+
+		if (name == NULL || aeSetApi(name) == AE_ERR) {
+			aeDefaultApi = &aeEpollApi;
+		}
+	}
+	eventLoop->api = aeDefaultApi;
+	if (eventLoop->api->create(eventLoop) == -1) {
+		if (eventLoop->api == &aeEpollApi) {
+			goto err;
+		}
+		eventLoop->api = &aeEpollApi;
+		if (eventLoop->api->create(eventLoop) == -1) {
+			goto err;
+		}
 	}
 
 	/* Events with mask == AE_NONE are not set. So let's initialize the
@@ -90,7 +123,24 @@ aeEventLoop *aeCreateEventLoop(int setsize)
 	// 初始化监听事件
 	for (i = 0; i < setsize; i++) {
 		eventLoop->events[i].mask = AE_NONE;
+		eventLoop->events[i].recvProc = NULL;
+		eventLoop->events[i].sendbuf = NULL;
+		eventLoop->events[i].sendlen = 0;
+		eventLoop->events[i].sendcap = 0;
+	}
+
+	// 跨线程投递任务和停止事件循环时，通过 eventfd 唤醒阻塞中的 aeApiPoll
+	eventLoop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (eventLoop->wakefd == -1 ||
+	    aeCreateFileEvent(eventLoop, eventLoop->wakefd, AE_READABLE,
+			      aeProcessTasks, NULL) == AE_ERR) {
+		if (eventLoop->wakefd != -1) {
+			close(eventLoop->wakefd);
+		}
+		eventLoop->api->free(eventLoop);
+		goto err;
 	}
+	pthread_mutex_init(&eventLoop->tasklock, NULL);
 
 	// 返回事件循环
 	return eventLoop;
@@ -129,7 +179,7 @@ int aeGetSetSize(aeEventLoop *eventLoop)
  */
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize)
 {
-	int i;
+	int i, oldsize = eventLoop->setsize;
 
 	if (setsize == eventLoop->setsize) {
 		return AE_OK;
@@ -137,7 +187,7 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize)
 	if (eventLoop->maxfd >= setsize) {
 		return AE_ERR;
 	}
-	if (aeApiResize(eventLoop, setsize) == -1) {
+	if (eventLoop->api->resize(eventLoop, setsize) == -1) {
 		return AE_ERR;
 	}
 
@@ -152,6 +202,12 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize)
 	for (i = eventLoop->maxfd + 1; i < setsize; i++) {
 		eventLoop->events[i].mask = AE_NONE;
 	}
+	for (i = oldsize; i < setsize; i++) {
+		eventLoop->events[i].recvProc = NULL;
+		eventLoop->events[i].sendbuf = NULL;
+		eventLoop->events[i].sendlen = 0;
+		eventLoop->events[i].sendcap = 0;
+	}
 	return AE_OK;
 }
 
@@ -160,18 +216,112 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize)
  */
 void aeDeleteEventLoop(aeEventLoop *eventLoop)
 {
-	aeApiFree(eventLoop);
+	aeTask *task;
+	int i;
+
+	// 还没执行的任务直接丢弃
+	while ((task = eventLoop->taskHead) != NULL) {
+		eventLoop->taskHead = task->next;
+		zfree(task);
+	}
+	pthread_mutex_destroy(&eventLoop->tasklock);
+	close(eventLoop->wakefd);
+
+	// 释放还没到达的时间事件
+	for (i = 0; i < eventLoop->timeEventNum; i++) {
+		zfree(eventLoop->timeEvents[i]);
+	}
+	zfree(eventLoop->timeEvents);
+	zfree(eventLoop->timeEventTable);
+
+	eventLoop->api->free(eventLoop);
+	for (i = 0; i < eventLoop->setsize; i++) {
+		zfree(eventLoop->events[i].sendbuf);
+	}
+	zfree(eventLoop->recvbuf);
 	zfree(eventLoop->events);
 	zfree(eventLoop->fired);
 	zfree(eventLoop);
 }
 
+/*
+ * 唤醒阻塞在 aeApiPoll 中的事件循环
+ */
+static void aeWakeUp(aeEventLoop *eventLoop)
+{
+	uint64_t one = 1;
+
+	// 计数器溢出时返回 EAGAIN，此时 eventfd 本来就是可读的，忽略即可
+	if (write(eventLoop->wakefd, &one, sizeof(one)) == -1) {
+		return;
+	}
+}
+
 /*
  * 停止事件处理器
+ *
+ * 可以在其他线程调用，事件循环会在处理完当前这一轮事件后从 aeMain 返回
  */
 void aeStop(aeEventLoop *eventLoop)
 {
-	eventLoop->stop = 1;
+	__atomic_store_n(&eventLoop->stop, 1, __ATOMIC_RELEASE);
+	aeWakeUp(eventLoop);
+}
+
+/*
+ * 投递任务给事件循环，可以在任意线程调用，
+ * proc 会在事件循环所在的线程里按投递顺序执行
+ */
+int aePostTask(aeEventLoop *eventLoop, aeTaskProc *proc, void *clientData)
+{
+	aeTask *task = zmalloc(sizeof(*task));
+
+	if (task == NULL) {
+		return AE_ERR;
+	}
+	task->proc = proc;
+	task->clientData = clientData;
+	task->next = NULL;
+
+	pthread_mutex_lock(&eventLoop->tasklock);
+	if (eventLoop->taskTail != NULL) {
+		eventLoop->taskTail->next = task;
+	} else {
+		eventLoop->taskHead = task;
+	}
+	eventLoop->taskTail = task;
+	pthread_mutex_unlock(&eventLoop->tasklock);
+
+	aeWakeUp(eventLoop);
+	return AE_OK;
+}
+
+/*
+ * wakefd 的读事件处理器，取出所有待执行的任务依次执行
+ */
+static void aeProcessTasks(aeEventLoop *eventLoop, int fd, void *clientData,
+			   int mask)
+{
+	aeTask *task, *next;
+	uint64_t count;
+
+	AE_NOTUSED(clientData);
+	AE_NOTUSED(mask);
+
+	if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		return;
+	}
+
+	pthread_mutex_lock(&eventLoop->tasklock);
+	task = eventLoop->taskHead;
+	eventLoop->taskHead = eventLoop->taskTail = NULL;
+	pthread_mutex_unlock(&eventLoop->tasklock);
+
+	for (; task != NULL; task = next) {
+		next = task->next;
+		task->proc(eventLoop, task->clientData);
+		zfree(task);
+	}
 }
 
 /*
@@ -197,7 +347,7 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd,
 	aeFileEvent *fe = &eventLoop->events[fd];
 
 	// 监听指定 fd 的指定事件
-	if (aeApiAddEvent(eventLoop, fd, mask) == -1) {
+	if (eventLoop->api->addEvent(eventLoop, fd, mask) == -1) {
 		return AE_ERR;
 	}
 
@@ -253,7 +403,7 @@ void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
 	}
 
 	// 取消对给定 fd 的给定事件的监视
-	aeApiDelEvent(eventLoop, fd, mask);
+	eventLoop->api->delEvent(eventLoop, fd, mask);
 }
 
 /*
@@ -270,44 +420,370 @@ int aeGetFileEvents(aeEventLoop *eventLoop, int fd)
 }
 
 /*
- * 取出当前时间的秒和毫秒，
- * 并分别将它们保存到 seconds 和 milliseconds 参数中
+ * 后端没有 addRecv 时，用可读事件加 read 模拟直接收数据
+ */
+static void aeRecvHandler(aeEventLoop *eventLoop, int fd, void *clientData,
+			  int mask)
+{
+	aeFileEvent *fe = &eventLoop->events[fd];
+	ssize_t nread;
+
+	eventLoop->syscalls++;
+	nread = read(fd, eventLoop->recvbuf, AE_RECV_BUF_SIZE);
+	if (nread == -1 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+	fe->recvProc(eventLoop, fd, clientData, nread > 0 ? eventLoop->recvbuf :
+							   NULL,
+		     nread);
+}
+
+/*
+ * 后端没有 send 时，把 aeSend 没写完的数据在可写时写出去
+ */
+static void aeSendHandler(aeEventLoop *eventLoop, int fd, void *clientData,
+			  int mask)
+{
+	aeFileEvent *fe = &eventLoop->events[fd];
+	ssize_t nwritten;
+
+	eventLoop->syscalls++;
+	nwritten = write(fd, fe->sendbuf, fe->sendlen);
+	if (nwritten == -1) {
+		if (errno == EAGAIN || errno == EINTR) {
+			return;
+		}
+		// 出错的连接由读端发现并关闭，这里丢掉还没发的数据
+		nwritten = fe->sendlen;
+	}
+	fe->sendlen -= nwritten;
+	if (fe->sendlen > 0) {
+		memmove(fe->sendbuf, fe->sendbuf + nwritten, fe->sendlen);
+	} else {
+		aeDeleteFileEvent(eventLoop, fd, AE_WRITABLE);
+	}
+}
+
+/*
+ * 追加到 fd 的待发送缓冲区
+ */
+static void aeSendAppend(aeFileEvent *fe, const void *buf, size_t len)
+{
+	if (fe->sendlen + len > fe->sendcap) {
+		size_t cap = fe->sendcap ? fe->sendcap * 2 : 1024;
+
+		while (cap < fe->sendlen + len) {
+			cap *= 2;
+		}
+		fe->sendbuf = zrealloc(fe->sendbuf, cap);
+		fe->sendcap = cap;
+	}
+	memcpy(fe->sendbuf + fe->sendlen, buf, len);
+	fe->sendlen += len;
+}
+
+/*
+ * 开始直接收 fd 上的数据，每收到一段调用一次 proc：
+ *   buf 只在回调期间有效，nread > 0 是数据长度，
+ *   nread == 0 表示对端关闭，nread == -1 表示出错（errno 已设置）。
+ * 之后应该用 aeSend 回写数据、用 aeDeleteRecvEvent 结束，不要再对 fd 调用
+ * aeCreateFileEvent。io_uring 后端不需要每次单独 read，其他后端用可读事件模拟。
+ */
+int aeCreateRecvEvent(aeEventLoop *eventLoop, int fd, aeRecvProc *proc,
+		      void *clientData)
+{
+	aeFileEvent *fe;
+
+	if (fd >= eventLoop->setsize) {
+		errno = ERANGE;
+		return AE_ERR;
+	}
+	fe = &eventLoop->events[fd];
+
+	if (eventLoop->api->addRecv == NULL) {
+		if (eventLoop->recvbuf == NULL) {
+			eventLoop->recvbuf = zmalloc(AE_RECV_BUF_SIZE);
+		}
+		fe->recvProc = proc;
+		return aeCreateFileEvent(eventLoop, fd, AE_READABLE,
+					 aeRecvHandler, clientData);
+	}
+
+	if (eventLoop->api->addRecv(eventLoop, fd) == -1) {
+		return AE_ERR;
+	}
+	fe->mask |= AE_RECV;
+	fe->recvProc = proc;
+	fe->clientData = clientData;
+	if (fd > eventLoop->maxfd) {
+		eventLoop->maxfd = fd;
+	}
+	return AE_OK;
+}
+
+/*
+ * 停止收 fd 上的数据，丢弃还没发出去的数据，之后可以关闭 fd
+ */
+void aeDeleteRecvEvent(aeEventLoop *eventLoop, int fd)
+{
+	aeFileEvent *fe;
+
+	if (fd >= eventLoop->setsize) {
+		return;
+	}
+	fe = &eventLoop->events[fd];
+
+	if (eventLoop->api->addRecv == NULL) {
+		aeDeleteFileEvent(eventLoop, fd, AE_READABLE | AE_WRITABLE);
+	} else {
+		eventLoop->api->delRecv(eventLoop, fd);
+		aeDeleteFileEvent(eventLoop, fd, AE_RECV);
+	}
+	fe->recvProc = NULL;
+	zfree(fe->sendbuf);
+	fe->sendbuf = NULL;
+	fe->sendlen = 0;
+	fe->sendcap = 0;
+}
+
+/*
+ * 向 aeCreateRecvEvent 注册过的 fd 发送数据，数据会先被复制，调用后 buf 即可复用。
+ * 同一个 fd 上的多次发送按顺序到达，发送期间追加的数据合并成一次发送。
+ */
+int aeSend(aeEventLoop *eventLoop, int fd, const void *buf, size_t len)
+{
+	aeFileEvent *fe;
+	ssize_t nwritten;
+
+	if (fd >= eventLoop->setsize) {
+		errno = ERANGE;
+		return AE_ERR;
+	}
+	fe = &eventLoop->events[fd];
+
+	if (eventLoop->api->send) {
+		aeSendAppend(fe, buf, len);
+		return eventLoop->api->send(eventLoop, fd) == -1 ? AE_ERR :
+								  AE_OK;
+	}
+
+	// 前面没有积压的数据时先直接写，写不完的等可写时再写
+	if (fe->sendlen == 0) {
+		eventLoop->syscalls++;
+		nwritten = write(fd, buf, len);
+		if (nwritten == -1) {
+			if (errno != EAGAIN && errno != EINTR) {
+				return AE_ERR;
+			}
+			nwritten = 0;
+		}
+		if ((size_t)nwritten == len) {
+			return AE_OK;
+		}
+		buf = (const char *)buf + nwritten;
+		len -= nwritten;
+	}
+	aeSendAppend(fe, buf, len);
+	if (!(fe->mask & AE_WRITABLE)) {
+		return aeCreateFileEvent(eventLoop, fd, AE_WRITABLE,
+					 aeSendHandler, fe->clientData);
+	}
+	return AE_OK;
+}
+
+/*
+ * 取出单调时钟的当前毫秒数，不受系统时间被调整的影响
  */
-static void aeGetTime(long *seconds, long *milliseconds)
+static long long aeGetMonotonicMs(void)
 {
-	struct timeval tv;
+	struct timespec ts;
 
-	gettimeofday(&tv, NULL);
-	*seconds = tv.tv_sec;
-	*milliseconds = tv.tv_usec / 1000;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 /*
- * 在当前时间上加上 milliseconds 毫秒，
- * 并且将加上之后的秒数和毫秒数分别保存在 sec 和 ms 指针中。
+ * 时间事件保存在 4 叉最小堆里，堆顶是最早到达的事件。
+ * 相比二叉堆层数减半，下沉时一次比较的 4 个孩子在同一条缓存行里。
+ *
+ * 插入、删除、更新到达时间都是 O(log n)，取最近的定时器是 O(1)。
  */
-static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms)
+#define AE_HEAP_D 4
+
+static inline void aeHeapSet(aeEventLoop *eventLoop, int i, aeTimeEvent *te)
+{
+	eventLoop->timeEvents[i] = te;
+	te->index = i;
+}
+
+// 上浮
+static void aeHeapUp(aeEventLoop *eventLoop, int i)
+{
+	aeTimeEvent **heap = eventLoop->timeEvents;
+	aeTimeEvent *te = heap[i];
+
+	while (i > 0) {
+		int parent = (i - 1) / AE_HEAP_D;
+
+		if (heap[parent]->when <= te->when) {
+			break;
+		}
+		aeHeapSet(eventLoop, i, heap[parent]);
+		i = parent;
+	}
+	aeHeapSet(eventLoop, i, te);
+}
+
+// 下沉
+static void aeHeapDown(aeEventLoop *eventLoop, int i)
 {
-	long cur_sec, cur_ms, when_sec, when_ms;
+	aeTimeEvent **heap = eventLoop->timeEvents;
+	aeTimeEvent *te = heap[i];
+	int num = eventLoop->timeEventNum;
 
-	// 获取当前时间
-	aeGetTime(&cur_sec, &cur_ms);
+	for (;;) {
+		int child = i * AE_HEAP_D + 1, last = child + AE_HEAP_D;
+		int min = -1, j;
 
-	// 计算增加 milliseconds 之后的秒数和毫秒数
-	when_sec = cur_sec + milliseconds / 1000;
-	when_ms = cur_ms + milliseconds % 1000;
+		if (last > num) {
+			last = num;
+		}
+		for (j = child; j < last; j++) {
+			if (heap[j]->when < te->when &&
+			    (min == -1 || heap[j]->when < heap[min]->when)) {
+				min = j;
+			}
+		}
+		if (min == -1) {
+			break;
+		}
+		aeHeapSet(eventLoop, i, heap[min]);
+		i = min;
+	}
+	aeHeapSet(eventLoop, i, te);
+}
 
-	// 进位：
-	// 如果 when_ms 大于等于 1000
-	// 那么将 when_sec 增大一秒
-	if (when_ms >= 1000) {
-		when_sec++;
-		when_ms -= 1000;
+static int aeHeapPush(aeEventLoop *eventLoop, aeTimeEvent *te)
+{
+	if (eventLoop->timeEventNum == eventLoop->timeEventCap) {
+		int cap = eventLoop->timeEventCap ? eventLoop->timeEventCap * 2 :
+						    16;
+		aeTimeEvent **heap = zrealloc(eventLoop->timeEvents,
+					      sizeof(*heap) * cap);
+
+		if (heap == NULL) {
+			return AE_ERR;
+		}
+		eventLoop->timeEvents = heap;
+		eventLoop->timeEventCap = cap;
 	}
+	aeHeapSet(eventLoop, eventLoop->timeEventNum++, te);
+	aeHeapUp(eventLoop, te->index);
+	return AE_OK;
+}
+
+// 把下标 i 的事件移出堆，用最后一个元素填补空位
+static void aeHeapRemove(aeEventLoop *eventLoop, int i)
+{
+	aeTimeEvent *last = eventLoop->timeEvents[--eventLoop->timeEventNum];
 
-	// 保存到指针中
-	*sec = when_sec;
-	*ms = when_ms;
+	eventLoop->timeEvents[i]->index = -1;
+	if (i == eventLoop->timeEventNum) {
+		return;
+	}
+	aeHeapSet(eventLoop, i, last);
+	if (i > 0 &&
+	    eventLoop->timeEvents[(i - 1) / AE_HEAP_D]->when > last->when) {
+		aeHeapUp(eventLoop, i);
+	} else {
+		aeHeapDown(eventLoop, i);
+	}
+}
+
+/*
+ * id 到时间事件的哈希表，线性探测，装载因子不超过 1/2，
+ * 删除时把后面的元素往前挪，不留墓碑。
+ */
+static inline int aeTableSlot(aeEventLoop *eventLoop, long long id)
+{
+	return (int)(((unsigned long long)id * 0x9E3779B97F4A7C15ULL) >> 32) &
+	       (eventLoop->timeEventTableSize - 1);
+}
+
+static aeTimeEvent *aeTableFind(aeEventLoop *eventLoop, long long id)
+{
+	int mask = eventLoop->timeEventTableSize - 1, i;
+	aeTimeEvent *te;
+
+	if (eventLoop->timeEventTableSize == 0) {
+		return NULL;
+	}
+	for (i = aeTableSlot(eventLoop, id);
+	     (te = eventLoop->timeEventTable[i]) != NULL; i = (i + 1) & mask) {
+		if (te->id == id) {
+			return te;
+		}
+	}
+	return NULL;
+}
+
+static void aeTablePut(aeEventLoop *eventLoop, aeTimeEvent *te)
+{
+	int mask = eventLoop->timeEventTableSize - 1;
+	int i = aeTableSlot(eventLoop, te->id);
+
+	while (eventLoop->timeEventTable[i] != NULL) {
+		i = (i + 1) & mask;
+	}
+	eventLoop->timeEventTable[i] = te;
+}
+
+static int aeTableAdd(aeEventLoop *eventLoop, aeTimeEvent *te)
+{
+	// 加入之后超过一半就扩容
+	if ((eventLoop->timeEventNum + 1) * 2 > eventLoop->timeEventTableSize) {
+		aeTimeEvent **old = eventLoop->timeEventTable;
+		int oldsize = eventLoop->timeEventTableSize, i;
+		int size = oldsize ? oldsize * 2 : 32;
+
+		eventLoop->timeEventTable = zcalloc(sizeof(*old) * size);
+		if (eventLoop->timeEventTable == NULL) {
+			eventLoop->timeEventTable = old;
+			return AE_ERR;
+		}
+		eventLoop->timeEventTableSize = size;
+		for (i = 0; i < oldsize; i++) {
+			if (old[i] != NULL) {
+				aeTablePut(eventLoop, old[i]);
+			}
+		}
+		zfree(old);
+	}
+	aeTablePut(eventLoop, te);
+	return AE_OK;
+}
+
+static void aeTableDel(aeEventLoop *eventLoop, aeTimeEvent *te)
+{
+	aeTimeEvent **table = eventLoop->timeEventTable;
+	int mask = eventLoop->timeEventTableSize - 1;
+	int i = aeTableSlot(eventLoop, te->id), j, k;
+
+	while (table[i] != te) {
+		i = (i + 1) & mask;
+	}
+	table[i] = NULL;
+
+	// 后面同一探测链上的元素，如果它的理想位置不在 (i, j] 内，就挪到空位 i
+	for (j = (i + 1) & mask; table[j] != NULL; j = (j + 1) & mask) {
+		k = aeTableSlot(eventLoop, table[j]->id);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+			continue;
+		}
+		table[i] = table[j];
+		table[j] = NULL;
+		i = j;
+	}
 }
 
 /*
@@ -332,82 +808,69 @@ long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
 	te->id = id;
 
 	// 设定处理事件的时间
-	aeAddMillisecondsToNow(milliseconds, &te->when_sec, &te->when_ms);
+	te->when = aeGetMonotonicMs() + milliseconds;
 	// 设置事件处理器
 	te->timeProc = proc;
 	te->finalizerProc = finalizerProc;
 	// 设置私有数据
 	te->clientData = clientData;
+	te->next = NULL;
 
-	// 将新事件放入表头
-	te->next = eventLoop->timeEventHead;
-	eventLoop->timeEventHead = te;
+	// 登记 id 并放入堆中
+	if (aeTableAdd(eventLoop, te) == AE_ERR) {
+		zfree(te);
+		return AE_ERR;
+	}
+	if (aeHeapPush(eventLoop, te) == AE_ERR) {
+		aeTableDel(eventLoop, te);
+		zfree(te);
+		return AE_ERR;
+	}
 
 	return id;
 }
 
 /*
  * 删除给定 id 的时间事件
+ *
+ * 正在执行或被 processTimeEvents 暂时移出堆的事件只做标记，
+ * 由 processTimeEvents 负责释放。
  */
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-	aeTimeEvent *te, *prev = NULL;
+	aeTimeEvent *te = aeTableFind(eventLoop, id);
 
-	// 遍历链表
-	te = eventLoop->timeEventHead;
-	while (te) {
-		// 发现目标事件，删除
-		if (te->id == id) {
-			if (prev == NULL) {
-				eventLoop->timeEventHead = te->next;
-			} else {
-				prev->next = te->next;
-			}
-
-			// 执行清理处理器
-			if (te->finalizerProc) {
-				te->finalizerProc(eventLoop, te->clientData);
-			}
+	if (te == NULL) {
+		return AE_ERR; /* NO event with the specified ID found */
+	}
+	aeTableDel(eventLoop, te);
 
-			// 释放时间事件
-			zfree(te);
+	// 执行清理处理器
+	if (te->finalizerProc) {
+		te->finalizerProc(eventLoop, te->clientData);
+	}
 
-			return AE_OK;
-		}
-		prev = te;
-		te = te->next;
+	if (te->index == -1) {
+		te->id = AE_DELETED_EVENT_ID;
+		return AE_OK;
 	}
+	aeHeapRemove(eventLoop, te->index);
 
-	return AE_ERR; /* NO event with the specified ID found */
+	// 释放时间事件
+	zfree(te);
+
+	return AE_OK;
 }
 
 /* Search the first timer to fire.
  * This operation is useful to know how many time the select can be
  * put in sleep without to delay any event.
  * If there are no timers NULL is returned.
- *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
  */
-// 寻找里目前时间最近的时间事件
-// 因为链表是乱序的，所以查找复杂度为 O（N）
+// 寻找里目前时间最近的时间事件，就是堆顶，复杂度为 O(1)
 static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
 {
-	aeTimeEvent *te = eventLoop->timeEventHead;
-	aeTimeEvent *nearest = NULL;
-
-	while (te) {
-		if (!nearest || te->when_sec < nearest->when_sec ||
-		    (te->when_sec == nearest->when_sec &&
-		     te->when_ms < nearest->when_ms)) {
-			nearest = te;
-		}
-		te = te->next;
-	}
-	return nearest;
+	return eventLoop->timeEventNum ? eventLoop->timeEvents[0] : NULL;
 }
 
 /* Process time events
@@ -417,94 +880,63 @@ static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
 static int processTimeEvents(aeEventLoop *eventLoop)
 {
 	int processed = 0;
-	aeTimeEvent *te;
-	long long maxId;
-	time_t now = time(NULL);
-
-	/* If the system clock is moved to the future, and then set back to the
-     * right value, time events may be delayed in a random way. Often this
-     * means that scheduled operations will not be performed soon enough.
-     *
-     * Here we try to detect system clock skews, and force all the time
-     * events to be processed ASAP when this happens: the idea is that
-     * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
-	// 通过重置事件的运行时间，
-	// 防止因时间穿插（skew）而造成的事件处理混乱
-	if (now < eventLoop->lastTime) {
-		te = eventLoop->timeEventHead;
-		while (te) {
-			te->when_sec = 0;
-			te = te->next;
-		}
-	}
-	// 更新最后一次处理时间事件的时间
-	eventLoop->lastTime = now;
-
-	// 遍历链表
-	// 执行那些已经到达的事件
-	te = eventLoop->timeEventHead;
+	aeTimeEvent *te, *deferred = NULL;
+	long long maxId, now;
+
+	/* 每次取出堆顶执行，直到堆顶还没到达。
+	 *
+	 * 处理器里新建的事件（id 大于 maxId）和周期性事件重新计算到达时间后，
+	 * 都先挂在 deferred 链表上，本轮结束再放回堆中，
+	 * 这样每个事件一轮最多执行一次，不会因为返回 0 而在这里死循环。 */
 	maxId = eventLoop->timeEventNextId - 1;
-	while (te) {
-		long now_sec, now_ms;
-		long long id;
-
-		// 跳过无效事件
-		if (te->id > maxId) {
-			te = te->next;
+	now = aeGetMonotonicMs();
+	while ((te = aeSearchNearestTimer(eventLoop)) != NULL &&
+	       te->when <= now) {
+		long long id = te->id;
+		int retval;
+
+		aeHeapRemove(eventLoop, 0);
+		if (id > maxId) {
+			te->next = deferred;
+			deferred = te;
 			continue;
 		}
 
-		// 获取当前时间
-		aeGetTime(&now_sec, &now_ms);
-
-		// 如果当前时间等于或等于事件的执行时间，那么说明事件已到达，执行这个事件
-		if (now_sec > te->when_sec ||
-		    (now_sec == te->when_sec && now_ms >= te->when_ms)) {
-			int retval;
+		// 执行事件处理器，并获取返回值
+		retval = te->timeProc(eventLoop, id, te->clientData);
+		processed++;
 
-			id = te->id;
-			// 执行事件处理器，并获取返回值
-			retval = te->timeProc(eventLoop, id, te->clientData);
-			processed++;
-			/* After an event is processed our time event list may
-             * no longer be the same, so we restart from head.
-             * Still we make sure to don't process events registered
-             * by event handlers itself in order to don't loop forever.
-             * To do so we saved the max ID we want to handle.
-             *
-             * FUTURE OPTIMIZATIONS:
-             * Note that this is NOT great algorithmically. Redis uses
-             * a single time event so it's not a problem but the right
-             * way to do this is to add the new elements on head, and
-             * to flag deleted elements in a special way for later
-             * deletion (putting references to the nodes to delete into
-             * another linked list). */
-			/*
+		/*
       如果事件处理器返回AE_NOMORE，那么这个事件为定时事件：该事件在达到一次之后就会被删除，之后不再到达。
       如果事件处理器返回一个非AE NOMORE的整数值，那么这个事件为周期性时间
       当一个时间事件到达之后，服务器会根据事件处理器返回的值，
       对时间事件的when属性进行更新，让这个事件在一段时间之后再次到达，并以这种方式一直更新并运行下去。
       比如说，如果一个时间事件的赴理器返回整数值30，那么服务器应该对这个时间事件进行更新，让这个事件在30毫秒之后再次到达。
-
-
-      * 决定时间事件是否要持续执行的 flag
       */
-			// 记录是否有需要循环执行这个事件时间
-			if (retval != AE_NOMORE) {
-				// 是的， retval 毫秒之后继续执行这个时间事件
-				aeAddMillisecondsToNow(retval, &te->when_sec,
-						       &te->when_ms);
-			} else {
-				// 不，将这个事件删除
-				aeDeleteTimeEvent(eventLoop, id);
-			}
-
-			// 因为执行事件之后，事件列表可能已经被改变了
-			// 因此需要将 te 放回表头，继续开始执行事件
-			te = eventLoop->timeEventHead;
+		if (te->id == AE_DELETED_EVENT_ID) {
+			// 处理器里已经删除了自己
+			zfree(te);
+		} else if (retval != AE_NOMORE) {
+			// 是的， retval 毫秒之后继续执行这个时间事件
+			te->when = aeGetMonotonicMs() + retval;
+			te->next = deferred;
+			deferred = te;
 		} else {
-			te = te->next;
+			// 不，将这个事件删除
+			aeDeleteTimeEvent(eventLoop, id);
+			zfree(te);
+		}
+	}
+
+	// 放回暂时移出的事件，期间被删除的直接释放
+	while ((te = deferred) != NULL) {
+		deferred = te->next;
+		te->next = NULL;
+		if (te->id == AE_DELETED_EVENT_ID) {
+			zfree(te);
+		} else if (aeHeapPush(eventLoop, te) == AE_ERR) {
+			aeDeleteTimeEvent(eventLoop, te->id);
+			zfree(te);
 		}
 	}
 	return processed;
@@ -567,33 +999,20 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 		if (shortest) {
 			// 如果时间事件存在的话
 			// 那么根据最近可执行时间事件和现在时间的时间差来决定文件事件的阻塞时间
-			long now_sec, now_ms;
+			long long ms = shortest->when - aeGetMonotonicMs();
 
 			/* Calculate the time missing for the nearest
              * timer to fire. */
 			// 计算距今最近的时间事件还要多久才能达到
 			// 并将该时间距保存在 tv 结构中
-			aeGetTime(&now_sec, &now_ms);
-			tvp = &tv;
-			tvp->tv_sec = shortest->when_sec - now_sec;
-			if (shortest->when_ms < now_ms) {
-				tvp->tv_usec =
-					((shortest->when_ms + 1000) - now_ms) *
-					1000;
-				tvp->tv_sec--;
-			} else {
-				tvp->tv_usec =
-					(shortest->when_ms - now_ms) * 1000;
-			}
-
 			// 时间差小于 0 ，说明事件已经可以执行了，将秒和毫秒设为 0
 			// （不阻塞）
-			if (tvp->tv_sec < 0) {
-				tvp->tv_sec = 0;
-			}
-			if (tvp->tv_usec < 0) {
-				tvp->tv_usec = 0;
+			if (ms < 0) {
+				ms = 0;
 			}
+			tvp = &tv;
+			tvp->tv_sec = ms / 1000;
+			tvp->tv_usec = (ms % 1000) * 1000;
 		} else {
 			// 执行到这一步，说明没有时间事件
 			// 那么根据 AE_DONT_WAIT 是否设置来决定是否阻塞，以及阻塞的时间长度
@@ -620,7 +1039,7 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
           */
 
 		// 处理文件事件，阻塞时间由 tvp 决定
-		numevents = aeApiPoll(eventLoop, tvp);
+		numevents = eventLoop->api->poll(eventLoop, tvp);
 		for (j = 0; j < numevents; j++) {
 			// 从已就绪数组中获取事件
 			aeFileEvent *fe =
@@ -704,9 +1123,8 @@ int aeWait(int fd, int mask, long long milliseconds)
  */ //serverCron在initServer->aeCreateTimeEvent中创建，然后在aeMain(server.el); 中执行  其他的时间事件(定时时间，超时事件)和读写事件都在该函数中执行
 void aeMain(aeEventLoop *eventLoop)
 {
-	eventLoop->stop = 0;
-
-	while (!eventLoop->stop) {
+	// 不在这里清除 stop，否则线程启动前其他线程调用的 aeStop 会丢失
+	while (!__atomic_load_n(&eventLoop->stop, __ATOMIC_ACQUIRE)) {
 		// 如果有需要在事件处理前执行的函数，那么运行它
 		if (eventLoop->beforesleep != NULL) {
 			eventLoop->beforesleep(eventLoop); // beforeSleep
@@ -715,6 +1133,9 @@ void aeMain(aeEventLoop *eventLoop)
 		// 开始处理事件
 		aeProcessEvents(eventLoop, AE_ALL_EVENTS);
 	}
+
+	// 清除停止标志，以便再次进入 aeMain
+	eventLoop->stop = 0;
 }
 
 /*
@@ -722,7 +1143,23 @@ void aeMain(aeEventLoop *eventLoop)
  */
 char *aeGetApiName(void)
 {
-	return aeApiName();
+	return (char *)(aeDefaultApi ? aeDefaultApi : &aeEpollApi)->name;
+}
+
+/*
+ * 选择之后新建的事件循环使用的后端："epoll" 或 "uring"
+ */
+int aeSetApi(const char *name)
+{
+	if (strcmp(name, aeEpollApi.name) == 0) {
+		aeDefaultApi = &aeEpollApi;
+	} else if (strcmp(name, aeUringApi.name) == 0) {
+		aeDefaultApi = &aeUringApi;
+	} else {
+		errno = EINVAL;
+		return AE_ERR;
+	}
+	return AE_OK;
 }
 
 /*
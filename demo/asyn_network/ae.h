@@ -33,7 +33,10 @@
 #ifndef __AE_H__
 #define __AE_H__
 
+#include <pthread.h>
 #include <stdlib.h>
+#include <sys/time.h>
+#include <sys/types.h>
 #include <time.h>
 
 /*
@@ -53,6 +56,8 @@
 #define AE_READABLE 1
 // 可写
 #define AE_WRITABLE 2
+// 由 aeCreateRecvEvent 注册，后端直接收数据（io_uring 后端使用）
+#define AE_RECV 4
 
 /*
  * 时间处理器的执行 flags
@@ -78,6 +83,9 @@
  */
 #define AE_NOMORE -1
 
+// 已被删除但还没释放的时间事件 id
+#define AE_DELETED_EVENT_ID -1
+
 /* Macros */
 #define AE_NOTUSED(V) ((void)V)
 
@@ -97,6 +105,11 @@ typedef int aeTimeProc(struct aeEventLoop *eventLoop, long long id,
 typedef void aeEventFinalizerProc(struct aeEventLoop *eventLoop,
 				  void *clientData);
 typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
+typedef void aeTaskProc(struct aeEventLoop *eventLoop, void *clientData);
+/* 收到数据时调用，buf 只在回调期间有效。
+ * nread 为 0 表示对端关闭，为 -1 表示出错，原因在 errno 中。 */
+typedef void aeRecvProc(struct aeEventLoop *eventLoop, int fd,
+			void *clientData, char *buf, ssize_t nread);
 
 /* File event structure
  *
@@ -117,6 +130,14 @@ typedef struct aeFileEvent {
 	// 多路复用库的私有数据
 	void *clientData;
 
+	// 数据处理器，见 aeCreateRecvEvent
+	aeRecvProc *recvProc;
+
+	// aeSend 追加、还没交给内核的数据
+	char *sendbuf;
+	size_t sendlen;
+	size_t sendcap;
+
 } aeFileEvent;
 
 /* Time event structure
@@ -124,12 +145,14 @@ typedef struct aeFileEvent {
  * 时间事件结构
  */
 typedef struct aeTimeEvent {
-	// 时间事件的唯一标识符
+	// 时间事件的唯一标识符，被回调自己删除时置为 AE_DELETED_EVENT_ID
 	long long id; /* time event identifier. */
 
-	// 事件的到达时间
-	long when_sec; /* seconds */
-	long when_ms; /* milliseconds */
+	// 事件的到达时间，单调时钟的毫秒数
+	long long when; /* monotonic milliseconds */
+
+	// 在最小堆中的下标，不在堆中（正在执行或等待放回）时为 -1
+	int index;
 
 	// 事件处理函数  processTimeEvents
 	// 根据执行该函数后是否返回AE_NOMORE来决定是否需要再次添加该定时器，也就是周期执行，见processTimeEvents
@@ -142,11 +165,25 @@ typedef struct aeTimeEvent {
 	// 多路复用库的私有数据
 	void *clientData;
 
-	// 指向下个时间事件结构，形成链表
+	// processTimeEvents 中暂时移出堆的事件链表
 	struct aeTimeEvent *next;
 
 } aeTimeEvent;
 
+/* Cross-thread task
+ *
+ * 其他线程通过 aePostTask 投递给事件循环的任务
+ */
+typedef struct aeTask {
+	// 在事件循环所在线程执行的函数
+	aeTaskProc *proc;
+
+	void *clientData;
+
+	struct aeTask *next;
+
+} aeTask;
+
 /* A fired event
  *
  * 已就绪事件
@@ -162,6 +199,45 @@ typedef struct aeFiredEvent {
 
 } aeFiredEvent;
 
+/* Multiplexing backend
+ *
+ * 多路复用后端，每个事件循环在创建时选定一个，见 aeSetApi
+ */
+typedef struct aeApi {
+	// 后端名字
+	const char *name;
+
+	// 创建后端状态，保存到 eventLoop->apidata
+	int (*create)(struct aeEventLoop *eventLoop);
+
+	// 调整事件槽大小
+	int (*resize)(struct aeEventLoop *eventLoop, int setsize);
+
+	// 释放后端状态
+	void (*free)(struct aeEventLoop *eventLoop);
+
+	// 关联给定事件到 fd，调用时 events[fd].mask 还是旧值
+	int (*addEvent)(struct aeEventLoop *eventLoop, int fd, int mask);
+
+	// 从 fd 中删除给定事件，调用时 events[fd].mask 已经是新值
+	void (*delEvent)(struct aeEventLoop *eventLoop, int fd, int delmask);
+
+	// 获取可执行事件，填入 eventLoop->fired，返回个数
+	int (*poll)(struct aeEventLoop *eventLoop, struct timeval *tvp);
+
+	/* 以下可以为 NULL，此时 ae.c 用可读/可写事件加 read/write 模拟 */
+
+	// 开始直接收数据，收到后调用 events[fd].recvProc
+	int (*addRecv)(struct aeEventLoop *eventLoop, int fd);
+
+	// 停止收数据，丢弃还在路上的发送
+	void (*delRecv)(struct aeEventLoop *eventLoop, int fd);
+
+	// 把 events[fd].sendbuf 中的数据交给内核发送
+	int (*send)(struct aeEventLoop *eventLoop, int fd);
+
+} aeApi;
+
 /* State of an event based program
  *
  * 事件处理器的状态
@@ -176,24 +252,44 @@ typedef struct aeEventLoop {
 	// 用于生成时间事件 id
 	long long timeEventNextId;
 
-	// 最后一次执行时间事件的时间
-	time_t lastTime; /* Used to detect system clock skew */
-
 	// 已注册的文件事件，每个fd都会对应一个该结构
 	aeFileEvent *events; /* Registered events */
 
 	// 已就绪的文件事件，参考aeApiPoll
 	aeFiredEvent *fired; /* Fired events */
 
-	// 时间事件，所有的定时器时间都添加到该链表中
-	aeTimeEvent *timeEventHead;
+	// 时间事件，按到达时间组织成 4 叉最小堆，堆顶就是最近的定时器
+	aeTimeEvent **timeEvents;
+	int timeEventNum;
+	int timeEventCap;
 
-	// 事件处理器的开关，生效见aeMain
+	// id 到时间事件的开放寻址哈希表，删除定时器时用来定位，大小为 2 的幂
+	aeTimeEvent **timeEventTable;
+	int timeEventTableSize;
+
+	// 事件处理器的开关，生效见aeMain，可以由其他线程通过aeStop设置
 	int stop;
 
+	// 跨线程唤醒用的 eventfd，aePostTask 和 aeStop 写入后 aeApiPoll 立即返回
+	int wakefd;
+
+	// 其他线程投递过来、还没执行的任务，先进先出
+	pthread_mutex_t tasklock;
+	aeTask *taskHead;
+	aeTask *taskTail;
+
+	// 多路复用后端
+	const aeApi *api;
+
 	// 多路复用库的私有数据，对应aeApiState
 	void *apidata; /* This is used for polling API specific data */
 
+	// 模拟 aeCreateRecvEvent 时的读缓冲区
+	char *recvbuf;
+
+	// 事件循环自己发起的系统调用次数，压测统计用
+	long long syscalls;
+
 	// 在处理事件前要执行的函数
 	aeBeforeSleepProc *beforesleep; // 赋值为beforeSleep，在函数aeMain中执行
 
@@ -203,6 +299,7 @@ typedef struct aeEventLoop {
 aeEventLoop *aeCreateEventLoop(int setsize);
 void aeDeleteEventLoop(aeEventLoop *eventLoop);
 void aeStop(aeEventLoop *eventLoop);
+int aePostTask(aeEventLoop *eventLoop, aeTaskProc *proc, void *clientData);
 int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
 		      aeFileProc *proc, void *clientData);
 void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask);
@@ -215,6 +312,11 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags);
 int aeWait(int fd, int mask, long long milliseconds);
 void aeMain(aeEventLoop *eventLoop);
 char *aeGetApiName(void);
+int aeSetApi(const char *name);
+int aeCreateRecvEvent(aeEventLoop *eventLoop, int fd, aeRecvProc *proc,
+		      void *clientData);
+void aeDeleteRecvEvent(aeEventLoop *eventLoop, int fd);
+int aeSend(aeEventLoop *eventLoop, int fd, const void *buf, size_t len);
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop,
 			  aeBeforeSleepProc *beforesleep);
 int aeGetSetSize(aeEventLoop *eventLoop);
@@ -30,7 +30,7 @@
 
 #include "ae_epoll.h"
 
-int aeApiCreate(aeEventLoop *eventLoop)
+static int aeApiCreate(aeEventLoop *eventLoop)
 {
 	aeApiState *state = zmalloc(sizeof(aeApiState));
 
@@ -60,7 +60,7 @@ int aeApiCreate(aeEventLoop *eventLoop)
 	return 0;
 }
 
-int aeApiResize(aeEventLoop *eventLoop, int setsize)
+static int aeApiResize(aeEventLoop *eventLoop, int setsize)
 {
 	aeApiState *state = eventLoop->apidata;
 
@@ -69,7 +69,7 @@ int aeApiResize(aeEventLoop *eventLoop, int setsize)
 	return 0;
 }
 
-void aeApiFree(aeEventLoop *eventLoop)
+static void aeApiFree(aeEventLoop *eventLoop)
 {
 	aeApiState *state = eventLoop->apidata;
 
@@ -78,7 +78,7 @@ void aeApiFree(aeEventLoop *eventLoop)
 	zfree(state);
 }
 
-int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask)
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask)
 {
 	aeApiState *state = eventLoop->apidata;
 	struct epoll_event ee;
@@ -105,6 +105,7 @@ int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask)
 	ee.data.u64 = 0; /* avoid valgrind warning */
 	ee.data.fd = fd;
 
+	eventLoop->syscalls++;
 	if (epoll_ctl(state->epfd, op, fd, &ee) == -1) {
 		return -1;
 	}
@@ -112,7 +113,7 @@ int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask)
 	return 0;
 }
 
-void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask)
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask)
 {
 	aeApiState *state = eventLoop->apidata;
 	struct epoll_event ee;
@@ -128,6 +129,7 @@ void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask)
 	}
 	ee.data.u64 = 0; /* avoid valgrind warning */
 	ee.data.fd = fd;
+	eventLoop->syscalls++;
 	if (mask != AE_NONE) {
 		epoll_ctl(state->epfd, EPOLL_CTL_MOD, fd, &ee);
 	} else {
@@ -137,12 +139,13 @@ void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask)
 	}
 }
 
-int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp)
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp)
 {
 	aeApiState *state = eventLoop->apidata;
 	int retval, numevents = 0;
 
 	// 等待时间
+	eventLoop->syscalls++;
 	retval = epoll_wait(state->epfd, state->events, eventLoop->setsize,
 			    tvp ? (tvp->tv_sec * 1000 + tvp->tv_usec / 1000) :
 				  -1);
@@ -181,7 +184,15 @@ int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp)
 	return numevents;
 }
 
-char *aeApiName(void)
-{
-	return "epoll";
-}
+const aeApi aeEpollApi = {
+	.name = "epoll",
+	.create = aeApiCreate,
+	.resize = aeApiResize,
+	.free = aeApiFree,
+	.addEvent = aeApiAddEvent,
+	.delEvent = aeApiDelEvent,
+	.poll = aeApiPoll,
+	.addRecv = NULL,
+	.delRecv = NULL,
+	.send = NULL,
+};
@@ -47,37 +47,6 @@ typedef struct aeApiState {
 } aeApiState;
 
 /*
- * 创建一个新的 epoll 实例，并将它赋值给 eventLoop
+ * epoll 后端，各函数的说明见 ae.h 中的 aeApi
  */
-int aeApiCreate(aeEventLoop *eventLoop);
-
-/*
- * 调整事件槽大小
- */
-int aeApiResize(aeEventLoop *eventLoop, int setsize);
-
-/*
- * 释放 epoll 实例和事件槽
- */
-void aeApiFree(aeEventLoop *eventLoop);
-
-/*
- * 关联给定事件到 fd
- */
-int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask);
-
-/*
- * 从 fd 中删除给定事件
- */
-void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask);
-
-/*
- * 获取可执行事件
- */ 
-// 文件事件 aeCreateFileEvent 时间事件 aeCreateTimeEvent aeProcessEvents 中执行文件和时间事件
-int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp);
-
-/*
- * 返回当前正在使用的 poll 库的名字
- */
-char *aeApiName(void);
+extern const aeApi aeEpollApi;
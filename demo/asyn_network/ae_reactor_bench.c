@@ -0,0 +1,230 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ae.h"
+#include "anet.h"
+#include "zmalloc.h"
+
+/*
+ * 回显服务器的压测客户端
+ *
+ * t 个线程各跑一个事件循环，共建立 c 个连接。每个连接一次发送 P 个 s 字节的请求，
+ * 收齐 P*s 字节的回显后再发下一批，运行 d 秒后统计每秒请求数。
+ *
+ * 和 main.c 配合测多 reactor 的扩展性：
+ *   ./demo_asyn_network -q -t 4 &
+ *   ./demo_ae_reactor_bench -t 4 -c 200 -s 64 -d 5
+ */
+
+#define BENCH_MAX_THREADS 64
+#define BENCH_MAX_BUF (64 * 1024)
+
+struct bench_conn {
+	int fd;
+	size_t want; // 这一批还没收到的回显字节数
+	struct bench_thread *t;
+};
+
+struct bench_thread {
+	pthread_t tid;
+	aeEventLoop *el;
+	struct bench_conn *conns;
+	int nconns;
+	long long requests;
+	long long errors;
+};
+
+static char *g_host = "127.0.0.1";
+static int g_port = 16379;
+static size_t g_size = 64;
+static int g_pipeline = 1;
+static int g_seconds = 5;
+static char g_payload[BENCH_MAX_BUF];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void closeConn(struct bench_conn *c)
+{
+	aeDeleteFileEvent(c->t->el, c->fd, AE_READABLE);
+	close(c->fd);
+	c->fd = -1;
+	c->t->errors++;
+}
+
+// 发送一批请求，请求不大，假定一次就能写进套接字缓冲区
+static int sendBatch(struct bench_conn *c)
+{
+	size_t len = g_size * g_pipeline;
+
+	if (write(c->fd, g_payload, len) != (ssize_t)len) {
+		return -1;
+	}
+	c->want = len;
+	return 0;
+}
+
+static void readReply(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+	struct bench_conn *c = privdata;
+	char buf[BENCH_MAX_BUF];
+	ssize_t n;
+
+	n = read(fd, buf, sizeof(buf));
+	if (n == -1 && errno == EAGAIN) {
+		return;
+	}
+	if (n <= 0 || (size_t)n > c->want) {
+		closeConn(c);
+		return;
+	}
+	c->want -= n;
+	if (c->want == 0) {
+		c->t->requests += g_pipeline;
+		if (sendBatch(c) == -1) {
+			closeConn(c);
+		}
+	}
+}
+
+static int stopLoop(struct aeEventLoop *eventLoop, long long id,
+		    void *clientData)
+{
+	aeStop(eventLoop);
+	return AE_NOMORE;
+}
+
+static void *benchThread(void *arg)
+{
+	struct bench_thread *t = arg;
+	int i;
+
+	for (i = 0; i < t->nconns; i++) {
+		if (t->conns[i].fd != -1 && sendBatch(&t->conns[i]) == -1) {
+			closeConn(&t->conns[i]);
+		}
+	}
+	aeCreateTimeEvent(t->el, g_seconds * 1000LL, stopLoop, NULL, NULL);
+	aeMain(t->el);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_thread threads[BENCH_MAX_THREADS];
+	char err[ANET_ERR_LEN];
+	int opt, nthreads = 1, nconns = 50, i, j, connected = 0;
+	long long requests = 0, errors = 0;
+	double t0, secs;
+
+	while ((opt = getopt(argc, argv, "H:p:t:c:s:P:d:h")) != -1) {
+		switch (opt) {
+		case 'H':
+			g_host = optarg;
+			break;
+		case 'p':
+			g_port = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'c':
+			nconns = atoi(optarg);
+			break;
+		case 's':
+			g_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'P':
+			g_pipeline = atoi(optarg);
+			break;
+		case 'd':
+			g_seconds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"usage: %s [-H host] [-p port] [-t threads] "
+				"[-c connections] [-s size] [-P pipeline] "
+				"[-d seconds]\n",
+				argv[0]);
+			return opt != 'h';
+		}
+	}
+	if (nthreads < 1 || nthreads > BENCH_MAX_THREADS ||
+	    nconns < nthreads || g_size < 1 || g_pipeline < 1 ||
+	    g_size * g_pipeline > BENCH_MAX_BUF || g_seconds < 1) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+	memset(g_payload, 'x', sizeof(g_payload));
+	zmalloc_enable_thread_safeness();
+
+	// 连接平均分给各个线程，在启动线程之前全部建好
+	for (i = 0; i < nthreads; i++) {
+		struct bench_thread *t = &threads[i];
+
+		t->nconns = nconns / nthreads + (i < nconns % nthreads);
+		t->conns = zmalloc(sizeof(*t->conns) * t->nconns);
+		t->el = aeCreateEventLoop(t->nconns * 2 + 128);
+		t->requests = 0;
+		t->errors = 0;
+		for (j = 0; j < t->nconns; j++) {
+			struct bench_conn *c = &t->conns[j];
+
+			c->t = t;
+			c->fd = anetTcpConnect(err, g_host, g_port);
+			if (c->fd == ANET_ERR) {
+				fprintf(stderr, "connect: %s\n", err);
+				return 1;
+			}
+			anetNonBlock(NULL, c->fd);
+			anetEnableTcpNoDelay(NULL, c->fd);
+			if (c->fd >= aeGetSetSize(t->el)) {
+				aeResizeSetSize(t->el, c->fd + 128);
+			}
+			if (aeCreateFileEvent(t->el, c->fd, AE_READABLE,
+					      readReply, c) == AE_ERR) {
+				fprintf(stderr, "aeCreateFileEvent: %s\n",
+					strerror(errno));
+				return 1;
+			}
+			connected++;
+		}
+	}
+
+	t0 = now();
+	for (i = 0; i < nthreads; i++) {
+		pthread_create(&threads[i].tid, NULL, benchThread, &threads[i]);
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		requests += threads[i].requests;
+		errors += threads[i].errors;
+	}
+	secs = now() - t0;
+
+	printf("threads %d, connections %d, size %zu, pipeline %d: "
+	       "%.0f requests/sec, %lld errors\n",
+	       nthreads, connected, g_size, g_pipeline, requests / secs,
+	       errors);
+
+	for (i = 0; i < nthreads; i++) {
+		for (j = 0; j < threads[i].nconns; j++) {
+			if (threads[i].conns[j].fd != -1) {
+				close(threads[i].conns[j].fd);
+			}
+		}
+		aeDeleteEventLoop(threads[i].el);
+		zfree(threads[i].conns);
+	}
+	return errors != 0;
+}
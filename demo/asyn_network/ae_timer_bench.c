@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ae.h"
+
+/*
+ * 时间事件的开销和定时器数量的关系
+ *
+ * 模拟每个连接一个空闲超时定时器：注册 n 个很久以后才到达的定时器，
+ * 再加一个管道读事件让 aeApiPoll 立即返回，测一次 aeProcessEvents 的耗时
+ * （找最近的定时器 + epoll_wait + 处理到达的定时器）。
+ * 另外测连接活跃时“删除旧定时器再建新定时器”的开销。
+ *
+ * 用法：ae_timer_bench [最大定时器数量]
+ */
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int idleTimer(struct aeEventLoop *eventLoop, long long id,
+		     void *clientData)
+{
+	return AE_NOMORE;
+}
+
+static void readable(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+}
+
+static void bench(int n)
+{
+	aeEventLoop *el = aeCreateEventLoop(1024);
+	long long *ids = malloc(sizeof(*ids) * (n ? n : 1));
+	int iters = 20000, churn = 200000, fds[2], i;
+	double t, loop_ns, churn_ns;
+
+	if (el == NULL || ids == NULL || pipe(fds) == -1) {
+		perror("setup");
+		exit(1);
+	}
+	// 管道里一直有数据，epoll_wait 每次都立即返回
+	if (write(fds[1], "x", 1) != 1 ||
+	    aeCreateFileEvent(el, fds[0], AE_READABLE, readable, NULL) ==
+		    AE_ERR) {
+		perror("pipe");
+		exit(1);
+	}
+
+	// 一小时以后才到达，错开到达时间
+	for (i = 0; i < n; i++) {
+		ids[i] = aeCreateTimeEvent(el, 3600000 + (rand() % 600000),
+					   idleTimer, NULL, NULL);
+	}
+
+	t = now();
+	for (i = 0; i < iters; i++) {
+		aeProcessEvents(el, AE_ALL_EVENTS);
+	}
+	loop_ns = (now() - t) * 1e9 / iters;
+
+	// 连接收到请求，重置它的超时定时器
+	t = now();
+	for (i = 0; i < churn && n > 0; i++) {
+		int k = rand() % n;
+
+		aeDeleteTimeEvent(el, ids[k]);
+		ids[k] = aeCreateTimeEvent(el, 3600000 + (rand() % 600000),
+					   idleTimer, NULL, NULL);
+	}
+	churn_ns = n > 0 ? (now() - t) * 1e9 / churn : 0;
+
+	printf("%8d %14.0f %14.0f\n", n, loop_ns, churn_ns);
+
+	aeDeleteFileEvent(el, fds[0], AE_READABLE);
+	close(fds[0]);
+	close(fds[1]);
+	aeDeleteEventLoop(el);
+	free(ids);
+}
+
+int main(int argc, char *argv[])
+{
+	int max = argc > 1 ? atoi(argv[1]) : 100000;
+	int n;
+
+	srand(1);
+	printf("%8s %14s %14s\n", "timers", "ns/iteration", "ns/reset");
+	bench(0);
+	for (n = 10; n <= max; n *= 10) {
+		bench(n);
+	}
+	return 0;
+}
@@ -0,0 +1,709 @@
+/* Linux io_uring based ae.c module
+ *
+ * 直接使用 io_uring 系统调用，不依赖 liburing。
+ */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "ae_uring.h"
+#include "zmalloc.h"
+
+// 提交队列长度，完成队列是它的两倍
+#define AE_URING_ENTRIES 4096
+// 接收缓冲区个数（2 的幂）和大小
+#define AE_URING_BUFS 512
+#define AE_URING_BUF_SIZE 4096
+#define AE_URING_BGID 0
+
+/*
+ * user_data 的低 3 位是请求类型。
+ * poll/recv 的高 32 位是 fd，中间是代数，fd 重新注册后旧请求的完成事件据此丢弃；
+ * send 的 user_data 是 aeUringSend 指针。
+ */
+#define AE_URING_POLL 1
+#define AE_URING_RECV 2
+#define AE_URING_CANCEL 3
+#define AE_URING_SEND 4
+#define AE_URING_TYPE_MASK 7
+#define AE_URING_GEN_MASK 0x1fffffff
+
+#define AE_URING_UD(fd, gen, type)                                  \
+	(((uint64_t)(uint32_t)(fd) << 32) |                         \
+	 ((uint64_t)((gen) & AE_URING_GEN_MASK) << 3) | (type))
+#define AE_URING_UD_FD(ud) ((int)((ud) >> 32))
+#define AE_URING_UD_GEN(ud) ((uint32_t)((ud) >> 3) & AE_URING_GEN_MASK)
+
+/*
+ * 一次发送，每个 fd 同时最多一个，发送期间 aeSend 追加的数据留在 sendbuf 里，
+ * 完成后再合并成一次发送
+ */
+typedef struct aeUringSend {
+	int fd;
+	uint32_t gen;
+	char *buf;
+	size_t len;
+	size_t off;
+} aeUringSend;
+
+/*
+ * 每个 fd 上还在内核里的请求
+ */
+typedef struct aeUringFd {
+	// 一次性 poll 的代数和掩码，掩码为 0 表示没有提交
+	uint32_t pollgen;
+	int pollmask;
+
+	// multishot recv 的代数，以及是否在进行
+	uint32_t recvgen;
+	int recv;
+
+	// 正在发送的数据，aeDeleteRecvEvent 后代数加一，旧的完成事件只释放内存
+	uint32_t sendgen;
+	aeUringSend *sending;
+} aeUringFd;
+
+/*
+ * 事件状态
+ */
+typedef struct aeUringState {
+	int ringfd;
+
+	// 提交队列，sq_local 是还没发布给内核的尾部
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_flags;
+	unsigned sq_entries;
+	unsigned sq_local;
+	struct io_uring_sqe *sqes;
+
+	// 完成队列
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	// 提供给内核挑选的接收缓冲区环
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	unsigned short br_tail;
+	char *bufs;
+
+	aeUringFd *fds;
+
+} aeUringState;
+
+static void aeApiFree(aeEventLoop *eventLoop);
+
+static int aeUringSetup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int aeUringRegister(int fd, unsigned op, void *arg, unsigned nr)
+{
+	return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+/*
+ * 发布本地攒下的 SQE，并等待至少 wait_nr 个完成事件，ts 为 NULL 时不限时
+ */
+static int aeUringEnter(aeEventLoop *eventLoop, unsigned wait_nr,
+			struct __kernel_timespec *ts)
+{
+	aeUringState *state = eventLoop->apidata;
+	struct io_uring_getevents_arg arg;
+	unsigned submit;
+
+	__atomic_store_n(state->sq_tail, state->sq_local, __ATOMIC_RELEASE);
+	submit = state->sq_local -
+		 __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE);
+
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	arg.ts = (uint64_t)(uintptr_t)ts;
+
+	eventLoop->syscalls++;
+	return (int)syscall(__NR_io_uring_enter, state->ringfd, submit, wait_nr,
+			    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			    &arg, sizeof(arg));
+}
+
+static struct io_uring_sqe *aeUringGetSqe(aeEventLoop *eventLoop)
+{
+	aeUringState *state = eventLoop->apidata;
+	struct io_uring_sqe *sqe;
+
+	// 队列满了先提交一次，不等待
+	if (state->sq_local - __atomic_load_n(state->sq_head,
+					       __ATOMIC_ACQUIRE) >=
+	    state->sq_entries) {
+		struct __kernel_timespec ts = { 0, 0 };
+
+		aeUringEnter(eventLoop, 0, &ts);
+		if (state->sq_local - __atomic_load_n(state->sq_head,
+						       __ATOMIC_ACQUIRE) >=
+		    state->sq_entries) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+	sqe = &state->sqes[state->sq_local & *state->sq_mask];
+	state->sq_local++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+// 把缓冲区还给内核
+static void aeUringRecycle(aeUringState *state, unsigned short bid)
+{
+	struct io_uring_buf *buf =
+		&state->br->bufs[state->br_tail & (AE_URING_BUFS - 1)];
+
+	buf->addr = (uint64_t)(uintptr_t)(state->bufs +
+					  (size_t)bid * AE_URING_BUF_SIZE);
+	buf->len = AE_URING_BUF_SIZE;
+	buf->bid = bid;
+	state->br_tail++;
+	__atomic_store_n(&state->br->tail, state->br_tail, __ATOMIC_RELEASE);
+}
+
+static int aeApiCreate(aeEventLoop *eventLoop)
+{
+	aeUringState *state = zmalloc(sizeof(aeUringState));
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	int i;
+
+	if (!state) {
+		return -1;
+	}
+	memset(state, 0, sizeof(*state));
+	state->ringfd = -1;
+	eventLoop->apidata = state;
+
+	// COOP_TASKRUN 在 5.19 之后才有，不支持就去掉
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN |
+		  IORING_SETUP_TASKRUN_FLAG;
+	p.cq_entries = AE_URING_ENTRIES * 2;
+	state->ringfd = aeUringSetup(AE_URING_ENTRIES, &p);
+	if (state->ringfd == -1 && errno == EINVAL) {
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = AE_URING_ENTRIES * 2;
+		state->ringfd = aeUringSetup(AE_URING_ENTRIES, &p);
+	}
+	if (state->ringfd == -1) {
+		goto err;
+	}
+	// 等待超时需要 EXT_ARG（5.11），完成队列满时不丢事件需要 NODROP
+	if (!(p.features & IORING_FEAT_EXT_ARG) ||
+	    !(p.features & IORING_FEAT_NODROP)) {
+		errno = ENOSYS;
+		goto err;
+	}
+
+	// 映射提交队列、完成队列和 SQE 数组
+	state->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	state->cq_ring_size =
+		p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (state->cq_ring_size > state->sq_ring_size) {
+			state->sq_ring_size = state->cq_ring_size;
+		}
+		state->cq_ring_size = state->sq_ring_size;
+	}
+	state->sq_ring = mmap(NULL, state->sq_ring_size,
+			      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			      state->ringfd, IORING_OFF_SQ_RING);
+	if (state->sq_ring == MAP_FAILED) {
+		state->sq_ring = NULL;
+		goto err;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		state->cq_ring = state->sq_ring;
+	} else {
+		state->cq_ring = mmap(NULL, state->cq_ring_size,
+				      PROT_READ | PROT_WRITE,
+				      MAP_SHARED | MAP_POPULATE, state->ringfd,
+				      IORING_OFF_CQ_RING);
+		if (state->cq_ring == MAP_FAILED) {
+			state->cq_ring = NULL;
+			goto err;
+		}
+	}
+	state->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	state->sqes = mmap(NULL, state->sqes_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, state->ringfd,
+			   IORING_OFF_SQES);
+	if (state->sqes == MAP_FAILED) {
+		state->sqes = NULL;
+		goto err;
+	}
+
+	state->sq_head = (unsigned *)((char *)state->sq_ring + p.sq_off.head);
+	state->sq_tail = (unsigned *)((char *)state->sq_ring + p.sq_off.tail);
+	state->sq_mask =
+		(unsigned *)((char *)state->sq_ring + p.sq_off.ring_mask);
+	state->sq_flags = (unsigned *)((char *)state->sq_ring + p.sq_off.flags);
+	state->sq_entries = p.sq_entries;
+	state->sq_local = *state->sq_tail;
+	state->cq_head = (unsigned *)((char *)state->cq_ring + p.cq_off.head);
+	state->cq_tail = (unsigned *)((char *)state->cq_ring + p.cq_off.tail);
+	state->cq_mask =
+		(unsigned *)((char *)state->cq_ring + p.cq_off.ring_mask);
+	state->cqes = (struct io_uring_cqe *)((char *)state->cq_ring +
+					      p.cq_off.cqes);
+
+	// SQ 下标数组固定为恒等映射
+	for (i = 0; i < (int)p.sq_entries; i++) {
+		((unsigned *)((char *)state->sq_ring + p.sq_off.array))[i] = i;
+	}
+
+	// 注册接收缓冲区环（5.19）
+	state->br_size = AE_URING_BUFS * sizeof(struct io_uring_buf);
+	state->br = mmap(NULL, state->br_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (state->br == MAP_FAILED) {
+		state->br = NULL;
+		goto err;
+	}
+	state->bufs = zmalloc((size_t)AE_URING_BUFS * AE_URING_BUF_SIZE);
+	if (state->bufs == NULL) {
+		goto err;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)state->br;
+	reg.ring_entries = AE_URING_BUFS;
+	reg.bgid = AE_URING_BGID;
+	if (aeUringRegister(state->ringfd, IORING_REGISTER_PBUF_RING, &reg,
+			    1) == -1) {
+		goto err;
+	}
+	for (i = 0; i < AE_URING_BUFS; i++) {
+		aeUringRecycle(state, i);
+	}
+
+	state->fds = zcalloc(sizeof(aeUringFd) * eventLoop->setsize);
+	if (state->fds == NULL) {
+		goto err;
+	}
+	return 0;
+
+err:
+	aeApiFree(eventLoop);
+	return -1;
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize)
+{
+	aeUringState *state = eventLoop->apidata;
+	aeUringFd *fds = zrealloc(state->fds, sizeof(aeUringFd) * setsize);
+
+	if (fds == NULL) {
+		return -1;
+	}
+	if (setsize > eventLoop->setsize) {
+		memset(fds + eventLoop->setsize, 0,
+		       sizeof(aeUringFd) * (setsize - eventLoop->setsize));
+	}
+	state->fds = fds;
+	return 0;
+}
+
+/*
+ * 关闭 ring 会取消所有请求。aeDeleteRecvEvent 之后还没完成的发送
+ * 已经不在 fds 里，这里不再回收。
+ */
+static void aeApiFree(aeEventLoop *eventLoop)
+{
+	aeUringState *state = eventLoop->apidata;
+	int i;
+
+	if (state == NULL) {
+		return;
+	}
+	if (state->ringfd != -1) {
+		close(state->ringfd);
+	}
+	if (state->sqes) {
+		munmap(state->sqes, state->sqes_size);
+	}
+	if (state->cq_ring && state->cq_ring != state->sq_ring) {
+		munmap(state->cq_ring, state->cq_ring_size);
+	}
+	if (state->sq_ring) {
+		munmap(state->sq_ring, state->sq_ring_size);
+	}
+	if (state->br) {
+		munmap(state->br, state->br_size);
+	}
+	zfree(state->bufs);
+	if (state->fds) {
+		for (i = 0; i < eventLoop->setsize; i++) {
+			if (state->fds[i].sending) {
+				zfree(state->fds[i].sending->buf);
+				zfree(state->fds[i].sending);
+			}
+		}
+		zfree(state->fds);
+	}
+	zfree(state);
+	eventLoop->apidata = NULL;
+}
+
+static int aeUringQueuePoll(aeEventLoop *eventLoop, int fd)
+{
+	aeUringState *state = eventLoop->apidata;
+	aeUringFd *f = &state->fds[fd];
+	struct io_uring_sqe *sqe = aeUringGetSqe(eventLoop);
+
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = ((f->pollmask & AE_READABLE) ? POLLIN : 0) |
+			     ((f->pollmask & AE_WRITABLE) ? POLLOUT : 0);
+	sqe->user_data = AE_URING_UD(fd, f->pollgen, AE_URING_POLL);
+	return 0;
+}
+
+static int aeUringQueueCancel(aeEventLoop *eventLoop, uint8_t opcode,
+			      uint64_t target)
+{
+	struct io_uring_sqe *sqe = aeUringGetSqe(eventLoop);
+
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->opcode = opcode;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = AE_URING_CANCEL;
+	return 0;
+}
+
+/*
+ * 把 fd 上的 poll 换成新掩码：取消旧的，提交新的
+ */
+static int aeUringSetPoll(aeEventLoop *eventLoop, int fd, int mask)
+{
+	aeUringState *state = eventLoop->apidata;
+	aeUringFd *f = &state->fds[fd];
+
+	mask &= AE_READABLE | AE_WRITABLE;
+	if (f->pollmask == mask) {
+		return 0;
+	}
+	if (f->pollmask) {
+		aeUringQueueCancel(eventLoop, IORING_OP_POLL_REMOVE,
+				   AE_URING_UD(fd, f->pollgen, AE_URING_POLL));
+		f->pollgen++;
+		f->pollmask = 0;
+	}
+	if (mask) {
+		f->pollmask = mask;
+		if (aeUringQueuePoll(eventLoop, fd) == -1) {
+			f->pollmask = 0;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask)
+{
+	return aeUringSetPoll(eventLoop, fd,
+			      eventLoop->events[fd].mask | mask);
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask)
+{
+	aeUringSetPoll(eventLoop, fd, eventLoop->events[fd].mask & ~delmask);
+}
+
+static int aeUringQueueRecv(aeEventLoop *eventLoop, int fd)
+{
+	aeUringState *state = eventLoop->apidata;
+	struct io_uring_sqe *sqe = aeUringGetSqe(eventLoop);
+
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = AE_URING_BGID;
+	sqe->user_data =
+		AE_URING_UD(fd, state->fds[fd].recvgen, AE_URING_RECV);
+	return 0;
+}
+
+static int aeApiAddRecv(aeEventLoop *eventLoop, int fd)
+{
+	aeUringState *state = eventLoop->apidata;
+	aeUringFd *f = &state->fds[fd];
+
+	if (f->recv) {
+		return 0;
+	}
+	if (aeUringQueueRecv(eventLoop, fd) == -1) {
+		return -1;
+	}
+	f->recv = 1;
+	return 0;
+}
+
+static void aeApiDelRecv(aeEventLoop *eventLoop, int fd)
+{
+	aeUringState *state = eventLoop->apidata;
+	aeUringFd *f = &state->fds[fd];
+
+	if (f->recv) {
+		aeUringQueueCancel(eventLoop, IORING_OP_ASYNC_CANCEL,
+				   AE_URING_UD(fd, f->recvgen, AE_URING_RECV));
+		f->recv = 0;
+	}
+	f->recvgen++;
+	f->sendgen++;
+	f->sending = NULL;
+}
+
+static int aeUringQueueSend(aeEventLoop *eventLoop, aeUringSend *s)
+{
+	struct io_uring_sqe *sqe = aeUringGetSqe(eventLoop);
+
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = s->fd;
+	sqe->addr = (uint64_t)(uintptr_t)(s->buf + s->off);
+	sqe->len = s->len - s->off;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (uint64_t)(uintptr_t)s | AE_URING_SEND;
+	return 0;
+}
+
+static int aeApiSend(aeEventLoop *eventLoop, int fd)
+{
+	aeUringState *state = eventLoop->apidata;
+	aeUringFd *f = &state->fds[fd];
+	aeFileEvent *fe = &eventLoop->events[fd];
+	aeUringSend *s;
+
+	if (f->sending || fe->sendlen == 0) {
+		return 0;
+	}
+	if ((s = zmalloc(sizeof(*s))) == NULL) {
+		return -1;
+	}
+	s->fd = fd;
+	s->gen = f->sendgen;
+	s->buf = fe->sendbuf;
+	s->len = fe->sendlen;
+	s->off = 0;
+	if (aeUringQueueSend(eventLoop, s) == -1) {
+		zfree(s);
+		return -1;
+	}
+	fe->sendbuf = NULL;
+	fe->sendlen = fe->sendcap = 0;
+	f->sending = s;
+	return 0;
+}
+
+static void aeUringSendDone(aeEventLoop *eventLoop, aeUringSend *s, int res)
+{
+	aeUringState *state = eventLoop->apidata;
+	int fd = s->fd;
+	aeUringFd *f = &state->fds[fd];
+
+	if (s->gen != f->sendgen || f->sending != s) {
+		// 连接已经不用了
+		zfree(s->buf);
+		zfree(s);
+		return;
+	}
+	if (res > 0 && s->off + res < s->len) {
+		// 没发完，接着发剩下的
+		s->off += res;
+		if (aeUringQueueSend(eventLoop, s) == 0) {
+			return;
+		}
+	}
+	f->sending = NULL;
+	zfree(s->buf);
+	zfree(s);
+	if (res < 0) {
+		// 出错的连接由 recv 发现并关闭，这里丢掉还没发的数据
+		eventLoop->events[fd].sendlen = 0;
+		return;
+	}
+	aeApiSend(eventLoop, fd);
+}
+
+static void aeUringRecvDone(aeEventLoop *eventLoop, uint64_t ud, int res,
+			    unsigned flags)
+{
+	aeUringState *state = eventLoop->apidata;
+	int fd = AE_URING_UD_FD(ud);
+	aeUringFd *f = &state->fds[fd];
+	aeFileEvent *fe = &eventLoop->events[fd];
+	int hasbuf = flags & IORING_CQE_F_BUFFER;
+	unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+	if (!f->recv || AE_URING_UD_GEN(ud) != (f->recvgen & AE_URING_GEN_MASK)) {
+		if (hasbuf) {
+			aeUringRecycle(state, bid);
+		}
+		return;
+	}
+	if (!(flags & IORING_CQE_F_MORE)) {
+		f->recv = 0;
+	}
+
+	if (res > 0) {
+		fe->recvProc(eventLoop, fd, fe->clientData,
+			     state->bufs + (size_t)bid * AE_URING_BUF_SIZE, res);
+		aeUringRecycle(state, bid);
+	} else if (res == 0) {
+		f->recv = 0;
+		fe->recvProc(eventLoop, fd, fe->clientData, NULL, 0);
+		return;
+	} else if (res != -ENOBUFS) {
+		f->recv = 0;
+		errno = -res;
+		fe->recvProc(eventLoop, fd, fe->clientData, NULL, -1);
+		return;
+	}
+
+	// multishot 结束了（比如缓冲区暂时用完）但连接还在用，重新提交
+	if (!f->recv && (fe->mask & AE_RECV) &&
+	    AE_URING_UD_GEN(ud) == (f->recvgen & AE_URING_GEN_MASK) &&
+	    aeUringQueueRecv(eventLoop, fd) == 0) {
+		f->recv = 1;
+	}
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp)
+{
+	aeUringState *state = eventLoop->apidata;
+	struct __kernel_timespec ts, *tsp = NULL;
+	unsigned head, wait_nr = 1;
+	int numevents = 0;
+
+	if (tvp) {
+		ts.tv_sec = tvp->tv_sec;
+		ts.tv_nsec = tvp->tv_usec * 1000;
+		tsp = &ts;
+		if (tvp->tv_sec == 0 && tvp->tv_usec == 0) {
+			wait_nr = 0;
+		}
+	}
+
+	// 已经有完成事件就不等待；没有要提交的也没有内核待办时省掉这次系统调用
+	head = *state->cq_head;
+	if (head != __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE)) {
+		wait_nr = 0;
+	}
+	if (wait_nr > 0 || state->sq_local != *state->sq_tail ||
+	    (__atomic_load_n(state->sq_flags, __ATOMIC_RELAXED) &
+	     (IORING_SQ_TASKRUN | IORING_SQ_CQ_OVERFLOW))) {
+		aeUringEnter(eventLoop, wait_nr, tsp);
+	}
+
+	while (numevents < eventLoop->setsize &&
+	       head != __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &state->cqes[head & *state->cq_mask];
+		uint64_t ud = cqe->user_data;
+		int res = cqe->res;
+		unsigned flags = cqe->flags;
+		int fd = AE_URING_UD_FD(ud);
+
+		// 先归还 CQE，处理器里可能会提交新的请求
+		__atomic_store_n(state->cq_head, ++head, __ATOMIC_RELEASE);
+
+		switch (ud & AE_URING_TYPE_MASK) {
+		case AE_URING_POLL: {
+			aeUringFd *f = &state->fds[fd];
+			int mask = 0;
+
+			if (fd >= eventLoop->setsize || !f->pollmask ||
+			    AE_URING_UD_GEN(ud) !=
+				    (f->pollgen & AE_URING_GEN_MASK) ||
+			    res == -ECANCELED) {
+				break;
+			}
+			if (res < 0) {
+				// fd 出错，不再提交，让处理器去发现错误
+				f->pollmask = 0;
+				mask = AE_READABLE | AE_WRITABLE;
+			} else {
+				if (res & POLLIN) {
+					mask |= AE_READABLE;
+				}
+				if (res & POLLOUT) {
+					mask |= AE_WRITABLE;
+				}
+				if (res & (POLLERR | POLLHUP)) {
+					mask |= AE_WRITABLE;
+				}
+				// 一次性 poll 已经用掉，重新提交，处理器执行完后下一轮才真正提交
+				aeUringQueuePoll(eventLoop, fd);
+			}
+			eventLoop->fired[numevents].fd = fd;
+			eventLoop->fired[numevents].mask = mask;
+			numevents++;
+			break;
+		}
+		case AE_URING_RECV:
+			if (fd < eventLoop->setsize) {
+				aeUringRecvDone(eventLoop, ud, res, flags);
+			}
+			break;
+		case AE_URING_SEND:
+			aeUringSendDone(eventLoop,
+					(aeUringSend *)(uintptr_t)(ud &
+						~(uint64_t)AE_URING_TYPE_MASK),
+					res);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return numevents;
+}
+
+const aeApi aeUringApi = {
+	.name = "uring",
+	.create = aeApiCreate,
+	.resize = aeApiResize,
+	.free = aeApiFree,
+	.addEvent = aeApiAddEvent,
+	.delEvent = aeApiDelEvent,
+	.poll = aeApiPoll,
+	.addRecv = aeApiAddRecv,
+	.delRecv = aeApiDelRecv,
+	.send = aeApiSend,
+};
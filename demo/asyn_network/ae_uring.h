@@ -0,0 +1,21 @@
+/* Linux io_uring based ae.c module
+ *
+ * 和 ae_epoll.c 一样实现 aeApi，在运行时通过 aeSetApi("uring") 或环境变量
+ * AE_API=uring 选用，内核不支持时 aeCreateEventLoop 自动退回 epoll。
+ *
+ * aeCreateFileEvent 注册的可读/可写事件用一次性 IORING_OP_POLL_ADD 实现，
+ * 触发后重新提交，保持和 epoll 一样的水平触发语义，原有的处理器不用修改。
+ * 所有 SQE 攒到下一次 aeApiPoll 和等待一起用一次 io_uring_enter 提交。
+ *
+ * aeCreateRecvEvent 用 multishot recv 加内核挑选的缓冲区环直接收数据，
+ * aeSend 用 IORING_OP_SEND 发送，读写都不再需要单独的系统调用。
+ */
+
+#ifndef __AE_URING_H__
+#define __AE_URING_H__
+
+#include "ae.h"
+
+extern const aeApi aeUringApi;
+
+#endif
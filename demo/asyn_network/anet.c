@@ -259,6 +259,22 @@ int anetSetReuseAddr(char *err, int fd)
 /*
  * 创建并返回 socket
  */
+/*
+ * 允许多个套接字绑定同一个端口，内核按连接的四元组把新连接分给它们，
+ * 每个线程持有自己的监听套接字，accept 不再争同一把锁
+ */
+int anetSetReusePort(char *err, int fd)
+{
+	int yes = 1;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+		anetSetError(err, "setsockopt SO_REUSEPORT: %s",
+			     strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+}
+
 static int anetCreateSocket(char *err, int domain)
 {
 	int s;
@@ -503,7 +519,7 @@ static int anetV6Only(char *err, int s)
 }
 
 static int _anetTcpServer(char *err, int port, char *bindaddr, int af,
-			  int backlog)
+			  int backlog, int reuseport)
 {
 	int s, rv;
 	char _port[6]; /* strlen("65535") */
@@ -531,6 +547,10 @@ static int _anetTcpServer(char *err, int port, char *bindaddr, int af,
 		if (anetSetReuseAddr(err, s) == ANET_ERR) {
 			goto error;
 		}
+		if (reuseport && anetSetReusePort(err, s) == ANET_ERR) {
+			close(s);
+			goto error;
+		}
 		if (anetListen(err, s, p->ai_addr, p->ai_addrlen, backlog) ==
 		    ANET_ERR) {
 			goto error;
@@ -551,12 +571,21 @@ end:
 
 int anetTcpServer(char *err, int port, char *bindaddr, int backlog)
 {
-	return _anetTcpServer(err, port, bindaddr, AF_INET, backlog);
+	return _anetTcpServer(err, port, bindaddr, AF_INET, backlog, 0);
 }
 
 int anetTcp6Server(char *err, int port, char *bindaddr, int backlog)
 {
-	return _anetTcpServer(err, port, bindaddr, AF_INET6, backlog);
+	return _anetTcpServer(err, port, bindaddr, AF_INET6, backlog, 0);
+}
+
+/*
+ * 和 anetTcpServer 一样，但监听套接字设置了 SO_REUSEPORT，
+ * 可以在每个事件循环里各创建一个绑定到同一端口
+ */
+int anetTcpReusePortServer(char *err, int port, char *bindaddr, int backlog)
+{
+	return _anetTcpServer(err, port, bindaddr, AF_INET, backlog, 1);
 }
 
 /*
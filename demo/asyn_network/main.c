@@ -4,6 +4,8 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -16,6 +18,7 @@
 
 #include "ae.h"
 #include "anet.h"
+#include "zmalloc.h"
 
 #define REDIS_SERVERPORT 16379 /* TCP port */
 #define REDIS_MAX_QUERYBUF_LEN 10240
@@ -24,13 +27,55 @@
 #define REDIS_MIN_RESERVED_FDS 32
 #define REDIS_EVENTLOOP_FDSET_INCR (REDIS_MIN_RESERVED_FDS + 96)
 #define REDIS_MAX_CLIENTS 10000
+#define REDIS_MAX_REACTORS 64
 
-// 错误信息
-char g_neterror_buf[1024];
+/*
+ * 一个事件循环及其监听套接字。
+ * 单线程模式下只有一个，在主线程运行；多 reactor 模式下每个线程一个，
+ * 各自用 SO_REUSEPORT 绑定同一端口，由内核分配新连接。
+ */
+struct reactor {
+	int id;
+	pthread_t tid;
+	aeEventLoop *el;
+	int listenfd;
+
+	// 错误信息，每个线程一份
+	char neterr[ANET_ERR_LEN];
+
+	// 只在本 reactor 的线程里修改
+	long long connections;
+	long long requests;
+
+	// 处理器自己调用 read/write 的次数，加上 el->syscalls 就是每个请求的系统调用开销
+	long long syscalls;
+};
+
+// 统计快照，从 reactor 线程投递回主事件循环
+struct reactor_stats {
+	int id;
+	long long connections;
+	long long requests;
+	long long syscalls;
+};
 
 // epoll事件循环机制
 aeEventLoop *g_epoll_loop = NULL;
 
+static struct reactor g_reactors[REDIS_MAX_REACTORS];
+static int g_nreactors = 0;
+static int g_quiet = 0;
+// 用 aeCreateRecvEvent/aeSend 收发，不再自己 read/write
+static int g_recv = 0;
+
+// 主事件循环汇总各 reactor 的统计
+static long long g_total_requests = 0;
+static long long g_total_connections = 0;
+static long long g_total_syscalls = 0;
+static long long g_last_requests = 0;
+static long long g_last_syscalls = 0;
+static int g_stats_pending = 0;
+
 /*
 定时时间到
 */
@@ -46,7 +91,11 @@ int MainTimerExpire(struct aeEventLoop *eventLoop, long long id,
 void MainCloseFd(aeEventLoop *el, int fd)
 {
 	// 删除结点，关闭文件
-	aeDeleteFileEvent(el, fd, AE_READABLE);
+	if (g_recv) {
+		aeDeleteRecvEvent(el, fd);
+	} else {
+		aeDeleteFileEvent(el, fd, AE_READABLE);
+	}
 	close(fd);
 }
 
@@ -55,13 +104,11 @@ void MainCloseFd(aeEventLoop *el, int fd)
 */
 void MainReadFromClient(aeEventLoop *el, int fd, void *privdata, int mask)
 {
+	struct reactor *r = privdata;
 	char buffer[REDIS_MAX_QUERYBUF_LEN] = { 0 };
 	int nread, nwrite;
 
-	char client_ip[REDIS_IP_STR_LEN];
-	int client_port;
-	anetPeerToString(fd, client_ip, REDIS_IP_STR_LEN, &client_port);
-
+	r->syscalls++;
 	nread = read(fd, buffer, REDIS_MAX_QUERYBUF_LEN);
 	/* 该fd对应的协议栈buf没有数据可读 */
 	if (nread == -1 && errno == EAGAIN) {
@@ -70,37 +117,82 @@ void MainReadFromClient(aeEventLoop *el, int fd, void *privdata, int mask)
 
 	// 说明客户端关闭了链接
 	if (nread <= 0) {
-		printf("I/O error reading from node link: %s",
-		       (nread == 0) ? "connection closed" : strerror(errno));
+		if (!g_quiet) {
+			printf("I/O error reading from node link: %s",
+			       (nread == 0) ? "connection closed" :
+					      strerror(errno));
+		}
+		r->connections--;
 		MainCloseFd(el, fd);
 	} else { // 读数据正常，则把读到的数据返回给客户端，也就是客户端会收到发送的数据
-		printf("recv from client %s:%d, data:%s\r\n", client_ip,
-		       client_port, buffer);
-		nwrite = write(fd, buffer, REDIS_MAX_QUERYBUF_LEN);
+		if (!g_quiet) {
+			char client_ip[REDIS_IP_STR_LEN];
+			int client_port;
+
+			anetPeerToString(fd, client_ip, REDIS_IP_STR_LEN,
+					 &client_port);
+			printf("recv from client %s:%d, data:%s\r\n", client_ip,
+			       client_port, buffer);
+		}
+		r->requests++;
+		r->syscalls++;
+		nwrite = write(fd, buffer, nread);
 		// 写异常了，可能是客户端关闭了链接，也可能是客户端进程挂了等
 		if (nwrite == -1) {
+			r->connections--;
 			MainCloseFd(el, fd);
 		}
 	}
 }
 
+/*
+-r 模式下收到客户端数据，由事件循环读好后交给这里，原样回写
+*/
+void MainRecvFromClient(aeEventLoop *el, int fd, void *privdata, char *buf,
+			ssize_t nread)
+{
+	struct reactor *r = privdata;
+
+	if (nread <= 0) {
+		if (!g_quiet) {
+			printf("I/O error reading from node link: %s",
+			       (nread == 0) ? "connection closed" :
+					      strerror(errno));
+		}
+		r->connections--;
+		MainCloseFd(el, fd);
+		return;
+	}
+	if (!g_quiet) {
+		printf("recv from client fd %d, data:%.*s\r\n", fd, (int)nread,
+		       buf);
+	}
+	r->requests++;
+	if (aeSend(el, fd, buf, nread) == AE_ERR) {
+		r->connections--;
+		MainCloseFd(el, fd);
+	}
+}
+
 /*
 处理客户端链接
 */
 void MainAcceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask)
 {
+	struct reactor *r = privdata;
 	int cfd, port;
 	char ip_addr[128] = { 0 };
-	cfd = anetTcpAccept(g_neterror_buf, fd, ip_addr, sizeof(ip_addr),
-			    &port);
+	cfd = anetTcpAccept(r->neterr, fd, ip_addr, sizeof(ip_addr), &port);
 	if (cfd == ANET_ERR) { // accept操作异常
 		if (errno != EWOULDBLOCK) {
-			printf("Accepting client connection: %s",
-			       g_neterror_buf);
+			printf("Accepting client connection: %s", r->neterr);
 		}
 		return;
 	}
-	printf("client %s:%d Connected\n", ip_addr, port);
+	if (!g_quiet) {
+		printf("client %s:%d Connected (reactor %d)\n", ip_addr, port,
+		       r->id);
+	}
 
 	// 非阻塞
 	anetNonBlock(NULL, cfd);
@@ -109,11 +201,14 @@ void MainAcceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask)
 
 	// 把accept返回的新套接字cfd注册到epoll事件集中，该新套接字关注AE_READABLE读事件，如果客户端有数据过来将会
 	// 触发读回调函数MainReadFromClient
-	if (aeCreateFileEvent(el, cfd, AE_READABLE, MainReadFromClient, NULL) ==
-	    AE_ERR) {
+	if ((g_recv ? aeCreateRecvEvent(el, cfd, MainRecvFromClient, r) :
+		      aeCreateFileEvent(el, cfd, AE_READABLE,
+					MainReadFromClient, r)) == AE_ERR) {
 		fprintf(stderr, "client connect fail: %d\n", cfd);
 		close(cfd);
+		return;
 	}
+	r->connections++;
 }
 
 void MainPriorityRun(struct aeEventLoop *eventLoop)
@@ -121,42 +216,275 @@ void MainPriorityRun(struct aeEventLoop *eventLoop)
 	printf("I run befor all other epoll event\n");
 }
 
-int main()
+/*
+ * 创建 reactor 的事件循环和监听套接字
+ */
+static int ReactorInit(struct reactor *r, int id, int port, int reuseport)
 {
-	printf("process Start begin\n");
-
-	// 初始化EPOLL事件处理器状态
-	g_epoll_loop = aeCreateEventLoop(REDIS_MAX_CLIENTS +
-					 REDIS_EVENTLOOP_FDSET_INCR);
+	r->id = id;
+	r->connections = 0;
+	r->requests = 0;
+	r->syscalls = 0;
+	r->el = aeCreateEventLoop(REDIS_MAX_CLIENTS +
+				  REDIS_EVENTLOOP_FDSET_INCR);
+	if (r->el == NULL) {
+		snprintf(r->neterr, sizeof(r->neterr), "aeCreateEventLoop: %s",
+			 strerror(errno));
+		return -1;
+	}
 
 	// 创建套接字并bind
-	int sd = anetTcpServer(g_neterror_buf, REDIS_SERVERPORT, NULL,
-			       REDIS_TCP_BACKLOG);
-	if (ANET_ERR == sd) {
-		fprintf(stderr, "Open port %d error: %s\n", REDIS_SERVERPORT,
-			g_neterror_buf);
-		exit(1);
+	if (reuseport) {
+		r->listenfd = anetTcpReusePortServer(r->neterr, port, NULL,
+						     REDIS_TCP_BACKLOG);
+	} else {
+		r->listenfd = anetTcpServer(r->neterr, port, NULL,
+					    REDIS_TCP_BACKLOG);
+	}
+	if (r->listenfd == ANET_ERR) {
+		return -1;
 	}
 
 	// 设置socket bind对应的fd为非阻塞
-	anetNonBlock(NULL, sd);
-	// 某些情况下，服务端进程退出后，会有监听端口timewait状态的连接，这时候如果重启进程，会提示error:98，Address
-	//  already in use，就可以用该设置来解决该问题。
-	anetSetReuseAddr(NULL, sd);
-	if (aeCreateFileEvent(g_epoll_loop, sd, AE_READABLE,
-			      MainAcceptTcpHandler, NULL) == AE_ERR) {
-		fprintf(stderr, "aeCreateFileEvent failed");
+	anetNonBlock(NULL, r->listenfd);
+	if (aeCreateFileEvent(r->el, r->listenfd, AE_READABLE,
+			      MainAcceptTcpHandler, r) == AE_ERR) {
+		snprintf(r->neterr, sizeof(r->neterr), "aeCreateFileEvent");
+		return -1;
+	}
+	return 0;
+}
+
+static void *ReactorMain(void *arg)
+{
+	struct reactor *r = arg;
+
+	aeMain(r->el);
+	return NULL;
+}
+
+/*
+ * 在主事件循环中执行：汇总 reactor 投递回来的统计快照
+ */
+static void MainCollectStats(aeEventLoop *el, void *clientData)
+{
+	struct reactor_stats *st = clientData;
+
+	g_total_connections += st->connections;
+	g_total_requests += st->requests;
+	g_total_syscalls += st->syscalls;
+	zfree(st);
+
+	if (--g_stats_pending == 0) {
+		long long requests = g_total_requests - g_last_requests;
+		long long syscalls = g_total_syscalls - g_last_syscalls;
+
+		printf("reactors %d, connections %lld, requests/sec %lld, "
+		       "syscalls/request %.3f\n",
+		       g_nreactors, g_total_connections, requests,
+		       requests ? (double)syscalls / requests : 0.0);
+		g_last_requests = g_total_requests;
+		g_last_syscalls = g_total_syscalls;
+	}
+}
+
+/*
+ * 在 reactor 线程中执行：取本线程的统计，投递回主事件循环
+ */
+static void ReactorReportStats(aeEventLoop *el, void *clientData)
+{
+	struct reactor *r = clientData;
+	struct reactor_stats *st = zmalloc(sizeof(*st));
+
+	st->id = r->id;
+	st->connections = r->connections;
+	st->requests = r->requests;
+	st->syscalls = r->syscalls + el->syscalls;
+	if (aePostTask(g_epoll_loop, MainCollectStats, st) == AE_ERR) {
+		zfree(st);
+	}
+}
+
+/*
+ * 主事件循环每秒向各 reactor 要一次统计，上一轮没收齐就跳过
+ */
+static int MainStatsTimer(struct aeEventLoop *eventLoop, long long id,
+			  void *clientData)
+{
+	int i;
+
+	if (g_stats_pending == 0) {
+		g_total_connections = 0;
+		g_total_requests = 0;
+		g_total_syscalls = 0;
+		for (i = 0; i < g_nreactors; i++) {
+			if (aePostTask(g_reactors[i].el, ReactorReportStats,
+				       &g_reactors[i]) == AE_OK) {
+				g_stats_pending++;
+			}
+		}
+	}
+	return 1000;
+}
+
+// aeStop 只做原子写和 write，可以在信号处理函数里调用
+static void MainSignalHandler(int sig)
+{
+	aeStop(g_epoll_loop);
+}
+
+/*
+ * 多 reactor 模式：n 个线程各跑一个事件循环并绑定到不同的 CPU，
+ * 主线程的事件循环只负责统计和退出
+ */
+static int MainMultiReactor(int n, int port)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+	int i, started, rc;
+
+	// 多个线程同时分配内存，打开 zmalloc 的原子计数
+	zmalloc_enable_thread_safeness();
+
+	for (i = 0; i < n; i++) {
+		if (ReactorInit(&g_reactors[i], i, port, 1) == -1) {
+			fprintf(stderr, "reactor %d: %s\n", i,
+				g_reactors[i].neterr);
+			exit(1);
+		}
+	}
+	g_nreactors = n;
+
+	signal(SIGINT, MainSignalHandler);
+	signal(SIGTERM, MainSignalHandler);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0, started = 0; i < n; i++, started++) {
+		pthread_attr_init(&attr);
+		CPU_ZERO(&cpus);
+		CPU_SET(i % (ncpu > 0 ? ncpu : 1), &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+		rc = pthread_create(&g_reactors[i].tid, &attr, ReactorMain,
+				    &g_reactors[i]);
+		if (rc != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+			pthread_attr_destroy(&attr);
+			aeStop(g_epoll_loop);
+			break;
+		}
+		pthread_attr_destroy(&attr);
+	}
+	printf("%d reactors listening on port %d, backend %s\n", started, port,
+	       g_reactors[0].el->api->name);
+
+	aeCreateTimeEvent(g_epoll_loop, 1000, MainStatsTimer, NULL, NULL);
+	aeMain(g_epoll_loop);
+
+	// 依次停止并等待每个 reactor 线程退出
+	for (i = 0; i < started; i++) {
+		aeStop(g_reactors[i].el);
+		pthread_join(g_reactors[i].tid, NULL);
+	}
+	for (i = 0; i < n; i++) {
+		close(g_reactors[i].listenfd);
+		aeDeleteEventLoop(g_reactors[i].el);
+	}
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-t reactors] [-p port] [-b epoll|uring] [-r] [-q]\n"
+		"  -t  run N event loops on N threads with SO_REUSEPORT,\n"
+		"      0 (default) runs a single loop on the main thread\n"
+		"  -b  event loop backend, defaults to $AE_API or epoll\n"
+		"  -r  let the event loop do the reads and writes\n"
+		"      (aeCreateRecvEvent/aeSend) instead of read/write\n"
+		"  -q  don't log connections and requests, print stats\n"
+		"      every second instead\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, threads = 0, port = REDIS_SERVERPORT;
+
+	while ((opt = getopt(argc, argv, "t:p:b:rqh")) != -1) {
+		switch (opt) {
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'b':
+			if (aeSetApi(optarg) == AE_ERR) {
+				fprintf(stderr, "unknown backend: %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			g_recv = 1;
+			break;
+		case 'q':
+			g_quiet = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt != 'h';
+		}
+	}
+	if (threads < 0 || threads > REDIS_MAX_REACTORS) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	printf("process Start begin\n");
+
+	// 初始化EPOLL事件处理器状态
+	if (threads > 0) {
+		g_epoll_loop = aeCreateEventLoop(REDIS_EVENTLOOP_FDSET_INCR);
+		if (g_epoll_loop == NULL) {
+			fprintf(stderr, "aeCreateEventLoop failed\n");
+			exit(1);
+		}
+		MainMultiReactor(threads, port);
+		aeDeleteEventLoop(g_epoll_loop);
+		printf("process End\n");
+		return 0;
+	}
+
+	if (ReactorInit(&g_reactors[0], 0, port, 0) == -1) {
+		fprintf(stderr, "Open port %d error: %s\n", port,
+			g_reactors[0].neterr);
 		exit(1);
 	}
+	g_nreactors = 1;
+	g_epoll_loop = g_reactors[0].el;
+	signal(SIGINT, MainSignalHandler);
+	signal(SIGTERM, MainSignalHandler);
+	signal(SIGPIPE, SIG_IGN);
+	printf("listening on port %d, backend %s\n", port,
+	       g_epoll_loop->api->name);
 
-	// 设置定时器
-	aeCreateTimeEvent(g_epoll_loop, 1, MainTimerExpire, NULL, NULL);
-	// 在aeMain循环中，优先运行该回调
-	aeSetBeforeSleepProc(g_epoll_loop, MainPriorityRun);
+	if (g_quiet) {
+		// 单线程时 reactor 就是主事件循环，统计任务投递给自己
+		aeCreateTimeEvent(g_epoll_loop, 1000, MainStatsTimer, NULL,
+				  NULL);
+	} else {
+		// 设置定时器
+		aeCreateTimeEvent(g_epoll_loop, 1, MainTimerExpire, NULL, NULL);
+		// 在aeMain循环中，优先运行该回调
+		aeSetBeforeSleepProc(g_epoll_loop, MainPriorityRun);
+	}
 	// 开启事件循环
 	aeMain(g_epoll_loop);
 
 	// 删除事件循环
+	close(g_reactors[0].listenfd);
 	aeDeleteEventLoop(g_epoll_loop);
 
 	printf("process End\n");
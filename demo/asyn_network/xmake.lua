@@ -1,3 +1,14 @@
 target("demo_asyn_network")
     set_kind("binary")
-    add_files("*.c")
+    add_files("*.c|ae_timer_bench.c|ae_reactor_bench.c")
+    add_syslinks("pthread")
+
+target("demo_ae_timer_bench")
+    set_kind("binary")
+    add_files("ae.c", "ae_epoll.c", "ae_uring.c", "zmalloc.c", "ae_timer_bench.c")
+    add_syslinks("pthread")
+
+target("demo_ae_reactor_bench")
+    set_kind("binary")
+    add_files("ae.c", "ae_epoll.c", "ae_uring.c", "anet.c", "zmalloc.c", "ae_reactor_bench.c")
+    add_syslinks("pthread")
@@ -62,15 +62,13 @@ list *listCreate(void)
 	return list;
 }
 
-/* Free the whole list.
- *
- * This function can't fail. */
+/* Remove all the elements from the list without destroying the list itself. */
 /*
- * 释放整个链表，以及链表中所有节点
+ * 释放链表中所有节点，链表本身保留，变成空链表
  *
  * T = O(N)
  */
-void listRelease(list *list)
+void listEmpty(list *list)
 {
 	unsigned long len;
 	listNode *current, *next;
@@ -91,6 +89,21 @@ void listRelease(list *list)
 
 		current = next;
 	}
+	list->head = list->tail = NULL;
+	list->len = 0;
+}
+
+/* Free the whole list.
+ *
+ * This function can't fail. */
+/*
+ * 释放整个链表，以及链表中所有节点
+ *
+ * T = O(N)
+ */
+void listRelease(list *list)
+{
+	listEmpty(list);
 
 	// 释放链表结构
 	zfree(list);
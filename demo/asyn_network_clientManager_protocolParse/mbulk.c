@@ -0,0 +1,97 @@
+/* mbulk.c - 一次扫描完整的多条查询命令
+ *
+ * *<argc>\r\n$<len>\r\n<arg>\r\n...$<len>\r\n<arg>\r\n
+ */
+
+#include "mbulk.h"
+
+/*
+ * 从 buf[*pos] 开始读一个以 \r\n 结尾的十进制整数，允许负号。
+ * 和 string2ll 一样不接受前导 0、正号和空白，数字过长也直接交回逐步解析。
+ *
+ * 成功返回 0，并让 *pos 指向 \r\n 之后
+ */
+static int mbulkReadLine(const char *buf, size_t len, size_t *pos,
+			 long long *value)
+{
+	size_t p = *pos, start;
+	long long v = 0;
+	int neg = 0;
+
+	if (p < len && buf[p] == '-') {
+		neg = 1;
+		p++;
+	}
+	start = p;
+	while (p < len && buf[p] >= '0' && buf[p] <= '9') {
+		v = v * 10 + (buf[p] - '0');
+		p++;
+		if (p - start > 18) {
+			return MBULK_AGAIN;
+		}
+	}
+	if (p == start || (buf[start] == '0' && p - start > 1) ||
+	    (neg && v == 0)) {
+		return MBULK_AGAIN;
+	}
+
+	// 和 processMultibulkBuffer 一样，只要求 \r 之后还有一个字节
+	if (p + 2 > len || buf[p] != '\r') {
+		return MBULK_AGAIN;
+	}
+	*pos = p + 2;
+	*value = neg ? -v : v;
+	return 0;
+}
+
+/*
+ * 扫描 buf 开头的一条多条查询命令。
+ *
+ * 命令完整时返回参数个数，整条命令的长度保存在 *cmdlen，
+ * 前 maxargs 个参数的位置写入 args；返回值大于 maxargs 时调用者应该扩大 args
+ * 再扫描一次。参数个数 <= 0 的空白命令返回 0。
+ *
+ * 命令不完整或者不符合协议时返回 MBULK_AGAIN
+ */
+long long mbulkScan(const char *buf, size_t len, mbulkArg *args,
+		    long long maxargs, size_t *cmdlen)
+{
+	size_t pos = 1;
+	long long argc, bulklen, j;
+
+	if (len == 0 || buf[0] != '*') {
+		return MBULK_AGAIN;
+	}
+	if (mbulkReadLine(buf, len, &pos, &argc) != 0 ||
+	    argc > MBULK_MAX_ARGC) {
+		return MBULK_AGAIN;
+	}
+	if (argc <= 0) {
+		*cmdlen = pos;
+		return 0;
+	}
+
+	for (j = 0; j < argc; j++) {
+		if (pos >= len || buf[pos] != '$') {
+			return MBULK_AGAIN;
+		}
+		pos++;
+		if (mbulkReadLine(buf, len, &pos, &bulklen) != 0 ||
+		    bulklen < 0 || bulklen > MBULK_MAX_BULK) {
+			return MBULK_AGAIN;
+		}
+
+		// 参数内容和结尾的 \r\n 都要已经收到
+		if (len - pos < (size_t)bulklen + 2) {
+			return MBULK_AGAIN;
+		}
+		if (j < maxargs) {
+			args[j].off = pos;
+			args[j].len = bulklen;
+		}
+		pos += bulklen + 2;
+	}
+
+	*cmdlen = pos;
+	return argc;
+}
@@ -0,0 +1,35 @@
+/* mbulk.h - 一次扫描完整的多条查询命令
+ *
+ * processMultibulkBuffer 的借用模式使用：整条命令都已经在查询缓冲区中时，
+ * 一次找出所有参数的位置，不复制、不分配内存，再由调用者决定如何建立参数对象。
+ * 不完整或者格式不对的命令交回原来的逐步解析处理，错误信息也由那里给出。
+ */
+
+#ifndef __MBULK_H__
+#define __MBULK_H__
+
+#include <stddef.h>
+
+// 命令不完整，或者需要按原来的方式逐步解析（协议错误、超出限制等）
+#define MBULK_AGAIN -1
+
+// 和 processMultibulkBuffer 中的限制一致
+#define MBULK_MAX_ARGC (1024 * 1024)
+#define MBULK_MAX_BULK (512LL * 1024 * 1024)
+
+/*
+ * 参数在缓冲区中的位置
+ */
+typedef struct mbulkArg {
+	// 参数内容相对缓冲区开头的偏移
+	size_t off;
+
+	// 参数长度，不包括结尾的 \r\n
+	size_t len;
+
+} mbulkArg;
+
+long long mbulkScan(const char *buf, size_t len, mbulkArg *args,
+		    long long maxargs, size_t *cmdlen);
+
+#endif
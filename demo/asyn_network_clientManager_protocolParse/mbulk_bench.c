@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mbulk.h"
+
+/*
+ * 多条查询解析的微基准
+ *
+ * 比较 processMultibulkBuffer 原来的逐个复制参数和借用模式（processMultibulkViews），
+ * 输入是管道化的 SET key:<n> <value>，每次处理约 16KB（一次 read 的量）。
+ * networking.c 依赖完整的 redis.h，这里按同样的内存布局模拟 robj/sds，
+ * 只测解析和建立、释放参数对象，不执行命令：
+ *
+ *   copy  - strchr 找行尾，每个参数 createStringObject（<= 39 字节一次分配，
+ *           否则两次），每条命令之后 sdsrange 删除处理过的内容
+ *   views - mbulkScan 一次扫描，短参数复制到复用的对象，长参数原地改写成 sds，
+ *           所有命令处理完之后才删除处理过的内容
+ *
+ *   ./mbulk_bench [-n commands] [-s size,...]
+ */
+
+#define BENCH_IOBUF_LEN (16 * 1024)
+#define BENCH_EMBSTR_LIMIT 39
+#define BENCH_BIG_ARG (1024 * 32)
+
+// 和 redis 3.0 相同的布局
+struct sdshdr {
+	unsigned int len;
+	unsigned int free;
+	char buf[];
+};
+
+typedef struct robj {
+	unsigned type : 4;
+	unsigned encoding : 4;
+	unsigned lru : 24;
+	int refcount;
+	void *ptr;
+} robj;
+
+#define ENC_RAW 0
+#define ENC_EMBSTR 8
+// 参数就是原来的查询缓冲区（大参数优化），内容不在这里释放
+#define ENC_QUERYBUF 15
+
+static long long g_mallocs = 0;
+
+static void *benchMalloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (p == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	g_mallocs++;
+	return p;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * 原来的方式：和 createStringObject/decrRefCount 一样分配、释放
+ */
+static robj *createString(const char *ptr, size_t len)
+{
+	struct sdshdr *sh;
+	robj *o;
+
+	if (len <= BENCH_EMBSTR_LIMIT) {
+		o = benchMalloc(sizeof(robj) + sizeof(struct sdshdr) + len + 1);
+		sh = (void *)(o + 1);
+		o->encoding = ENC_EMBSTR;
+	} else {
+		o = benchMalloc(sizeof(robj));
+		sh = benchMalloc(sizeof(struct sdshdr) + len + 1);
+		o->encoding = ENC_RAW;
+	}
+	sh->len = len;
+	sh->free = 0;
+	memcpy(sh->buf, ptr, len);
+	sh->buf[len] = '\0';
+	o->ptr = sh->buf;
+	o->refcount = 1;
+	return o;
+}
+
+static void freeString(robj *o)
+{
+	if (o->encoding == ENC_RAW || o->encoding == ENC_QUERYBUF) {
+		free((char *)o->ptr - sizeof(struct sdshdr));
+	}
+	free(o);
+}
+
+/*
+ * 模拟 sds 查询缓冲区
+ */
+struct querybuf {
+	char *buf;
+	size_t len;
+	size_t cap;
+	size_t pos; // 借用模式的 c->qb_pos
+};
+
+static void sdsrangeFront(struct querybuf *q, size_t start)
+{
+	memmove(q->buf, q->buf + start, q->len - start);
+	q->len -= start;
+	q->buf[q->len] = '\0';
+}
+
+/*
+ * 按 processMultibulkBuffer 的逐步解析处理一条命令，返回参数个数，不完整返回 -1
+ */
+static int parseCopy(struct querybuf *q, robj **argv, long long *sum)
+{
+	char *newline;
+	size_t pos;
+	long long argc, ll;
+	int j;
+
+	newline = strchr(q->buf, '\r');
+	if (newline == NULL || newline - q->buf > (long)q->len - 2) {
+		return -1;
+	}
+	argc = strtoll(q->buf + 1, NULL, 10);
+	pos = newline - q->buf + 2;
+
+	for (j = 0; j < argc; j++) {
+		newline = strchr(q->buf + pos, '\r');
+		if (newline == NULL) {
+			return -1;
+		}
+		ll = strtoll(q->buf + pos + 1, NULL, 10);
+		pos += newline - (q->buf + pos) + 2;
+		if (ll >= BENCH_BIG_ARG) {
+			sdsrangeFront(q, pos);
+			pos = 0;
+		}
+		if (q->len - pos < (size_t)ll + 2) {
+			return -1;
+		}
+		if (pos == 0 && ll >= BENCH_BIG_ARG && q->len == (size_t)ll + 2) {
+			// 整个缓冲区直接作为参数，再为下一个大参数分配新的缓冲区
+			argv[j] = benchMalloc(sizeof(robj));
+			argv[j]->encoding = ENC_QUERYBUF;
+			argv[j]->ptr = benchMalloc(sizeof(struct sdshdr) + ll + 2);
+			argv[j]->ptr = (char *)argv[j]->ptr + sizeof(struct sdshdr);
+			*sum += q->buf[0] + ll;
+			q->len = 0;
+			pos = 0;
+			continue;
+		}
+		argv[j] = createString(q->buf + pos, ll);
+		*sum += ((char *)argv[j]->ptr)[0] + ll;
+		pos += ll + 2;
+	}
+	sdsrangeFront(q, pos);
+	return argc;
+}
+
+/*
+ * 借用模式，和 processMultibulkViews/argvPoolGet/argvPoolRelease 相同的策略
+ */
+struct pool {
+	robj **objs;
+	int size;
+	int used;
+	mbulkArg *pos;
+	int poslen;
+};
+
+static robj *poolGet(struct pool *p)
+{
+	robj *o;
+
+	if (p->used == p->size) {
+		int size = p->size ? p->size * 2 : 16;
+
+		p->objs = realloc(p->objs, sizeof(robj *) * size);
+		memset(p->objs + p->size, 0, sizeof(robj *) * (size - p->size));
+		p->size = size;
+	}
+	o = p->objs[p->used];
+	if (o == NULL) {
+		o = benchMalloc(sizeof(robj) + sizeof(struct sdshdr) +
+				BENCH_EMBSTR_LIMIT + 1);
+		o->encoding = ENC_EMBSTR;
+		o->refcount = 1;
+		p->objs[p->used] = o;
+	}
+	p->used++;
+	o->refcount++;
+	return o;
+}
+
+static int parseViews(struct querybuf *q, struct pool *p, robj **argv,
+		      long long *sum)
+{
+	char *buf = q->buf + q->pos;
+	size_t cmdlen, prevend = 0;
+	long long argc;
+	int j;
+
+	argc = mbulkScan(buf, q->len - q->pos, p->pos, p->poslen, &cmdlen);
+	if (argc > p->poslen) {
+		p->pos = realloc(p->pos, sizeof(mbulkArg) * argc);
+		p->poslen = argc;
+		argc = mbulkScan(buf, q->len - q->pos, p->pos, p->poslen,
+				 &cmdlen);
+	}
+	if (argc == MBULK_AGAIN) {
+		return -1;
+	}
+	q->pos += cmdlen;
+
+	for (j = 0; j < argc; j++) {
+		char *data = buf + p->pos[j].off;
+		size_t len = p->pos[j].len;
+		struct sdshdr *sh;
+		robj *o;
+
+		if (len <= BENCH_EMBSTR_LIMIT) {
+			o = poolGet(p);
+			sh = (void *)(o + 1);
+			memcpy(sh->buf, data, len);
+		} else if (p->pos[j].off >= prevend + sizeof(struct sdshdr)) {
+			o = poolGet(p);
+			sh = (void *)(data - sizeof(struct sdshdr));
+		} else {
+			o = createString(data, len);
+			sh = NULL;
+		}
+		if (sh) {
+			sh->len = len;
+			sh->free = 0;
+			sh->buf[len] = '\0';
+			o->ptr = sh->buf;
+		}
+		argv[j] = o;
+		*sum += ((char *)o->ptr)[0] + len;
+		prevend = p->pos[j].off + len + 1;
+	}
+	return argc;
+}
+
+static void releaseViews(struct pool *p, robj **argv, int argc)
+{
+	int j;
+
+	for (j = 0; j < argc; j++) {
+		if (--argv[j]->refcount == 0) {
+			freeString(argv[j]);
+		}
+	}
+	p->used = 0;
+}
+
+/*
+ * 生成 n 条 SET 命令，每条一个 size 字节的值
+ */
+static char *makeCommands(int n, size_t size, size_t *cmdsize, size_t *total)
+{
+	char *value = malloc(size + 1), *out, *p;
+	char head[128];
+	int i, hl;
+
+	memset(value, 'v', size);
+	hl = snprintf(head, sizeof(head),
+		      "*3\r\n$3\r\nSET\r\n$12\r\nkey:%08d\r\n$%zu\r\n", 0, size);
+	*cmdsize = hl + size + 2;
+	*total = *cmdsize * n;
+	out = p = malloc(*total + 1);
+	for (i = 0; i < n; i++) {
+		p += snprintf(p, sizeof(head),
+			      "*3\r\n$3\r\nSET\r\n$12\r\nkey:%08d\r\n$%zu\r\n",
+			      i % 100000000, size);
+		memcpy(p, value, size);
+		p += size;
+		*p++ = '\r';
+		*p++ = '\n';
+	}
+	*p = '\0';
+	free(value);
+	return out;
+}
+
+static void runSize(int ncmds, size_t size)
+{
+	size_t cmdsize, total, batchlen, off;
+	char *cmds = makeCommands(ncmds, size, &cmdsize, &total);
+	struct querybuf q;
+	struct pool p;
+	robj *argv[3];
+	long long sum = 0, mallocs[2];
+	double t0, secs[2];
+	int batch, mode, j, argc;
+
+	// 每次处理约一次 read 的量，至少一条命令
+	batch = BENCH_IOBUF_LEN / cmdsize;
+	if (batch < 1) {
+		batch = 1;
+	}
+	batchlen = cmdsize * batch;
+	q.cap = batchlen + 1;
+	q.buf = malloc(q.cap);
+	memset(&p, 0, sizeof(p));
+
+	for (mode = 0; mode < 2; mode++) {
+		g_mallocs = 0;
+		t0 = now();
+		for (off = 0; off + batchlen <= total; off += batchlen) {
+			memcpy(q.buf, cmds + off, batchlen);
+			q.buf[batchlen] = '\0';
+			q.len = batchlen;
+			q.pos = 0;
+			for (j = 0; j < batch; j++) {
+				if (mode == 0) {
+					argc = parseCopy(&q, argv, &sum);
+					while (argc-- > 0) {
+						freeString(argv[argc]);
+					}
+				} else {
+					argc = parseViews(&q, &p, argv, &sum);
+					releaseViews(&p, argv, argc);
+				}
+			}
+			if (mode == 1) {
+				sdsrangeFront(&q, q.pos);
+			}
+		}
+		secs[mode] = now() - t0;
+		mallocs[mode] = g_mallocs;
+	}
+
+	printf("%8zu %10.1f %10.1f %7.2fx %9.2f %9.2f\n", size,
+	       secs[0] * 1e9 / ncmds, secs[1] * 1e9 / ncmds, secs[0] / secs[1],
+	       (double)mallocs[0] / ncmds, (double)mallocs[1] / ncmds);
+	if (sum == 42) {
+		printf("\n");
+	}
+
+	for (j = 0; j < p.size; j++) {
+		free(p.objs[j]);
+	}
+	free(p.objs);
+	free(p.pos);
+	free(q.buf);
+	free(cmds);
+}
+
+int main(int argc, char *argv[])
+{
+	char sizes[256] = "8,32,100,1024,16384,65536", *s;
+	int opt, ncmds = 200000;
+
+	while ((opt = getopt(argc, argv, "n:s:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			ncmds = atoi(optarg);
+			break;
+		case 's':
+			snprintf(sizes, sizeof(sizes), "%s", optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n commands] [-s size,...]\n",
+				argv[0]);
+			return opt != 'h';
+		}
+	}
+
+	printf("    size    copy ns   views ns speedup  copy mal views mal\n");
+	for (s = strtok(sizes, ","); s; s = strtok(NULL, ",")) {
+		size_t size = strtoul(s, NULL, 10);
+		// 大值时减少命令数，避免输入太大
+		int n = size > 4096 ? ncmds / (size / 4096) : ncmds;
+
+		runSize(n > 16 ? n : 16, size);
+	}
+	return 0;
+}
@@ -28,10 +28,47 @@
  */
 
 #include "redis.h"
+#include "mbulk.h"
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <sys/uio.h>
 
 static void setProtocolError(redisClient *c, int pos);
+static int postponeClientRead(redisClient *c);
+
+/*
+ * 借用模式（server.argv_views）下的参数对象
+ *
+ * 长度不超过 REDIS_ARGV_EMBSTR_LIMIT 的参数复制到客户端池子里的 EMBSTR 对象中，
+ * 池子里的对象在命令之间复用，不需要为每个参数分配内存；
+ * 更长的参数如果前面的协议头放得下 sdshdr，就在查询缓冲区里原地改写成 sds，
+ * 对象直接指向 c->querybuf，不复制内容。这种对象的编码也是 EMBSTR
+ * （只读，不会被 sdsfree），但 ptr 不在对象自己的内存里，见 isArgvView。
+ *
+ * 池子里的对象始终多持有一个引用，这样命令执行期间 tryObjectEncoding 等
+ * 不会原地修改或者释放它们。resetClient 时引用计数仍然大于 1 的对象
+ * 被命令保留了（写入数据库、MULTI 队列、慢查询日志等），
+ * 借用查询缓冲区的先复制出自己的 sds，然后交给持有者。
+ */
+#define REDIS_ARGV_EMBSTR_LIMIT 39
+// 一条命令的参数特别多时，之后池子里最多保留的对象个数
+#define REDIS_ARGV_POOL_MAX 1024
+
+#define isArgvView(o)                                   \
+	((o)->encoding == REDIS_ENCODING_EMBSTR &&      \
+	 (o)->ptr != ((struct sdshdr *)((o) + 1))->buf)
+
+/*
+ * I/O 线程（server.io_threads_num > 1）使用的客户端状态，保存在 c->io_flags
+ *
+ * PENDING_READ/PENDING_WRITE 表示客户端在 server.clients_pending_read 或
+ * server.clients_pending_write 中，等待 beforeSleep 交给 I/O 线程读写；
+ * PENDING_COMMAND 表示 I/O 线程已经解析好了一条命令，等待主线程执行
+ */
+#define REDIS_IO_PENDING_READ (1 << 0)
+#define REDIS_IO_PENDING_WRITE (1 << 1)
+#define REDIS_IO_PENDING_COMMAND (1 << 2)
 
 /* To evaluate the output buffer size of a client we need to get size of
  * allocated objects, however we can't used zmalloc_size() directly on sds
@@ -126,12 +163,20 @@ redisClient *createClient(int fd)
 	c->querybuf = sdsempty();
 	// 查询缓冲区峰值
 	c->querybuf_peak = 0;
+	// 查询缓冲区中已经处理过、还没删除的内容长度（借用模式）
+	c->qb_pos = 0;
 	// 命令请求的类型
 	c->reqtype = 0;
 	// 命令参数数量
 	c->argc = 0;
 	// 命令参数
 	c->argv = NULL;
+	// 借用模式下复用的参数对象，以及扫描命令时参数的位置
+	c->argvpool = NULL;
+	c->argvpoolsize = 0;
+	c->argvpoolused = 0;
+	c->argvpos = NULL;
+	c->argvposlen = 0;
 	// 当前执行的命令和最近一次执行的命令
 	c->cmd = c->lastcmd = NULL;
 	// 查询缓冲区中未读入的命令内容数量
@@ -142,6 +187,10 @@ redisClient *createClient(int fd)
 	c->sentlen = 0;
 	// 状态 FLAG
 	c->flags = 0;
+	// I/O 线程的读写状态和结果
+	c->io_flags = 0;
+	c->io_nbytes = 0;
+	c->io_errno = 0;
 	// 创建时间和最后一次互动时间
 	c->ctime = c->lastinteraction = server.unixtime;
 	// 认证状态
@@ -242,10 +291,20 @@ int prepareClientToWrite(redisClient *c)
 	// 一般情况，为客户端套接字安装写处理器到事件循环
 	if (c->bufpos == 0 && listLength(c->reply) == 0 &&
 	    (c->replstate == REDIS_REPL_NONE ||
-	     c->replstate == REDIS_REPL_ONLINE) &&
-	    aeCreateFileEvent(server.el, c->fd, AE_WRITABLE, sendReplyToClient,
-			      c) == AE_ERR)
-		return REDIS_ERR;
+	     c->replstate == REDIS_REPL_ONLINE)) {
+		// 打开了 I/O 线程时先不安装写处理器，普通客户端在 beforeSleep 中
+		// 统一写出（可能由 I/O 线程写），写不完的再安装写处理器
+		if (server.io_threads_num > 1 &&
+		    !(c->flags & (REDIS_SLAVE | REDIS_MASTER))) {
+			if (!(c->io_flags & REDIS_IO_PENDING_WRITE)) {
+				c->io_flags |= REDIS_IO_PENDING_WRITE;
+				listAddNodeHead(server.clients_pending_write, c);
+			}
+		} else if (aeCreateFileEvent(server.el, c->fd, AE_WRITABLE,
+					     sendReplyToClient, c) == AE_ERR) {
+			return REDIS_ERR;
+		}
+	}
 
 	return REDIS_OK;
 }
@@ -313,6 +372,16 @@ void _addReplyObjectToList(redisClient *c, robj *o)
 	if (c->flags & REDIS_CLOSE_AFTER_REPLY)
 		return;
 
+	// 借用查询缓冲区的参数对象（比如 ECHO 的参数）复制一份再放进链表，
+	// 否则 resetClient 之后它会变成 RAW 编码，reply_bytes 的增减对不上
+	if (isArgvView(o)) {
+		robj *copy = dupStringObject(o);
+
+		_addReplyObjectToList(c, copy);
+		decrRefCount(copy);
+		return;
+	}
+
 	// 链表中无缓冲块，直接将对象追加到链表中
 	if (listLength(c->reply) == 0) {
 		incrRefCount(o);
@@ -906,6 +975,99 @@ void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask)
 	}
 }
 
+/*
+ * 从池子里取一个对象给当前命令的参数使用，池子和 argv 各持有一个引用
+ */
+static robj *argvPoolGet(redisClient *c)
+{
+	robj *o;
+
+	if (c->argvpoolused == c->argvpoolsize) {
+		int size = c->argvpoolsize ? c->argvpoolsize * 2 : 16;
+
+		c->argvpool = zrealloc(c->argvpool, sizeof(robj *) * size);
+		memset(c->argvpool + c->argvpoolsize, 0,
+		       sizeof(robj *) * (size - c->argvpoolsize));
+		c->argvpoolsize = size;
+	}
+
+	o = c->argvpool[c->argvpoolused];
+	if (o == NULL) {
+		o = zmalloc(sizeof(robj) + sizeof(struct sdshdr) +
+			    REDIS_ARGV_EMBSTR_LIMIT + 1);
+		o->type = REDIS_STRING;
+		o->encoding = REDIS_ENCODING_EMBSTR;
+		o->refcount = 1;
+		c->argvpool[c->argvpoolused] = o;
+	}
+	c->argvpoolused++;
+
+	o->refcount++;
+	o->lru = LRU_CLOCK();
+	return o;
+}
+
+/*
+ * 命令执行完之后回收池子里的对象，被命令保留的对象交给持有者
+ */
+static void argvPoolRelease(redisClient *c)
+{
+	int j;
+
+	for (j = 0; j < c->argvpoolused; j++) {
+		robj *o = c->argvpool[j];
+
+		// 只剩池子自己的引用，下条命令继续用
+		if (o->refcount == 1)
+			continue;
+
+		// 查询缓冲区马上就要被覆盖，保留的参数需要自己的 sds
+		if (isArgvView(o)) {
+			o->ptr = sdsnewlen(o->ptr, sdslen(o->ptr));
+			o->encoding = REDIS_ENCODING_RAW;
+		}
+		decrRefCount(o);
+		c->argvpool[j] = NULL;
+	}
+	c->argvpoolused = 0;
+
+	// 偶尔出现的超长命令（比如很大的 MSET）之后不要一直占着内存
+	if (c->argvpoolsize > REDIS_ARGV_POOL_MAX) {
+		for (j = REDIS_ARGV_POOL_MAX; j < c->argvpoolsize; j++) {
+			if (c->argvpool[j])
+				decrRefCount(c->argvpool[j]);
+		}
+		c->argvpool = zrealloc(c->argvpool,
+				       sizeof(robj *) * REDIS_ARGV_POOL_MAX);
+		c->argvpoolsize = REDIS_ARGV_POOL_MAX;
+	}
+	if (c->argvposlen > REDIS_ARGV_POOL_MAX) {
+		c->argvpos = zrealloc(c->argvpos,
+				      sizeof(mbulkArg) * REDIS_ARGV_POOL_MAX);
+		c->argvposlen = REDIS_ARGV_POOL_MAX;
+	}
+}
+
+/*
+ * 让借用查询缓冲区的参数复制出自己的 sds
+ *
+ * 命令暂时不能执行（比如客户端被暂停）时，之后的读入可能重新分配 c->querybuf，
+ * 借用的参数就失效了
+ */
+static void materializeArgvViews(redisClient *c)
+{
+	int j;
+
+	for (j = 0; j < c->argc; j++) {
+		robj *o = c->argv[j];
+
+		if (!isArgvView(o))
+			continue;
+		c->argv[j] = createStringObject(o->ptr, sdslen(o->ptr));
+		decrRefCount(o);
+	}
+}
+
 /*
  * 清空所有命令参数
  */
@@ -916,6 +1078,8 @@ static void freeClientArgv(redisClient *c)
 		decrRefCount(c->argv[j]);
 	c->argc = 0;
 	c->cmd = NULL;
+	if (c->argvpoolused)
+		argvPoolRelease(c);
 }
 
 /* Close all the slaves connections. This is useful in chained replication
@@ -1002,6 +1166,7 @@ MB，软性限制的时长为60秒。
 void freeClient(redisClient *c, const char *func, unsigned int line)
 {
 	listNode *ln;
+	int j;
 
 	redisLog(REDIS_WARNING, "free client ip:%s, port:%d <%s, %d>", c->cip,
 		 c->cport, func, line);
@@ -1039,6 +1204,8 @@ void freeClient(redisClient *c, const char *func, unsigned int line)
 	}
 
 	/* Free the query buffer */
+	// 借用模式下参数可能还指向查询缓冲区，先清空命令参数
+	freeClientArgv(c);
 	sdsfree(c->querybuf);
 	c->querybuf = NULL;
 
@@ -1071,9 +1238,6 @@ void freeClient(redisClient *c, const char *func, unsigned int line)
 	// 清空回复缓冲区
 	listRelease(c->reply);
 
-	// 清空命令参数
-	freeClientArgv(c);
-
 	/* Remove from the list of clients */
 	// 从服务器的客户端链表中删除自身
 	if (c->fd != -1) {
@@ -1126,12 +1290,31 @@ void freeClient(redisClient *c, const char *func, unsigned int line)
 		listDelNode(server.clients_to_close, ln);
 	}
 
+	// 从等待 I/O 线程读写的链表中删除
+	if (c->io_flags & REDIS_IO_PENDING_READ) {
+		ln = listSearchKey(server.clients_pending_read, c);
+		redisAssert(ln != NULL);
+		listDelNode(server.clients_pending_read, ln);
+	}
+	if (c->io_flags & REDIS_IO_PENDING_WRITE) {
+		ln = listSearchKey(server.clients_pending_write, c);
+		redisAssert(ln != NULL);
+		listDelNode(server.clients_pending_write, ln);
+	}
+
 	/* Release other dynamically allocated client structure fields,
    * and finally release the client structure itself. */
 	if (c->name)
 		decrRefCount(c->name);
 	// 清除参数空间
 	zfree(c->argv);
+	// 释放借用模式下复用的参数对象
+	for (j = 0; j < c->argvpoolsize; j++) {
+		if (c->argvpool[j])
+			decrRefCount(c->argvpool[j]);
+	}
+	zfree(c->argvpool);
+	zfree(c->argvpos);
 	// 清除事务状态信息
 	freeClientMultiState(c);
 	sdsfree(c->peerid);
@@ -1169,107 +1352,103 @@ void freeClientsInAsyncFreeQueue(void)
 }
 
 /*
- * 负责传送命令回复的写处理器
- */ //readQueryFromClient与sendReplyToClient对应，一个接收，一个发送  //创建TCP连接在acceptTcpHandler
- //这里面会限制最多一次性发送64M，避免数据过大阻塞
-void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask)
+ * 一次 writev 最多收集的 iovec 个数和字节数
+ *
+ * 字节数和每个事件的写入上限一致，避免单次 writev 收集过多的回复对象
+ */
+#define REDIS_WRITEV_IOV_MAX (IOV_MAX > 1024 ? 1024 : IOV_MAX)
+#define REDIS_WRITEV_MAX_BYTES REDIS_MAX_WRITE_PER_EVENT
+
+/*
+ * 把 c->buf 和 c->reply 中还没发送的内容收集到 iov 中，
+ * 返回 iovec 的个数，收集到的字节数保存在 *bytes
+ *
+ * c->sentlen 是第一块内容（c->buf 或者链表头部的对象）已经写入的长度
+ */
+static int collectReplyIov(redisClient *c, struct iovec *iov, int iovmax,
+			   size_t maxbytes, size_t *bytes)
 {
-	redisClient *c = privdata;
-	int nwritten = 0, totwritten = 0, objlen;
-	size_t objmem;
-	robj *o;
-	REDIS_NOTUSED(el);
-	REDIS_NOTUSED(mask);
+	int iovcnt = 0;
+	size_t sentlen = c->sentlen;
+	listIter li;
+	listNode *ln;
 
-	// 一直循环，直到回复缓冲区为空
-	// 或者指定条件满足为止
-	while (c->bufpos > 0 || listLength(c->reply)) {
-		if (c->bufpos > 0) {
-			// c->bufpos > 0
-
-			// 写入内容到套接字
-			// c->sentlen 是用来处理 short write 的
-			// 当出现 short write ，导致写入未能一次完成时，
-			// c->buf+c->sentlen 就会偏移到正确（未写入）内容的位置上。
-			nwritten = write(fd, c->buf + c->sentlen,
-					 c->bufpos - c->sentlen);
-			// 出错则跳出
-			if (nwritten <= 0)
-				break;
-			// 成功写入则更新写入计数器变量
-			c->sentlen += nwritten;
-			totwritten += nwritten;
-
-			/* If the buffer was sent, set bufpos to zero to continue with
-       * the remainder of the reply. */
-			// 如果缓冲区中的内容已经全部写入完毕
-			// 那么清空客户端的两个计数器变量
-			if (c->sentlen == c->bufpos) {
-				c->bufpos = 0;
-				c->sentlen = 0;
-			}
-		} else {
-			// listLength(c->reply) != 0
+	*bytes = 0;
+	if (c->bufpos > 0) {
+		iov[iovcnt].iov_base = c->buf + sentlen;
+		iov[iovcnt].iov_len = c->bufpos - sentlen;
+		*bytes += iov[iovcnt].iov_len;
+		iovcnt++;
+		sentlen = 0;
+	}
 
-			// 取出位于链表最前面的对象
-			o = listNodeValue(listFirst(c->reply));
-			objlen = sdslen(o->ptr);
-			objmem = getStringObjectSdsUsedMemory(o);
+	listRewind(c->reply, &li);
+	while (iovcnt < iovmax && *bytes < maxbytes &&
+	       (ln = listNext(&li)) != NULL) {
+		robj *o = listNodeValue(ln);
+		size_t objlen = sdslen(o->ptr);
+
+		// 略过空对象，写完之后和已发送的对象一起删除
+		if (objlen > sentlen) {
+			iov[iovcnt].iov_base = ((char *)o->ptr) + sentlen;
+			iov[iovcnt].iov_len = objlen - sentlen;
+			*bytes += iov[iovcnt].iov_len;
+			iovcnt++;
+		}
+		sentlen = 0;
+	}
+	return iovcnt;
+}
 
-			// 略过空对象
-			if (objlen == 0) {
-				listDelNode(c->reply, listFirst(c->reply));
-				c->reply_bytes -= objmem;
-				continue;
-			}
+/*
+ * 成功写入 nwritten 字节后，清空已经写完的 c->buf，删除已经写完的回复对象，
+ * 没写完的部分记录在 c->sentlen 中（short write）
+ */
+static void advanceReplyAfterWrite(redisClient *c, size_t nwritten)
+{
+	if (c->bufpos > 0) {
+		size_t left = c->bufpos - c->sentlen;
 
-			// 写入内容到套接字
-			// c->sentlen 是用来处理 short write 的
-			// 当出现 short write ，导致写入未能一次完成时，
-			// c->buf+c->sentlen 就会偏移到正确（未写入）内容的位置上。
-			nwritten = write(fd, ((char *)o->ptr) + c->sentlen,
-					 objlen - c->sentlen);
-			// 写入出错则跳出
-			if (nwritten <= 0)
-				break;
-			// 成功写入则更新写入计数器变量
+		if (nwritten < left) {
 			c->sentlen += nwritten;
-			totwritten += nwritten;
-
-			/* If we fully sent the object on head go to the next one */
-			// 如果缓冲区内容全部写入完毕，那么删除已写入完毕的节点
-			if (c->sentlen == objlen) {
-				listDelNode(c->reply, listFirst(c->reply));
-				c->sentlen = 0;
-				c->reply_bytes -= objmem;
-			}
+			return;
 		}
-		/* Note that we avoid to send more than REDIS_MAX_WRITE_PER_EVENT
-     * bytes, in a single threaded server it's a good idea to serve
-     * other clients as well, even if a very large request comes from
-     * super fast link that is always able to accept data (in real world
-     * scenario think about 'KEYS *' against the loopback interface).
-     *
-     * 为了避免一个非常大的回复独占服务器，
-     * 当写入的总数量大于 REDIS_MAX_WRITE_PER_EVENT ，
-     * 临时中断写入，将处理时间让给其他客户端，
-     * 剩余的内容等下次写入就绪再继续写入
-     *
-     * However if we are over the maxmemory limit we ignore that and
-     * just deliver as much data as it is possible to deliver.
-     *
-     * 不过，如果服务器的内存占用已经超过了限制，
-     * 那么为了将回复缓冲区中的内容尽快写入给客户端，
-     * 然后释放回复缓冲区的空间来回收内存，
-     * 这时即使写入量超过了 REDIS_MAX_WRITE_PER_EVENT ，
-     * 程序也继续进行写入
-     */
-		if (totwritten > REDIS_MAX_WRITE_PER_EVENT && //最多写64M
-		    (server.maxmemory == 0 ||
-		     zmalloc_used_memory() < server.maxmemory))
-			break;
+		// 缓冲区中的内容已经全部写入完毕
+		nwritten -= left;
+		c->bufpos = 0;
+		c->sentlen = 0;
+	}
+
+	while (listLength(c->reply)) {
+		listNode *ln = listFirst(c->reply);
+		robj *o = listNodeValue(ln);
+		size_t objlen = sdslen(o->ptr);
+		size_t objmem;
+
+		if (nwritten < objlen - c->sentlen) {
+			c->sentlen += nwritten;
+			return;
+		}
+
+		// 对象全部写入完毕（或者是空对象），删除节点
+		nwritten -= objlen - c->sentlen;
+		objmem = getStringObjectSdsUsedMemory(o);
+		listDelNode(c->reply, ln);
+		c->sentlen = 0;
+		c->reply_bytes -= objmem;
 	}
+}
 
+/*
+ * 写入之后的处理：写入出错时释放客户端，更新互动时间，
+ * 回复全部写完时删除写处理器（handler_installed 为真时），
+ * 并关闭设置了 REDIS_CLOSE_AFTER_REPLY 的客户端
+ *
+ * 客户端被释放时返回 REDIS_ERR
+ */
+static int afterClientWrite(redisClient *c, ssize_t nwritten, int totwritten,
+			    int handler_installed)
+{
 	// 写入出错检查
 	if (nwritten == -1) {
 		if (errno == EAGAIN) {
@@ -1278,7 +1457,7 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask)
 			redisLog(REDIS_VERBOSE, "Error writing to client: %s",
 				 strerror(errno));
 			freeClient(c, NGX_FUNC_LINE);
-			return;
+			return REDIS_ERR;
 		}
 	}
 
@@ -1294,13 +1473,99 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask)
 		c->sentlen = 0;
 
 		// 删除 write handler
-		aeDeleteFileEvent(server.el, c->fd, AE_WRITABLE);
+		if (handler_installed)
+			aeDeleteFileEvent(server.el, c->fd, AE_WRITABLE);
 
 		/* Close connection after entire reply has been sent. */
 		// 如果指定了写入之后关闭客户端 FLAG ，那么关闭客户端
-		if (c->flags & REDIS_CLOSE_AFTER_REPLY)
+		if (c->flags & REDIS_CLOSE_AFTER_REPLY) {
 			freeClient(c, NGX_FUNC_LINE);
+			return REDIS_ERR;
+		}
 	}
+	return REDIS_OK;
+}
+
+/*
+ * 把客户端的回复写到套接字
+ *
+ * c->buf 和 c->reply 中的回复对象收集到一个 iovec 数组里，用一次 writev 写出，
+ * 管道化的客户端有几百个小回复时也只需要一次系统调用。
+ * handler_installed 表示是否由写处理器调用，回复写完时需要删除写处理器
+ *
+ * 客户端被释放时返回 REDIS_ERR
+ */ //这里面会限制最多一次性发送64M，避免数据过大阻塞
+static int writeToClient(redisClient *c, int handler_installed)
+{
+	struct iovec iov[REDIS_WRITEV_IOV_MAX];
+	ssize_t nwritten = 0;
+	int totwritten = 0, iovcnt;
+	size_t bytes;
+
+	// 一直循环，直到回复缓冲区为空
+	// 或者指定条件满足为止
+	while (c->bufpos > 0 || listLength(c->reply)) {
+		iovcnt = collectReplyIov(c, iov, REDIS_WRITEV_IOV_MAX,
+					 REDIS_WRITEV_MAX_BYTES, &bytes);
+
+		// 只剩下空对象，直接删除
+		if (bytes == 0) {
+			advanceReplyAfterWrite(c, 0);
+			continue;
+		}
+
+		// 写入内容到套接字
+		nwritten = writev(c->fd, iov, iovcnt);
+		// 出错则跳出
+		if (nwritten <= 0)
+			break;
+		// 成功写入则更新写入计数器变量，并释放写完的内容
+		totwritten += nwritten;
+		advanceReplyAfterWrite(c, nwritten);
+
+		// 没有全部写入，说明套接字的发送缓冲区已满，等下次可写再继续
+		if ((size_t)nwritten < bytes)
+			break;
+
+		/* Note that we avoid to send more than REDIS_MAX_WRITE_PER_EVENT
+     * bytes, in a single threaded server it's a good idea to serve
+     * other clients as well, even if a very large request comes from
+     * super fast link that is always able to accept data (in real world
+     * scenario think about 'KEYS *' against the loopback interface).
+     *
+     * 为了避免一个非常大的回复独占服务器，
+     * 当写入的总数量大于 REDIS_MAX_WRITE_PER_EVENT ，
+     * 临时中断写入，将处理时间让给其他客户端，
+     * 剩余的内容等下次写入就绪再继续写入
+     *
+     * However if we are over the maxmemory limit we ignore that and
+     * just deliver as much data as it is possible to deliver.
+     *
+     * 不过，如果服务器的内存占用已经超过了限制，
+     * 那么为了将回复缓冲区中的内容尽快写入给客户端，
+     * 然后释放回复缓冲区的空间来回收内存，
+     * 这时即使写入量超过了 REDIS_MAX_WRITE_PER_EVENT ，
+     * 程序也继续进行写入
+     */
+		if (totwritten > REDIS_MAX_WRITE_PER_EVENT && //最多写64M
+		    (server.maxmemory == 0 ||
+		     zmalloc_used_memory() < server.maxmemory))
+			break;
+	}
+
+	return afterClientWrite(c, nwritten, totwritten, handler_installed);
+}
+
+/*
+ * 负责传送命令回复的写处理器
+ */ //readQueryFromClient与sendReplyToClient对应，一个接收，一个发送  //创建TCP连接在acceptTcpHandler
+void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+	REDIS_NOTUSED(el);
+	REDIS_NOTUSED(fd);
+	REDIS_NOTUSED(mask);
+
+	writeToClient(privdata, 1);
 }
 
 /* resetClient prepare the client to process the next command */
@@ -1446,6 +1711,84 @@ static void setProtocolError(redisClient *c, int pos)
 // rdbSaveBackground把命令全部写入rdb文件中，然后在serverCron->backgroundSaveDoneHandler->updateSlavesWaitingBgsave中同步rdb文件内容到从服务器
 
 // RDB文件发送格式和普通命令字符串协议格式一样，$length\r\n+实际内容，rdb文件数据发送在updateSlavesWaitingBgsave->sendBulkToSlave，
+/*
+ * 删除查询缓冲区中借用模式已经处理过的命令
+ */
+static void trimQueryBuffer(redisClient *c)
+{
+	if (c->qb_pos) {
+		sdsrange(c->querybuf, c->qb_pos, -1);
+		c->qb_pos = 0;
+	}
+}
+
+/*
+ * 借用模式：c->querybuf + c->qb_pos 开始是一条完整的命令时，
+ * 一次扫描出所有参数，建立不需要为每个参数分配内存的参数对象（见 argvPoolGet）。
+ *
+ * 处理过的命令只是让 c->qb_pos 前进，在 processInputBuffer 结束时一起删除，
+ * 这样原地借用的参数在 resetClient 之前一直有效。
+ *
+ * 命令不完整或者格式不对时返回 REDIS_ERR，由 processMultibulkBuffer 逐步解析
+ */
+static int processMultibulkViews(redisClient *c)
+{
+	char *buf = c->querybuf + c->qb_pos;
+	size_t len = sdslen(c->querybuf) - c->qb_pos, cmdlen, prevend = 0;
+	long long argc;
+	int j;
+
+	argc = mbulkScan(buf, len, c->argvpos, c->argvposlen, &cmdlen);
+	if (argc > c->argvposlen) {
+		c->argvpos = zrealloc(c->argvpos, sizeof(mbulkArg) * argc);
+		c->argvposlen = argc;
+		argc = mbulkScan(buf, len, c->argvpos, c->argvposlen, &cmdlen);
+	}
+	if (argc == MBULK_AGAIN)
+		return REDIS_ERR;
+
+	c->qb_pos += cmdlen;
+	// 空白命令，和逐步解析一样 argc 为 0
+	if (argc == 0)
+		return REDIS_OK;
+
+	if (c->argv)
+		zfree(c->argv);
+	c->argv = zmalloc(sizeof(robj *) * argc);
+
+	for (j = 0; j < argc; j++) {
+		char *data = buf + c->argvpos[j].off;
+		size_t arglen = c->argvpos[j].len;
+		struct sdshdr *sh;
+		robj *o;
+
+		if (arglen <= REDIS_ARGV_EMBSTR_LIMIT) {
+			// 短参数复制到池子里的对象中
+			o = argvPoolGet(c);
+			sh = (void *)(o + 1);
+			memcpy(sh->buf, data, arglen);
+		} else if (c->argvpos[j].off >= prevend + sizeof(struct sdshdr)) {
+			// 前面的 "\r\n$<len>\r\n" 放得下 sdshdr，并且不会覆盖
+			// 上一个参数结尾的 '\0'（长度至少 4 位数时成立），原地改写成 sds
+			o = argvPoolGet(c);
+			sh = (void *)(data - sizeof(struct sdshdr));
+		} else {
+			o = createStringObject(data, arglen);
+			sh = NULL;
+		}
+		if (sh) {
+			sh->len = arglen;
+			sh->free = 0;
+			sh->buf[arglen] = '\0';
+			o->ptr = sh->buf;
+		}
+		c->argv[c->argc++] = o;
+		prevend = c->argvpos[j].off + arglen + 1;
+	}
+
+	return REDIS_OK;
+}
+
 // rdb主从整体同步(非增量式)数据接收函数为readSyncBulkPayload，其他数据(包括主从增量式命令同步)接收解析见processMultibulkBuffer
 int processMultibulkBuffer(redisClient *c)
 {
@@ -1459,6 +1802,12 @@ int processMultibulkBuffer(redisClient *c)
 		/* The client should have been reset */
 		redisAssertWithInfo(c, NULL, c->argc == 0);
 
+		// 借用模式下整条命令已经收齐时，不用逐个复制参数
+		if (server.argv_views && processMultibulkViews(c) == REDIS_OK)
+			return REDIS_OK;
+		// 逐步解析要求命令从缓冲区开头开始
+		trimQueryBuffer(c);
+
 		/* Multi bulk length cannot be read without a \r\n */
 		// 检查缓冲区的内容第一个 "\r\n"
 		newline = strchr(c->querybuf, '\r');
@@ -1671,24 +2020,26 @@ void processInputBuffer(redisClient *c)
 	// 如果读取出现 short read ，那么可能会有内容滞留在读取缓冲区里面
 	// 这些滞留内容也许不能完整构成一个符合协议的命令，
 	// 需要等待下次读事件的就绪
-	while (sdslen(c->querybuf)) {
+	// I/O 线程已经解析好的命令不在缓冲区里，也要处理
+	while ((c->io_flags & REDIS_IO_PENDING_COMMAND) ||
+	       sdslen(c->querybuf) > c->qb_pos) {
 		/* Return if clients are paused. */
 		// 如果客户端正处于暂停状态，那么直接返回
 		if (!(c->flags & REDIS_SLAVE) && clientsArePaused())
-			return; //正在进行cluster failove
+			break; //正在进行cluster failove
 				//手动故障转移，processInputBuffer->clientsArePaused会暂停处理客户端请求
 
 		/* Immediately abort if the client is in the middle of something. */
 		// REDIS_BLOCKED 状态表示客户端正在被阻塞
 		if (c->flags & REDIS_BLOCKED)
-			return;
+			break;
 
 		/* REDIS_CLOSE_AFTER_REPLY closes the connection once the reply is
      * written to the client. Make sure to not let the reply grow after
      * this flag has been set (i.e. don't process more commands). */
 		// 客户端已经设置了关闭 FLAG ，没有必要处理命令了
 		if (c->flags & REDIS_CLOSE_AFTER_REPLY)
-			return;
+			break;
 
 		/* Determine request type when unknown. */
 		// 判断请求的类型
@@ -1714,7 +2065,7 @@ void processInputBuffer(redisClient *c)
     ab，一共3个，分别是get ,a,b。 $3表示后面的get是3个字节。
     */
 		if (!c->reqtype) {
-			if (c->querybuf[0] == '*') {
+			if (c->querybuf[c->qb_pos] == '*') {
 				// 多条查询
 				c->reqtype = REDIS_REQ_MULTIBULK;
 			} else {
@@ -1724,7 +2075,11 @@ void processInputBuffer(redisClient *c)
 		}
 
 		// 将缓冲区中的内容转换成命令，以及命令参数
-		if (c->reqtype == REDIS_REQ_INLINE) {
+		if (c->io_flags & REDIS_IO_PENDING_COMMAND) {
+			// I/O 线程已经解析好了参数，直接执行
+			c->io_flags &= ~REDIS_IO_PENDING_COMMAND;
+		} else if (c->reqtype == REDIS_REQ_INLINE) {
+			trimQueryBuffer(c);
 			if (processInlineBuffer(c) != REDIS_OK)
 				break;
 		} else if (c->reqtype == REDIS_REQ_MULTIBULK) {
@@ -1744,24 +2099,28 @@ void processInputBuffer(redisClient *c)
 				resetClient(c);
 		}
 	}
+
+	// I/O 线程解析好的命令没有执行（客户端被暂停、阻塞或者即将关闭），
+	// 下次读入之前让它的参数不再借用查询缓冲区
+	if (c->io_flags & REDIS_IO_PENDING_COMMAND)
+		materializeArgvViews(c);
+
+	// 一起删除借用模式处理过的命令。没有执行的命令（比如 QUIT）的参数
+	// 可能还借用着缓冲区，这时先不动，客户端反正马上要关闭了
+	if (c->argc == 0)
+		trimQueryBuffer(c);
 }
 
 /*
-//如果杀掉主节点redis，节点通过readQueryFromClient(备接收主的实时KV用这个)或者clusterReadHandler(集群之间通信用这个)中的read读异常事件检测到节点异常
- * 读取客户端的查询缓冲区内容
- */ //readQueryFromClient与sendReplyToClient对应，一个接收，一个发送  //创建TCP连接在acceptTcpHandler，关闭连接并释放资源见freeClient    读取数据在readQueryFromClient
-void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask)
+ * 从套接字读入数据到查询缓冲区，返回 read 的结果
+ *
+ * 只修改客户端自己的状态，I/O 线程也调用这个函数
+ */
+static ssize_t readClientSocket(redisClient *c)
 {
-	//主 备
-	//量同步完成后，备创建一个client来接收主到备的实时KV,通过readQueryFromClient接收主来的实时KV数据
-	redisClient *c = (redisClient *)privdata;
-	int nread, readlen;
+	ssize_t nread;
+	int readlen;
 	size_t qblen;
-	REDIS_NOTUSED(el);
-	REDIS_NOTUSED(mask);
-
-	// 设置服务器的当前客户端
-	server.current_client = c;
 
 	// 读入长度（默认为 16 MB）
 	readlen = REDIS_IOBUF_LEN;
@@ -1791,40 +2150,45 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask)
 	// 为查询缓冲区分配空间
 	c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
 	// 读入内容到查询缓存
-	nread = read(fd, c->querybuf + qblen, readlen);
+	nread = read(c->fd, c->querybuf + qblen, readlen);
+
+	// 根据内容，更新查询缓冲区（SDS） free 和 len 属性
+	// 并将 '\0' 正确地放到内容的最后
+	if (nread > 0)
+		sdsIncrLen(c->querybuf, nread);
+	return nread;
+}
 
+/*
+ * 处理 readClientSocket 的结果：出错或者连接关闭时释放客户端，
+ * 更新互动时间和复制偏移，检查查询缓冲区的长度限制
+ *
+ * 可以继续处理查询缓冲区时返回 REDIS_OK
+ */
+static int afterClientRead(redisClient *c, ssize_t nread)
+{
 	// 读入出错
 	if (nread == -1) {
-		if (errno == EAGAIN) {
-			nread = 0;
-		} else {
-			redisLog(REDIS_VERBOSE, "Reading from client: %s",
-				 strerror(errno));
-			freeClient(c, NGX_FUNC_LINE);
-			return;
-		}
+		// 在 nread == -1 且 errno == EAGAIN 时没有数据
+		if (errno == EAGAIN)
+			return REDIS_ERR;
+		redisLog(REDIS_VERBOSE, "Reading from client: %s",
+			 strerror(errno));
+		freeClient(c, NGX_FUNC_LINE);
+		return REDIS_ERR;
 		// 遇到 EOF
 	} else if (nread == 0) {
 		redisLog(REDIS_VERBOSE, "Client closed connection");
 		freeClient(c, NGX_FUNC_LINE);
-		return;
+		return REDIS_ERR;
 	}
 
-	if (nread) {
-		// 根据内容，更新查询缓冲区（SDS） free 和 len 属性
-		// 并将 '\0' 正确地放到内容的最后
-		sdsIncrLen(c->querybuf, nread);
-		// 记录服务器和客户端最后一次互动的时间
-		c->lastinteraction = server.unixtime;
-		// 如果客户端是 master 的话，更新它的复制偏移
-		// ，也就是对方是master，本实例为slave
-		if (c->flags & REDIS_MASTER)
-			c->reploff += nread;
-	} else {
-		// 在 nread == -1 且 errno == EAGAIN 时运行
-		server.current_client = NULL;
-		return;
-	}
+	// 记录服务器和客户端最后一次互动的时间
+	c->lastinteraction = server.unixtime;
+	// 如果客户端是 master 的话，更新它的复制偏移
+	// ，也就是对方是master，本实例为slave
+	if (c->flags & REDIS_MASTER)
+		c->reploff += nread;
 
 	// 查询缓冲区长度超出服务器最大缓冲区长度
 	// 清空缓冲区并释放客户端
@@ -1840,12 +2204,38 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask)
 		sdsfree(ci);
 		sdsfree(bytes);
 		freeClient(c, NGX_FUNC_LINE);
-		return;
+		return REDIS_ERR;
 	}
+	return REDIS_OK;
+}
+
+/*
+//如果杀掉主节点redis，节点通过readQueryFromClient(备接收主的实时KV用这个)或者clusterReadHandler(集群之间通信用这个)中的read读异常事件检测到节点异常
+ * 读取客户端的查询缓冲区内容
+ */ //readQueryFromClient与sendReplyToClient对应，一个接收，一个发送  //创建TCP连接在acceptTcpHandler，关闭连接并释放资源见freeClient    读取数据在readQueryFromClient
+void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+	//主 备
+	//量同步完成后，备创建一个client来接收主到备的实时KV,通过readQueryFromClient接收主来的实时KV数据
+	redisClient *c = (redisClient *)privdata;
+	ssize_t nread;
+	REDIS_NOTUSED(el);
+	REDIS_NOTUSED(fd);
+	REDIS_NOTUSED(mask);
+
+	// 打开了 I/O 线程时交给线程读取和解析，beforeSleep 中再执行命令
+	if (postponeClientRead(c))
+		return;
+
+	// 设置服务器的当前客户端
+	server.current_client = c;
+
+	nread = readClientSocket(c);
 
 	// 从查询缓存重读取内容，创建参数，并执行命令
 	// 函数会执行到缓存中的所有内容都被处理完为止
-	processInputBuffer(c);
+	if (afterClientRead(c, nread) == REDIS_OK)
+		processInputBuffer(c);
 
 	server.current_client = NULL;
 }
@@ -2453,6 +2843,393 @@ int clientsArePaused(void)
 	return server.clients_paused;
 }
 
+/* ==========================================================================
+ * Threaded I/O
+ * ======================================================================== */
+
+/*
+ * 多线程读写（server.io_threads_num > 1 时打开，包括主线程在内的线程数）
+ *
+ * 事件循环中可读的客户端先放进 server.clients_pending_read，有新回复的客户端
+ * 放进 server.clients_pending_write。beforeSleep 把它们平均分给 I/O 线程
+ * （主线程自己也处理一份），各线程并行地读套接字、解析出第一条命令，
+ * 或者写出回复，主线程等所有线程做完之后再依次执行命令、处理出错的客户端。
+ * 执行命令、释放客户端、修改事件以及回复对象的引用计数都只在主线程进行，
+ * 命令的语义和单线程时一样。
+ *
+ * 线程没有任务时忙等，主线程持有线程的互斥锁时线程在锁上睡眠：
+ * 待写的客户端很少时不值得让线程忙等，停掉线程，直接在主线程读写
+ */
+#define REDIS_IO_THREADS_MAX_NUM 16
+// 线程在检查是否需要睡眠之前忙等的次数
+#define REDIS_IO_THREADS_BUSY_LOOPS 1000000
+
+#define REDIS_IO_THREADS_OP_READ 0
+#define REDIS_IO_THREADS_OP_WRITE 1
+
+static pthread_t io_threads[REDIS_IO_THREADS_MAX_NUM];
+static pthread_mutex_t io_threads_mutex[REDIS_IO_THREADS_MAX_NUM];
+// 分给每个线程的客户端，0 号由主线程处理
+static list *io_threads_list[REDIS_IO_THREADS_MAX_NUM];
+// 每个线程还没处理完的客户端个数，主线程分配任务后设置，线程做完后清零
+static unsigned long io_threads_pending[REDIS_IO_THREADS_MAX_NUM];
+// 这一轮是读还是写
+static int io_threads_op;
+// 线程是否在运行（没有在互斥锁上睡眠）
+static int io_threads_active = 0;
+// processEventsWhileBlocked 期间不交给 I/O 线程读
+static int processing_events_while_blocked = 0;
+
+static unsigned long getIOPendingCount(int id)
+{
+	return __atomic_load_n(&io_threads_pending[id], __ATOMIC_ACQUIRE);
+}
+
+static void setIOPendingCount(int id, unsigned long count)
+{
+	__atomic_store_n(&io_threads_pending[id], count, __ATOMIC_RELEASE);
+}
+
+/*
+ * I/O 线程读一个客户端
+ *
+ * 开启借用模式（server.argv_views）时，如果读入之后查询缓冲区开头是一条完整的
+ * 多条查询命令，用借用模式解析出参数（不分配回复、不修改共享状态），留给主线程
+ * 执行；关闭借用模式时只读不解析，和主线程读路径选用同一种解析器。
+ * 客户端被暂停时也不解析（只读 server.clients_paused，clientsArePaused 会修改
+ * 共享状态），和主线程一样等暂停结束再解析。
+ * 内联命令、不完整或者格式不对的命令，以及读取出错，都交给主线程按原来的方式处理
+ */
+static void ioThreadReadClient(redisClient *c)
+{
+	c->io_nbytes = readClientSocket(c);
+	c->io_errno = errno;
+
+	if (server.argv_views && c->io_nbytes > 0 && c->argc == 0 &&
+	    c->multibulklen == 0 &&
+	    !(c->flags & (REDIS_BLOCKED | REDIS_CLOSE_AFTER_REPLY)) &&
+	    ((c->flags & REDIS_SLAVE) || !server.clients_paused) &&
+	    processMultibulkViews(c) == REDIS_OK && c->argc > 0) {
+		c->reqtype = REDIS_REQ_MULTIBULK;
+		c->io_flags |= REDIS_IO_PENDING_COMMAND;
+	}
+}
+
+/*
+ * I/O 线程写一个客户端：收集回复，用一次 writev 写出
+ *
+ * 回复对象可能是共享对象，引用计数不是原子的，
+ * 所以这里不删除写完的对象，由主线程根据写入的字节数释放
+ */
+static void ioThreadWriteClient(redisClient *c)
+{
+	struct iovec iov[REDIS_WRITEV_IOV_MAX];
+	size_t bytes;
+	int iovcnt;
+
+	iovcnt = collectReplyIov(c, iov, REDIS_WRITEV_IOV_MAX,
+				 REDIS_WRITEV_MAX_BYTES, &bytes);
+	c->io_nbytes = bytes ? writev(c->fd, iov, iovcnt) : 0;
+	c->io_errno = errno;
+}
+
+static void *ioThreadMain(void *arg)
+{
+	long id = (long)arg;
+	sigset_t sigset;
+	listIter li;
+	listNode *ln;
+	int j;
+
+	/* Block SIGALRM so we are sure that only the main thread will
+   * receive the watchdog signal. */
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGALRM);
+	if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+		redisLog(REDIS_WARNING,
+			 "Warning: can't mask SIGALRM in I/O thread: %s",
+			 strerror(errno));
+
+	while (1) {
+		// 先忙等一会，主线程每次进入 beforeSleep 都会分配任务
+		for (j = 0; j < REDIS_IO_THREADS_BUSY_LOOPS; j++) {
+			if (getIOPendingCount(id) != 0)
+				break;
+		}
+
+		// 主线程停掉了线程时在互斥锁上睡眠
+		if (getIOPendingCount(id) == 0) {
+			pthread_mutex_lock(&io_threads_mutex[id]);
+			pthread_mutex_unlock(&io_threads_mutex[id]);
+			continue;
+		}
+
+		listRewind(io_threads_list[id], &li);
+		while ((ln = listNext(&li))) {
+			redisClient *c = listNodeValue(ln);
+
+			if (io_threads_op == REDIS_IO_THREADS_OP_WRITE)
+				ioThreadWriteClient(c);
+			else
+				ioThreadReadClient(c);
+		}
+		listEmpty(io_threads_list[id]);
+		setIOPendingCount(id, 0);
+	}
+	return NULL;
+}
+
+/*
+ * 初始化 I/O 线程，在 initServer 中调用
+ *
+ * 线程创建之后在各自的互斥锁上睡眠，直到待写的客户端足够多时才开始工作
+ */
+void initThreadedIO(void)
+{
+	long j;
+
+	io_threads_active = 0;
+	if (server.io_threads_num <= 1)
+		return;
+	if (server.io_threads_num > REDIS_IO_THREADS_MAX_NUM) {
+		redisLog(REDIS_WARNING,
+			 "Fatal: too many I/O threads configured. "
+			 "The maximum number is %d.",
+			 REDIS_IO_THREADS_MAX_NUM);
+		exit(1);
+	}
+
+	// I/O 线程也会分配和释放内存
+	zmalloc_enable_thread_safeness();
+
+	for (j = 0; j < server.io_threads_num; j++) {
+		io_threads_list[j] = listCreate();
+		setIOPendingCount(j, 0);
+
+		// 0 号是主线程
+		if (j == 0)
+			continue;
+		pthread_mutex_init(&io_threads_mutex[j], NULL);
+		pthread_mutex_lock(&io_threads_mutex[j]);
+		if (pthread_create(&io_threads[j], NULL, ioThreadMain,
+				   (void *)j) != 0) {
+			redisLog(REDIS_WARNING,
+				 "Fatal: Can't initialize I/O threads.");
+			exit(1);
+		}
+	}
+}
+
+static void startThreadedIO(void)
+{
+	int j;
+
+	for (j = 1; j < server.io_threads_num; j++)
+		pthread_mutex_unlock(&io_threads_mutex[j]);
+	io_threads_active = 1;
+}
+
+static void stopThreadedIO(void)
+{
+	int j;
+
+	// 先处理已经交给线程读的客户端
+	handleClientsWithPendingReadsUsingThreads();
+	for (j = 1; j < server.io_threads_num; j++)
+		pthread_mutex_lock(&io_threads_mutex[j]);
+	io_threads_active = 0;
+}
+
+/*
+ * 待写的客户端少于线程数的两倍时停掉线程，返回 1，由主线程直接写
+ */
+static int stopThreadedIOIfNeeded(void)
+{
+	int pending = listLength(server.clients_pending_write);
+
+	if (server.io_threads_num <= 1)
+		return 1;
+	if (pending < server.io_threads_num * 2) {
+		if (io_threads_active)
+			stopThreadedIO();
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * 把 clients 中的客户端平均分给各线程，主线程处理自己那份，
+ * 然后等所有线程做完
+ */
+static void runThreadedIO(list *clients, int op)
+{
+	listIter li;
+	listNode *ln;
+	unsigned long pending;
+	int item_id = 0, j;
+
+	listRewind(clients, &li);
+	while ((ln = listNext(&li))) {
+		int target_id = item_id % server.io_threads_num;
+
+		listAddNodeTail(io_threads_list[target_id], listNodeValue(ln));
+		item_id++;
+	}
+
+	// 先设置任务类型，线程看到任务个数之后才会读取
+	io_threads_op = op;
+	for (j = 1; j < server.io_threads_num; j++)
+		setIOPendingCount(j, listLength(io_threads_list[j]));
+
+	listRewind(io_threads_list[0], &li);
+	while ((ln = listNext(&li))) {
+		redisClient *c = listNodeValue(ln);
+
+		if (op == REDIS_IO_THREADS_OP_WRITE)
+			ioThreadWriteClient(c);
+		else
+			ioThreadReadClient(c);
+	}
+	listEmpty(io_threads_list[0]);
+
+	// 等待其他线程
+	do {
+		pending = 0;
+		for (j = 1; j < server.io_threads_num; j++)
+			pending += getIOPendingCount(j);
+	} while (pending != 0);
+}
+
+/*
+ * 打开 I/O 线程时，可读的客户端不在事件处理器里读，
+ * 放进 server.clients_pending_read，在 beforeSleep 中交给线程读
+ *
+ * 主从复制的客户端仍然在主线程读
+ */
+static int postponeClientRead(redisClient *c)
+{
+	if (io_threads_active && server.io_threads_do_reads &&
+	    !processing_events_while_blocked &&
+	    !(c->flags & (REDIS_MASTER | REDIS_SLAVE)) &&
+	    !(c->io_flags & REDIS_IO_PENDING_READ)) {
+		c->io_flags |= REDIS_IO_PENDING_READ;
+		listAddNodeHead(server.clients_pending_read, c);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * 由 I/O 线程读取并解析 server.clients_pending_read 中的客户端，
+ * 然后在主线程依次执行命令。在 beforeSleep 中调用
+ *
+ * 返回处理的客户端个数
+ */
+int handleClientsWithPendingReadsUsingThreads(void)
+{
+	int processed;
+
+	if (!io_threads_active || !server.io_threads_do_reads)
+		return 0;
+	processed = listLength(server.clients_pending_read);
+	if (processed == 0)
+		return 0;
+
+	runThreadedIO(server.clients_pending_read, REDIS_IO_THREADS_OP_READ);
+
+	// 执行命令时可能释放其他客户端（比如 CLIENT KILL），
+	// freeClient 会把它们从链表中删除，所以每次都取链表头
+	while (listLength(server.clients_pending_read)) {
+		listNode *ln = listFirst(server.clients_pending_read);
+		redisClient *c = listNodeValue(ln);
+
+		c->io_flags &= ~REDIS_IO_PENDING_READ;
+		listDelNode(server.clients_pending_read, ln);
+
+		errno = c->io_errno;
+		if (afterClientRead(c, c->io_nbytes) != REDIS_OK)
+			continue;
+
+		server.current_client = c;
+		processInputBuffer(c);
+		server.current_client = NULL;
+	}
+	return processed;
+}
+
+/*
+ * 在主线程写出 server.clients_pending_write 中的客户端，
+ * 没写完的安装写处理器
+ *
+ * 返回处理的客户端个数
+ */
+int handleClientsWithPendingWrites(void)
+{
+	int processed = listLength(server.clients_pending_write);
+
+	while (listLength(server.clients_pending_write)) {
+		listNode *ln = listFirst(server.clients_pending_write);
+		redisClient *c = listNodeValue(ln);
+
+		c->io_flags &= ~REDIS_IO_PENDING_WRITE;
+		listDelNode(server.clients_pending_write, ln);
+
+		if (writeToClient(c, 0) == REDIS_ERR)
+			continue;
+		if ((c->bufpos || listLength(c->reply)) &&
+		    aeCreateFileEvent(server.el, c->fd, AE_WRITABLE,
+				      sendReplyToClient, c) == AE_ERR)
+			freeClientAsync(c);
+	}
+	return processed;
+}
+
+/*
+ * 由 I/O 线程写出 server.clients_pending_write 中的客户端，
+ * 没写完的安装写处理器。在 beforeSleep 中调用
+ *
+ * 返回处理的客户端个数
+ */
+int handleClientsWithPendingWritesUsingThreads(void)
+{
+	int processed = listLength(server.clients_pending_write);
+
+	if (processed == 0)
+		return 0;
+
+	// 客户端很少时不值得使用线程
+	if (stopThreadedIOIfNeeded())
+		return handleClientsWithPendingWrites();
+	if (!io_threads_active)
+		startThreadedIO();
+
+	runThreadedIO(server.clients_pending_write, REDIS_IO_THREADS_OP_WRITE);
+
+	while (listLength(server.clients_pending_write)) {
+		listNode *ln = listFirst(server.clients_pending_write);
+		redisClient *c = listNodeValue(ln);
+		ssize_t nwritten = c->io_nbytes;
+
+		c->io_flags &= ~REDIS_IO_PENDING_WRITE;
+		listDelNode(server.clients_pending_write, ln);
+
+		// 释放线程写完的内容
+		if (nwritten >= 0)
+			advanceReplyAfterWrite(c, nwritten);
+		errno = c->io_errno;
+		if (afterClientWrite(c, nwritten, nwritten > 0 ? nwritten : 0,
+				     0) == REDIS_ERR)
+			continue;
+
+		// 没写完（套接字缓冲区满了或者超过了每次写入的上限）
+		if ((c->bufpos || listLength(c->reply)) &&
+		    aeCreateFileEvent(server.el, c->fd, AE_WRITABLE,
+				      sendReplyToClient, c) == AE_ERR)
+			freeClientAsync(c);
+	}
+	return processed;
+}
+
 /* This function is called by Redis in order to process a few events from
  * time to time while blocked into some not interruptible operation.
  * This allows to reply to clients with the -LOADING error while loading the
@@ -2470,14 +3247,19 @@ int processEventsWhileBlocked(void)
 {
 	int iterations = 4; /* See the function top-comment. */
 	int count = 0;
+
+	// 这期间不会调用 beforeSleep，在主线程直接读，并且自己写出回复
+	processing_events_while_blocked = 1;
 	while (iterations--) {
 		int events = aeProcessEvents(
 			server.el,
 			AE_FILE_EVENTS |
 				AE_DONT_WAIT); //这里只处理FILE事件，不会处理TIME时间
+		events += handleClientsWithPendingWrites();
 		if (!events)
 			break;
 		count += events;
 	}
+	processing_events_while_blocked = 0;
 	return count;
 }
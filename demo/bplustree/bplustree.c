@@ -2,9 +2,15 @@
  * Copyright (C) 2017, Leo Ma <begeekmyfriend@gmail.com>
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <assert.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -42,6 +48,8 @@ enum {
 static int _block_size;
 static int _max_entries;
 static int _max_order;
+/* 本线程最近一次 node_seek() 的节点 */
+static __thread struct bplus_node *_seek_node;
 
 /* 是否叶子节点 */
 static inline int is_leaf(struct bplus_node *node)
@@ -49,14 +57,9 @@ static inline int is_leaf(struct bplus_node *node)
 	return node->type == BPLUS_TREE_LEAF;
 }
 
-/* 搜索 key
- * 二分查找 */
-static int key_binary_search(struct bplus_node *node, key_t target)
+/* 在长度为 len 的 key 数组中二分查找 */
+static int key_search(key_t *arr, int len, key_t target)
 {
-	/* 获取 key 数组 */
-	key_t *arr = key(node);
-	/* 获取 key 数组长度 */
-	int len = is_leaf(node) ? node->children : node->children - 1;
 	int low = -1;
 	int high = len;
 
@@ -82,41 +85,459 @@ static int key_binary_search(struct bplus_node *node, key_t target)
 	}
 }
 
+/* 搜索 key
+ * 二分查找 */
+static inline int key_binary_search(struct bplus_node *node, key_t target)
+{
+	/* 获取 key 数组长度 */
+	int len = is_leaf(node) ? node->children : node->children - 1;
+	return key_search(key(node), len, target);
+}
+
 static inline int parent_key_index(struct bplus_node *parent, key_t key)
 {
 	int index = key_binary_search(parent, key);
 	return index >= 0 ? index : -index - 2;
 }
 
-/* 获取空闲节点 */
-static inline struct bplus_node *cache_refer(struct bplus_tree *tree)
+/* 缓冲池帧, 帧头紧挨在块数据前面, 节点指针减去帧头即得到帧 */
+struct bplus_frame {
+	/* 所缓存块的偏移量, 空闲帧为 INVALID_OFFSET */
+	off_t offset;
+	/* 正在使用该块的引用数, 大于 0 时不能淘汰 */
+	int pin;
+	/* 被修改过, 淘汰前需要写回 */
+	int dirty;
+	/* CLOCK 访问位 */
+	int ref;
+	/* 哈希链表中的下一帧 */
+	int next;
+	int shard;
+	/* 节点版本锁, 偶数表示未加锁, 写者加锁时为奇数, 解锁后加一
+	 * 帧被换成其他块时同样加 2, 乐观读者据此发现节点已变化 */
+	unsigned long version;
+	/* 在未提交修改中的序号加一, 0 表示不在其中 */
+	int txn;
+};
+
+#define FRAME_HDR_SIZE ((sizeof(struct bplus_frame) + 63) & ~(size_t)63)
+
+struct bplus_shard {
+	pthread_mutex_t lock;
+	char *frames;
+	int frame_num;
+	/* 哈希桶, 存放帧下标, -1 表示空 */
+	int *buckets;
+	/* CLOCK 指针 */
+	int hand;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long writes;
+} __attribute__((aligned(64)));
+
+static inline struct bplus_frame *shard_frame(struct bplus_shard *shard, int i)
 {
-	int i;
-	for (i = 0; i < MIN_CACHE_NUM; i++) {
-		if (!tree->used[i]) {
-			tree->used[i] = 1;
-			char *buf = tree->caches + _block_size * i;
-			return (struct bplus_node *)buf;
+	return (struct bplus_frame *)(shard->frames +
+				      (FRAME_HDR_SIZE + _block_size) * i);
+}
+
+static inline struct bplus_frame *node_frame(struct bplus_node *node)
+{
+	return (struct bplus_frame *)((char *)node - FRAME_HDR_SIZE);
+}
+
+static inline struct bplus_node *frame_node(struct bplus_frame *frame)
+{
+	return (struct bplus_node *)((char *)frame + FRAME_HDR_SIZE);
+}
+
+/* 一次结构修改改动过的块, 提交前一直 pin 住不会写回
+ * 缓冲池不够时由修改者自己换出, 内容暂存在 image 中 */
+struct txn_page {
+	off_t offset;
+	struct bplus_frame *frame;
+	char *image;
+};
+
+struct bplus_txn {
+	/* 持有结构修改锁的线程 */
+	pthread_t owner;
+	int active;
+	struct txn_page *pages;
+	int npages;
+	int page_cap;
+	/* 从空闲链表取出和放回的块 */
+	off_t *alloc;
+	int nalloc;
+	int alloc_cap;
+	off_t *freed;
+	int nfree;
+	int free_cap;
+};
+
+static void *txn_grow(void *arr, int n, int *cap, size_t size)
+{
+	if (n == *cap) {
+		*cap = *cap ? *cap * 2 : 16;
+		arr = realloc(arr, *cap * size);
+		assert(arr != NULL);
+	}
+	return arr;
+}
+
+static inline int txn_owned(struct bplus_tree *tree)
+{
+	return tree->txn->active &&
+	       pthread_equal(tree->txn->owner, pthread_self());
+}
+
+/* 记录空闲链表的变化, 恢复时据此重建 */
+static void txn_note(struct bplus_tree *tree, off_t offset, int freed)
+{
+	struct bplus_txn *txn = tree->txn;
+	if (!txn->active) {
+		return;
+	}
+	if (freed) {
+		txn->freed = txn_grow(txn->freed, txn->nfree, &txn->free_cap,
+				      sizeof(off_t));
+		txn->freed[txn->nfree++] = offset;
+	} else {
+		txn->alloc = txn_grow(txn->alloc, txn->nalloc, &txn->alloc_cap,
+				      sizeof(off_t));
+		txn->alloc[txn->nalloc++] = offset;
+	}
+}
+
+/* 调用者持有 wal_lock */
+static void wal_fsync(struct bplus_tree *tree)
+{
+	int err = fdatasync(tree->wal_fd);
+	(void)err;
+	assert(err == 0);
+	tree->wal_unsynced = 0;
+	tree->wal_syncs++;
+}
+
+static void wal_sync(struct bplus_tree *tree)
+{
+	pthread_mutex_lock(&tree->wal_lock);
+	if (tree->wal_unsynced > 0) {
+		wal_fsync(tree);
+	}
+	pthread_mutex_unlock(&tree->wal_lock);
+}
+
+/* 先写日志: 块写回文件前, 改动它的提交记录必须已经落盘 */
+static inline void wal_ahead(struct bplus_tree *tree)
+{
+	if (tree->durability == BPLUS_DURABLE_GROUP &&
+	    __atomic_load_n(&tree->wal_unsynced, __ATOMIC_RELAXED) > 0) {
+		wal_sync(tree);
+	}
+}
+
+/* 缓冲池被未提交的修改占满, 把 frame 的内容移到 image 中腾出帧 */
+static void txn_spill(struct bplus_tree *tree, struct bplus_frame *frame)
+{
+	struct txn_page *page = &tree->txn->pages[frame->txn - 1];
+	page->image = malloc(_block_size);
+	assert(page->image != NULL);
+	memcpy(page->image, frame_node(frame), _block_size);
+	page->frame = NULL;
+	frame->txn = 0;
+	frame->pin = 0;
+	frame->dirty = 0;
+	__atomic_add_fetch(&tree->txn_spilled, 1, __ATOMIC_RELEASE);
+}
+
+/* Fibonacci hashing of the block number: the top bits pick the shard,
+ * the bits below them the bucket */
+static inline unsigned long block_hash(off_t offset)
+{
+	return (unsigned long)(offset / _block_size) * 0x9e3779b97f4a7c15UL;
+}
+
+static inline struct bplus_shard *shard_of(struct bplus_tree *tree,
+					   unsigned long hash)
+{
+	return tree->shard_bits == 0 ?
+		       tree->shards :
+		       &tree->shards[hash >> (64 - tree->shard_bits)];
+}
+
+static inline int *bucket_of(struct bplus_tree *tree,
+			     struct bplus_shard *shard, unsigned long hash)
+{
+	hash <<= tree->shard_bits;
+	return &shard->buckets[hash >> (64 - tree->bucket_bits)];
+}
+
+static void frame_unhash(struct bplus_tree *tree, struct bplus_shard *shard,
+			 struct bplus_frame *frame)
+{
+	int *p = bucket_of(tree, shard, block_hash(frame->offset));
+	while (shard_frame(shard, *p) != frame) {
+		p = &shard_frame(shard, *p)->next;
+	}
+	*p = frame->next;
+	frame->offset = INVALID_OFFSET;
+}
+
+/* 写回脏块 */
+static void frame_write(struct bplus_shard *shard, int fd,
+			struct bplus_frame *frame)
+{
+	int len = pwrite(fd, frame_node(frame), _block_size, frame->offset);
+	(void)len;
+	assert(len == _block_size);
+	frame->dirty = 0;
+	shard->writes++;
+}
+
+/* CLOCK: 跳过被引用的帧, 清除访问位, 淘汰第一个访问位为 0 的帧 */
+static struct bplus_frame *shard_victim(struct bplus_tree *tree,
+					struct bplus_shard *shard)
+{
+	int n;
+	for (n = 0; n < 2 * shard->frame_num; n++) {
+		struct bplus_frame *frame = shard_frame(shard, shard->hand);
+		if (++shard->hand == shard->frame_num) {
+			shard->hand = 0;
+		}
+		if (frame->pin > 0) {
+			continue;
+		}
+		if (frame->offset == INVALID_OFFSET) {
+			return frame;
+		}
+		if (frame->ref) {
+			frame->ref = 0;
+			continue;
+		}
+		if (frame->dirty) {
+			wal_ahead(tree);
+			frame_write(shard, tree->fd, frame);
+		}
+		frame_unhash(tree, shard, frame);
+		return frame;
+	}
+
+	if (tree->txn->active) {
+		if (!txn_owned(tree)) {
+			/* 被其他线程未提交的修改占满, 等它提交 */
+			return NULL;
+		}
+		for (n = 0; n < shard->frame_num; n++) {
+			struct bplus_frame *frame = shard_frame(shard, n);
+			if (frame->txn && frame->pin == 1) {
+				txn_spill(tree, frame);
+				frame_unhash(tree, shard, frame);
+				return frame;
+			}
 		}
 	}
+	/* every frame pinned, the pool is smaller than MIN_CACHE_NUM */
 	assert(0);
 	return NULL;
 }
 
-/* 缓存释放节点 */
-static inline void cache_defer(struct bplus_tree *tree, struct bplus_node *node)
+/* 本次修改中被换出的块, 返回序号, 没有返回 -1 */
+static int txn_spilled_page(struct bplus_tree *tree, off_t offset)
 {
-	/* return the node cache borrowed from */
-	char *buf = (char *)node;
-	int i = (buf - tree->caches) / _block_size;
-	tree->used[i] = 0;
+	struct bplus_txn *txn = tree->txn;
+	int i;
+	for (i = 0; i < txn->npages; i++) {
+		if (txn->pages[i].image != NULL && txn->pages[i].offset == offset) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* 在缓冲池中查找 offset 所在的块, 没有则淘汰一帧,
+ * load 时从文件读入
+ * 未提交的块被换出期间, 其他线程不在缓冲池中的块返回 NULL */
+static struct bplus_node *cache_get(struct bplus_tree *tree, off_t offset,
+				    int pin, int load)
+{
+	unsigned long hash = block_hash(offset);
+	struct bplus_shard *shard = shard_of(tree, hash);
+	int *bucket = bucket_of(tree, shard, hash);
+	struct bplus_frame *frame = NULL;
+	int i, spilled = -1;
+
+retry:
+	pthread_mutex_lock(&shard->lock);
+	for (i = *bucket; i >= 0; i = frame->next) {
+		frame = shard_frame(shard, i);
+		if (frame->offset == offset) {
+			break;
+		}
+	}
+	if (i >= 0) {
+		shard->hits++;
+	} else {
+		if (__atomic_load_n(&tree->txn_spilled, __ATOMIC_ACQUIRE) > 0) {
+			if (!txn_owned(tree)) {
+				pthread_mutex_unlock(&shard->lock);
+				return NULL;
+			}
+			spilled = txn_spilled_page(tree, offset);
+		}
+		frame = shard_victim(tree, shard);
+		if (frame == NULL) {
+			pthread_mutex_unlock(&shard->lock);
+			sched_yield();
+			goto retry;
+		}
+		shard->misses++;
+		__atomic_add_fetch(&frame->version, 1, __ATOMIC_SEQ_CST);
+		frame->offset = offset;
+		frame->dirty = 0;
+		frame->next = *bucket;
+		*bucket = ((char *)frame - shard->frames) /
+			  (FRAME_HDR_SIZE + _block_size);
+		if (spilled >= 0) {
+			/* 换回未提交的内容, 重新由本次修改 pin 住 */
+			struct txn_page *page = &tree->txn->pages[spilled];
+			memcpy(frame_node(frame), page->image, _block_size);
+			free(page->image);
+			page->image = NULL;
+			page->frame = frame;
+			frame->txn = spilled + 1;
+			frame->pin++;
+			__atomic_sub_fetch(&tree->txn_spilled, 1, __ATOMIC_RELEASE);
+		} else if (load) {
+			int len = pread(tree->fd, frame_node(frame), _block_size,
+					offset);
+			(void)len;
+			assert(len == _block_size);
+		}
+		__atomic_add_fetch(&frame->version, 1, __ATOMIC_RELEASE);
+	}
+	frame->ref = 1;
+	frame->pin += pin;
+	pthread_mutex_unlock(&shard->lock);
+	return frame_node(frame);
+}
+
+/* 放回节点, dirty 表示节点被修改过 */
+static inline void cache_defer(struct bplus_tree *tree, struct bplus_node *node,
+			       int dirty)
+{
+	struct bplus_frame *frame = node_frame(node);
+	struct bplus_shard *shard = &tree->shards[frame->shard];
+
+	pthread_mutex_lock(&shard->lock);
+	assert(frame->pin > 0);
+	frame->pin--;
+	frame->dirty |= dirty;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* 标记节点正在使用, 不能被淘汰 */
+static inline void cache_pin(struct bplus_tree *tree, struct bplus_node *node)
+{
+	struct bplus_frame *frame = node_frame(node);
+	struct bplus_shard *shard = &tree->shards[frame->shard];
+
+	pthread_mutex_lock(&shard->lock);
+	frame->pin++;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* 块已释放, 丢弃缓存内容 */
+static inline void cache_drop(struct bplus_tree *tree, struct bplus_node *node)
+{
+	struct bplus_frame *frame = node_frame(node);
+	struct bplus_shard *shard = &tree->shards[frame->shard];
+
+	/* a dropped node may still be the seek pin of this thread */
+	if (_seek_node == node) {
+		_seek_node = NULL;
+	}
+
+	pthread_mutex_lock(&shard->lock);
+	assert(frame->pin >= 1);
+	if (frame->txn) {
+		struct txn_page *page = &tree->txn->pages[frame->txn - 1];
+		page->offset = INVALID_OFFSET;
+		page->frame = NULL;
+		frame->txn = 0;
+	}
+	frame->pin = 0;
+	frame->dirty = 0;
+	__atomic_add_fetch(&frame->version, 2, __ATOMIC_RELEASE);
+	frame_unhash(tree, shard, frame);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* 读取节点版本, 写者持有锁时返回奇数 */
+static inline unsigned long node_version(struct bplus_node *node)
+{
+	return __atomic_load_n(&node_frame(node)->version, __ATOMIC_ACQUIRE);
+}
+
+/* 乐观读结束时检查节点在读取期间没有被修改或换出 */
+static inline int node_validate(struct bplus_node *node, unsigned long version)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&node_frame(node)->version, __ATOMIC_RELAXED) ==
+	       version;
+}
+
+/* 节点写锁, 调用者必须已经 pin 住节点 */
+static void node_lock(struct bplus_node *node)
+{
+	struct bplus_frame *frame = node_frame(node);
+	for (;;) {
+		unsigned long v = node_version(node);
+		if (!(v & 1) &&
+		    __atomic_compare_exchange_n(&frame->version, &v, v + 1, 0,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_RELAXED)) {
+			return;
+		}
+		sched_yield();
+	}
+}
+
+static inline void node_unlock(struct bplus_node *node)
+{
+	__atomic_add_fetch(&node_frame(node)->version, 1, __ATOMIC_RELEASE);
+}
+
+/* 获取新块 */
+static off_t new_node_append(struct bplus_tree *tree)
+{
+	off_t offset;
+	/* assign new offset to the new node */
+	if (list_empty(&tree->free_blocks)) {
+		/* 分配新的块 */
+		offset = tree->file_size;
+		tree->file_size += _block_size;
+	} else {
+		/* 从空闲块链表中分配 */
+		struct free_block *block;
+		block = list_first_entry(&tree->free_blocks, struct free_block,
+					 link);
+		/* 移除已分配的块 */
+		list_del(&block->link);
+		offset = block->offset;
+		free(block);
+		txn_note(tree, offset, 0);
+	}
+	return offset;
 }
 
 /* 创建新节点 */
 static struct bplus_node *node_new(struct bplus_tree *tree)
 {
-	struct bplus_node *node = cache_refer(tree);
-	node->self = INVALID_OFFSET;
+	/* the block is new, nothing to read */
+	off_t offset = new_node_append(tree);
+	struct bplus_node *node = cache_get(tree, offset, 1, 0);
+	node->self = offset;
 	node->parent = INVALID_OFFSET;
 	node->prev = INVALID_OFFSET;
 	node->next = INVALID_OFFSET;
@@ -139,74 +560,67 @@ static inline struct bplus_node *leaf_new(struct bplus_tree *tree)
 	return node;
 }
 
-/* 节点获取数据 */
+/* 节点获取数据, 返回的节点需要用 node_flush() 放回 */
 static struct bplus_node *node_fetch(struct bplus_tree *tree, off_t offset)
 {
 	if (offset == INVALID_OFFSET) {
 		return NULL;
 	}
 
-	/* 获取空闲节点 */
-	struct bplus_node *node = cache_refer(tree);
-	/* 读取节点数据 */
-	int len = pread(tree->fd, node, _block_size, offset);
-	(void)len;
-	assert(len == _block_size);
-	return node;
+	return cache_get(tree, offset, 1, 1);
+}
+
+/* 放开本线程 node_seek() 持有的节点 */
+static inline void seek_release(struct bplus_tree *tree)
+{
+	if (_seek_node != NULL) {
+		cache_defer(tree, _seek_node, 0);
+		_seek_node = NULL;
+	}
 }
 
+/* 只读访问, 节点只在本线程下一次 node_seek() 前有效
+ * 期间保持 pin, 其他线程不能把它换出 */
 static struct bplus_node *node_seek(struct bplus_tree *tree, off_t offset)
 {
 	if (offset == INVALID_OFFSET) {
 		return NULL;
 	}
 
-	int i;
-	/* 读取 offset 所在的块
-	 * 同时将块缓存起来*/
-	for (i = 0; i < MIN_CACHE_NUM; i++) {
-		if (!tree->used[i]) {
-			char *buf = tree->caches + _block_size * i;
-			int len = pread(tree->fd, buf, _block_size, offset);
-			(void)len;
-			assert(len == _block_size);
-			return (struct bplus_node *)buf;
-		}
-	}
-	assert(0);
-	return NULL;
+	struct bplus_node *node = cache_get(tree, offset, 1, 1);
+	seek_release(tree);
+	_seek_node = node;
+	return node;
 }
 
-/* 数据持久化 */
-static inline void node_flush(struct bplus_tree *tree, struct bplus_node *node)
+/* 加入本次修改, 第一次加入时接管调用者的 pin */
+static int txn_add(struct bplus_tree *tree, struct bplus_node *node)
 {
-	if (node != NULL) {
-		int len = pwrite(tree->fd, node, _block_size, node->self);
-		(void)len;
-		assert(len == _block_size);
-		cache_defer(tree, node);
+	struct bplus_txn *txn = tree->txn;
+	struct bplus_frame *frame = node_frame(node);
+	if (frame->txn) {
+		return 0;
 	}
+	txn->pages = txn_grow(txn->pages, txn->npages, &txn->page_cap,
+			      sizeof(*txn->pages));
+	txn->pages[txn->npages].offset = frame->offset;
+	txn->pages[txn->npages].frame = frame;
+	txn->pages[txn->npages].image = NULL;
+	frame->txn = ++txn->npages;
+	return 1;
 }
 
-/* 获取新块 */
-static off_t new_node_append(struct bplus_tree *tree, struct bplus_node *node)
+/* 数据持久化
+ * 只标记为脏, 淘汰或关闭时写回
+ * 开启日志时先留在本次修改中, 提交后才能写回 */
+static inline void node_flush(struct bplus_tree *tree, struct bplus_node *node)
 {
-	/* assign new offset to the new node */
-	if (list_empty(&tree->free_blocks)) {
-		/* 分配新的块 */
-		node->self = tree->file_size;
-		tree->file_size += _block_size;
-	} else {
-		/* 从空闲块链表中分配 */
-		struct free_block *block;
-		block = list_first_entry(&tree->free_blocks, struct free_block,
-					 link);
-		/* 移除已分配的块 */
-		list_del(&block->link);
-		node->self = block->offset;
-		free(block);
+	if (node != NULL) {
+		if (tree->txn->active && txn_add(tree, node)) {
+			return;
+		}
+		cache_defer(tree, node, 1);
 	}
-	return node->self;
 }
 
 static void node_delete(struct bplus_tree *tree, struct bplus_node *node,
@@ -234,8 +648,9 @@ static void node_delete(struct bplus_tree *tree, struct bplus_node *node,
 	/* deleted blocks can be allocated for other nodes */
 	block->offset = node->self;
 	list_add_tail(&block->link, &tree->free_blocks);
+	txn_note(tree, node->self, 1);
 	/* return the node cache borrowed from */
-	cache_defer(tree, node);
+	cache_drop(tree, node);
 }
 
 static inline void sub_node_update(struct bplus_tree *tree,
@@ -257,67 +672,440 @@ static inline void sub_node_flush(struct bplus_tree *tree,
 	node_flush(tree, sub_node);
 }
 
-static long bplus_tree_search(struct bplus_tree *tree, key_t key)
+/* 重做日志
+ * 每次结构修改或叶子更新提交一条记录, 包含改动块的完整内容,
+ * 新的根节点, 文件大小和空闲链表的变化, 整条记录一个 crc32
+ * 日志以检查点记录开头, 恢复时从那里重放到第一条不完整的记录 */
+#define WAL_MAGIC 0x4c415742
+#define WAL_CHECKPOINT_SIZE (16 * 1024 * 1024)
+
+enum {
+	WAL_CHECKPOINT,
+	WAL_COMMIT,
+};
+
+struct wal_record {
+	unsigned int magic;
+	/* 从 len 开始到记录末尾的 crc32 */
+	unsigned int crc;
+	unsigned int len;
+	unsigned int type;
+	off_t root;
+	off_t file_size;
+	int block_size;
+	int npages;
+	/* 检查点记录中 nfree 为整个空闲链表 */
+	int nalloc;
+	int nfree;
+	/* 后跟 alloc[nalloc], freed[nfree], npages 个 (offset, 块内容) */
+};
+
+/* slicing-by-8: 每次查 8 张表处理 8 个字节 */
+static unsigned int crc_table[8][256];
+
+static void crc_init(void)
 {
-	int ret = -1;
-	struct bplus_node *node = node_seek(tree, tree->root);
-	while (node != NULL) {
-		int i = key_binary_search(node, key);
-		if (is_leaf(node)) {
-			ret = i >= 0 ? data(node)[i] : -1;
-			break;
-		} else {
-			if (i >= 0) {
-				node = node_seek(tree, sub(node)[i + 1]);
-			} else {
-				i = -i - 1;
-				node = node_seek(tree, sub(node)[i]);
-			}
+	unsigned int i, j, c;
+	for (i = 0; i < 256; i++) {
+		for (c = i, j = 0; j < 8; j++) {
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
 		}
+		crc_table[0][i] = c;
 	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			c = crc_table[j - 1][i];
+			crc_table[j][i] = crc_table[0][c & 0xff] ^ (c >> 8);
+		}
+	}
+}
 
-	return ret;
+static unsigned int crc32(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	unsigned int c = 0xffffffff;
+	while (len >= 8) {
+		unsigned int lo = c ^ (p[0] | p[1] << 8 | p[2] << 16 |
+				       (unsigned int)p[3] << 24);
+		unsigned int hi = p[4] | p[5] << 8 | p[6] << 16 |
+				  (unsigned int)p[7] << 24;
+		c = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+		    crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+		    crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+		    crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		c = crc_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+	}
+	return c ^ 0xffffffff;
 }
 
-/* 插入到链表左节点 */
-static void left_node_add(struct bplus_tree *tree, struct bplus_node *node,
-			  struct bplus_node *left)
+static inline unsigned int wal_crc(struct wal_record *rec)
 {
-	new_node_append(tree, left);
+	return crc32(&rec->len, rec->len - offsetof(struct wal_record, len));
+}
 
-	/* 获取当前节点的前一个节点 */
-	struct bplus_node *prev = node_fetch(tree, node->prev);
-	if (prev != NULL) {
-		prev->next = left->self;
-		left->prev = prev->self;
-		node_flush(tree, prev);
-	} else {
-		left->prev = INVALID_OFFSET;
+/* 在 wal_buf 中组装一条记录, 调用者持有 wal_lock */
+static struct wal_record *wal_build(struct bplus_tree *tree, int type,
+				    struct txn_page *pages, int npages,
+				    off_t *alloc, int nalloc, off_t *freed,
+				    int nfree)
+{
+	size_t len = sizeof(struct wal_record) +
+		     (nalloc + nfree) * sizeof(off_t);
+	int i, n = 0;
+
+	for (i = 0; i < npages; i++) {
+		if (pages[i].offset != INVALID_OFFSET) {
+			n++;
+		}
 	}
-	left->next = node->self;
-	node->prev = left->self;
+	len += n * (sizeof(off_t) + _block_size);
+	if (len > tree->wal_buf_size) {
+		free(tree->wal_buf);
+		tree->wal_buf_size = len * 2;
+		tree->wal_buf = malloc(tree->wal_buf_size);
+		assert(tree->wal_buf != NULL);
+	}
+
+	struct wal_record *rec = (struct wal_record *)tree->wal_buf;
+	rec->magic = WAL_MAGIC;
+	rec->len = len;
+	rec->type = type;
+	rec->root = tree->root;
+	rec->file_size = tree->file_size;
+	rec->block_size = _block_size;
+	rec->npages = n;
+	rec->nalloc = nalloc;
+	rec->nfree = nfree;
+
+	char *p = (char *)(rec + 1);
+	if (nalloc > 0) {
+		memcpy(p, alloc, nalloc * sizeof(off_t));
+		p += nalloc * sizeof(off_t);
+	}
+	if (nfree > 0) {
+		memcpy(p, freed, nfree * sizeof(off_t));
+		p += nfree * sizeof(off_t);
+	}
+	for (i = 0; i < npages; i++) {
+		if (pages[i].offset == INVALID_OFFSET) {
+			continue;
+		}
+		memcpy(p, &pages[i].offset, sizeof(off_t));
+		p += sizeof(off_t);
+		memcpy(p,
+		       pages[i].frame != NULL ? (char *)frame_node(pages[i].frame) :
+						pages[i].image,
+		       _block_size);
+		p += _block_size;
+	}
+	rec->crc = wal_crc(rec);
+	return rec;
 }
 
-static void right_node_add(struct bplus_tree *tree, struct bplus_node *node,
-			   struct bplus_node *right)
+static void write_full(int fd, const void *buf, size_t len)
 {
-	new_node_append(tree, right);
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		assert(n > 0);
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+}
 
-	struct bplus_node *next = node_fetch(tree, node->next);
-	if (next != NULL) {
-		next->prev = right->self;
-		right->next = next->self;
-		node_flush(tree, next);
-	} else {
-		right->next = INVALID_OFFSET;
+/* 追加一条提交记录, 按持久化级别 fsync */
+static void wal_append(struct bplus_tree *tree, struct txn_page *pages,
+		       int npages, off_t *alloc, int nalloc, off_t *freed,
+		       int nfree)
+{
+	pthread_mutex_lock(&tree->wal_lock);
+	struct wal_record *rec = wal_build(tree, WAL_COMMIT, pages, npages,
+					   alloc, nalloc, freed, nfree);
+	write_full(tree->wal_fd, rec, rec->len);
+	tree->wal_size += rec->len;
+	tree->wal_bytes += rec->len;
+	tree->wal_commits++;
+	tree->wal_root = tree->root;
+	tree->wal_file_size = tree->file_size;
+	if (tree->durability == BPLUS_DURABLE_SYNC) {
+		tree->wal_unsynced = 1;
+		wal_fsync(tree);
+	} else if (tree->durability == BPLUS_DURABLE_GROUP &&
+		   ++tree->wal_unsynced >= BPLUS_GROUP_COMMITS) {
+		wal_fsync(tree);
 	}
-	right->prev = node->self;
-	node->next = right->self;
+	pthread_mutex_unlock(&tree->wal_lock);
 }
 
-static key_t non_leaf_insert(struct bplus_tree *tree, struct bplus_node *node,
-			     struct bplus_node *l_ch, struct bplus_node *r_ch,
-			     key_t key);
+/* 只改动一个叶子的提交, 调用者持有叶子的锁, 保证同一块的记录有序 */
+static void wal_log_page(struct bplus_tree *tree, struct bplus_node *node)
+{
+	struct txn_page page;
+	page.offset = node_frame(node)->offset;
+	page.frame = node_frame(node);
+	page.image = NULL;
+	wal_append(tree, &page, 1, NULL, 0, NULL, 0);
+}
+
+/* 提交后放开本次修改的 pin, 块可以写回了 */
+static void cache_commit(struct bplus_tree *tree, struct bplus_frame *frame)
+{
+	struct bplus_shard *shard = &tree->shards[frame->shard];
+
+	pthread_mutex_lock(&shard->lock);
+	assert(frame->pin > 0);
+	frame->txn = 0;
+	frame->pin--;
+	frame->dirty = 1;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* 把本次结构修改作为一条记录提交 */
+static void wal_commit(struct bplus_tree *tree)
+{
+	struct bplus_txn *txn = tree->txn;
+	int i;
+
+	if (txn->npages > 0 || txn->nalloc > 0 || txn->nfree > 0 ||
+	    tree->root != tree->wal_root ||
+	    tree->file_size != tree->wal_file_size) {
+		wal_append(tree, txn->pages, txn->npages, txn->alloc,
+			   txn->nalloc, txn->freed, txn->nfree);
+	}
+
+	/* 被换出的块不再经过缓冲池, 直接写回 */
+	if (__atomic_load_n(&tree->txn_spilled, __ATOMIC_RELAXED) > 0) {
+		wal_ahead(tree);
+		for (i = 0; i < txn->npages; i++) {
+			struct txn_page *page = &txn->pages[i];
+			if (page->image != NULL) {
+				int len = pwrite(tree->fd, page->image,
+						 _block_size, page->offset);
+				(void)len;
+				assert(len == _block_size);
+				free(page->image);
+				page->image = NULL;
+			}
+		}
+		__atomic_store_n(&tree->txn_spilled, 0, __ATOMIC_RELEASE);
+	}
+	for (i = 0; i < txn->npages; i++) {
+		if (txn->pages[i].frame != NULL) {
+			cache_commit(tree, txn->pages[i].frame);
+		}
+	}
+	txn->npages = txn->nalloc = txn->nfree = 0;
+}
+
+/* 写回缓冲池中所有脏块 */
+static void cache_flush(struct bplus_tree *tree)
+{
+	int i, j;
+
+	for (i = 0; i < 1 << tree->shard_bits; i++) {
+		struct bplus_shard *shard = &tree->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		for (j = 0; j < shard->frame_num; j++) {
+			struct bplus_frame *frame = shard_frame(shard, j);
+			if (frame->offset != INVALID_OFFSET && frame->dirty) {
+				frame_write(shard, tree->fd, frame);
+			}
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+/* 索引文件名加上后缀, tree->filename 以 .boot 结尾 */
+static void tree_path(struct bplus_tree *tree, char *buf, const char *ext)
+{
+	int len = strlen(tree->filename) - strlen(".boot");
+	memcpy(buf, tree->filename, len);
+	strcpy(buf + len, ext);
+}
+
+/* rename() 和 unlink() 在目录 fsync 之后才算落盘 */
+static void dir_sync(const char *path)
+{
+	char dir[1024];
+	char *p;
+
+	strcpy(dir, path);
+	p = strrchr(dir, '/');
+	if (p == NULL) {
+		strcpy(dir, ".");
+	} else {
+		p[p == dir] = '\0';
+	}
+	int fd = open(dir, O_RDONLY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+/* 写回所有脏块, 用只有一条检查点记录的新日志替换旧日志
+ * 调用者独占整棵树 */
+static void wal_checkpoint(struct bplus_tree *tree)
+{
+	char path[1040], tmp[1040];
+	struct list_head *pos;
+	off_t *freed = NULL;
+	int nfree = 0, cap = 0;
+
+	wal_ahead(tree);
+	cache_flush(tree);
+	fsync(tree->fd);
+
+	list_for_each(pos, &tree->free_blocks) {
+		freed = txn_grow(freed, nfree, &cap, sizeof(off_t));
+		freed[nfree++] = list_entry(pos, struct free_block, link)->offset;
+	}
+
+	tree_path(tree, path, ".wal");
+	tree_path(tree, tmp, ".wal.tmp");
+	int fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	assert(fd >= 0);
+	pthread_mutex_lock(&tree->wal_lock);
+	struct wal_record *rec =
+		wal_build(tree, WAL_CHECKPOINT, NULL, 0, NULL, 0, freed, nfree);
+	write_full(fd, rec, rec->len);
+	fsync(fd);
+	close(fd);
+	int err = rename(tmp, path);
+	(void)err;
+	assert(err == 0);
+	dir_sync(path);
+
+	if (tree->wal_fd >= 0) {
+		close(tree->wal_fd);
+	}
+	tree->wal_fd = open(path, O_WRONLY | O_APPEND);
+	assert(tree->wal_fd >= 0);
+	tree->wal_size = rec->len;
+	tree->wal_bytes += rec->len;
+	tree->wal_unsynced = 0;
+	tree->wal_checkpoints++;
+	tree->wal_root = tree->root;
+	tree->wal_file_size = tree->file_size;
+	pthread_mutex_unlock(&tree->wal_lock);
+	free(freed);
+}
+
+/* 结构修改 (分裂, 合并, 换根) 独占整棵树
+ * 序号为奇数时乐观读者等待, 读完后序号变了就重来
+ * 开启日志时整个修改作为一条记录提交 */
+static void smo_begin(struct bplus_tree *tree)
+{
+	pthread_rwlock_wrlock(&tree->smo_lock);
+	__atomic_add_fetch(&tree->smo_seq, 1, __ATOMIC_SEQ_CST);
+	if (tree->durability != BPLUS_DURABLE_NONE) {
+		tree->txn->owner = pthread_self();
+		tree->txn->active = 1;
+	}
+}
+
+static void smo_end(struct bplus_tree *tree)
+{
+	seek_release(tree);
+	if (tree->txn->active) {
+		wal_commit(tree);
+		tree->txn->active = 0;
+		if (tree->wal_size > WAL_CHECKPOINT_SIZE) {
+			wal_checkpoint(tree);
+		}
+	}
+	__atomic_add_fetch(&tree->smo_seq, 1, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&tree->smo_lock);
+}
+
+/* 乐观读, 不加任何节点锁
+ * 每读完一个节点都检查它的版本和结构修改序号, 变了就从根重来 */
+static long bplus_tree_search(struct bplus_tree *tree, key_t key)
+{
+	unsigned long seq, version;
+	long ret = -1;
+	off_t offset;
+
+restart:
+	while ((seq = __atomic_load_n(&tree->smo_seq, __ATOMIC_ACQUIRE)) & 1) {
+		sched_yield();
+	}
+	offset = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+	while (offset != INVALID_OFFSET) {
+		struct bplus_node *node = cache_get(tree, offset, 0, 1);
+		if (node == NULL) {
+			goto restart;
+		}
+		version = node_version(node);
+		if ((version & 1) ||
+		    __atomic_load_n(&node_frame(node)->offset,
+				    __ATOMIC_RELAXED) != offset) {
+			goto restart;
+		}
+
+		/* the node may change under us, bound the search */
+		int leaf = is_leaf(node);
+		int len = leaf ? node->children : node->children - 1;
+		if (len < 0 || len > (leaf ? _max_entries : _max_order - 1)) {
+			goto restart;
+		}
+		int i = key_search(key(node), len, key);
+		if (leaf) {
+			ret = i >= 0 ? data(node)[i] : -1;
+		} else {
+			offset = sub(node)[i >= 0 ? i + 1 : -i - 1];
+		}
+
+		if (!node_validate(node, version) ||
+		    __atomic_load_n(&tree->smo_seq, __ATOMIC_RELAXED) != seq) {
+			goto restart;
+		}
+		if (leaf) {
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/* 插入到链表左节点 */
+static void left_node_add(struct bplus_tree *tree, struct bplus_node *node,
+			  struct bplus_node *left)
+{
+	/* 获取当前节点的前一个节点 */
+	struct bplus_node *prev = node_fetch(tree, node->prev);
+	if (prev != NULL) {
+		prev->next = left->self;
+		left->prev = prev->self;
+		node_flush(tree, prev);
+	} else {
+		left->prev = INVALID_OFFSET;
+	}
+	left->next = node->self;
+	node->prev = left->self;
+}
+
+static void right_node_add(struct bplus_tree *tree, struct bplus_node *node,
+			   struct bplus_node *right)
+{
+	struct bplus_node *next = node_fetch(tree, node->next);
+	if (next != NULL) {
+		next->prev = right->self;
+		right->next = next->self;
+		node_flush(tree, next);
+	} else {
+		right->next = INVALID_OFFSET;
+	}
+	right->prev = node->self;
+	node->next = right->self;
+}
+
+static key_t non_leaf_insert(struct bplus_tree *tree, struct bplus_node *node,
+			     struct bplus_node *l_ch, struct bplus_node *r_ch,
+			     key_t key);
 
 static int parent_node_build(struct bplus_tree *tree, struct bplus_node *l_ch,
 			     struct bplus_node *r_ch, key_t key)
@@ -330,7 +1118,7 @@ static int parent_node_build(struct bplus_tree *tree, struct bplus_node *l_ch,
 		sub(parent)[1] = r_ch->self;
 		parent->children = 2;
 		/* write new parent and update root */
-		tree->root = new_node_append(tree, parent);
+		tree->root = parent->self;
 		l_ch->parent = parent->self;
 		r_ch->parent = parent->self;
 		tree->level++;
@@ -659,10 +1447,8 @@ static int leaf_insert(struct bplus_tree *tree, struct bplus_node *leaf,
 	insert = -insert - 1;
 
 	/* fetch from free node caches */
-	/* 从空闲节点缓存中获取位置 */
-	int i = ((char *)leaf - tree->caches) / _block_size;
 	/* 标记节点使用 */
-	tree->used[i] = 1;
+	cache_pin(tree, leaf);
 
 	/* leaf is full */
 	if (leaf->children == _max_entries) {
@@ -725,7 +1511,7 @@ static int bplus_tree_insert(struct bplus_tree *tree, key_t key, long data)
 	key(root)[0] = key;
 	data(root)[0] = data;
 	root->children = 1;
-	tree->root = new_node_append(tree, root);
+	tree->root = root->self;
 	tree->level = 1;
 	node_flush(tree, root);
 	return 0;
@@ -1025,8 +1811,8 @@ static int leaf_remove(struct bplus_tree *tree, struct bplus_node *leaf,
 	}
 
 	/* fetch from free node caches */
-	int i = ((char *)leaf - tree->caches) / _block_size;
-	tree->used[i] = 1;
+	cache_pin(tree, leaf);
+	int i;
 
 	if (leaf->parent == INVALID_OFFSET) {
 		/* leaf as the root */
@@ -1121,148 +1907,1486 @@ long bplus_tree_get(struct bplus_tree *tree, key_t key)
 	return bplus_tree_search(tree, key);
 }
 
+/* 不改变树结构的插入和删除, 只锁叶子节点
+ * 需要分裂, 合并或换根时返回 -1, 交给 bplus_tree_insert()/bplus_tree_delete() */
+static int leaf_update(struct bplus_tree *tree, key_t key, long data, int *ret)
+{
+	int done = -1, dirty = 0;
+
+	pthread_rwlock_rdlock(&tree->smo_lock);
+	struct bplus_node *node = node_seek(tree, tree->root);
+	while (node != NULL && !is_leaf(node)) {
+		int i = key_binary_search(node, key);
+		node = node_seek(tree, sub(node)[i >= 0 ? i + 1 : -i - 1]);
+	}
+
+	if (node != NULL) {
+		node_lock(node);
+		int i = key_binary_search(node, key);
+		if (data != 0) {
+			if (i >= 0) {
+				*ret = -1;
+				done = 0;
+			} else if (node->children < _max_entries) {
+				leaf_simple_insert(tree, node, key, data, -i - 1);
+				*ret = 0;
+				done = 0;
+				dirty = 1;
+			}
+		} else {
+			if (i < 0) {
+				*ret = -1;
+				done = 0;
+			} else if (node->parent == INVALID_OFFSET ?
+					   node->children > 1 :
+					   node->children > (_max_entries + 1) / 2) {
+				leaf_simple_remove(tree, node, i);
+				*ret = 0;
+				done = 0;
+				dirty = 1;
+			}
+		}
+		if (dirty) {
+			if (tree->durability != BPLUS_DURABLE_NONE) {
+				wal_log_page(tree, node);
+			}
+			cache_pin(tree, node);
+			node_flush(tree, node);
+		}
+		node_unlock(node);
+	}
+
+	seek_release(tree);
+	pthread_rwlock_unlock(&tree->smo_lock);
+	return done;
+}
+
 int bplus_tree_put(struct bplus_tree *tree, key_t key, long data)
 {
+	int ret;
+
+	if (leaf_update(tree, key, data, &ret) == 0) {
+		if (tree->durability != BPLUS_DURABLE_NONE &&
+		    __atomic_load_n(&tree->wal_size, __ATOMIC_RELAXED) >
+			    WAL_CHECKPOINT_SIZE) {
+			/* 叶子更新只持有共享锁, 检查点留给结构修改做 */
+			smo_begin(tree);
+			smo_end(tree);
+		}
+		return ret;
+	}
+
+	smo_begin(tree);
 	if (data) {
-		return bplus_tree_insert(tree, key, data);
+		ret = bplus_tree_insert(tree, key, data);
 	} else {
-		return bplus_tree_delete(tree, key);
+		ret = bplus_tree_delete(tree, key);
 	}
+	smo_end(tree);
+	return ret;
 }
 
+/* 范围查询期间禁止结构修改, 逐个锁住叶子节点读取 */
 long bplus_tree_get_range(struct bplus_tree *tree, key_t key1, key_t key2)
 {
 	long start = -1;
 	key_t min = key1 <= key2 ? key1 : key2;
 	key_t max = min == key1 ? key2 : key1;
 
+	pthread_rwlock_rdlock(&tree->smo_lock);
 	struct bplus_node *node = node_seek(tree, tree->root);
-	while (node != NULL) {
+	while (node != NULL && !is_leaf(node)) {
 		int i = key_binary_search(node, min);
-		if (is_leaf(node)) {
-			if (i < 0) {
-				i = -i - 1;
-				if (i >= node->children) {
-					node = node_seek(tree, node->next);
-				}
-			}
-			while (node != NULL && key(node)[i] <= max) {
-				start = data(node)[i];
-				if (++i >= node->children) {
-					node = node_seek(tree, node->next);
-					i = 0;
+		node = node_seek(tree, sub(node)[i >= 0 ? i + 1 : -i - 1]);
+	}
+
+	if (node != NULL) {
+		node_lock(node);
+		int i = key_binary_search(node, min);
+		if (i < 0) {
+			i = -i - 1;
+		}
+		for (;;) {
+			if (i >= node->children) {
+				off_t next = node->next;
+				node_unlock(node);
+				node = node_seek(tree, next);
+				if (node == NULL) {
+					break;
 				}
+				node_lock(node);
+				i = 0;
+				continue;
 			}
-			break;
-		} else {
-			if (i >= 0) {
-				node = node_seek(tree, sub(node)[i + 1]);
-			} else {
-				i = -i - 1;
-				node = node_seek(tree, sub(node)[i]);
+			if (key(node)[i] > max) {
+				node_unlock(node);
+				break;
 			}
+			start = data(node)[i++];
 		}
 	}
 
+	seek_release(tree);
+	pthread_rwlock_unlock(&tree->smo_lock);
 	return start;
 }
 
-int bplus_open(char *filename)
-{
-	return open(filename, O_CREAT | O_RDWR, 0644);
-}
+/* 批量加载时每层保留两个节点: cur 正在填充, prev 已填满但尚未写出,
+ * 这样结束时可以在 prev 和 cur 之间重新分配, 避免最右边的节点过小 */
+struct bulk_level {
+	struct bplus_node *cur;
+	struct bplus_node *prev;
+	/* 子树中的最小 key, 作为父节点中的分隔键 */
+	key_t cur_first;
+	key_t prev_first;
+	/* 本层已创建的节点数 */
+	long count;
+};
 
-void bplus_close(int fd)
+#define BULK_MAX_LEVEL 32
+/* 顺序写窗口大小 */
+#define BULK_WINDOW_SIZE (2 * 1024 * 1024)
+
+struct bulk_builder {
+	struct bplus_tree *tree;
+	struct bulk_level level[BULK_MAX_LEVEL];
+	int height;
+	int leaf_fill;
+	int node_fill;
+	/* 下一个分配的块 */
+	off_t next;
+	/* 写窗口覆盖 [base, base + slots * _block_size) */
+	char *window;
+	char *ready;
+	int slots;
+	off_t base;
+};
+
+/* 写出窗口中已完成的块, 每段连续的块一次 pwrite,
+ * 仍在填充中的节点留空, 完成时单独写出 */
+static void bulk_flush(struct bulk_builder *b)
 {
-	close(fd);
+	int i, j, n = (b->next - b->base) / _block_size;
+	if (n > b->slots) {
+		n = b->slots;
+	}
+	for (i = 0; i < n; i = j) {
+		if (!b->ready[i]) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < n && b->ready[j]; j++) {
+			continue;
+		}
+		ssize_t len = (ssize_t)(j - i) * _block_size;
+		ssize_t ret = pwrite(b->tree->fd, b->window + (size_t)i * _block_size,
+				     len, b->base + (off_t)i * _block_size);
+		(void)ret;
+		assert(ret == len);
+	}
+	memset(b->ready, 0, b->slots);
 }
 
-// 16 进制字符串转 10 进制
-static off_t str_to_hex(char *c, int len)
+static off_t bulk_alloc(struct bulk_builder *b)
 {
-	off_t offset = 0;
-	while (len-- > 0) {
-		if (isdigit(*c)) {
-			// 是 10 进制
-			offset = offset * 16 + *c - '0';
-		} else if (isxdigit(*c)) {
-			// 是 16 进制
-			if (islower(*c)) {
-				offset = offset * 16 + *c - 'a' + 10;
-			} else {
-				offset = offset * 16 + *c - 'A' + 10;
-			}
-		}
-		c++;
+	off_t offset = b->next;
+	if (offset >= b->base + (off_t)b->slots * _block_size) {
+		bulk_flush(b);
+		b->base = offset;
 	}
+	b->next += _block_size;
 	return offset;
 }
 
-// 10 进制转 16 进制字符串
-static inline void hex_to_str(off_t offset, char *buf, int len)
+static void bulk_write(struct bulk_builder *b, struct bplus_node *node)
 {
-	const static char *hex = "0123456789ABCDEF";
-	while (len-- > 0) {
-		buf[len] = hex[offset & 0xf];
-		offset >>= 4;
+	if (node->self >= b->base) {
+		int i = (node->self - b->base) / _block_size;
+		memcpy(b->window + (size_t)i * _block_size, node, _block_size);
+		b->ready[i] = 1;
+	} else {
+		int len = pwrite(b->tree->fd, node, _block_size, node->self);
+		(void)len;
+		assert(len == _block_size);
 	}
 }
 
-static inline off_t offset_load(int fd)
+/* 修改已写出子节点的父节点指针 */
+static void bulk_set_parent(struct bulk_builder *b, off_t child, off_t parent)
 {
-	char buf[ADDR_STR_WIDTH];
-	ssize_t len = read(fd, buf, sizeof(buf));
-	return len > 0 ? str_to_hex(buf, sizeof(buf)) : INVALID_OFFSET;
+	off_t field = offsetof(struct bplus_node, parent);
+	if (child >= b->base) {
+		int i = (child - b->base) / _block_size;
+		assert(b->ready[i]);
+		memcpy(b->window + (size_t)i * _block_size + field, &parent,
+		       sizeof(parent));
+	} else {
+		int len = pwrite(b->tree->fd, &parent, sizeof(parent),
+				 child + field);
+		(void)len;
+		assert(len == sizeof(parent));
+	}
 }
 
-static inline ssize_t offset_store(int fd, off_t offset)
+static void bulk_node_init(struct bulk_builder *b, struct bplus_node *node,
+			   int type)
 {
-	char buf[ADDR_STR_WIDTH];
-	hex_to_str(offset, buf, sizeof(buf));
-	return write(fd, buf, sizeof(buf));
+	memset(node, 0, _block_size);
+	node->self = bulk_alloc(b);
+	node->parent = INVALID_OFFSET;
+	node->prev = INVALID_OFFSET;
+	node->next = INVALID_OFFSET;
+	node->type = type;
+	node->children = 0;
 }
 
-struct bplus_tree *bplus_tree_init(char *filename, int block_size)
+/* 向第 l 层追加一项, 叶子层 value 为数据, 其余层为子节点偏移
+ * 返回追加到的节点 */
+static struct bplus_node *bulk_add(struct bulk_builder *b, int l, key_t key,
+				   long value)
 {
-	int i;
-	struct bplus_node node;
-
-	if (strlen(filename) >= 1024) {
-		// 文件名太长
-		fprintf(stderr, "Index file name too long!\n");
-		return NULL;
+	struct bulk_level *lv = &b->level[l];
+	int type = l == 0 ? BPLUS_TREE_LEAF : BPLUS_TREE_NON_LEAF;
+
+	assert(l < BULK_MAX_LEVEL);
+	if (lv->cur == NULL) {
+		lv->cur = malloc(_block_size);
+		lv->prev = malloc(_block_size);
+		assert(lv->cur != NULL && lv->prev != NULL);
+		bulk_node_init(b, lv->cur, type);
+		lv->cur_first = key;
+		lv->count = 1;
+		b->height = l + 1;
+	} else if (lv->cur->children == (l == 0 ? b->leaf_fill : b->node_fill)) {
+		struct bplus_node *node = lv->prev;
+		if (lv->count > 1) {
+			bulk_write(b, node);
+		}
+		lv->prev = lv->cur;
+		lv->prev_first = lv->cur_first;
+		lv->cur = node;
+		bulk_node_init(b, node, type);
+		node->prev = lv->prev->self;
+		lv->prev->next = node->self;
+		lv->cur_first = key;
+		lv->count++;
+		lv->prev->parent =
+			bulk_add(b, l + 1, lv->prev_first, lv->prev->self)->self;
 	}
 
-	if ((block_size & (block_size - 1)) != 0) {
-		// 必须是 2 的倍数
-		fprintf(stderr, "Block size must be pow of 2!\n");
-		return NULL;
+	struct bplus_node *node = lv->cur;
+	if (l == 0) {
+		key(node)[node->children] = key;
+		data(node)[node->children] = value;
+	} else {
+		if (node->children > 0) {
+			key(node)[node->children - 1] = key;
+		}
+		sub(node)[node->children] = value;
 	}
+	node->children++;
+	return node;
+}
 
-	if (block_size < (int)sizeof(node)) {
-		// 块大小小于一个 bplus_node 大小
-		fprintf(stderr, "block size is too small for one node!\n");
-		return NULL;
+/* 把 prev 末尾的 n 项移到 cur 开头 */
+static void bulk_shift(struct bulk_builder *b, struct bulk_level *lv, int n)
+{
+	struct bplus_node *prev = lv->prev;
+	struct bplus_node *cur = lv->cur;
+	int i, from = prev->children - n;
+
+	if (is_leaf(cur)) {
+		memmove(&key(cur)[n], &key(cur)[0], cur->children * sizeof(key_t));
+		memmove(&data(cur)[n], &data(cur)[0], cur->children * sizeof(long));
+		memcpy(&key(cur)[0], &key(prev)[from], n * sizeof(key_t));
+		memcpy(&data(cur)[0], &data(prev)[from], n * sizeof(long));
+		lv->cur_first = key(cur)[0];
+	} else {
+		memmove(&key(cur)[n], &key(cur)[0],
+			(cur->children - 1) * sizeof(key_t));
+		memmove(&sub(cur)[n], &sub(cur)[0], cur->children * sizeof(off_t));
+		key(cur)[n - 1] = lv->cur_first;
+		memcpy(&key(cur)[0], &key(prev)[from], (n - 1) * sizeof(key_t));
+		memcpy(&sub(cur)[0], &sub(prev)[from], n * sizeof(off_t));
+		lv->cur_first = key(prev)[from - 1];
+		for (i = 0; i < n; i++) {
+			bulk_set_parent(b, sub(cur)[i], cur->self);
+		}
 	}
+	prev->children -= n;
+	cur->children += n;
+}
 
-	_block_size = block_size;
-	_max_order =
-		(block_size - sizeof(node)) / (sizeof(key_t) + sizeof(off_t));
-	_max_entries =
-		(block_size - sizeof(node)) / (sizeof(key_t) + sizeof(long));
-	if (_max_order <= 2) {
-		fprintf(stderr, "block size is too small for one node!\n");
-		return NULL;
+/* 块未写出就不再使用, 放回空闲链表 */
+static void bulk_discard(struct bulk_builder *b, off_t offset)
+{
+	struct free_block *block = malloc(sizeof(*block));
+	assert(block != NULL);
+	block->offset = offset;
+	list_add_tail(&block->link, &b->tree->free_blocks);
+	txn_note(b->tree, offset, 1);
+}
+
+/* 把 cur 合并到 prev */
+static void bulk_merge(struct bulk_builder *b, struct bulk_level *lv)
+{
+	struct bplus_node *prev = lv->prev;
+	struct bplus_node *cur = lv->cur;
+	int i, n = prev->children;
+
+	if (is_leaf(cur)) {
+		memcpy(&key(prev)[n], &key(cur)[0], cur->children * sizeof(key_t));
+		memcpy(&data(prev)[n], &data(cur)[0], cur->children * sizeof(long));
+	} else {
+		key(prev)[n - 1] = lv->cur_first;
+		memcpy(&key(prev)[n], &key(cur)[0],
+		       (cur->children - 1) * sizeof(key_t));
+		memcpy(&sub(prev)[n], &sub(cur)[0], cur->children * sizeof(off_t));
+		for (i = 0; i < cur->children; i++) {
+			bulk_set_parent(b, sub(cur)[i], prev->self);
+		}
 	}
+	prev->children += cur->children;
+	prev->next = INVALID_OFFSET;
+	bulk_discard(b, cur->self);
+
+	lv->cur = prev;
+	lv->prev = cur;
+	lv->cur_first = lv->prev_first;
+	lv->count--;
+}
 
-	/* 分配内存同时初始化为 0 */
-	struct bplus_tree *tree = calloc(1, sizeof(*tree));
+/* 自底向上写出每层剩下的节点, 返回根节点 */
+static off_t bulk_finish(struct bulk_builder *b)
+{
+	off_t root = INVALID_OFFSET;
+	int l;
+
+	for (l = 0; l < b->height; l++) {
+		struct bulk_level *lv = &b->level[l];
+		int min = l == 0 ? (_max_entries + 1) / 2 : (_max_order + 1) / 2;
+		int merged = 0;
+
+		if (lv->count == 1) {
+			/* the only node of the top level */
+			root = lv->cur->self;
+			bulk_write(b, lv->cur);
+			break;
+		}
+
+		if (lv->cur->children < min) {
+			int total = lv->prev->children + lv->cur->children;
+			if (total >= 2 * min) {
+				bulk_shift(b, lv, total / 2 - lv->cur->children);
+			} else {
+				bulk_merge(b, lv);
+				merged = 1;
+			}
+		}
+
+		if (merged && lv->count == 1) {
+			/* the parent level was only opened for this node */
+			assert(l + 2 == b->height &&
+			       b->level[l + 1].count == 1);
+			bulk_discard(b, b->level[l + 1].cur->self);
+			b->height = l + 1;
+			lv->cur->parent = INVALID_OFFSET;
+			root = lv->cur->self;
+			bulk_write(b, lv->cur);
+			break;
+		}
+
+		if (!merged) {
+			/* prev was held back for rebalancing */
+			bulk_write(b, lv->prev);
+			lv->cur->parent =
+				bulk_add(b, l + 1, lv->cur_first, lv->cur->self)
+					->self;
+		}
+		bulk_write(b, lv->cur);
+	}
+
+	bulk_flush(b);
+	return root;
+}
+
+static int bulk_load(struct bplus_tree *tree, bplus_iter_t iter, void *arg,
+		     int fill)
+{
+	struct bulk_builder b;
+	key_t key, last = 0;
+	long data, n = 0;
+	int l, ret = 0;
+
+	if (tree->varlen || tree->root != INVALID_OFFSET) {
+		return -1;
+	}
+	if (fill <= 0 || fill > 100) {
+		fill = 100;
+	}
+
+	memset(&b, 0, sizeof(b));
+	b.tree = tree;
+	b.leaf_fill = _max_entries * fill / 100;
+	if (b.leaf_fill < (_max_entries + 1) / 2) {
+		b.leaf_fill = (_max_entries + 1) / 2;
+	}
+	b.node_fill = _max_order * fill / 100;
+	if (b.node_fill < (_max_order + 1) / 2) {
+		b.node_fill = (_max_order + 1) / 2;
+	}
+	b.next = b.base = tree->file_size;
+	b.slots = BULK_WINDOW_SIZE / _block_size;
+	if (b.slots == 0) {
+		b.slots = 1;
+	}
+	b.window = malloc((size_t)b.slots * _block_size);
+	b.ready = calloc(b.slots, 1);
+	assert(b.window != NULL && b.ready != NULL);
+
+	while (iter(arg, &key, &data) == 0) {
+		if (n++ > 0 && key <= last) {
+			ret = -1;
+			break;
+		}
+		bulk_add(&b, 0, key, data);
+		last = key;
+	}
+
+	if (ret == 0 && n > 0) {
+		tree->root = bulk_finish(&b);
+		tree->level = b.height;
+		tree->file_size = b.next;
+	} else if (ret < 0) {
+		/* unsorted input, drop what has been written */
+		int err = ftruncate(tree->fd, tree->file_size);
+		(void)err;
+	}
+
+	for (l = 0; l < BULK_MAX_LEVEL; l++) {
+		free(b.level[l].cur);
+		free(b.level[l].prev);
+	}
+	free(b.window);
+	free(b.ready);
+	return ret;
+}
+
+/* 从有序输入自底向上构建整棵树, 只能用于空树
+ * fill 为节点填充百分比, key 必须严格递增 */
+int bplus_tree_bulk_load(struct bplus_tree *tree, bplus_iter_t iter, void *arg,
+			 int fill)
+{
+	smo_begin(tree);
+	int ret = bulk_load(tree, iter, arg, fill);
+	if (ret == 0 && tree->durability >= BPLUS_DURABLE_GROUP) {
+		/* 新块不经过日志, 先于提交记录落盘 */
+		fsync(tree->fd);
+	}
+	smo_end(tree);
+	return ret;
+}
+
+/*
+ * 变长 key/value 的槽页 (slotted page) 格式
+ *
+ * | bplus_node | vpage | slot[0..n) -> ... 空闲 ... <- cells | prefix |
+ *
+ * 槽数组存放 cell 在块内的偏移, 按 key 有序, cell 从块尾向前分配.
+ * leaf cell: klen(2) dlen(2) key suffix data, the common prefix of all
+ * keys in the leaf is stored once at the end of the block.
+ * non-leaf cell: child(8) klen(2) key, key is a truncated separator and
+ * child is the sub node right of it, the leftmost sub node is in first.
+ */
+struct vpage {
+	/* 叶子节点 key 公共前缀长度 */
+	unsigned short prefix;
+	/* cell 区起始偏移 */
+	unsigned short heap;
+	/* 非叶子节点最左子节点 */
+	off_t first;
+	unsigned short slot[];
+};
+
+/* 分裂和重建时展开的一项 */
+struct vent {
+	const char *key;
+	int klen;
+	const char *data;
+	int dlen;
+	off_t child;
+};
+
+#define VPAGE_HDR ((int)(sizeof(struct bplus_node) + sizeof(struct vpage)))
+#define VLEAF_CELL 4
+#define VNODE_CELL ((int)sizeof(off_t) + 2)
+#define VPATH_MAX 32
+#define vpage(node) ((struct vpage *)offset_ptr(node))
+#define vcell(node, i) ((char *)(node) + vpage(node)->slot[i])
+
+static inline int get16(const char *p)
+{
+	unsigned short v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void put16(char *p, int v)
+{
+	unsigned short s = v;
+	memcpy(p, &s, sizeof(s));
+}
+
+/* 单个 cell (含槽) 的最大字节数, 保证分裂后两边都放得下 */
+static inline int vcell_max(void)
+{
+	return (_block_size - VPAGE_HDR) / 4;
+}
+
+static inline int vkey_cmp(struct bplus_tree *tree, const char *k1, int len1,
+			   const char *k2, int len2)
+{
+	if (tree->cmp == NULL) {
+		int n = memcmp(k1, k2, len1 < len2 ? len1 : len2);
+		return n != 0 ? n : len1 - len2;
+	}
+	return tree->cmp(k1, len1, k2, len2);
+}
+
+static inline int vkey_lcp(const char *k1, int len1, const char *k2, int len2)
+{
+	int i, n = len1 < len2 ? len1 : len2;
+	for (i = 0; i < n && k1[i] == k2[i]; i++) {
+		continue;
+	}
+	return i;
+}
+
+static inline void vpage_reset(struct bplus_node *node)
+{
+	node->children = 0;
+	vpage(node)->prefix = 0;
+	vpage(node)->heap = _block_size;
+}
+
+static inline int vpage_room(struct bplus_node *node)
+{
+	return vpage(node)->heap - VPAGE_HDR - node->children * 2;
+}
+
+/* 在槽 i 处分配 size 字节的 cell */
+static char *vpage_alloc(struct bplus_node *node, int i, int size)
+{
+	struct vpage *vp = vpage(node);
+	assert(vpage_room(node) >= size + 2);
+	vp->heap -= size;
+	memmove(&vp->slot[i + 1], &vp->slot[i],
+		(node->children - i) * sizeof(vp->slot[0]));
+	vp->slot[i] = vp->heap;
+	node->children++;
+	return (char *)node + vp->heap;
+}
+
+/* 只移除槽, cell 占用的空间在下次重建时回收 */
+static inline void vpage_remove(struct bplus_node *node, int i)
+{
+	struct vpage *vp = vpage(node);
+	memmove(&vp->slot[i], &vp->slot[i + 1],
+		(node->children - i - 1) * sizeof(vp->slot[0]));
+	node->children--;
+}
+
+static inline const char *vleaf_key(struct bplus_node *leaf, int i, int *len)
+{
+	const char *c = vcell(leaf, i);
+	*len = get16(c);
+	return c + VLEAF_CELL;
+}
+
+static inline const char *vleaf_data(struct bplus_node *leaf, int i, int *len)
+{
+	const char *c = vcell(leaf, i);
+	*len = get16(c + 2);
+	return c + VLEAF_CELL + get16(c);
+}
+
+static inline const char *vnode_key(struct bplus_node *node, int i, int *len)
+{
+	const char *c = vcell(node, i);
+	*len = get16(c + sizeof(off_t));
+	return c + VNODE_CELL;
+}
+
+/* 第 i 个子节点 */
+static inline off_t vnode_sub(struct bplus_node *node, int i)
+{
+	off_t offset;
+	if (i == 0) {
+		return vpage(node)->first;
+	}
+	memcpy(&offset, vcell(node, i - 1), sizeof(offset));
+	return offset;
+}
+
+static void vleaf_put(struct bplus_node *leaf, int i, const char *key,
+		      int klen, const char *data, int dlen)
+{
+	int p = vpage(leaf)->prefix;
+	char *c = vpage_alloc(leaf, i, VLEAF_CELL + klen - p + dlen);
+	put16(c, klen - p);
+	put16(c + 2, dlen);
+	memcpy(c + VLEAF_CELL, key + p, klen - p);
+	memcpy(c + VLEAF_CELL + klen - p, data, dlen);
+}
+
+static void vnode_put(struct bplus_node *node, int i, const char *key,
+		      int klen, off_t child)
+{
+	char *c = vpage_alloc(node, i, VNODE_CELL + klen);
+	memcpy(c, &child, sizeof(child));
+	put16(c + sizeof(off_t), klen);
+	memcpy(c + VNODE_CELL, key, klen);
+}
+
+/* 叶子节点二分查找, 返回值同 key_binary_search()
+ * memcmp 比较时先和页前缀比较一次, 之后只比较后缀 */
+static int vleaf_search(struct bplus_tree *tree, struct bplus_node *leaf,
+			const char *key, int klen)
+{
+	int p = vpage(leaf)->prefix;
+	int low = -1;
+	int high = leaf->children;
+
+	if (p > 0) {
+		const char *prefix = (char *)leaf + _block_size - p;
+		int n = memcmp(key, prefix, klen < p ? klen : p);
+		if (n < 0 || (n == 0 && klen < p)) {
+			return -1;
+		} else if (n > 0) {
+			return -high - 1;
+		}
+		key += p;
+		klen -= p;
+	}
+
+	while (low + 1 < high) {
+		int len, mid = low + (high - low) / 2;
+		const char *k = vleaf_key(leaf, mid, &len);
+		int n = vkey_cmp(tree, k, len, key, klen);
+		if (n < 0) {
+			low = mid;
+		} else if (n > 0) {
+			high = mid;
+		} else {
+			return mid;
+		}
+	}
+
+	return -high - 1;
+}
+
+/* 非叶子节点查找, 返回 key 所在子节点的下标 */
+static int vnode_search(struct bplus_tree *tree, struct bplus_node *node,
+			const char *key, int klen)
+{
+	int low = 0;
+	int high = node->children;
+	while (low < high) {
+		int len, mid = low + (high - low) / 2;
+		const char *k = vnode_key(node, mid, &len);
+		if (vkey_cmp(tree, k, len, key, klen) <= 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/* 有序区间的公共前缀, 自定义比较函数时不做前缀压缩 */
+static inline int vent_prefix(struct bplus_tree *tree, struct vent *ent, int n)
+{
+	if (tree->cmp != NULL || n == 0) {
+		return 0;
+	}
+	return vkey_lcp(ent[0].key, ent[0].klen, ent[n - 1].key,
+			ent[n - 1].klen);
+}
+
+/* 展开叶子节点的所有项, key 和 data 拷贝到 arena */
+static int vleaf_unpack(struct bplus_node *leaf, struct vent *ent, char *arena)
+{
+	int i, p = vpage(leaf)->prefix;
+	const char *prefix = (char *)leaf + _block_size - p;
+	for (i = 0; i < leaf->children; i++) {
+		int len;
+		const char *s = vleaf_key(leaf, i, &len);
+		memcpy(arena, prefix, p);
+		memcpy(arena + p, s, len);
+		ent[i].key = arena;
+		ent[i].klen = p + len;
+		arena += p + len;
+		s = vleaf_data(leaf, i, &len);
+		memcpy(arena, s, len);
+		ent[i].data = arena;
+		ent[i].dlen = len;
+		arena += len;
+	}
+	return leaf->children;
+}
+
+static int vnode_unpack(struct bplus_node *node, struct vent *ent, char *arena)
+{
+	int i;
+	for (i = 0; i < node->children; i++) {
+		int len;
+		const char *k = vnode_key(node, i, &len);
+		memcpy(arena, k, len);
+		ent[i].key = arena;
+		ent[i].klen = len;
+		ent[i].child = vnode_sub(node, i + 1);
+		arena += len;
+	}
+	return node->children;
+}
+
+/* 以公共前缀 p 存放 ent[0..n) 所需的字节数 */
+static inline int vleaf_size(struct vent *ent, int n, int p)
+{
+	int i, size = VPAGE_HDR + p;
+	for (i = 0; i < n; i++) {
+		size += 2 + VLEAF_CELL + ent[i].klen - p + ent[i].dlen;
+	}
+	return size;
+}
+
+static inline int vnode_size(struct vent *ent, int n)
+{
+	int i, size = VPAGE_HDR;
+	for (i = 0; i < n; i++) {
+		size += 2 + VNODE_CELL + ent[i].klen;
+	}
+	return size;
+}
+
+static void vleaf_build(struct bplus_tree *tree, struct bplus_node *leaf,
+			struct vent *ent, int n)
+{
+	int i, p = vent_prefix(tree, ent, n);
+	vpage_reset(leaf);
+	vpage(leaf)->prefix = p;
+	vpage(leaf)->heap = _block_size - p;
+	if (p > 0) {
+		memcpy((char *)leaf + _block_size - p, ent[0].key, p);
+	}
+	for (i = 0; i < n; i++) {
+		vleaf_put(leaf, i, ent[i].key, ent[i].klen, ent[i].data,
+			  ent[i].dlen);
+	}
+}
+
+static void vnode_build(struct bplus_node *node, struct vent *ent, int n,
+			off_t first)
+{
+	int i;
+	vpage_reset(node);
+	vpage(node)->first = first;
+	for (i = 0; i < n; i++) {
+		vnode_put(node, i, ent[i].key, ent[i].klen, ent[i].child);
+	}
+}
+
+/* 选择分裂点, 两边按各自的公共前缀压缩后都放得下且大小最接近 */
+static int vleaf_split_point(struct bplus_tree *tree, struct vent *ent, int n)
+{
+	int m, best = 0, diff = _block_size;
+	int left = 0, total = 0;
+
+	for (m = 0; m < n; m++) {
+		total += 2 + VLEAF_CELL + ent[m].klen + ent[m].dlen;
+	}
+	for (m = 1; m < n; m++) {
+		left += 2 + VLEAF_CELL + ent[m - 1].klen + ent[m - 1].dlen;
+		int lp = vent_prefix(tree, ent, m);
+		int rp = vent_prefix(tree, ent + m, n - m);
+		int ls = VPAGE_HDR + lp + left - m * lp;
+		int rs = VPAGE_HDR + rp + total - left - (n - m) * rp;
+		if (ls <= _block_size && rs <= _block_size &&
+		    abs(ls - rs) < diff) {
+			best = m;
+			diff = abs(ls - rs);
+		}
+	}
+	assert(best > 0);
+	return best;
+}
+
+/* 插入到叶子节点的 pos 处
+ * 放不下时先按新的公共前缀重建, 仍放不下则分裂,
+ * 返回新的右兄弟, 分隔键写入 sep */
+static struct bplus_node *vleaf_insert(struct bplus_tree *tree,
+				       struct bplus_node *leaf, int pos,
+				       const char *key, int klen,
+				       const char *data, int dlen, char *sep,
+				       int *seplen)
+{
+	struct bplus_node *right = NULL;
+	int n, p = vpage(leaf)->prefix;
+
+	if (klen >= p && memcmp(key, (char *)leaf + _block_size - p, p) == 0 &&
+	    vpage_room(leaf) >= 2 + VLEAF_CELL + klen - p + dlen) {
+		vleaf_put(leaf, pos, key, klen, data, dlen);
+		return NULL;
+	}
+
+	n = leaf->children + 1;
+	struct vent *ent = malloc(n * sizeof(*ent));
+	char *arena = malloc(n * p + _block_size);
+	assert(ent != NULL && arena != NULL);
+	vleaf_unpack(leaf, ent, arena);
+	memmove(&ent[pos + 1], &ent[pos], (n - pos - 1) * sizeof(*ent));
+	ent[pos].key = key;
+	ent[pos].klen = klen;
+	ent[pos].data = data;
+	ent[pos].dlen = dlen;
+
+	if (vleaf_size(ent, n, vent_prefix(tree, ent, n)) <= _block_size) {
+		vleaf_build(tree, leaf, ent, n);
+	} else {
+		int m = vleaf_split_point(tree, ent, n);
+		right = leaf_new(tree);
+		struct bplus_node *next = node_fetch(tree, leaf->next);
+		if (next != NULL) {
+			next->prev = right->self;
+			node_flush(tree, next);
+		}
+		right->next = leaf->next;
+		right->prev = leaf->self;
+		leaf->next = right->self;
+		vleaf_build(tree, leaf, ent, m);
+		vleaf_build(tree, right, ent + m, n - m);
+		/* suffix truncation: the shortest prefix of the right first
+		 * key that is still greater than the left last key */
+		if (tree->cmp == NULL) {
+			*seplen = vkey_lcp(ent[m - 1].key, ent[m - 1].klen,
+					   ent[m].key, ent[m].klen) + 1;
+		} else {
+			*seplen = ent[m].klen;
+		}
+		memcpy(sep, ent[m].key, *seplen);
+	}
+
+	free(arena);
+	free(ent);
+	return right;
+}
+
+/* 插入分隔键 key 和其右边的子节点, 分裂时返回新的右兄弟,
+ * 上提的分隔键写入 sep, key 可以和 sep 是同一块内存 */
+static struct bplus_node *vnode_insert(struct bplus_tree *tree,
+				       struct bplus_node *node,
+				       const char *key, int klen, off_t child,
+				       char *sep, int *seplen)
+{
+	struct bplus_node *right = NULL;
+	int n, pos = vnode_search(tree, node, key, klen);
+
+	if (vpage_room(node) >= 2 + VNODE_CELL + klen) {
+		vnode_put(node, pos, key, klen, child);
+		return NULL;
+	}
+
+	n = node->children + 1;
+	struct vent *ent = malloc(n * sizeof(*ent));
+	char *arena = malloc(_block_size);
+	assert(ent != NULL && arena != NULL);
+	vnode_unpack(node, ent, arena);
+	memmove(&ent[pos + 1], &ent[pos], (n - pos - 1) * sizeof(*ent));
+	ent[pos].key = key;
+	ent[pos].klen = klen;
+	ent[pos].child = child;
+
+	if (vnode_size(ent, n) <= _block_size) {
+		vnode_build(node, ent, n, vpage(node)->first);
+	} else {
+		int m, best = 1, diff = _block_size;
+		for (m = 1; m < n - 1; m++) {
+			int ls = vnode_size(ent, m);
+			int rs = vnode_size(ent + m + 1, n - m - 1);
+			if (abs(ls - rs) < diff) {
+				best = m;
+				diff = abs(ls - rs);
+			}
+		}
+		m = best;
+		right = non_leaf_new(tree);
+		vnode_build(node, ent, m, vpage(node)->first);
+		vnode_build(right, ent + m + 1, n - m - 1, ent[m].child);
+		/* ent[m] may point into sep itself */
+		memmove(sep, ent[m].key, ent[m].klen);
+		*seplen = ent[m].klen;
+	}
+
+	free(arena);
+	free(ent);
+	return right;
+}
+
+/* 从根节点查找到叶子节点, 记录路径和每层的子节点下标, 返回叶子深度 */
+static int vtree_descend(struct bplus_tree *tree, const char *key, int klen,
+			 off_t *path, int *index)
+{
+	int depth = 0;
+	struct bplus_node *node = node_seek(tree, tree->root);
+	while (node != NULL) {
+		path[depth] = node->self;
+		if (is_leaf(node)) {
+			return depth;
+		}
+		int i = vnode_search(tree, node, key, klen);
+		if (index != NULL) {
+			index[depth] = i;
+		}
+		assert(++depth < VPATH_MAX);
+		node = node_seek(tree, vnode_sub(node, i));
+	}
+	return -1;
+}
+
+static int vtree_insert(struct bplus_tree *tree, const char *key, int klen,
+			const char *data, int dlen)
+{
+	off_t path[VPATH_MAX];
+	int depth, seplen, pos;
+	char *sep = tree->vbuf;
+
+	if (tree->root == INVALID_OFFSET) {
+		struct bplus_node *root = leaf_new(tree);
+		vpage_reset(root);
+		tree->root = root->self;
+		tree->level = 1;
+		node_flush(tree, root);
+	}
+
+	depth = vtree_descend(tree, key, klen, path, NULL);
+	struct bplus_node *leaf = node_fetch(tree, path[depth]);
+	pos = vleaf_search(tree, leaf, key, klen);
+	if (pos >= 0) {
+		/* overwrite */
+		vpage_remove(leaf, pos);
+	} else {
+		pos = -pos - 1;
+	}
+
+	struct bplus_node *right = vleaf_insert(tree, leaf, pos, key, klen,
+						data, dlen, sep, &seplen);
+	off_t left = leaf->self;
+	node_flush(tree, leaf);
+
+	while (right != NULL) {
+		off_t offset = right->self;
+		node_flush(tree, right);
+		if (depth == 0) {
+			/* split the root */
+			struct bplus_node *root = non_leaf_new(tree);
+			vpage_reset(root);
+			vpage(root)->first = left;
+			vnode_put(root, 0, sep, seplen, offset);
+			tree->root = root->self;
+			tree->level++;
+			node_flush(tree, root);
+			break;
+		}
+		struct bplus_node *node = node_fetch(tree, path[--depth]);
+		right = vnode_insert(tree, node, sep, seplen, offset, sep,
+				     &seplen);
+		left = node->self;
+		node_flush(tree, node);
+	}
+
+	return 0;
+}
+
+/* 删除 key, 叶子节点为空时从父节点摘除, 不做合并 */
+static int vtree_delete(struct bplus_tree *tree, const char *key, int klen)
+{
+	off_t path[VPATH_MAX];
+	int index[VPATH_MAX];
+	int depth, pos;
+
+	if (tree->root == INVALID_OFFSET) {
+		return -1;
+	}
+
+	depth = vtree_descend(tree, key, klen, path, index);
+	struct bplus_node *leaf = node_fetch(tree, path[depth]);
+	pos = vleaf_search(tree, leaf, key, klen);
+	if (pos < 0) {
+		cache_defer(tree, leaf, 0);
+		return -1;
+	}
+
+	vpage_remove(leaf, pos);
+	if (leaf->children > 0 || depth == 0) {
+		node_flush(tree, leaf);
+		return 0;
+	}
+
+	struct bplus_node *prev = node_fetch(tree, leaf->prev);
+	struct bplus_node *next = node_fetch(tree, leaf->next);
+	node_delete(tree, leaf, prev, next);
+
+	while (depth-- > 0) {
+		struct bplus_node *node = node_fetch(tree, path[depth]);
+		int i = index[depth];
+		if (node->children == 0) {
+			/* the removed sub node was the only one */
+			node_delete(tree, node, NULL, NULL);
+			if (depth == 0) {
+				tree->root = INVALID_OFFSET;
+				tree->level = 0;
+			}
+			continue;
+		}
+		if (i == 0) {
+			vpage(node)->first = vnode_sub(node, 1);
+			vpage_remove(node, 0);
+		} else {
+			vpage_remove(node, i - 1);
+		}
+		node_flush(tree, node);
+		break;
+	}
+
+	/* shrink the root while it has a single sub node */
+	for (;;) {
+		struct bplus_node *root = node_fetch(tree, tree->root);
+		if (root == NULL || is_leaf(root) || root->children > 0) {
+			if (root != NULL) {
+				cache_defer(tree, root, 0);
+			}
+			break;
+		}
+		tree->root = vpage(root)->first;
+		tree->level--;
+		node_delete(tree, root, NULL, NULL);
+	}
+
+	return 0;
+}
+
+/* 变长 key 的树没有乐观读, 查找持有共享锁, 修改独占整棵树 */
+int bplus_tree_get_var(struct bplus_tree *tree, const void *key, int klen,
+		       void *data, int size)
+{
+	int i, len = -1;
+
+	pthread_rwlock_rdlock(&tree->smo_lock);
+	struct bplus_node *node = node_seek(tree, tree->root);
+	while (node != NULL && !is_leaf(node)) {
+		i = vnode_search(tree, node, key, klen);
+		node = node_seek(tree, vnode_sub(node, i));
+	}
+	if (node != NULL && (i = vleaf_search(tree, node, key, klen)) >= 0) {
+		const char *d = vleaf_data(node, i, &len);
+		memcpy(data, d, len < size ? len : size);
+	}
+
+	seek_release(tree);
+	pthread_rwlock_unlock(&tree->smo_lock);
+	return len;
+}
+
+int bplus_tree_put_var(struct bplus_tree *tree, const void *key, int klen,
+		       const void *data, int dlen)
+{
+	int ret;
+
+	if (data != NULL && (klen < 0 || dlen < 0 ||
+			     2 + VLEAF_CELL + klen + dlen > vcell_max())) {
+		return -1;
+	}
+
+	smo_begin(tree);
+	if (data == NULL) {
+		ret = vtree_delete(tree, key, klen);
+	} else {
+		ret = vtree_insert(tree, key, klen, data, dlen);
+	}
+	smo_end(tree);
+	return ret;
+}
+
+void bplus_tree_stat(struct bplus_tree *tree, struct bplus_tree_stat *st)
+{
+	int i, top = 0, max = 64;
+	struct {
+		off_t offset;
+		int depth;
+	} *stack = malloc(max * sizeof(*stack));
+
+	assert(stack != NULL);
+	memset(st, 0, sizeof(*st));
+	pthread_rwlock_rdlock(&tree->smo_lock);
+	if (tree->root != INVALID_OFFSET) {
+		stack[top].offset = tree->root;
+		stack[top++].depth = 1;
+	}
+
+	while (top > 0) {
+		int depth = stack[--top].depth;
+		struct bplus_node *node = node_seek(tree, stack[top].offset);
+		if (depth > st->height) {
+			st->height = depth;
+		}
+		if (is_leaf(node)) {
+			st->leaves++;
+			st->entries += node->children;
+			continue;
+		}
+		int n = tree->varlen ? node->children + 1 : node->children;
+		st->non_leaves++;
+		st->branches += n;
+		if (top + n > max) {
+			max = (top + n) * 2;
+			stack = realloc(stack, max * sizeof(*stack));
+			assert(stack != NULL);
+		}
+		for (i = 0; i < n; i++) {
+			stack[top].offset =
+				tree->varlen ? vnode_sub(node, i) : sub(node)[i];
+			stack[top++].depth = depth + 1;
+		}
+	}
+
+	seek_release(tree);
+	pthread_rwlock_unlock(&tree->smo_lock);
+	free(stack);
+}
+
+int bplus_open(char *filename)
+{
+	return open(filename, O_CREAT | O_RDWR, 0644);
+}
+
+void bplus_close(int fd)
+{
+	close(fd);
+}
+
+// 16 进制字符串转 10 进制
+static off_t str_to_hex(char *c, int len)
+{
+	off_t offset = 0;
+	while (len-- > 0) {
+		if (isdigit(*c)) {
+			// 是 10 进制
+			offset = offset * 16 + *c - '0';
+		} else if (isxdigit(*c)) {
+			// 是 16 进制
+			if (islower(*c)) {
+				offset = offset * 16 + *c - 'a' + 10;
+			} else {
+				offset = offset * 16 + *c - 'A' + 10;
+			}
+		}
+		c++;
+	}
+	return offset;
+}
+
+// 10 进制转 16 进制字符串
+static inline void hex_to_str(off_t offset, char *buf, int len)
+{
+	const static char *hex = "0123456789ABCDEF";
+	while (len-- > 0) {
+		buf[len] = hex[offset & 0xf];
+		offset >>= 4;
+	}
+}
+
+static inline off_t offset_load(int fd)
+{
+	char buf[ADDR_STR_WIDTH];
+	ssize_t len = read(fd, buf, sizeof(buf));
+	return len > 0 ? str_to_hex(buf, sizeof(buf)) : INVALID_OFFSET;
+}
+
+static inline ssize_t offset_store(int fd, off_t offset)
+{
+	char buf[ADDR_STR_WIDTH];
+	hex_to_str(offset, buf, sizeof(buf));
+	return write(fd, buf, sizeof(buf));
+}
+
+/* 持久化树 meta 信息, 先写临时文件再改名, 不会留下半个 boot 文件 */
+static void boot_store(struct bplus_tree *tree, int sync)
+{
+	char tmp[1040];
+	struct list_head *pos;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", tree->filename);
+	int fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	assert(fd >= 0);
+	assert(offset_store(fd, tree->root) == ADDR_STR_WIDTH);
+	assert(offset_store(fd, _block_size) == ADDR_STR_WIDTH);
+	assert(offset_store(fd, tree->file_size) == ADDR_STR_WIDTH);
+
+	/* store free blocks in files for future reuse */
+	list_for_each(pos, &tree->free_blocks) {
+		struct free_block *block =
+			list_entry(pos, struct free_block, link);
+		assert(offset_store(fd, block->offset) == ADDR_STR_WIDTH);
+	}
+	if (sync) {
+		fsync(fd);
+	}
+	close(fd);
+	int err = rename(tmp, tree->filename);
+	(void)err;
+	assert(err == 0);
+	if (sync) {
+		dir_sync(tree->filename);
+	}
+}
+
+static void free_blocks_clear(struct bplus_tree *tree)
+{
+	struct list_head *pos, *n;
+	list_for_each_safe(pos, n, &tree->free_blocks) {
+		list_del(pos);
+		free(list_entry(pos, struct free_block, link));
+	}
+}
+
+static void free_block_add(struct bplus_tree *tree, off_t offset)
+{
+	struct free_block *block = malloc(sizeof(*block));
+	assert(block != NULL);
+	block->offset = offset;
+	list_add_tail(&block->link, &tree->free_blocks);
+}
+
+static void free_block_remove(struct bplus_tree *tree, off_t offset)
+{
+	struct list_head *pos;
+	list_for_each(pos, &tree->free_blocks) {
+		struct free_block *block =
+			list_entry(pos, struct free_block, link);
+		if (block->offset == offset) {
+			list_del(pos);
+			free(block);
+			return;
+		}
+	}
+}
+
+/* 重放上次没有正常关闭时留下的日志
+ * 从检查点记录开始, 依次写入每条完整提交中的块, 遇到不完整或
+ * 校验失败的记录为止, 之后写回 boot 文件并删除日志 */
+static void wal_recover(struct bplus_tree *tree)
+{
+	char path[1040];
+	struct stat st;
+	int i, commits = -1;
+	size_t pos = 0;
+
+	tree_path(tree, path, ".wal");
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+	assert(fstat(fd, &st) == 0);
+	size_t size = st.st_size;
+	char *buf = malloc(size + 1);
+	assert(buf != NULL);
+	ssize_t len = pread(fd, buf, size, 0);
+	close(fd);
+	if (len < 0) {
+		len = 0;
+	}
+	size = len;
+
+	while (pos + sizeof(struct wal_record) <= size) {
+		struct wal_record *rec = (struct wal_record *)(buf + pos);
+		if (rec->magic != WAL_MAGIC ||
+		    rec->len < sizeof(struct wal_record) ||
+		    rec->len > size - pos || wal_crc(rec) != rec->crc ||
+		    (commits >= 0 && rec->block_size != _block_size) ||
+		    (commits < 0) != (rec->type == WAL_CHECKPOINT)) {
+			break;
+		}
+
+		off_t *alloc = (off_t *)(rec + 1);
+		off_t *freed = alloc + rec->nalloc;
+		char *p = (char *)(freed + rec->nfree);
+		if (rec->type == WAL_CHECKPOINT) {
+			_block_size = rec->block_size;
+			free_blocks_clear(tree);
+		}
+		for (i = 0; i < rec->npages; i++) {
+			off_t offset;
+			memcpy(&offset, p, sizeof(off_t));
+			len = pwrite(tree->fd, p + sizeof(off_t), _block_size,
+				     offset);
+			assert(len == _block_size);
+			p += sizeof(off_t) + _block_size;
+		}
+		for (i = 0; i < rec->nalloc; i++) {
+			free_block_remove(tree, alloc[i]);
+		}
+		for (i = 0; i < rec->nfree; i++) {
+			free_block_add(tree, freed[i]);
+		}
+		tree->root = rec->root;
+		tree->file_size = rec->file_size;
+		commits++;
+		pos += rec->len;
+	}
+	free(buf);
+
+	if (commits < 0) {
+		fprintf(stderr, "%s has no checkpoint, ignored!\n", path);
+		return;
+	}
+	fsync(tree->fd);
+	boot_store(tree, 1);
+	unlink(path);
+	dir_sync(path);
+	printf("recovered %d commits from %s\n", commits, path);
+}
+
+/* 分配缓冲池
+ * 分片数为 2 的幂, 每个分片至少能同时容纳两次操作所需的节点 */
+static void cache_init(struct bplus_tree *tree, int cache_num)
+{
+	int i, j, per_shard;
+
+	if (cache_num < MIN_CACHE_NUM + 1) {
+		cache_num = MIN_CACHE_NUM + 1;
+	}
+	tree->shard_bits = 0;
+	while (tree->shard_bits < 4 &&
+	       (cache_num >> (tree->shard_bits + 1)) >= 2 * (MIN_CACHE_NUM + 1)) {
+		tree->shard_bits++;
+	}
+	per_shard = cache_num >> tree->shard_bits;
+	tree->cache_num = per_shard << tree->shard_bits;
+	tree->bucket_bits = 1;
+	while ((1 << tree->bucket_bits) < per_shard) {
+		tree->bucket_bits++;
+	}
+
+	tree->shards = calloc(1 << tree->shard_bits, sizeof(*tree->shards));
+	assert(tree->shards != NULL);
+	for (i = 0; i < 1 << tree->shard_bits; i++) {
+		struct bplus_shard *shard = &tree->shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->frame_num = per_shard;
+		shard->frames = malloc((FRAME_HDR_SIZE + _block_size) * per_shard);
+		shard->buckets = malloc(sizeof(int) << tree->bucket_bits);
+		assert(shard->frames != NULL && shard->buckets != NULL);
+		memset(shard->buckets, -1, sizeof(int) << tree->bucket_bits);
+		for (j = 0; j < per_shard; j++) {
+			struct bplus_frame *frame = shard_frame(shard, j);
+			memset(frame, 0, sizeof(*frame));
+			frame->offset = INVALID_OFFSET;
+			frame->next = -1;
+			frame->shard = i;
+		}
+	}
+}
+
+/* 写回所有脏块并释放缓冲池 */
+static void cache_deinit(struct bplus_tree *tree)
+{
+	int i, j;
+
+	for (i = 0; i < 1 << tree->shard_bits; i++) {
+		struct bplus_shard *shard = &tree->shards[i];
+		for (j = 0; j < shard->frame_num; j++) {
+			struct bplus_frame *frame = shard_frame(shard, j);
+			assert(frame->pin == 0);
+			if (frame->offset != INVALID_OFFSET && frame->dirty) {
+				frame_write(shard, tree->fd, frame);
+			}
+		}
+		pthread_mutex_destroy(&shard->lock);
+		free(shard->frames);
+		free(shard->buckets);
+	}
+	free(tree->shards);
+}
+
+void bplus_tree_cache_stats(struct bplus_tree *tree, unsigned long *hits,
+			    unsigned long *misses, unsigned long *writes)
+{
+	int i;
+
+	*hits = *misses = *writes = 0;
+	for (i = 0; i < 1 << tree->shard_bits; i++) {
+		struct bplus_shard *shard = &tree->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		*hits += shard->hits;
+		*misses += shard->misses;
+		*writes += shard->writes;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+struct bplus_tree *bplus_tree_init(char *filename, int block_size)
+{
+	return bplus_tree_init_cache(filename, block_size, DEFAULT_CACHE_NUM);
+}
+
+/* cache_num 为缓冲池块数 */
+struct bplus_tree *bplus_tree_init_cache(char *filename, int block_size,
+					 int cache_num)
+{
+	int i;
+	struct bplus_node node;
+
+	if (strlen(filename) >= 1024) {
+		// 文件名太长
+		fprintf(stderr, "Index file name too long!\n");
+		return NULL;
+	}
+
+	if ((block_size & (block_size - 1)) != 0) {
+		// 必须是 2 的倍数
+		fprintf(stderr, "Block size must be pow of 2!\n");
+		return NULL;
+	}
+
+	if (block_size < (int)sizeof(node)) {
+		// 块大小小于一个 bplus_node 大小
+		fprintf(stderr, "block size is too small for one node!\n");
+		return NULL;
+	}
+
+	_block_size = block_size;
+	_max_order =
+		(block_size - sizeof(node)) / (sizeof(key_t) + sizeof(off_t));
+	_max_entries =
+		(block_size - sizeof(node)) / (sizeof(key_t) + sizeof(long));
+	if (_max_order <= 2) {
+		fprintf(stderr, "block size is too small for one node!\n");
+		return NULL;
+	}
+
+	/* 分配内存同时初始化为 0 */
+	struct bplus_tree *tree = calloc(1, sizeof(*tree));
 	assert(tree != NULL);
 	/* 链表初始化 */
 	list_init(&tree->free_blocks);
 	/* 拷贝文件名 */
 	strcpy(tree->filename, filename);
 
+	/* open data file */
+	/* 打开数据文件 */
+	tree->fd = bplus_open(filename);
+	assert(tree->fd >= 0);
+
 	/* load index boot file */
 	/* 打开索引 boot 文件 */
 	int fd = open(strcat(tree->filename, ".boot"), O_RDWR, 0644);
@@ -1288,6 +3412,10 @@ struct bplus_tree *bplus_tree_init(char *filename, int block_size)
 		tree->file_size = 0;
 	}
 
+	/* 上次没有正常关闭, 用日志恢复 */
+	crc_init();
+	wal_recover(tree);
+
 	/* set order and entries */
 	_max_order =
 		(_block_size - sizeof(node)) / (sizeof(key_t) + sizeof(off_t));
@@ -1296,38 +3424,131 @@ struct bplus_tree *bplus_tree_init(char *filename, int block_size)
 	printf("config node order:%d and leaf entries:%d\n", _max_order,
 	       _max_entries);
 
-	/* init free node caches */
-	tree->caches = malloc(_block_size * MIN_CACHE_NUM);
+	/* init node buffer pool */
+	cache_init(tree, cache_num);
 
-	/* open data file */
-	/* 打开数据文件 */
-	tree->fd = bplus_open(filename);
-	assert(tree->fd >= 0);
+	/* 结构修改优先, 避免被源源不断的叶子更新饿死 */
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+	pthread_rwlockattr_setkind_np(
+		&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&tree->smo_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	/* 默认不写日志 */
+	pthread_mutex_init(&tree->wal_lock, NULL);
+	tree->durability = BPLUS_DURABLE_NONE;
+	tree->wal_fd = -1;
+	tree->txn = calloc(1, sizeof(*tree->txn));
+	assert(tree->txn != NULL);
 	return tree;
 }
 
-/* 持久化树 meta 信息 */
+/* 变长 key 的索引, cmp 为 NULL 时按字节序比较 */
+struct bplus_tree *bplus_tree_init_var(char *filename, int block_size,
+				       int cache_num, bplus_cmp_t cmp)
+{
+	/* 块内偏移用 16 位存放 */
+	if (block_size > 32768) {
+		fprintf(stderr, "block size is too large for variable keys!\n");
+		return NULL;
+	}
+
+	struct bplus_tree *tree =
+		bplus_tree_init_cache(filename, block_size, cache_num);
+	if (tree != NULL) {
+		tree->varlen = 1;
+		tree->cmp = cmp;
+		tree->vbuf = malloc(_block_size);
+		assert(tree->vbuf != NULL);
+	}
+	return tree;
+}
+
+/* mode 为 BPLUS_DURABLE_*
+ * 开启日志时先做一次检查点, 关闭时写回所有块并删除日志 */
+int bplus_tree_set_durability(struct bplus_tree *tree, int mode)
+{
+	char path[1040];
+
+	if (mode < BPLUS_DURABLE_NONE || mode > BPLUS_DURABLE_SYNC) {
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&tree->smo_lock);
+	seek_release(tree);
+	if (tree->durability == BPLUS_DURABLE_NONE) {
+		if (mode != BPLUS_DURABLE_NONE) {
+			tree->durability = mode;
+			wal_checkpoint(tree);
+		}
+	} else if (mode == BPLUS_DURABLE_NONE) {
+		wal_sync(tree);
+		cache_flush(tree);
+		fsync(tree->fd);
+		boot_store(tree, 1);
+		close(tree->wal_fd);
+		tree->wal_fd = -1;
+		tree_path(tree, path, ".wal");
+		unlink(path);
+		dir_sync(path);
+		tree->durability = mode;
+	} else {
+		tree->durability = mode;
+		wal_sync(tree);
+	}
+	pthread_rwlock_unlock(&tree->smo_lock);
+	return 0;
+}
+
+void bplus_tree_wal_stats(struct bplus_tree *tree, unsigned long *commits,
+			  unsigned long *bytes, unsigned long *syncs,
+			  unsigned long *checkpoints)
+{
+	pthread_mutex_lock(&tree->wal_lock);
+	*commits = tree->wal_commits;
+	*bytes = tree->wal_bytes;
+	*syncs = tree->wal_syncs;
+	*checkpoints = tree->wal_checkpoints;
+	pthread_mutex_unlock(&tree->wal_lock);
+}
+
+/* 持久化树 meta 信息
+ * 开启日志时块和 boot 文件都落盘后才删除日志 */
 void bplus_tree_deinit(struct bplus_tree *tree)
 {
-	int fd = open(tree->filename, O_CREAT | O_RDWR, 0644);
-	(void)fd;
-	assert(fd >= 0);
-	assert(offset_store(fd, tree->root) == ADDR_STR_WIDTH);
-	assert(offset_store(fd, _block_size) == ADDR_STR_WIDTH);
-	assert(offset_store(fd, tree->file_size) == ADDR_STR_WIDTH);
+	char path[1040];
+	int durable = tree->durability != BPLUS_DURABLE_NONE;
 
-	/* store free blocks in files for future reuse */
-	struct list_head *pos, *n;
-	list_for_each_safe(pos, n, &tree->free_blocks) {
-		list_del(pos);
-		struct free_block *block =
-			list_entry(pos, struct free_block, link);
-		assert(offset_store(fd, block->offset) == ADDR_STR_WIDTH);
-		free(block);
+	seek_release(tree);
+	if (durable) {
+		wal_sync(tree);
+	}
+	/* dirty nodes reach the data file before it is closed */
+	cache_deinit(tree);
+	if (durable) {
+		fsync(tree->fd);
+	}
+	boot_store(tree, durable);
+	if (durable) {
+		close(tree->wal_fd);
+		tree_path(tree, path, ".wal");
+		unlink(path);
+		dir_sync(path);
 	}
+	free_blocks_clear(tree);
 
+	pthread_rwlock_destroy(&tree->smo_lock);
+	pthread_mutex_destroy(&tree->wal_lock);
 	bplus_close(tree->fd);
-	free(tree->caches);
+	free(tree->txn->pages);
+	free(tree->txn->alloc);
+	free(tree->txn->freed);
+	free(tree->txn);
+	free(tree->wal_buf);
+	free(tree->vbuf);
 	free(tree);
 }
 
@@ -1428,6 +3649,7 @@ void bplus_tree_dump(struct bplus_tree *tree)
 			level--;
 		}
 	}
+	seek_release(tree);
 }
 
 #endif
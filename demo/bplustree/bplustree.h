@@ -4,11 +4,28 @@
 
 #ifndef _BPLUS_TREE_H
 #define _BPLUS_TREE_H
+#include <pthread.h>
 #include <unistd.h>
 
 /* 5 node caches are needed at least for self, left and right sibling, sibling
  * of sibling, parent and node seeking */
 #define MIN_CACHE_NUM 5
+/* default buffer pool size in blocks */
+#define DEFAULT_CACHE_NUM 1024
+
+/* 持久化级别, 见 bplus_tree_set_durability() */
+enum {
+	/* 不写日志, 块在淘汰或关闭时原地写回, 崩溃后索引可能损坏 */
+	BPLUS_DURABLE_NONE,
+	/* 每次提交写入重做日志, 不 fsync, 只能防进程崩溃 */
+	BPLUS_DURABLE_LOG,
+	/* 每 BPLUS_GROUP_COMMITS 次提交或写回脏块前 fsync 日志 */
+	BPLUS_DURABLE_GROUP,
+	/* 每次提交都 fsync 日志 */
+	BPLUS_DURABLE_SYNC,
+};
+
+#define BPLUS_GROUP_COMMITS 32
 
 #define list_entry(ptr, type, member) \
 	((type *)((char *)(ptr) - (size_t)(&((type *)0)->member)))
@@ -27,6 +44,12 @@
 
 typedef int key_t;
 
+/* 批量加载的有序输入, 取到一项返回 0, 结束返回非 0 */
+typedef int (*bplus_iter_t)(void *arg, key_t *key, long *data);
+
+/* 变长 key 比较函数, 返回值同 memcmp() */
+typedef int (*bplus_cmp_t)(const void *k1, int len1, const void *k2, int len2);
+
 struct list_head {
 	struct list_head *prev, *next;
 };
@@ -120,11 +143,17 @@ typedef struct free_block {
 	off_t offset;
 } free_block;
 
+struct bplus_shard;
+struct bplus_txn;
+
 struct bplus_tree {
-	/* 块缓存区
-	 * 缓存 5 个块*/
-	char *caches;
-	int used[MIN_CACHE_NUM];
+	/* 缓冲池, 按块号哈希分片
+	 * 每个分片有自己的锁, 哈希表和 CLOCK 指针 */
+	struct bplus_shard *shards;
+	int shard_bits;
+	int bucket_bits;
+	/* 缓冲池总块数 */
+	int cache_num;
 	/* 索引存放的文件名 */
 	char filename[1024];
 	/* 文件描述符 */
@@ -136,13 +165,73 @@ struct bplus_tree {
 	off_t file_size;
 	/* 空闲块的双向链表 */
 	struct list_head free_blocks;
+	/* 变长 key 槽页格式 */
+	int varlen;
+	/* 变长 key 比较函数, NULL 表示 memcmp 字节序 */
+	bplus_cmp_t cmp;
+	/* 分隔键缓冲区 */
+	char *vbuf;
+	/* 分裂, 合并等结构修改持有写锁, 只改叶子的更新持有读锁 */
+	pthread_rwlock_t smo_lock;
+	/* 结构修改序号, 奇数表示正在修改, 乐观读者据此重试 */
+	unsigned long smo_seq;
+	/* 持久化级别 */
+	int durability;
+	/* 重做日志, 从最近一次检查点开始的提交记录 */
+	int wal_fd;
+	off_t wal_size;
+	/* 已写入但尚未 fsync 的提交数 */
+	int wal_unsynced;
+	pthread_mutex_t wal_lock;
+	/* 记录组装缓冲区 */
+	char *wal_buf;
+	size_t wal_buf_size;
+	/* 最近一次记录中的根节点和文件大小 */
+	off_t wal_root;
+	off_t wal_file_size;
+	unsigned long wal_commits;
+	unsigned long wal_bytes;
+	unsigned long wal_syncs;
+	unsigned long wal_checkpoints;
+	/* 正在进行的结构修改所改动的块 */
+	struct bplus_txn *txn;
+	/* 本次修改中被换出缓冲池的块数, 非 0 时乐观读者不能从文件读入 */
+	int txn_spilled;
+};
+
+/* 树的形状统计 */
+struct bplus_tree_stat {
+	int height;
+	long leaves;
+	long non_leaves;
+	/* 叶子节点中的条目总数 */
+	long entries;
+	/* 非叶子节点的子节点总数 */
+	long branches;
 };
 
 void bplus_tree_dump(struct bplus_tree *tree);
 long bplus_tree_get(struct bplus_tree *tree, key_t key);
 int bplus_tree_put(struct bplus_tree *tree, key_t key, long data);
 long bplus_tree_get_range(struct bplus_tree *tree, key_t key1, key_t key2);
+int bplus_tree_bulk_load(struct bplus_tree *tree, bplus_iter_t iter, void *arg,
+			 int fill);
 struct bplus_tree *bplus_tree_init(char *filename, int block_size);
+struct bplus_tree *bplus_tree_init_cache(char *filename, int block_size,
+					 int cache_num);
+void bplus_tree_cache_stats(struct bplus_tree *tree, unsigned long *hits,
+			    unsigned long *misses, unsigned long *writes);
+int bplus_tree_set_durability(struct bplus_tree *tree, int mode);
+void bplus_tree_wal_stats(struct bplus_tree *tree, unsigned long *commits,
+			  unsigned long *bytes, unsigned long *syncs,
+			  unsigned long *checkpoints);
+struct bplus_tree *bplus_tree_init_var(char *filename, int block_size,
+				       int cache_num, bplus_cmp_t cmp);
+int bplus_tree_get_var(struct bplus_tree *tree, const void *key, int klen,
+		       void *data, int size);
+int bplus_tree_put_var(struct bplus_tree *tree, const void *key, int klen,
+		       const void *data, int dlen);
+void bplus_tree_stat(struct bplus_tree *tree, struct bplus_tree_stat *st);
 void bplus_tree_deinit(struct bplus_tree *tree);
 int bplus_open(char *filename);
 void bplus_close(int fd);
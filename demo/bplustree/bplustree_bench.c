@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bplustree.h"
+
+#define BENCH_FILE "/tmp/bench.index"
+#define BENCH_BLOCK_SIZE 4096
+#define BENCH_LOOKUPS 1000000
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void shuffle(int *keys, int n, unsigned int *seed)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		keys[i] = i + 1;
+	}
+	for (i = n - 1; i > 0; i--) {
+		int j = rand_r(seed) % (i + 1);
+		int k = keys[i];
+		keys[i] = keys[j];
+		keys[j] = k;
+	}
+}
+
+static void bench_reset(void)
+{
+	unlink(BENCH_FILE);
+	unlink(BENCH_FILE ".boot");
+	unlink(BENCH_FILE ".wal");
+}
+
+/* Fill the index with keys 1..n in random order, close it so everything
+ * is on disk, then time random point lookups for each pool size. */
+static void bench_cache(int *keys, int n)
+{
+	static const int caches[] = { 0, 64, 1024, 8192, 65536 };
+	struct bplus_tree *tree;
+	unsigned long hits, misses, writes;
+	unsigned int seed = 1;
+	double t0, t1;
+	int i, c;
+
+	bench_reset();
+	tree = bplus_tree_init_cache(BENCH_FILE, BENCH_BLOCK_SIZE,
+				     DEFAULT_CACHE_NUM);
+	t0 = now();
+	for (i = 0; i < n; i++) {
+		bplus_tree_put(tree, keys[i], keys[i]);
+	}
+	t1 = now() - t0;
+	bplus_tree_cache_stats(tree, &hits, &misses, &writes);
+	printf("insert %d keys: %.0f keys/s, %lu block writes\n", n, n / t1,
+	       writes);
+	bplus_tree_deinit(tree);
+
+	printf("%10s %14s %10s %10s\n", "cache", "lookups/s", "hit rate",
+	       "errors");
+	for (c = 0; c < (int)(sizeof(caches) / sizeof(caches[0])); c++) {
+		long errors = 0;
+		tree = bplus_tree_init_cache(BENCH_FILE, BENCH_BLOCK_SIZE,
+					     caches[c]);
+		t0 = now();
+		for (i = 0; i < BENCH_LOOKUPS; i++) {
+			int key = keys[rand_r(&seed) % n];
+			if (bplus_tree_get(tree, key) != key) {
+				errors++;
+			}
+		}
+		t1 = now() - t0;
+		bplus_tree_cache_stats(tree, &hits, &misses, &writes);
+		printf("%10d %14.0f %9.1f%% %10ld\n", tree->cache_num,
+		       BENCH_LOOKUPS / t1, 100.0 * hits / (hits + misses),
+		       errors);
+		bplus_tree_deinit(tree);
+	}
+	bench_reset();
+}
+
+enum {
+	LAYOUT_INT,
+	/* 8-byte big-endian keys, same payload as the int layout */
+	LAYOUT_U64,
+	/* "user/profile/%08d" keys sharing a 13-byte prefix */
+	LAYOUT_STR,
+};
+
+static int layout_key(int layout, int key, char *buf)
+{
+	unsigned long k = key;
+	int i;
+
+	if (layout == LAYOUT_STR) {
+		return sprintf(buf, "user/profile/%08d", key);
+	}
+	for (i = 7; i >= 0; i--, k >>= 8) {
+		buf[i] = k & 0xff;
+	}
+	return 8;
+}
+
+/* Tree shape and lookup speed of the fixed int layout against the
+ * slotted page layout, with a pool large enough to hold every block. */
+static void bench_layout(int *keys, int n)
+{
+	static const char *names[] = { "int", "var/u64", "var/str" };
+	struct bplus_tree *tree;
+	struct bplus_tree_stat st;
+	unsigned int seed = 1;
+	char buf[32];
+	double t0, t1;
+	int i, layout;
+
+	printf("%10s %8s %8s %10s %10s %14s %10s\n", "layout", "height",
+	       "fanout", "leaf ents", "blocks", "lookups/s", "errors");
+	for (layout = LAYOUT_INT; layout <= LAYOUT_STR; layout++) {
+		long errors = 0, data;
+		bench_reset();
+		if (layout == LAYOUT_INT) {
+			tree = bplus_tree_init_cache(BENCH_FILE, BENCH_BLOCK_SIZE,
+						     65536);
+		} else {
+			tree = bplus_tree_init_var(BENCH_FILE, BENCH_BLOCK_SIZE,
+						   65536, NULL);
+		}
+		for (i = 0; i < n; i++) {
+			data = keys[i];
+			if (layout == LAYOUT_INT) {
+				bplus_tree_put(tree, keys[i], data);
+			} else {
+				int len = layout_key(layout, keys[i], buf);
+				bplus_tree_put_var(tree, buf, len, &data,
+						   sizeof(data));
+			}
+		}
+		bplus_tree_stat(tree, &st);
+
+		t0 = now();
+		for (i = 0; i < BENCH_LOOKUPS; i++) {
+			int key = keys[rand_r(&seed) % n];
+			if (layout == LAYOUT_INT) {
+				data = bplus_tree_get(tree, key);
+			} else {
+				int len = layout_key(layout, key, buf);
+				bplus_tree_get_var(tree, buf, len, &data,
+						   sizeof(data));
+			}
+			if (data != key) {
+				errors++;
+			}
+		}
+		t1 = now() - t0;
+		printf("%10s %8d %8.1f %10.1f %10ld %14.0f %10ld\n",
+		       names[layout], st.height,
+		       st.non_leaves ? (double)st.branches / st.non_leaves : 0,
+		       (double)st.entries / st.leaves,
+		       st.leaves + st.non_leaves, BENCH_LOOKUPS / t1, errors);
+		bplus_tree_deinit(tree);
+	}
+	bench_reset();
+}
+
+struct bulk_iter {
+	int i;
+	int n;
+};
+
+static int bulk_next(void *arg, key_t *key, long *data)
+{
+	struct bulk_iter *it = arg;
+	if (it->i >= it->n) {
+		return -1;
+	}
+	*key = ++it->i;
+	*data = it->i;
+	return 0;
+}
+
+/* Build an index of keys 1..n in order, once through bplus_tree_put()
+ * and once through bplus_tree_bulk_load() at a few fill factors. */
+static void bench_bulk(int n)
+{
+	static const int fills[] = { 0, 100, 90, 70 };
+	struct bplus_tree *tree;
+	struct bplus_tree_stat st;
+	struct stat sb;
+	unsigned int seed = 1;
+	double t0, t1;
+	int i, f;
+
+	printf("%10s %12s %14s %8s %10s %10s\n", "build", "seconds",
+	       "file bytes", "height", "leaves", "errors");
+	for (f = 0; f < (int)(sizeof(fills) / sizeof(fills[0])); f++) {
+		struct bulk_iter it = { 0, n };
+		long errors = 0;
+		char name[16];
+
+		bench_reset();
+		tree = bplus_tree_init_cache(BENCH_FILE, BENCH_BLOCK_SIZE,
+					     DEFAULT_CACHE_NUM);
+		t0 = now();
+		if (fills[f] == 0) {
+			strcpy(name, "put");
+			for (i = 1; i <= n; i++) {
+				bplus_tree_put(tree, i, i);
+			}
+		} else {
+			sprintf(name, "bulk/%d%%", fills[f]);
+			bplus_tree_bulk_load(tree, bulk_next, &it, fills[f]);
+		}
+		bplus_tree_deinit(tree);
+		t1 = now() - t0;
+
+		tree = bplus_tree_init_cache(BENCH_FILE, BENCH_BLOCK_SIZE,
+					     DEFAULT_CACHE_NUM);
+		bplus_tree_stat(tree, &st);
+		for (i = 0; i < BENCH_LOOKUPS; i++) {
+			int key = rand_r(&seed) % n + 1;
+			if (bplus_tree_get(tree, key) != key) {
+				errors++;
+			}
+		}
+		bplus_tree_deinit(tree);
+		stat(BENCH_FILE, &sb);
+		printf("%10s %12.3f %14ld %8d %10ld %10ld\n", name, t1,
+		       (long)sb.st_size, st.height, st.leaves, errors);
+	}
+	bench_reset();
+}
+
+/* Random inserts under each durability setting.  Write amplification
+ * counts log bytes plus block write-backs (checkpoints and evictions)
+ * against the key/value bytes inserted; the final close is not counted. */
+static void bench_durability(int *keys, int n)
+{
+	static const char *names[] = { "none", "log", "group", "sync" };
+	struct bplus_tree *tree;
+	unsigned long hits, misses, writes, commits, bytes, syncs, ckpts;
+	double t0, t1;
+	int i, mode;
+
+	if (n > 100000) {
+		n = 100000;
+	}
+	printf("%10s %12s %12s %12s %10s %8s %10s\n", "durability", "inserts/s",
+	       "log B/op", "blk wr/op", "fsyncs", "ckpts", "write amp");
+	for (mode = BPLUS_DURABLE_NONE; mode <= BPLUS_DURABLE_SYNC; mode++) {
+		bench_reset();
+		tree = bplus_tree_init_cache(BENCH_FILE, BENCH_BLOCK_SIZE,
+					     DEFAULT_CACHE_NUM);
+		bplus_tree_set_durability(tree, mode);
+		t0 = now();
+		for (i = 0; i < n; i++) {
+			bplus_tree_put(tree, keys[i], keys[i]);
+		}
+		t1 = now() - t0;
+		bplus_tree_cache_stats(tree, &hits, &misses, &writes);
+		bplus_tree_wal_stats(tree, &commits, &bytes, &syncs, &ckpts);
+		printf("%10s %12.0f %12.1f %12.3f %10lu %8lu %10.1f\n",
+		       names[mode], n / t1, (double)bytes / n,
+		       (double)writes / n, syncs, ckpts,
+		       (bytes + (double)writes * BENCH_BLOCK_SIZE) /
+			       ((double)n * (sizeof(key_t) + sizeof(long))));
+		bplus_tree_deinit(tree);
+	}
+	bench_reset();
+}
+
+int main(int argc, char *argv[])
+{
+	int n = argc > 1 ? atoi(argv[1]) : 1000000;
+	unsigned int seed = 1;
+	int *keys;
+
+	if (n <= 0) {
+		fprintf(stderr, "usage: %s [keys]\n", argv[0]);
+		return 1;
+	}
+
+	keys = malloc(n * sizeof(int));
+	shuffle(keys, n, &seed);
+	bench_cache(keys, n);
+	bench_layout(keys, n);
+	bench_durability(keys, n);
+	free(keys);
+	bench_bulk(n);
+	return 0;
+}
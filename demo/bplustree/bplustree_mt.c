@@ -0,0 +1,210 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bplustree.h"
+
+#define MT_FILE "/tmp/mt.index"
+#define MT_BLOCK_SIZE 4096
+#define MT_SECS 2
+#define MT_MAX_THREADS 64
+
+static struct bplus_tree *mt_tree;
+static pthread_mutex_t mt_lock = PTHREAD_MUTEX_INITIALIZER;
+static int mt_global;
+static int mt_keys;
+static int mt_threads;
+static int mt_write_pct;
+static volatile int mt_stop;
+
+struct mt_thr {
+	pthread_t tid;
+	int id;
+	unsigned int seed;
+	/* odd keys owned by this thread that are currently in the tree */
+	char *present;
+	unsigned long gets;
+	unsigned long puts;
+	unsigned long errors;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long mt_get(key_t key)
+{
+	long data;
+	if (mt_global) {
+		pthread_mutex_lock(&mt_lock);
+	}
+	data = bplus_tree_get(mt_tree, key);
+	if (mt_global) {
+		pthread_mutex_unlock(&mt_lock);
+	}
+	return data;
+}
+
+static int mt_put(key_t key, long data)
+{
+	int ret;
+	if (mt_global) {
+		pthread_mutex_lock(&mt_lock);
+	}
+	ret = bplus_tree_put(mt_tree, key, data);
+	if (mt_global) {
+		pthread_mutex_unlock(&mt_lock);
+	}
+	return ret;
+}
+
+/* Even keys 2..2n are loaded up front and never change, so every get of
+ * one must find it.  Writers toggle odd keys, each thread its own stripe,
+ * so the result of every put is known in advance as well. */
+static void *mt_worker(void *arg)
+{
+	struct mt_thr *t = arg;
+	int slots = mt_keys / mt_threads;
+
+	while (!mt_stop) {
+		if ((int)(rand_r(&t->seed) % 100) < mt_write_pct && slots > 0) {
+			int slot = rand_r(&t->seed) % slots;
+			key_t key = 2 * (slot * mt_threads + t->id) + 1;
+			int ret = mt_put(key, t->present[slot] ? 0 : key);
+			if (ret != 0) {
+				t->errors++;
+			}
+			t->present[slot] = !t->present[slot];
+			t->puts++;
+		} else {
+			key_t key = 2 * (rand_r(&t->seed) % mt_keys + 1);
+			if (mt_get(key) != key) {
+				t->errors++;
+			}
+			t->gets++;
+		}
+	}
+	return NULL;
+}
+
+struct mt_iter {
+	int i;
+	int n;
+};
+
+static int mt_next(void *arg, key_t *key, long *data)
+{
+	struct mt_iter *it = arg;
+	if (it->i >= it->n) {
+		return -1;
+	}
+	it->i++;
+	*key = 2 * it->i;
+	*data = *key;
+	return 0;
+}
+
+/* Check the odd keys the writers left behind against their maps. */
+static unsigned long mt_verify(struct mt_thr *thr)
+{
+	unsigned long errors = 0;
+	int i, slot, slots = mt_keys / mt_threads;
+
+	for (i = 0; i < mt_threads; i++) {
+		for (slot = 0; slot < slots; slot++) {
+			key_t key = 2 * (slot * mt_threads + i) + 1;
+			long want = thr[i].present[slot] ? key : -1;
+			if (bplus_tree_get(mt_tree, key) != want) {
+				errors++;
+			}
+		}
+	}
+	return errors;
+}
+
+static int mt_run(const char *list, int cache_num)
+{
+	struct mt_thr *thr;
+	const char *p;
+	int i, rc = 0;
+
+	printf("%8s %8s %14s %14s %12s %10s\n", "latch", "threads", "ops/s",
+	       "ops/s/thr", "puts/s", "errors");
+	for (p = list; *p != '\0'; p += strcspn(p, ","), p += *p == ',') {
+		for (mt_global = 1; mt_global >= 0; mt_global--) {
+			struct mt_iter it = { 0, mt_keys };
+			unsigned long gets = 0, puts = 0, errors = 0;
+			double t0, t1;
+
+			mt_threads = atoi(p);
+			if (mt_threads <= 0 || mt_threads > MT_MAX_THREADS) {
+				break;
+			}
+			unlink(MT_FILE);
+			unlink(MT_FILE ".boot");
+			mt_tree = bplus_tree_init_cache(MT_FILE, MT_BLOCK_SIZE,
+							cache_num);
+			bplus_tree_bulk_load(mt_tree, mt_next, &it, 70);
+
+			thr = calloc(mt_threads, sizeof(*thr));
+			mt_stop = 0;
+			t0 = now();
+			for (i = 0; i < mt_threads; i++) {
+				thr[i].id = i;
+				thr[i].seed = i + 1;
+				thr[i].present = calloc(mt_keys / mt_threads + 1, 1);
+				pthread_create(&thr[i].tid, NULL, mt_worker, &thr[i]);
+			}
+			sleep(MT_SECS);
+			mt_stop = 1;
+			for (i = 0; i < mt_threads; i++) {
+				pthread_join(thr[i].tid, NULL);
+				gets += thr[i].gets;
+				puts += thr[i].puts;
+				errors += thr[i].errors;
+			}
+			t1 = now() - t0;
+			errors += mt_verify(thr);
+			for (i = 0; i < mt_threads; i++) {
+				free(thr[i].present);
+			}
+			free(thr);
+			bplus_tree_deinit(mt_tree);
+
+			printf("%8s %8d %14.0f %14.0f %12.0f %10lu\n",
+			       mt_global ? "mutex" : "olc", mt_threads,
+			       (gets + puts) / t1, (gets + puts) / t1 / mt_threads,
+			       puts / t1, errors);
+			if (errors != 0) {
+				rc = 1;
+			}
+		}
+	}
+	unlink(MT_FILE);
+	unlink(MT_FILE ".boot");
+	return rc;
+}
+
+/* Usage: bplustree_mt [threads,...] [keys] [write%] [cache blocks]
+ * Runs each thread count once behind a single global mutex and once on
+ * the tree's own latches. */
+int main(int argc, char *argv[])
+{
+	const char *list = argc > 1 ? argv[1] : "1,2,4,8";
+	int cache_num = argc > 4 ? atoi(argv[4]) : 65536;
+
+	mt_keys = argc > 2 ? atoi(argv[2]) : 1000000;
+	mt_write_pct = argc > 3 ? atoi(argv[3]) : 10;
+	if (mt_keys <= 0 || mt_write_pct < 0 || mt_write_pct > 100) {
+		fprintf(stderr, "usage: %s [threads,...] [keys] [write%%] "
+				"[cache blocks]\n", argv[0]);
+		return 1;
+	}
+	return mt_run(list, cache_num);
+}
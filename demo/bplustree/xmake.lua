@@ -2,6 +2,7 @@ target("bplustree")
     set_kind("static")
     -- add_includedirs("include", {public = true})
     add_files("bplustree.c")
+    add_syslinks("pthread")
 
 target("demo_bplustree_demo")
     set_kind("binary")
@@ -12,3 +13,13 @@ target("demo_bplustree_coverage")
     set_kind("binary")
     add_files("bplustree_coverage.c")
     add_deps("bplustree")
+
+target("demo_bplustree_bench")
+    set_kind("binary")
+    add_files("bplustree_bench.c")
+    add_deps("bplustree")
+
+target("demo_bplustree_mt")
+    set_kind("binary")
+    add_files("bplustree_mt.c")
+    add_deps("bplustree")
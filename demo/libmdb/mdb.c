@@ -1,17 +1,21 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/queue.h>
 #include <sys/param.h>
 #include <sys/uio.h>
 #include <sys/mman.h>
-#ifdef HAVE_SYS_FILE_H
 #include <sys/file.h>
-#endif
 
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -24,8 +28,6 @@
 
 #include "mdb.h"
 
-#define DEBUG
-
 #ifdef DEBUG
 #define DPRINTF(...)                                            \
 	do {                                                    \
@@ -34,22 +36,35 @@
 		fprintf(stderr, "\n");                          \
 	} while (0)
 #else
-#define DPRINTF(...)
+#define DPRINTF(...) \
+	do {            \
+	} while (0)
 #endif
 
 #define PAGESIZE 4096
 #define MDB_MINKEYS 4
 #define MDB_MAGIC 0xBEEFC0DE
-#define MDB_VERSION 1
+#define MDB_VERSION 2
 #define MAXKEYSIZE 255
+#define MDB_MAXREADERS_DEF 126
+#define CACHELINE 64
 
 #define P_INVALID 0xFFFFFFFF
 
 #define F_ISSET(w, f) (((w) & (f)) == (f))
 
 typedef ulong pgno_t;
+typedef ulong txnid_t;
 typedef uint16_t indx_t;
 
+/* Page 0 is the header, pages 1 and 2 hold the two meta pages which
+ * are written alternately, so the previous one stays intact while the
+ * other is being overwritten.
+ */
+#define NUM_METAS 2
+#define META_PGNO(txnid) (1 + ((txnid) % NUM_METAS))
+#define FIRST_DATA_PGNO (1 + NUM_METAS)
+
 /* Common header for all page types. Overflow pages
  * occupy a number of contiguous pages with no
  * headers on any page after the first.
@@ -101,10 +116,12 @@ typedef struct MDB_rootstat {
 	MDB_stat mr_stat;
 } MDB_rootstat;
 
-typedef struct MDB_meta { /* meta (footer) page content */
+typedef struct MDB_meta { /* meta page content */
 	pgno_t mm_root; /* page number of root page */
 	MDB_stat mm_stat;
-	pgno_t mm_prev_meta; /* previous meta page number */
+	MDB_rootstat mm_free; /* freelist DB */
+	txnid_t mm_txnid; /* txn that wrote this meta page */
+	pgno_t mm_last_pgno; /* last used page in the file */
 #define MDB_TOMBSTONE 0x01 /* file is replaced */
 	uint32_t mm_flags;
 #define mm_revisions mm_stat.ms_revisions
@@ -172,17 +189,107 @@ typedef struct MDB_node {
 	char mn_data[1];
 } MDB_node;
 
+/* Reader slot in the lock file, owned by one thread of one process.
+ * mr_txnid is the snapshot the thread is reading, or (txnid_t)-1.
+ */
+typedef struct MDB_rxbody {
+	txnid_t mrb_txnid;
+	pid_t mrb_pid;
+	pthread_t mrb_tid;
+} MDB_rxbody;
+
+typedef struct MDB_reader {
+	union {
+		MDB_rxbody mrx;
+#define mr_txnid mru.mrx.mrb_txnid
+#define mr_pid mru.mrx.mrb_pid
+#define mr_tid mru.mrx.mrb_tid
+		/* cache line alignment */
+		char pad[CACHELINE];
+	} mru;
+} MDB_reader;
+
+typedef struct MDB_txbody {
+	uint32_t mtb_magic;
+	uint32_t mtb_version;
+	pthread_mutex_t mtb_mutex; /* protects slot allocation */
+	txnid_t mtb_txnid; /* last committed txn */
+	unsigned int mtb_numreaders; /* slots ever used */
+	unsigned int mtb_maxreaders;
+} MDB_txbody;
+
+/* Shared lock file: reader table plus the writer mutex. */
+typedef struct MDB_txninfo {
+	union {
+		MDB_txbody mtb;
+#define mti_magic mt1.mtb.mtb_magic
+#define mti_version mt1.mtb.mtb_version
+#define mti_mutex mt1.mtb.mtb_mutex
+#define mti_txnid mt1.mtb.mtb_txnid
+#define mti_numreaders mt1.mtb.mtb_numreaders
+#define mti_maxreaders mt1.mtb.mtb_maxreaders
+		char pad[(sizeof(MDB_txbody) + CACHELINE - 1) &
+			 ~(CACHELINE - 1)];
+	} mt1;
+	union {
+		pthread_mutex_t mt2_wmutex;
+#define mti_wmutex mt2.mt2_wmutex
+		char pad[(sizeof(pthread_mutex_t) + CACHELINE - 1) &
+			 ~(CACHELINE - 1)];
+	} mt2;
+	MDB_reader mti_readers[1];
+} MDB_txninfo;
+
+typedef struct MDB_pglist { /* growable array of page numbers */
+	pgno_t *pl_pgno;
+	unsigned int pl_num;
+	unsigned int pl_max;
+} MDB_pglist;
+
+/* Freelist DB key: the txn that freed the pages, and a chunk number
+ * since one record only holds MDB_FREE_CHUNK pages.
+ */
+typedef struct MDB_freekey {
+	txnid_t fk_txnid;
+	unsigned int fk_chunk;
+} MDB_freekey;
+
+/* keep freelist records small enough to stay off overflow pages */
+#define MDB_FREE_CHUNK ((PAGESIZE / MDB_MINKEYS - 1) / sizeof(pgno_t))
+/* pages to have at hand before updating the freelist at commit */
+#define MDB_FREE_RESERVE 8
+
 struct MDB_txn {
 	pgno_t mt_root; /* current / new root page */
+	pgno_t mt_free_root; /* root page of the freelist DB */
 	pgno_t mt_next_pgno; /* next unallocated page */
 	pgno_t mt_first_pgno;
+	txnid_t mt_txnid;
 	MDB_env *mt_env;
 	struct dirty_queue *mt_dirty_queue; /* modified pages */
+	MDB_dpage **mt_dirty_idx; /* the same pages, sorted by pgno */
+	unsigned int mt_dirty_num;
+	unsigned int mt_dirty_max;
+	MDB_reader *mt_reader; /* read-only: our slot in the lock file */
+	MDB_pglist mt_free_pgs; /* committed pages this txn replaced */
+	MDB_pglist mt_reuse; /* reclaimed pages ready for reuse */
+	txnid_t mt_reclaimed; /* last freelist record moved to mt_reuse */
+	pgno_t mt_reuse_lo; /* range of reused page numbers */
+	pgno_t mt_reuse_hi;
 #define MDB_TXN_RDONLY 0x01 /* read-only transaction */
 #define MDB_TXN_ERROR 0x02 /* an error has occurred */
+#define MDB_TXN_FREEING 0x04 /* saving the freelist, don't reclaim */
+#define MDB_TXN_NORECLAIM 0x08 /* nothing more to reclaim */
 	unsigned int mt_flags;
 };
 
+#define MDB_FREEDB 0x80000000 /* internal: the freelist DB */
+
+/* root page of db as seen by txn */
+#define TXN_ROOT(txn, db)                                            \
+	(*(F_ISSET((db)->md_flags, MDB_FREEDB) ? &(txn)->mt_free_root : \
+						 &(txn)->mt_root))
+
 /* Must be same as MDB_db, minus md_root/md_stat */
 typedef struct MDB_db0 {
 	unsigned int md_flags;
@@ -204,16 +311,21 @@ struct MDB_db {
 
 struct MDB_env {
 	int me_fd;
-#define MDB_FIXPADDING 0x01 /* internal */
+	int me_lfd; /* lock file */
 	uint32_t me_flags;
 	char *me_path;
 	char *me_map;
 	MDB_head me_head;
 	MDB_db0 me_db; /* first DB, overlaps with meta */
 	MDB_meta me_meta;
+	MDB_db0 me_free_db; /* freelist DB, overlaps with me_free */
+	MDB_rootstat me_free;
 	MDB_txn *me_txn; /* current write transaction */
 	size_t me_mapsize;
-	off_t me_size; /* current file size */
+	MDB_txninfo *me_txns; /* shared reader table, or NULL */
+	size_t me_txns_size;
+	unsigned int me_maxreaders;
+	pthread_key_t me_txkey; /* thread -> reader slot */
 };
 
 #define NODESIZE offsetof(MDB_node, mn_data)
@@ -229,24 +341,42 @@ struct MDB_env {
 #define MDB_COMMIT_PAGES 64 /* max number of pages to write in one commit */
 #define MDB_MAXCACHE_DEF 1024 /* max number of pages to keep in cache  */
 
-static int mdb_search_page_root(MDB_db *db, MDB_val *key, MDB_cursor *cursor,
-				int modify, MDB_pageparent *mpp);
+/* mdb_search_page() flags */
+#define MDB_PS_MODIFY 1 /* touch the pages on the path */
+#define MDB_PS_LAST 2 /* without a key, go to the last leaf */
+
+static int mdb_search_page_root(MDB_db *db, MDB_txn *txn, MDB_val *key,
+				MDB_cursor *cursor, int flags,
+				MDB_pageparent *mpp);
 static int mdb_search_page(MDB_db *db, MDB_txn *txn, MDB_val *key,
-			   MDB_cursor *cursor, int modify, MDB_pageparent *mpp);
+			   MDB_cursor *cursor, int flags, MDB_pageparent *mpp);
 
 static int mdbenv_write_header(MDB_env *env);
 static int mdbenv_read_header(MDB_env *env);
-static int mdb_check_meta_page(MDB_page *p);
+static int mdb_check_meta_page(MDB_page *p, MDB_meta *m);
+static int mdbenv_pick_meta(MDB_env *env, MDB_meta *meta);
 static int mdbenv_read_meta(MDB_env *env, pgno_t *p_next);
 static int mdbenv_write_meta(MDB_env *env, pgno_t root, unsigned int flags);
-static MDB_page *mdbenv_get_page(MDB_env *env, pgno_t pgno);
+static MDB_page *mdbenv_get_page(MDB_env *env, MDB_txn *txn, pgno_t pgno);
+static int mdbenv_setup_locks(MDB_env *env, const char *lpath, mode_t mode);
+static void mdbenv_reader_dest(void *ptr);
+
+static int mdb_txn_read_snapshot(MDB_txn *txn);
+static int mdb_pglist_add(MDB_pglist *pl, pgno_t pgno);
+static void mdb_drop_dirty(MDB_txn *txn, MDB_page *mp);
+static int mdb_free_overflow(MDB_db *db, MDB_txn *txn, MDB_node *leaf);
+static txnid_t mdb_find_oldest(MDB_txn *txn);
+static int mdb_freelist_load(MDB_txn *txn);
+static int mdb_freelist_put(MDB_txn *txn, txnid_t txnid, MDB_pglist *pl);
+static int mdb_freelist_save(MDB_txn *txn);
+static int mdb_cmp_freekey(const MDB_val *a, const MDB_val *b);
 
 static MDB_node *mdb_search_node(MDB_db *db, MDB_page *mp, MDB_val *key,
 				 int *exactp, unsigned int *kip);
 static int mdb_add_node(MDB_db *bt, MDB_page *mp, indx_t indx, MDB_val *key,
 			MDB_val *data, pgno_t pgno, uint8_t flags);
 static void mdb_del_node(MDB_db *bt, MDB_page *mp, indx_t indx);
-static int mdb_read_data(MDB_db *bt, MDB_page *mp, MDB_node *leaf,
+static int mdb_read_data(MDB_db *bt, MDB_txn *txn, MDB_node *leaf,
 			 MDB_val *data);
 
 static int mdb_rebalance(MDB_db *bt, MDB_pageparent *mp);
@@ -256,7 +386,7 @@ static int mdb_move_node(MDB_db *bt, MDB_pageparent *src, indx_t srcindx,
 static int mdb_merge(MDB_db *bt, MDB_pageparent *src, MDB_pageparent *dst);
 static int mdb_split(MDB_db *bt, MDB_page **mpp, unsigned int *newindxp,
 		     MDB_val *newkey, MDB_val *newdata, pgno_t newpgno);
-static MDB_dpage *mdbenv_new_page(MDB_env *env, uint32_t flags, int num);
+static MDB_dpage *mdb_new_page(MDB_db *db, uint32_t flags, int num);
 
 static void cursor_pop_page(MDB_cursor *cursor);
 static MDB_ppage *cursor_push_page(MDB_cursor *cursor, MDB_page *mp);
@@ -266,7 +396,9 @@ static int mdb_sibling(MDB_cursor *cursor, int move_right);
 static int mdb_cursor_next(MDB_cursor *cursor, MDB_val *key, MDB_val *data);
 static int mdb_cursor_set(MDB_cursor *cursor, MDB_val *key, MDB_val *data,
 			  int *exactp);
+static int mdb_cursor_prev(MDB_cursor *cursor, MDB_val *key, MDB_val *data);
 static int mdb_cursor_first(MDB_cursor *cursor, MDB_val *key, MDB_val *data);
+static int mdb_cursor_last(MDB_cursor *cursor, MDB_val *key, MDB_val *data);
 
 static size_t mdb_leaf_size(MDB_db *bt, MDB_val *key, MDB_val *data);
 static size_t mdb_branch_size(MDB_db *bt, MDB_val *key);
@@ -328,42 +460,177 @@ static int _mdb_cmp(MDB_db *db, const MDB_val *key1, const MDB_val *key2)
 			       key2->mv_data, key2->mv_size);
 }
 
-/* Allocate new page(s) for writing */
+static int mdb_cmp_freekey(const MDB_val *a, const MDB_val *b)
+{
+	MDB_freekey ka, kb;
+
+	bcopy(a->mv_data, &ka, sizeof(ka));
+	bcopy(b->mv_data, &kb, sizeof(kb));
+	if (ka.fk_txnid != kb.fk_txnid)
+		return ka.fk_txnid < kb.fk_txnid ? -1 : 1;
+	if (ka.fk_chunk != kb.fk_chunk)
+		return ka.fk_chunk < kb.fk_chunk ? -1 : 1;
+	return 0;
+}
+
+static int mdb_pglist_add(MDB_pglist *pl, pgno_t pgno)
+{
+	pgno_t *p;
+	unsigned int max;
+
+	if (pl->pl_num == pl->pl_max) {
+		max = pl->pl_max ? pl->pl_max * 2 : 64;
+		if ((p = realloc(pl->pl_pgno, max * sizeof(pgno_t))) == NULL)
+			return ENOMEM;
+		pl->pl_pgno = p;
+		pl->pl_max = max;
+	}
+	pl->pl_pgno[pl->pl_num++] = pgno;
+	return MDB_SUCCESS;
+}
+
+/* Position of pgno in the sorted dirty page index, or of the first
+ * page above it.
+ */
+static unsigned int mdb_dirty_search(MDB_txn *txn, pgno_t pgno)
+{
+	unsigned int lo = 0, hi = txn->mt_dirty_num, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (txn->mt_dirty_idx[mid]->p.mp_pgno < pgno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static MDB_dpage *mdb_dirty_find(MDB_txn *txn, pgno_t pgno)
+{
+	unsigned int i = mdb_dirty_search(txn, pgno);
+
+	if (i < txn->mt_dirty_num && txn->mt_dirty_idx[i]->p.mp_pgno == pgno)
+		return txn->mt_dirty_idx[i];
+	return NULL;
+}
+
+static int mdb_dirty_insert(MDB_txn *txn, MDB_dpage *dp)
+{
+	MDB_dpage **idx;
+	unsigned int i, max;
+
+	if (txn->mt_dirty_num == txn->mt_dirty_max) {
+		max = txn->mt_dirty_max ? txn->mt_dirty_max * 2 : 256;
+		idx = realloc(txn->mt_dirty_idx, max * sizeof(*idx));
+		if (idx == NULL)
+			return ENOMEM;
+		txn->mt_dirty_idx = idx;
+		txn->mt_dirty_max = max;
+	}
+	i = mdb_dirty_search(txn, dp->p.mp_pgno);
+	memmove(txn->mt_dirty_idx + i + 1, txn->mt_dirty_idx + i,
+		(txn->mt_dirty_num - i) * sizeof(*txn->mt_dirty_idx));
+	txn->mt_dirty_idx[i] = dp;
+	txn->mt_dirty_num++;
+	return MDB_SUCCESS;
+}
+
+static void mdb_dirty_remove(MDB_txn *txn, MDB_dpage *dp)
+{
+	unsigned int i = mdb_dirty_search(txn, dp->p.mp_pgno);
+
+	assert(i < txn->mt_dirty_num && txn->mt_dirty_idx[i] == dp);
+	txn->mt_dirty_num--;
+	memmove(txn->mt_dirty_idx + i, txn->mt_dirty_idx + i + 1,
+		(txn->mt_dirty_num - i) * sizeof(*txn->mt_dirty_idx));
+}
+
+/* Allocate new page(s) for writing. Single pages are taken from the
+ * reclaimed freelist when possible, otherwise the file is extended.
+ */
 static MDB_dpage *mdb_newpage(MDB_txn *txn, MDB_page *parent, int parent_idx,
 			      int num)
 {
 	MDB_dpage *dp;
+	pgno_t pgno = P_INVALID;
+
+	if (num == 1 && !F_ISSET(txn->mt_flags, MDB_TXN_FREEING)) {
+		if (txn->mt_reuse.pl_num == 0 &&
+		    !F_ISSET(txn->mt_flags, MDB_TXN_NORECLAIM) &&
+		    mdb_freelist_load(txn) != MDB_SUCCESS)
+			txn->mt_flags |= MDB_TXN_NORECLAIM;
+		if (txn->mt_reuse.pl_num > 0) {
+			pgno = txn->mt_reuse.pl_pgno[--txn->mt_reuse.pl_num];
+			if (pgno < txn->mt_reuse_lo)
+				txn->mt_reuse_lo = pgno;
+			if (pgno > txn->mt_reuse_hi)
+				txn->mt_reuse_hi = pgno;
+		}
+	}
 
 	if ((dp = malloc(txn->mt_env->me_head.mh_psize * num +
 			 sizeof(MDB_dhead))) == NULL)
-		return NULL;
+		goto fail;
 	dp->h.md_num = num;
 	dp->h.md_parent = parent;
 	dp->h.md_pi = parent_idx;
+	dp->p.mp_pgno = pgno == P_INVALID ? txn->mt_next_pgno : pgno;
+	if (mdb_dirty_insert(txn, dp) != MDB_SUCCESS) {
+		free(dp);
+		goto fail;
+	}
 	SIMPLEQ_INSERT_TAIL(txn->mt_dirty_queue, dp, h.md_next);
-	dp->p.mp_pgno = txn->mt_next_pgno;
-	txn->mt_next_pgno += num;
+	if (pgno == P_INVALID)
+		txn->mt_next_pgno += num;
 
 	return dp;
+
+fail:
+	if (pgno != P_INVALID)
+		txn->mt_reuse.pl_num++; /* still in place */
+	return NULL;
+}
+
+/* Forget a dirty page that is no longer referenced. It was never
+ * committed, so its page numbers can be reused right away.
+ */
+static void mdb_drop_dirty(MDB_txn *txn, MDB_page *mp)
+{
+	MDB_dpage *dp;
+	int i;
+
+	assert(F_ISSET(mp->mp_flags, P_DIRTY));
+	dp = (MDB_dpage *)(((MDB_dhead *)mp) - 1);
+	SIMPLEQ_REMOVE(txn->mt_dirty_queue, dp, MDB_dpage, h.md_next);
+	mdb_dirty_remove(txn, dp);
+	for (i = 0; i < dp->h.md_num; i++)
+		mdb_pglist_add(&txn->mt_reuse, dp->p.mp_pgno + i);
+	free(dp);
 }
 
 /* Touch a page: make it dirty and re-insert into tree with updated pgno.
+ * The replaced page is recorded in mt_free_pgs. An already dirty page
+ * just gets its parent link refreshed, the tree may have been split
+ * or merged above it since it was touched.
  */
 static int mdb_touch(MDB_txn *txn, MDB_pageparent *pp)
 {
-	// int rc;
 	MDB_page *mp = pp->mp_page;
+	MDB_dhead *dh;
 	pgno_t pgno;
 	assert(txn != NULL);
 	assert(pp != NULL);
 
 	if (!F_ISSET(mp->mp_flags, P_DIRTY)) {
 		MDB_dpage *dp;
-		DPRINTF("touching page %lu -> %lu", mp->mp_pgno,
-			txn->mt_next_pgno);
+		if (mdb_pglist_add(&txn->mt_free_pgs, mp->mp_pgno) != 0)
+			return ENOMEM;
 		if ((dp = mdb_newpage(txn, pp->mp_parent, pp->mp_pi, 1)) ==
 		    NULL)
 			return ENOMEM;
+		DPRINTF("touching page %lu -> %lu", mp->mp_pgno,
+			dp->p.mp_pgno);
 		pgno = dp->p.mp_pgno;
 		bcopy(mp, &dp->p, txn->mt_env->me_head.mh_psize);
 		mp = &dp->p;
@@ -375,6 +642,10 @@ static int mdb_touch(MDB_txn *txn, MDB_pageparent *pp)
 			NODEPGNO(NODEPTR(pp->mp_parent, pp->mp_pi)) =
 				mp->mp_pgno;
 		pp->mp_page = mp;
+	} else {
+		dh = ((MDB_dhead *)mp) - 1;
+		dh->md_parent = pp->mp_parent;
+		dh->md_pi = pp->mp_pi;
 	}
 	return 0;
 }
@@ -389,12 +660,127 @@ int mdbenv_sync(MDB_env *env)
 	return rc;
 }
 
+/* The lock file is robust: a writer that died holding the mutex never
+ * committed, so the state it protects is still consistent.
+ */
+static int mdb_mutex_lock(pthread_mutex_t *mutex)
+{
+	int rc = pthread_mutex_lock(mutex);
+
+	if (rc == EOWNERDEAD) {
+		DPRINTF("previous lock owner died, recovering");
+		rc = pthread_mutex_consistent(mutex);
+	}
+	return rc;
+}
+
+static void mdbenv_reader_dest(void *ptr)
+{
+	MDB_reader *r = ptr;
+
+	r->mr_txnid = (txnid_t)-1;
+	r->mr_pid = 0;
+}
+
+/* Get the calling thread's reader slot, allocating one on first use.
+ */
+static int mdb_reader_slot(MDB_env *env, MDB_reader **ret)
+{
+	MDB_txninfo *ti = env->me_txns;
+	MDB_reader *r;
+	unsigned int i;
+	pid_t pid = getpid();
+	int rc;
+
+	r = pthread_getspecific(env->me_txkey);
+	if (r != NULL && r->mr_pid == pid) {
+		*ret = r;
+		return MDB_SUCCESS;
+	}
+
+	if ((rc = mdb_mutex_lock(&ti->mti_mutex)) != 0)
+		return rc;
+	for (i = 0; i < ti->mti_numreaders; i++) {
+		if (ti->mti_readers[i].mr_pid == 0)
+			break;
+	}
+	if (i >= ti->mti_maxreaders) {
+		pthread_mutex_unlock(&ti->mti_mutex);
+		DPRINTF("reader table is full");
+		return EBUSY;
+	}
+	r = &ti->mti_readers[i];
+	r->mr_txnid = (txnid_t)-1;
+	r->mr_tid = pthread_self();
+	r->mr_pid = pid;
+	if (i == ti->mti_numreaders)
+		ti->mti_numreaders++;
+	pthread_mutex_unlock(&ti->mti_mutex);
+
+	if ((rc = pthread_setspecific(env->me_txkey, r)) != 0) {
+		mdbenv_reader_dest(r);
+		return rc;
+	}
+	*ret = r;
+	return MDB_SUCCESS;
+}
+
+/* Pin the last committed snapshot for a read-only txn. The slot is
+ * published before any page is read, and the meta page is re-checked
+ * afterwards: a writer that missed the slot can only have committed
+ * a newer txn, and then we retry with that one.
+ */
+static int mdb_txn_read_snapshot(MDB_txn *txn)
+{
+	MDB_env *env = txn->mt_env;
+	MDB_txninfo *ti = env->me_txns;
+	MDB_reader *r = NULL;
+	MDB_meta meta;
+	txnid_t txnid = 0;
+	int rc;
+
+	if (ti != NULL && (rc = mdb_reader_slot(env, &r)) != MDB_SUCCESS)
+		return rc;
+
+	for (;;) {
+		if (r != NULL) {
+			txnid = ti->mti_txnid;
+			r->mr_txnid = txnid;
+			__sync_synchronize();
+		}
+		if ((rc = mdbenv_pick_meta(env, &meta)) != MDB_SUCCESS)
+			goto fail;
+		if (F_ISSET(meta.mm_flags, MDB_TOMBSTONE)) {
+			DPRINTF("file is dead");
+			rc = ESTALE;
+			goto fail;
+		}
+		if (r == NULL || meta.mm_txnid <= txnid)
+			break;
+		DPRINTF("txn %lu committed meanwhile, retry", meta.mm_txnid);
+	}
+	if (r != NULL && meta.mm_txnid < txnid)
+		r->mr_txnid = meta.mm_txnid;
+
+	txn->mt_reader = r;
+	txn->mt_txnid = meta.mm_txnid;
+	txn->mt_root = meta.mm_root;
+	txn->mt_free_root = meta.mm_free.mr_root;
+	txn->mt_next_pgno = meta.mm_last_pgno + 1;
+	return MDB_SUCCESS;
+
+fail:
+	if (r != NULL)
+		r->mr_txnid = (txnid_t)-1;
+	return rc;
+}
+
 int mdb_txn_begin(MDB_env *env, int rdonly, MDB_txn **ret)
 {
 	MDB_txn *txn;
 	int rc;
 
-	if (!rdonly && env->me_txn != NULL) {
+	if (!rdonly && env->me_txns == NULL && env->me_txn != NULL) {
 		DPRINTF("write transaction already begun");
 		return EBUSY;
 	}
@@ -404,30 +790,37 @@ int mdb_txn_begin(MDB_env *env, int rdonly, MDB_txn **ret)
 		return ENOMEM;
 	}
 
+	txn->mt_env = env;
+	txn->mt_reuse_lo = P_INVALID;
+
 	if (rdonly) {
 		txn->mt_flags |= MDB_TXN_RDONLY;
-	} else {
-		txn->mt_dirty_queue = calloc(1, sizeof(*txn->mt_dirty_queue));
-		if (txn->mt_dirty_queue == NULL) {
-			free(txn);
-			return ENOMEM;
-		}
-		SIMPLEQ_INIT(txn->mt_dirty_queue);
-
-#if 0
-		DPRINTF("taking write lock on txn %p", txn);
-		if (flock(bt->fd, LOCK_EX | LOCK_NB) != 0) {
-			DPRINTF("flock: %s", strerror(errno));
-			errno = EBUSY;
-			free(txn->dirty_queue);
+		if ((rc = mdb_txn_read_snapshot(txn)) != MDB_SUCCESS) {
 			free(txn);
-			return NULL;
+			return rc;
 		}
-#endif
-		env->me_txn = txn;
+		DPRINTF("begin read-only txn %lu on mdbenv %p, root page %lu",
+			txn->mt_txnid, env, txn->mt_root);
+		*ret = txn;
+		return MDB_SUCCESS;
 	}
 
-	txn->mt_env = env;
+	txn->mt_dirty_queue = calloc(1, sizeof(*txn->mt_dirty_queue));
+	if (txn->mt_dirty_queue == NULL) {
+		free(txn);
+		return ENOMEM;
+	}
+	SIMPLEQ_INIT(txn->mt_dirty_queue);
+
+	/* One writer at a time, across threads and processes. */
+	if (env->me_txns != NULL &&
+	    (rc = mdb_mutex_lock(&env->me_txns->mti_wmutex)) != 0) {
+		DPRINTF("failed to take write lock: %s", strerror(rc));
+		free(txn->mt_dirty_queue);
+		free(txn);
+		return rc == EDEADLK ? EBUSY : rc;
+	}
+	env->me_txn = txn;
 
 	if ((rc = mdbenv_read_meta(env, &txn->mt_next_pgno)) != MDB_SUCCESS) {
 		mdb_txn_abort(txn);
@@ -435,9 +828,12 @@ int mdb_txn_begin(MDB_env *env, int rdonly, MDB_txn **ret)
 	}
 
 	txn->mt_first_pgno = txn->mt_next_pgno;
+	txn->mt_txnid = env->me_meta.mm_txnid + 1;
 	txn->mt_root = env->me_meta.mm_root;
-	DPRINTF("begin transaction on mdbenv %p, root page %lu", env,
-		txn->mt_root);
+	bcopy(&env->me_meta.mm_free, &env->me_free, sizeof(env->me_free));
+	txn->mt_free_root = env->me_free.mr_root;
+	DPRINTF("begin txn %lu on mdbenv %p, root page %lu", txn->mt_txnid,
+		env, txn->mt_root);
 
 	*ret = txn;
 	return MDB_SUCCESS;
@@ -455,7 +851,10 @@ void mdb_txn_abort(MDB_txn *txn)
 	DPRINTF("abort transaction on mdbenv %p, root page %lu", env,
 		txn->mt_root);
 
-	if (!F_ISSET(txn->mt_flags, MDB_TXN_RDONLY)) {
+	if (F_ISSET(txn->mt_flags, MDB_TXN_RDONLY)) {
+		if (txn->mt_reader != NULL)
+			txn->mt_reader->mr_txnid = (txnid_t)-1;
+	} else {
 		/* Discard all dirty pages.
 		 */
 		while (!SIMPLEQ_EMPTY(txn->mt_dirty_queue)) {
@@ -463,28 +862,243 @@ void mdb_txn_abort(MDB_txn *txn)
 			SIMPLEQ_REMOVE_HEAD(txn->mt_dirty_queue, h.md_next);
 			free(dp);
 		}
-
-#if 0
-		DPRINTF("releasing write lock on txn %p", txn);
-		txn->bt->txn = NULL;
-		if (flock(txn->bt->fd, LOCK_UN) != 0) {
-			DPRINTF("failed to unlock fd %d: %s",
-			    txn->bt->fd, strerror(errno));
-		}
-#endif
 		free(txn->mt_dirty_queue);
+		free(txn->mt_dirty_idx);
+		free(txn->mt_free_pgs.pl_pgno);
+		free(txn->mt_reuse.pl_pgno);
+
+		if (txn == env->me_txn) {
+			env->me_txn = NULL;
+			if (env->me_txns != NULL)
+				pthread_mutex_unlock(
+					&env->me_txns->mti_wmutex);
+		}
 	}
 
-	if (txn == env->me_txn)
-		env->me_txn = NULL;
 	free(txn);
 }
 
+/* Oldest snapshot still in use. Slots of dead processes are cleared on
+ * the way. Without a lock file nothing can be proven unused.
+ */
+static txnid_t mdb_find_oldest(MDB_txn *txn)
+{
+	MDB_txninfo *ti = txn->mt_env->me_txns;
+	MDB_reader *r;
+	txnid_t oldest = txn->mt_txnid - 1, t;
+	pid_t pid, self = getpid();
+	unsigned int i;
+
+	if (ti == NULL)
+		return 0;
+
+	__sync_synchronize();
+	for (i = 0; i < ti->mti_numreaders; i++) {
+		r = &ti->mti_readers[i];
+		if ((pid = r->mr_pid) == 0 || (t = r->mr_txnid) == (txnid_t)-1)
+			continue;
+		if (pid != self && kill(pid, 0) == -1 && errno == ESRCH) {
+			DPRINTF("clearing reader slot %u of dead pid %d", i,
+				(int)pid);
+			mdbenv_reader_dest(r);
+			continue;
+		}
+		if (t < oldest)
+			oldest = t;
+	}
+	return oldest;
+}
+
+/* Move the pages of the next freelist record that no reader can see
+ * anymore into mt_reuse. Pages freed by txn F belong to snapshot F-1,
+ * so they are reusable once the oldest reader is at F or later. The
+ * consumed records are deleted in mdb_freelist_save().
+ */
+static int mdb_freelist_load(MDB_txn *txn)
+{
+	MDB_db *fdb = (MDB_db *)&txn->mt_env->me_free_db;
+	MDB_cursor *cursor;
+	MDB_freekey fk;
+	MDB_val key, data;
+	txnid_t oldest, t = 0;
+	pgno_t pgno;
+	size_t i;
+	int rc;
+
+	if (txn->mt_free_root == P_INVALID)
+		return ENOENT;
+
+	oldest = mdb_find_oldest(txn);
+	if (oldest <= txn->mt_reclaimed)
+		return ENOENT;
+
+	if ((rc = mdb_cursor_open(fdb, txn, &cursor)) != MDB_SUCCESS)
+		return rc;
+
+	bzero(&fk, sizeof(fk));
+	fk.fk_txnid = txn->mt_reclaimed + 1;
+	key.mv_data = &fk;
+	key.mv_size = sizeof(fk);
+	rc = mdb_cursor_get(cursor, &key, &data, MDB_CURSOR);
+	while (rc == MDB_SUCCESS) {
+		bcopy(key.mv_data, &fk, sizeof(fk));
+		if (fk.fk_txnid > oldest || (t != 0 && fk.fk_txnid != t))
+			break;
+		t = fk.fk_txnid;
+		for (i = 0; i < data.mv_size / sizeof(pgno_t); i++) {
+			bcopy((char *)data.mv_data + i * sizeof(pgno_t), &pgno,
+			      sizeof(pgno));
+			if ((rc = mdb_pglist_add(&txn->mt_reuse, pgno)) != 0)
+				break;
+		}
+		if (rc == MDB_SUCCESS)
+			rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+	}
+	mdb_cursor_close(cursor);
+
+	if (t == 0)
+		return ENOENT;
+	DPRINTF("reclaimed pages freed by txn %lu, oldest reader %lu", t,
+		oldest);
+	txn->mt_reclaimed = t;
+	return MDB_SUCCESS;
+}
+
+/* Store a page list under txnid, MDB_FREE_CHUNK pages per record.
+ * Writing the freelist may touch more of its pages, which appends to
+ * the list being written, so loop until everything is saved.
+ */
+static int mdb_freelist_put(MDB_txn *txn, txnid_t txnid, MDB_pglist *pl)
+{
+	MDB_db *fdb = (MDB_db *)&txn->mt_env->me_free_db;
+	pgno_t chunk[MDB_FREE_CHUNK];
+	MDB_freekey fk;
+	MDB_val key, data;
+	unsigned int saved = 0, start, len;
+	int rc;
+
+	while (saved < pl->pl_num) {
+		start = saved - saved % MDB_FREE_CHUNK;
+		len = MIN(MDB_FREE_CHUNK, pl->pl_num - start);
+		bcopy(pl->pl_pgno + start, chunk, len * sizeof(pgno_t));
+
+		bzero(&fk, sizeof(fk));
+		fk.fk_txnid = txnid;
+		fk.fk_chunk = start / MDB_FREE_CHUNK;
+		key.mv_data = &fk;
+		key.mv_size = sizeof(fk);
+		data.mv_data = chunk;
+		data.mv_size = len * sizeof(pgno_t);
+		if ((rc = mdb_put(fdb, txn, &key, &data, 0)) != MDB_SUCCESS)
+			return rc;
+		saved = start + len;
+	}
+	return MDB_SUCCESS;
+}
+
+/* Update the freelist DB at commit: drop the records consumed by
+ * mdb_freelist_load(), put back what was loaded but not used, and
+ * record the pages this txn replaced under its own txnid.
+ */
+static int mdb_freelist_save(MDB_txn *txn)
+{
+	MDB_db *fdb = (MDB_db *)&txn->mt_env->me_free_db;
+	MDB_pageparent mpp;
+	MDB_freekey fk;
+	MDB_val key;
+	unsigned int i, nfree, nreuse, chunks, written = 0;
+	int rc;
+
+	/* Saving may still take pages from mt_reuse, but must not load
+	 * more of them. Top it up first, or the freelist pages would keep
+	 * coming from the end of the file.
+	 */
+	while (txn->mt_reuse.pl_num < MDB_FREE_RESERVE &&
+	       !F_ISSET(txn->mt_flags, MDB_TXN_NORECLAIM) &&
+	       mdb_freelist_load(txn) == MDB_SUCCESS)
+		;
+	txn->mt_flags |= MDB_TXN_NORECLAIM;
+
+	while (txn->mt_reclaimed != 0) {
+		rc = mdb_search_page(fdb, txn, NULL, NULL, 0, &mpp);
+		if (rc == ENOENT)
+			break;
+		if (rc != MDB_SUCCESS)
+			return rc;
+		key.mv_size = NODEPTR(mpp.mp_page, 0)->mn_ksize;
+		key.mv_data = NODEKEY(NODEPTR(mpp.mp_page, 0));
+		bcopy(key.mv_data, &fk, sizeof(fk));
+		if (fk.fk_txnid > txn->mt_reclaimed)
+			break;
+		key.mv_data = &fk;
+		if ((rc = mdb_del(fdb, txn, &key, NULL)) != MDB_SUCCESS)
+			return rc;
+	}
+
+	/* Without a consumed txnid, leftovers wait until this txn's own
+	 * freed pages become reusable, and the freelist pages come from
+	 * the end of the file.
+	 */
+	if (txn->mt_reclaimed == 0) {
+		txn->mt_flags |= MDB_TXN_FREEING;
+		do {
+			for (i = 0; i < txn->mt_reuse.pl_num; i++) {
+				rc = mdb_pglist_add(&txn->mt_free_pgs,
+						    txn->mt_reuse.pl_pgno[i]);
+				if (rc != MDB_SUCCESS)
+					return rc;
+			}
+			txn->mt_reuse.pl_num = 0;
+			rc = mdb_freelist_put(txn, txn->mt_txnid,
+					      &txn->mt_free_pgs);
+			if (rc != MDB_SUCCESS)
+				return rc;
+		} while (txn->mt_reuse.pl_num != 0);
+		return MDB_SUCCESS;
+	}
+
+	/* Leftovers go back under the last consumed txnid, which is
+	 * already known to be reusable. Writing either list may take
+	 * pages from mt_reuse or free more of them, so repeat until a
+	 * pass leaves both lists alone, dropping chunks that are no
+	 * longer needed.
+	 */
+	do {
+		nfree = txn->mt_free_pgs.pl_num;
+		nreuse = txn->mt_reuse.pl_num;
+		rc = mdb_freelist_put(txn, txn->mt_txnid, &txn->mt_free_pgs);
+		if (rc != MDB_SUCCESS)
+			return rc;
+		rc = mdb_freelist_put(txn, txn->mt_reclaimed, &txn->mt_reuse);
+		if (rc != MDB_SUCCESS)
+			return rc;
+		chunks = (txn->mt_reuse.pl_num + MDB_FREE_CHUNK - 1) /
+			 MDB_FREE_CHUNK;
+		for (; chunks < written; written--) {
+			bzero(&fk, sizeof(fk));
+			fk.fk_txnid = txn->mt_reclaimed;
+			fk.fk_chunk = written - 1;
+			key.mv_data = &fk;
+			key.mv_size = sizeof(fk);
+			rc = mdb_del(fdb, txn, &key, NULL);
+			if (rc != MDB_SUCCESS && rc != ENOENT)
+				return rc;
+		}
+		written = chunks;
+	} while (nfree != txn->mt_free_pgs.pl_num ||
+		 nreuse != txn->mt_reuse.pl_num);
+
+	return MDB_SUCCESS;
+}
+
 int mdb_txn_commit(MDB_txn *txn)
 {
-	int n, done;
+	int n;
 	ssize_t rc;
-	off_t size;
+	size_t size;
+	off_t pos = 0;
+	pgno_t next = 0;
+	unsigned int psize;
 	MDB_dpage *dp;
 	MDB_env *env;
 	struct iovec iov[MDB_COMMIT_PAGES];
@@ -493,6 +1107,7 @@ int mdb_txn_commit(MDB_txn *txn)
 	assert(txn->mt_env != NULL);
 
 	env = txn->mt_env;
+	psize = env->me_head.mh_psize;
 
 	if (F_ISSET(txn->mt_flags, MDB_TXN_RDONLY)) {
 		DPRINTF("attempt to commit read-only transaction");
@@ -515,65 +1130,58 @@ int mdb_txn_commit(MDB_txn *txn)
 	if (SIMPLEQ_EMPTY(txn->mt_dirty_queue))
 		goto done;
 
-	if (F_ISSET(env->me_flags, MDB_FIXPADDING)) {
-		size = lseek(env->me_fd, 0, SEEK_END);
-		size += env->me_head.mh_psize - (size % env->me_head.mh_psize);
-		DPRINTF("extending to multiple of page size: %lu", size);
-		if (ftruncate(env->me_fd, size) != 0) {
-			n = errno;
-			DPRINTF("ftruncate: %s", strerror(errno));
-			mdb_txn_abort(txn);
-			return n;
-		}
-		env->me_flags ^= MDB_FIXPADDING;
-	}
+	DPRINTF("committing txn %lu on mdbenv %p, root page %lu",
+		txn->mt_txnid, env, txn->mt_root);
 
-	DPRINTF("committing transaction on mdbenv %p, root page %lu", env,
-		txn->mt_root);
+	if ((n = mdb_freelist_save(txn)) != MDB_SUCCESS) {
+		DPRINTF("failed to save freelist: %d", n);
+		mdb_txn_abort(txn);
+		return n;
+	}
 
-	/* Commit up to MDB_COMMIT_PAGES dirty pages to disk until done.
+	/* Write dirty pages, up to MDB_COMMIT_PAGES of them per call,
+	 * coalescing runs of consecutive page numbers into one pwritev().
 	 */
-	do {
+	while (!SIMPLEQ_EMPTY(txn->mt_dirty_queue)) {
 		n = 0;
-		done = 1;
+		size = 0;
 		SIMPLEQ_FOREACH(dp, txn->mt_dirty_queue, h.md_next)
 		{
+			if (n > 0 && dp->p.mp_pgno != next)
+				break;
 			DPRINTF("committing page %lu", dp->p.mp_pgno);
-			iov[n].iov_len = env->me_head.mh_psize * dp->h.md_num;
+			if (n == 0)
+				pos = (off_t)dp->p.mp_pgno * psize;
+			iov[n].iov_len = psize * dp->h.md_num;
 			iov[n].iov_base = &dp->p;
+			size += iov[n].iov_len;
+			next = dp->p.mp_pgno + dp->h.md_num;
 			/* clear dirty flag */
 			dp->p.mp_flags &= ~P_DIRTY;
-			if (++n >= MDB_COMMIT_PAGES) {
-				done = 0;
+			if (++n >= MDB_COMMIT_PAGES)
 				break;
-			}
 		}
 
-		if (n == 0)
-			break;
-
 		DPRINTF("committing %u dirty pages", n);
-		rc = writev(env->me_fd, iov, n);
-		if (rc != (ssize_t)env->me_head.mh_psize * n) {
+		rc = pwritev(env->me_fd, iov, n, pos);
+		if (rc != (ssize_t)size) {
 			n = errno;
-			if (rc > 0)
+			if (rc >= 0)
 				DPRINTF("short write, filesystem full?");
 			else
-				DPRINTF("writev: %s", strerror(errno));
+				DPRINTF("pwritev: %s", strerror(errno));
 			mdb_txn_abort(txn);
-			return n;
+			return n ? n : EIO;
 		}
 
 		/* Drop the dirty pages.
 		 */
-		while (!SIMPLEQ_EMPTY(txn->mt_dirty_queue)) {
+		while (n-- > 0) {
 			dp = SIMPLEQ_FIRST(txn->mt_dirty_queue);
 			SIMPLEQ_REMOVE_HEAD(txn->mt_dirty_queue, h.md_next);
 			free(dp);
-			if (--n == 0)
-				break;
 		}
-	} while (!done);
+	}
 
 	if ((n = mdbenv_sync(env)) != 0 ||
 	    (n = mdbenv_write_meta(env, txn->mt_root, 0)) != MDB_SUCCESS ||
@@ -581,8 +1189,12 @@ int mdb_txn_commit(MDB_txn *txn)
 		mdb_txn_abort(txn);
 		return n;
 	}
-	txn = NULL;
-	env->me_txn = NULL;
+
+	/* Readers may use the new snapshot from now on. */
+	if (env->me_txns != NULL) {
+		__sync_synchronize();
+		env->me_txns->mti_txnid = txn->mt_txnid;
+	}
 
 done:
 	mdb_txn_abort(txn);
@@ -592,18 +1204,20 @@ done:
 
 static int mdbenv_write_header(MDB_env *env)
 {
-	// struct stat sb;
 	MDB_head *h;
+	MDB_meta *m;
 	MDB_page *p;
 	ssize_t rc;
 	unsigned int psize;
+	int i;
 
 	DPRINTF("writing header page");
 	assert(env != NULL);
 
 	psize = sysconf(_SC_PAGE_SIZE);
 
-	if ((p = calloc(1, psize)) == NULL)
+	/* header page followed by both (empty) meta pages */
+	if ((p = calloc(FIRST_DATA_PGNO, psize)) == NULL)
 		return ENOMEM;
 	p->mp_flags = P_HEAD;
 
@@ -613,9 +1227,21 @@ static int mdbenv_write_header(MDB_env *env)
 	h = METADATA(p);
 	bcopy(&env->me_head, h, sizeof(*h));
 
-	rc = write(env->me_fd, p, env->me_head.mh_psize);
+	for (i = 0; i < NUM_METAS; i++) {
+		MDB_page *mp = (MDB_page *)((char *)p + psize * (i + 1));
+		mp->mp_pgno = i + 1;
+		mp->mp_flags = P_META;
+		m = METADATA(mp);
+		m->mm_root = P_INVALID;
+		m->mm_free.mr_root = P_INVALID;
+		m->mm_last_pgno = FIRST_DATA_PGNO - 1;
+		m->mm_created_at = time(0);
+		SHA1((unsigned char *)m, METAHASHLEN, m->mm_hash);
+	}
+
+	rc = pwrite(env->me_fd, p, psize * FIRST_DATA_PGNO, 0);
 	free(p);
-	if (rc != (ssize_t)env->me_head.mh_psize) {
+	if (rc != (ssize_t)psize * FIRST_DATA_PGNO) {
 		int err = errno;
 		if (rc > 0)
 			DPRINTF("short write, filesystem full?");
@@ -669,34 +1295,45 @@ static int mdbenv_read_header(MDB_env *env)
 	return 0;
 }
 
+/* Write the meta page of the current write txn into its slot. The
+ * other slot still holds the previous meta page.
+ */
 static int mdbenv_write_meta(MDB_env *env, pgno_t root, unsigned int flags)
 {
-	MDB_dpage *dp;
+	MDB_page *p;
 	MDB_meta *meta;
+	MDB_txn *txn;
 	ssize_t rc;
+	pgno_t pgno;
 
 	DPRINTF("writing meta page for root page %lu", root);
 
 	assert(env != NULL);
 	assert(env->me_txn != NULL);
 
-	if ((dp = mdbenv_new_page(env, P_META, 1)) == NULL)
+	txn = env->me_txn;
+	if ((p = calloc(1, env->me_head.mh_psize)) == NULL)
 		return ENOMEM;
 
-	env->me_meta.mm_prev_meta = env->me_meta.mm_root;
+	env->me_free.mr_root = txn->mt_free_root;
+	bcopy(&env->me_free, &env->me_meta.mm_free, sizeof(env->me_free));
 	env->me_meta.mm_root = root;
 	env->me_meta.mm_flags = flags;
+	env->me_meta.mm_txnid = txn->mt_txnid;
+	env->me_meta.mm_last_pgno = txn->mt_next_pgno - 1;
 	env->me_meta.mm_created_at = time(0);
 	env->me_meta.mm_revisions++;
 	SHA1((unsigned char *)&env->me_meta, METAHASHLEN, env->me_meta.mm_hash);
 
-	/* Copy the meta data changes to the new meta page. */
-	meta = METADATA(&dp->p);
+	pgno = META_PGNO(txn->mt_txnid);
+	p->mp_pgno = pgno;
+	p->mp_flags = P_META;
+	meta = METADATA(p);
 	bcopy(&env->me_meta, meta, sizeof(*meta));
 
-	rc = write(env->me_fd, &dp->p, env->me_head.mh_psize);
-	SIMPLEQ_REMOVE_HEAD(env->me_txn->mt_dirty_queue, h.md_next);
-	free(dp);
+	rc = pwrite(env->me_fd, p, env->me_head.mh_psize,
+		    (off_t)pgno * env->me_head.mh_psize);
+	free(p);
 	if (rc != (ssize_t)env->me_head.mh_psize) {
 		int err = errno;
 		if (rc > 0)
@@ -704,28 +1341,24 @@ static int mdbenv_write_meta(MDB_env *env, pgno_t root, unsigned int flags)
 		return err;
 	}
 
-	if ((env->me_size = lseek(env->me_fd, 0, SEEK_END)) == -1) {
-		DPRINTF("failed to update file size: %s", strerror(errno));
-		env->me_size = 0;
-	}
-
 	return MDB_SUCCESS;
 }
 
-/* Returns true if page p is a valid meta page, false otherwise.
+/* Returns 0 if p is a valid meta page, and copies its content to m.
  */
-static int mdb_check_meta_page(MDB_page *p)
+static int mdb_check_meta_page(MDB_page *p, MDB_meta *m)
 {
-	MDB_meta *m;
 	unsigned char hash[SHA_DIGEST_LENGTH];
 
-	m = METADATA(p);
 	if (!F_ISSET(p->mp_flags, P_META)) {
 		DPRINTF("page %lu not a meta page", p->mp_pgno);
 		return EINVAL;
 	}
 
-	if (m->mm_root >= p->mp_pgno && m->mm_root != P_INVALID) {
+	/* Copy first, a writer may be rewriting the page under us. */
+	bcopy(METADATA(p), m, sizeof(*m));
+
+	if (m->mm_root > m->mm_last_pgno && m->mm_root != P_INVALID) {
 		DPRINTF("page %lu points to an invalid root page", p->mp_pgno);
 		return EINVAL;
 	}
@@ -739,83 +1372,56 @@ static int mdb_check_meta_page(MDB_page *p)
 	return 0;
 }
 
-static int mdbenv_read_meta(MDB_env *env, pgno_t *p_next)
+/* Copy the newest valid meta page to *meta.
+ */
+static int mdbenv_pick_meta(MDB_env *env, MDB_meta *meta)
 {
+	MDB_meta m;
 	MDB_page *mp;
-	MDB_meta *meta;
-	pgno_t meta_pgno, next_pgno;
-	off_t size;
-
-	assert(env != NULL);
-
-	if ((size = lseek(env->me_fd, 0, SEEK_END)) == -1)
-		goto fail;
-
-	DPRINTF("mdbenv_read_meta: size = %lu", size);
-
-	if (size < env->me_size) {
-		DPRINTF("file has shrunk!");
-		errno = EIO;
-		goto fail;
-	}
-
-	if (size == env->me_head.mh_psize) { /* there is only the header */
-		if (p_next != NULL)
-			*p_next = 1;
-		return MDB_SUCCESS; /* new file */
+	int i, found = 0;
+
+	for (i = 0; i < NUM_METAS; i++) {
+		mp = (MDB_page *)(env->me_map + env->me_head.mh_psize * (i + 1));
+		if (mdb_check_meta_page(mp, &m) != 0)
+			continue;
+		if (!found || m.mm_txnid > meta->mm_txnid) {
+			bcopy(&m, meta, sizeof(m));
+			found = 1;
+		}
 	}
 
-	next_pgno = size / env->me_head.mh_psize;
-	if (next_pgno == 0) {
-		DPRINTF("corrupt file");
+	if (!found) {
+		DPRINTF("no valid meta page");
 		errno = EIO;
-		goto fail;
+		return MDB_FAIL;
 	}
+	return MDB_SUCCESS;
+}
 
-	meta_pgno = next_pgno - 1;
+/* Load the newest meta page into env->me_meta. Only the writer, or
+ * the opener before any txn exists, may call this.
+ */
+static int mdbenv_read_meta(MDB_env *env, pgno_t *p_next)
+{
+	MDB_meta meta;
 
-	if (size % env->me_head.mh_psize != 0) {
-		DPRINTF("filesize not a multiple of the page size!");
-		env->me_flags |= MDB_FIXPADDING;
-		next_pgno++;
-	}
+	assert(env != NULL);
 
-	if (p_next != NULL)
-		*p_next = next_pgno;
+	if (mdbenv_pick_meta(env, &meta) != MDB_SUCCESS)
+		goto fail;
 
-	if (size == env->me_size) {
-		DPRINTF("size unchanged, keeping current meta page");
-		if (F_ISSET(env->me_meta.mm_flags, MDB_TOMBSTONE)) {
-			DPRINTF("file is dead");
-			errno = ESTALE;
-			return MDB_FAIL;
-		} else
-			return MDB_SUCCESS;
-	} else {
-		env->me_size = size;
+	DPRINTF("flags = 0x%x", meta.mm_flags);
+	if (F_ISSET(meta.mm_flags, MDB_TOMBSTONE)) {
+		DPRINTF("file is dead");
+		errno = ESTALE;
+		goto fail;
 	}
 
-	while (meta_pgno > 0) {
-		if ((mp = mdbenv_get_page(env, meta_pgno)) == NULL)
-			break;
-		if (!mdb_check_meta_page(mp)) {
-			meta = METADATA(mp);
-			DPRINTF("flags = 0x%x", meta->mm_flags);
-			if (F_ISSET(meta->mm_flags, MDB_TOMBSTONE)) {
-				DPRINTF("file is dead");
-				errno = ESTALE;
-				return MDB_FAIL;
-			} else {
-				/* Make copy of last meta page. */
-				bcopy(meta, &env->me_meta,
-				      sizeof(env->me_meta));
-				return MDB_SUCCESS;
-			}
-		}
-		--meta_pgno; /* scan backwards to first valid meta page */
-	}
+	bcopy(&meta, &env->me_meta, sizeof(env->me_meta));
+	if (p_next != NULL)
+		*p_next = meta.mm_last_pgno + 1;
+	return MDB_SUCCESS;
 
-	errno = EIO;
 fail:
 	if (p_next != NULL)
 		*p_next = P_INVALID;
@@ -837,20 +1443,39 @@ int mdbenv_create(MDB_env **env, size_t size)
 	e->me_head.mh_version = MDB_VERSION;
 	e->me_mapsize = e->me_head.mh_mapsize = size;
 	e->me_db.md_env = e;
+	e->me_free_db.md_env = e;
+	e->me_free_db.md_flags = MDB_FREEDB;
+	e->me_free_db.md_cmp = mdb_cmp_freekey;
+	e->me_free.mr_root = P_INVALID;
+	e->me_fd = e->me_lfd = -1;
+	e->me_maxreaders = MDB_MAXREADERS_DEF;
 	*env = e;
 	return MDB_SUCCESS;
 }
 
+int mdbenv_set_maxreaders(MDB_env *env, unsigned int readers)
+{
+	if (env == NULL || readers == 0 || env->me_txns != NULL)
+		return EINVAL;
+
+	env->me_maxreaders = readers;
+	return MDB_SUCCESS;
+}
+
+int mdbenv_get_maxreaders(MDB_env *env, unsigned int *readers)
+{
+	if (env == NULL || readers == NULL)
+		return EINVAL;
+
+	*readers = env->me_maxreaders;
+	return MDB_SUCCESS;
+}
+
 int mdbenv_open2(MDB_env *env, unsigned int flags)
 {
 	int i, newenv = 0;
 
-	i = fcntl(env->me_fd, F_GETFL, 0);
-	if (fcntl(env->me_fd, F_SETFL, i | O_APPEND) == -1)
-		return errno;
-
 	env->me_flags = flags;
-	env->me_flags &= ~MDB_FIXPADDING;
 	env->me_meta.mm_root = P_INVALID;
 
 	if ((i = mdbenv_read_header(env)) != 0) {
@@ -892,19 +1517,107 @@ int mdbenv_open2(MDB_env *env, unsigned int flags)
 	DPRINTF("leaf pages: %lu", env->me_meta.mm_stat.ms_leaf_pages);
 	DPRINTF("overflow pages: %lu", env->me_meta.mm_stat.ms_overflow_pages);
 	DPRINTF("root: %lu", env->me_meta.mm_root);
-	DPRINTF("previous me_meta.me_page: %lu", env->me_meta.mm_prev_meta);
+	DPRINTF("txnid: %lu", env->me_meta.mm_txnid);
+	DPRINTF("free pages root: %lu", env->me_meta.mm_free.mr_root);
+
+	return MDB_SUCCESS;
+}
+
+/* Open (or create) the lock file holding the reader table. The first
+ * process to get an exclusive flock() on it knows nobody else has the
+ * environment open, and (re)initializes the table. Everyone keeps a
+ * shared flock() until mdbenv_close().
+ */
+static int mdbenv_setup_locks(MDB_env *env, const char *lpath, mode_t mode)
+{
+	MDB_txninfo *ti;
+	pthread_mutexattr_t mattr;
+	struct stat sb;
+	size_t size;
+	int rc, init = 0;
+
+	if ((env->me_lfd = open(lpath, O_RDWR | O_CREAT, mode)) == -1)
+		return errno;
+
+	if (flock(env->me_lfd, LOCK_EX | LOCK_NB) == 0) {
+		init = 1;
+		size = sizeof(MDB_txninfo) +
+		       (env->me_maxreaders - 1) * sizeof(MDB_reader);
+		if (ftruncate(env->me_lfd, 0) != 0 ||
+		    ftruncate(env->me_lfd, size) != 0)
+			goto fail_errno;
+	} else {
+		if (errno != EWOULDBLOCK || flock(env->me_lfd, LOCK_SH) != 0)
+			goto fail_errno;
+		if (fstat(env->me_lfd, &sb) != 0)
+			goto fail_errno;
+		size = sb.st_size;
+		if (size < sizeof(MDB_txninfo)) {
+			rc = EINVAL;
+			goto fail;
+		}
+	}
+
+	ti = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, env->me_lfd,
+		  0);
+	if (ti == MAP_FAILED)
+		goto fail_errno;
+	env->me_txns = ti;
+	env->me_txns_size = size;
+
+	if (init) {
+		pthread_mutexattr_init(&mattr);
+		pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&ti->mti_mutex, &mattr);
+		pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_ERRORCHECK);
+		pthread_mutex_init(&ti->mti_wmutex, &mattr);
+		pthread_mutexattr_destroy(&mattr);
+		ti->mti_txnid = env->me_meta.mm_txnid;
+		ti->mti_maxreaders = env->me_maxreaders;
+		ti->mti_version = MDB_VERSION;
+		ti->mti_magic = MDB_MAGIC;
+		if (flock(env->me_lfd, LOCK_SH) != 0)
+			goto fail_errno;
+	} else {
+		if (ti->mti_magic != MDB_MAGIC ||
+		    ti->mti_version != MDB_VERSION ||
+		    size < sizeof(MDB_txninfo) + (ti->mti_maxreaders - 1) *
+							 sizeof(MDB_reader)) {
+			DPRINTF("lock file %s is invalid", lpath);
+			rc = EINVAL;
+			goto fail;
+		}
+		env->me_maxreaders = ti->mti_maxreaders;
+	}
+
+	if ((rc = pthread_key_create(&env->me_txkey, mdbenv_reader_dest)) !=
+	    0)
+		goto fail;
 
 	return MDB_SUCCESS;
+
+fail_errno:
+	rc = errno;
+fail:
+	if (env->me_txns != NULL) {
+		munmap(env->me_txns, env->me_txns_size);
+		env->me_txns = NULL;
+	}
+	close(env->me_lfd);
+	env->me_lfd = -1;
+	return rc;
 }
 
 int mdbenv_open(MDB_env *env, const char *path, unsigned int flags, mode_t mode)
 {
 	int oflags, rc;
+	char *lpath;
 
 	if (F_ISSET(flags, MDB_RDONLY))
 		oflags = O_RDONLY;
 	else
-		oflags = O_RDWR | O_CREAT | O_APPEND;
+		oflags = O_RDWR | O_CREAT;
 
 	if ((env->me_fd = open(path, oflags, mode)) == -1)
 		return errno;
@@ -912,25 +1625,65 @@ int mdbenv_open(MDB_env *env, const char *path, unsigned int flags, mode_t mode)
 	if ((rc = mdbenv_open2(env, flags)) != MDB_SUCCESS) {
 		close(env->me_fd);
 		env->me_fd = -1;
+		return rc;
+	}
+
+	if (asprintf(&lpath, "%s-lock", path) == -1) {
+		rc = ENOMEM;
 	} else {
-		env->me_path = strdup(path);
-		DPRINTF("opened dbenv %p", env);
+		rc = mdbenv_setup_locks(env, lpath, mode);
+		free(lpath);
+	}
+	/* A read-only environment may live where it can't create files;
+	 * it then runs without the reader table.
+	 */
+	if (rc != MDB_SUCCESS && F_ISSET(flags, MDB_RDONLY)) {
+		DPRINTF("no lock file, readers are not tracked");
+		rc = MDB_SUCCESS;
+	}
+	if (rc != MDB_SUCCESS) {
+		munmap(env->me_map, env->me_mapsize);
+		env->me_map = NULL;
+		close(env->me_fd);
+		env->me_fd = -1;
+		return rc;
 	}
 
+	env->me_path = strdup(path);
+	DPRINTF("opened dbenv %p", env);
 	return rc;
 }
 
 void mdbenv_close(MDB_env *env)
 {
+	MDB_txninfo *ti;
+	unsigned int i;
+	pid_t pid;
+
 	if (env == NULL)
 		return;
 
 	free(env->me_path);
 
+	if ((ti = env->me_txns) != NULL) {
+		/* release the slots of all our threads */
+		pid = getpid();
+		for (i = 0; i < ti->mti_numreaders; i++) {
+			if (ti->mti_readers[i].mr_pid == pid)
+				mdbenv_reader_dest(&ti->mti_readers[i]);
+		}
+		pthread_key_delete(env->me_txkey);
+		munmap(ti, env->me_txns_size);
+		env->me_txns = NULL;
+	}
+	if (env->me_lfd != -1)
+		close(env->me_lfd);
+
 	if (env->me_map) {
 		munmap(env->me_map, env->me_mapsize);
 	}
 	close(env->me_fd);
+	free(env);
 }
 
 /* Search for key within a leaf page, using binary search.
@@ -1026,29 +1779,28 @@ static MDB_ppage *cursor_push_page(MDB_cursor *cursor, MDB_page *mp)
 	return ppage;
 }
 
-static MDB_page *mdbenv_get_page(MDB_env *env, pgno_t pgno)
+/* Only a write txn has dirty pages: new ones past mt_first_pgno, and
+ * reused ones somewhere in [mt_reuse_lo, mt_reuse_hi]. Read-only txns
+ * go straight to the map.
+ */
+static MDB_page *mdbenv_get_page(MDB_env *env, MDB_txn *txn, pgno_t pgno)
 {
-	MDB_page *p = NULL;
-	MDB_txn *txn = env->me_txn;
+	MDB_dpage *dp;
 
-	if (txn && pgno >= txn->mt_first_pgno &&
-	    !SIMPLEQ_EMPTY(txn->mt_dirty_queue)) {
-		MDB_dpage *dp;
-		SIMPLEQ_FOREACH(dp, txn->mt_dirty_queue, h.md_next)
-		{
-			if (dp->p.mp_pgno == pgno) {
-				p = &dp->p;
-				break;
-			}
-		}
-	} else {
-		p = (MDB_page *)(env->me_map + env->me_head.mh_psize * pgno);
+	if (txn && !F_ISSET(txn->mt_flags, MDB_TXN_RDONLY) &&
+	    (pgno >= txn->mt_first_pgno ||
+	     (pgno >= txn->mt_reuse_lo && pgno <= txn->mt_reuse_hi))) {
+		if ((dp = mdb_dirty_find(txn, pgno)) != NULL)
+			return &dp->p;
+		if (pgno >= txn->mt_first_pgno)
+			return NULL;
 	}
-	return p;
+	return (MDB_page *)(env->me_map + env->me_head.mh_psize * pgno);
 }
 
-static int mdb_search_page_root(MDB_db *bt, MDB_val *key, MDB_cursor *cursor,
-				int modify, MDB_pageparent *mpp)
+static int mdb_search_page_root(MDB_db *bt, MDB_txn *txn, MDB_val *key,
+				MDB_cursor *cursor, int flags,
+				MDB_pageparent *mpp)
 {
 	MDB_page *mp = mpp->mp_page;
 	int rc;
@@ -1065,8 +1817,8 @@ static int mdb_search_page_root(MDB_db *bt, MDB_val *key, MDB_cursor *cursor,
 		assert(NUMKEYS(mp) > 1);
 		DPRINTF("found index 0 to page %lu", NODEPGNO(NODEPTR(mp, 0)));
 
-		if (key == NULL) /* Initialize cursor to first page. */
-			i = 0;
+		if (key == NULL) /* Initialize cursor to first or last page. */
+			i = F_ISSET(flags, MDB_PS_LAST) ? NUMKEYS(mp) - 1 : 0;
 		else {
 			int exact;
 			node = mdb_search_node(bt, mp, key, &exact, &i);
@@ -1088,7 +1840,8 @@ static int mdb_search_page_root(MDB_db *bt, MDB_val *key, MDB_cursor *cursor,
 			CURSOR_TOP(cursor)->mp_ki = i;
 
 		mpp->mp_parent = mp;
-		if ((mp = mdbenv_get_page(bt->md_env, NODEPGNO(node))) == NULL)
+		if ((mp = mdbenv_get_page(bt->md_env, txn, NODEPGNO(node))) ==
+		    NULL)
 			return MDB_FAIL;
 		mpp->mp_pi = i;
 		mpp->mp_page = mp;
@@ -1096,7 +1849,8 @@ static int mdb_search_page_root(MDB_db *bt, MDB_val *key, MDB_cursor *cursor,
 		if (cursor && cursor_push_page(cursor, mp) == NULL)
 			return MDB_FAIL;
 
-		if (modify && (rc = mdb_touch(bt->md_env->me_txn, mpp)))
+		if (F_ISSET(flags, MDB_PS_MODIFY) &&
+		    (rc = mdb_touch(txn, mpp)))
 			return rc;
 		mp = mpp->mp_page;
 	}
@@ -1115,57 +1869,62 @@ static int mdb_search_page_root(MDB_db *bt, MDB_val *key, MDB_cursor *cursor,
 
 /* Search for the page a given key should be in.
  * Stores a pointer to the found page in *mpp.
- * If key is NULL, search for the lowest page (used by mdb_cursor_first).
+ * If key is NULL, search for the lowest page (used by mdb_cursor_first),
+ * or the highest one with MDB_PS_LAST (used by mdb_cursor_last).
  * If cursor is non-null, pushes parent pages on the cursor stack.
- * If modify is true, visited pages are updated with new page numbers.
+ * With MDB_PS_MODIFY, visited pages are updated with new page numbers.
  */
 static int mdb_search_page(MDB_db *db, MDB_txn *txn, MDB_val *key,
-			   MDB_cursor *cursor, int modify, MDB_pageparent *mpp)
+			   MDB_cursor *cursor, int flags, MDB_pageparent *mpp)
 {
 	int rc;
 	pgno_t root;
+	MDB_meta meta;
 
 	/* Can't modify pages outside a transaction. */
-	if (txn == NULL && modify) {
+	if (txn == NULL && F_ISSET(flags, MDB_PS_MODIFY)) {
 		return EINVAL;
 	}
 
 	/* Choose which root page to start with. If a transaction is given
 	 * use the root page from the transaction, otherwise read the last
-	 * committed root page.
+	 * committed root page. Without a txn nothing pins the snapshot.
 	 */
 	if (txn == NULL) {
-		if ((rc = mdbenv_read_meta(db->md_env, NULL)) != MDB_SUCCESS)
+		if ((rc = mdbenv_pick_meta(db->md_env, &meta)) != MDB_SUCCESS)
 			return rc;
-		root = db->md_env->me_meta.mm_root;
+		if (F_ISSET(meta.mm_flags, MDB_TOMBSTONE))
+			return ESTALE;
+		root = F_ISSET(db->md_flags, MDB_FREEDB) ? meta.mm_free.mr_root :
+							    meta.mm_root;
 	} else if (F_ISSET(txn->mt_flags, MDB_TXN_ERROR)) {
 		DPRINTF("transaction has failed, must abort");
 		return EINVAL;
 	} else
-		root = txn->mt_root;
+		root = TXN_ROOT(txn, db);
 
 	if (root == P_INVALID) { /* Tree is empty. */
 		DPRINTF("tree is empty");
 		return ENOENT;
 	}
 
-	if ((mpp->mp_page = mdbenv_get_page(db->md_env, root)) == NULL)
+	if ((mpp->mp_page = mdbenv_get_page(db->md_env, txn, root)) == NULL)
 		return MDB_FAIL;
 
 	DPRINTF("root page has flags 0x%X", mpp->mp_page->mp_flags);
 
-	if (modify && !F_ISSET(mpp->mp_page->mp_flags, P_DIRTY)) {
+	if (F_ISSET(flags, MDB_PS_MODIFY)) {
 		mpp->mp_parent = NULL;
 		mpp->mp_pi = 0;
 		if ((rc = mdb_touch(txn, mpp)))
 			return rc;
-		txn->mt_root = mpp->mp_page->mp_pgno;
+		TXN_ROOT(txn, db) = mpp->mp_page->mp_pgno;
 	}
 
-	return mdb_search_page_root(db, key, cursor, modify, mpp);
+	return mdb_search_page_root(db, txn, key, cursor, flags, mpp);
 }
 
-static int mdb_read_data(MDB_db *db, MDB_page *mp, MDB_node *leaf,
+static int mdb_read_data(MDB_db *db, MDB_txn *txn, MDB_node *leaf,
 			 MDB_val *data)
 {
 	MDB_page *omp; /* overflow mpage */
@@ -1188,11 +1947,11 @@ static int mdb_read_data(MDB_db *db, MDB_page *mp, MDB_node *leaf,
 	 */
 	data->mv_size = leaf->mn_dsize;
 	bcopy(NODEDATA(leaf), &pgno, sizeof(pgno));
-	if ((omp = mdbenv_get_page(db->md_env, pgno)) == NULL) {
+	if ((omp = mdbenv_get_page(db->md_env, txn, pgno)) == NULL) {
 		DPRINTF("read overflow page %lu failed", pgno);
 		return MDB_FAIL;
 	}
-	data->mv_data = omp;
+	data->mv_data = METADATA(omp);
 
 	return MDB_SUCCESS;
 }
@@ -1223,7 +1982,7 @@ int mdb_get(MDB_db *db, MDB_txn *txn, MDB_val *key, MDB_val *data)
 
 	leaf = mdb_search_node(db, mpp.mp_page, key, &exact, NULL);
 	if (leaf && exact)
-		rc = mdb_read_data(db, mpp.mp_page, leaf, data);
+		rc = mdb_read_data(db, txn, leaf, data);
 	else {
 		rc = ENOENT;
 	}
@@ -1231,48 +1990,49 @@ int mdb_get(MDB_db *db, MDB_txn *txn, MDB_val *key, MDB_val *data)
 	return rc;
 }
 
+/* Move the cursor to the next or previous leaf. The stack entries are
+ * reused: go up to the closest parent that has a sibling in that
+ * direction, step over, then follow the near edge back down. On
+ * failure the cursor is left where it was.
+ */
 static int mdb_sibling(MDB_cursor *cursor, int move_right)
 {
-	int rc;
-	// MDB_node *indx;
-	MDB_ppage *parent, *top;
-	MDB_page *mp = NULL;
+	MDB_node *indx;
+	MDB_ppage *parent, *child, *top;
+	MDB_page *mp;
 
 	top = CURSOR_TOP(cursor);
-	if ((parent = SLIST_NEXT(top, mp_entry)) == NULL) {
-		return ENOENT; /* root has no siblings */
+	for (parent = SLIST_NEXT(top, mp_entry); parent != NULL;
+	     parent = SLIST_NEXT(parent, mp_entry)) {
+		if (move_right ? parent->mp_ki + 1 < NUMKEYS(parent->mp_page) :
+				 parent->mp_ki > 0)
+			break;
 	}
+	if (parent == NULL)
+		return ENOENT; /* no more leaves that way */
 
-	DPRINTF("parent page is page %lu, index %u", parent->mp_page->mp_pgno,
-		parent->mp_ki);
-
-	cursor_pop_page(cursor);
-	if (move_right ? (parent->mp_ki + 1 >= NUMKEYS(parent->mp_page)) :
-			 (parent->mp_ki == 0)) {
-		DPRINTF("no more keys left, moving to %s sibling",
-			move_right ? "right" : "left");
-		if ((rc = mdb_sibling(cursor, move_right)) != MDB_SUCCESS)
-			return rc;
-		parent = CURSOR_TOP(cursor);
-	} else {
-		if (move_right)
-			parent->mp_ki++;
-		else
-			parent->mp_ki--;
-		DPRINTF("just moving to %s index key %u",
-			move_right ? "right" : "left", parent->mp_ki);
+	if (move_right)
+		parent->mp_ki++;
+	else
+		parent->mp_ki--;
+	DPRINTF("moving to %s index key %u on parent page %lu",
+		move_right ? "right" : "left", parent->mp_ki,
+		parent->mp_page->mp_pgno);
+
+	while (parent != top) {
+		assert(IS_BRANCH(parent->mp_page));
+		for (child = top; SLIST_NEXT(child, mp_entry) != parent;
+		     child = SLIST_NEXT(child, mp_entry))
+			;
+		indx = NODEPTR(parent->mp_page, parent->mp_ki);
+		if ((mp = mdbenv_get_page(cursor->mc_db->md_env,
+					  cursor->mc_txn, NODEPGNO(indx))) ==
+		    NULL)
+			return MDB_FAIL;
+		child->mp_page = mp;
+		child->mp_ki = move_right ? 0 : NUMKEYS(mp) - 1;
+		parent = child;
 	}
-	assert(IS_BRANCH(parent->mp_page));
-
-#if 0
-	indx = NODEPTR(parent->mp_page, parent->mp_ki);
-	if ((mp = mdbenv_get_page(cursor->bt, indx->n_pgno)) == NULL)
-		return MDB_FAIL;
-	mp->parent = parent->mp_page;
-	mp->parent_index = parent->mp_ki;
-#endif
-
-	cursor_push_page(cursor, mp);
 
 	return MDB_SUCCESS;
 }
@@ -1325,7 +2085,49 @@ static int mdb_cursor_next(MDB_cursor *cursor, MDB_val *key, MDB_val *data)
 	assert(IS_LEAF(mp));
 	leaf = NODEPTR(mp, top->mp_ki);
 
-	if (data && mdb_read_data(cursor->mc_db, mp, leaf, data) != MDB_SUCCESS)
+	if (data && mdb_read_data(cursor->mc_db, cursor->mc_txn, leaf, data) !=
+			    MDB_SUCCESS)
+		return MDB_FAIL;
+
+	return mdb_set_key(cursor->mc_db, mp, leaf, key);
+}
+
+static int mdb_cursor_prev(MDB_cursor *cursor, MDB_val *key, MDB_val *data)
+{
+	MDB_ppage *top;
+	MDB_page *mp;
+	MDB_node *leaf;
+
+	assert(cursor->mc_initialized);
+
+	top = CURSOR_TOP(cursor);
+	mp = top->mp_page;
+
+	DPRINTF("cursor_prev: top page is %lu in cursor %p", mp->mp_pgno,
+		cursor);
+
+	if (cursor->mc_eof) {
+		/* Still on the last entry, return it again. */
+		cursor->mc_eof = 0;
+	} else if (top->mp_ki == 0) {
+		DPRINTF("=====> move to prev sibling page");
+		if (mdb_sibling(cursor, 0) != MDB_SUCCESS)
+			return ENOENT;
+		top = CURSOR_TOP(cursor);
+		mp = top->mp_page;
+		DPRINTF("prev page is %lu, key index %u", mp->mp_pgno,
+			top->mp_ki);
+	} else
+		top->mp_ki--;
+
+	DPRINTF("==> cursor points to page %lu with %lu keys, key index %u",
+		mp->mp_pgno, NUMKEYS(mp), top->mp_ki);
+
+	assert(IS_LEAF(mp));
+	leaf = NODEPTR(mp, top->mp_ki);
+
+	if (data && mdb_read_data(cursor->mc_db, cursor->mc_txn, leaf, data) !=
+			    MDB_SUCCESS)
 		return MDB_FAIL;
 
 	return mdb_set_key(cursor->mc_db, mp, leaf, key);
@@ -1371,7 +2173,7 @@ static int mdb_cursor_set(MDB_cursor *cursor, MDB_val *key, MDB_val *data,
 	cursor->mc_initialized = 1;
 	cursor->mc_eof = 0;
 
-	if (data && (rc = mdb_read_data(cursor->mc_db, mpp.mp_page, leaf,
+	if (data && (rc = mdb_read_data(cursor->mc_db, cursor->mc_txn, leaf,
 					data)) != MDB_SUCCESS)
 		return rc;
 
@@ -1401,7 +2203,33 @@ static int mdb_cursor_first(MDB_cursor *cursor, MDB_val *key, MDB_val *data)
 	cursor->mc_initialized = 1;
 	cursor->mc_eof = 0;
 
-	if (data && (rc = mdb_read_data(cursor->mc_db, mpp.mp_page, leaf,
+	if (data && (rc = mdb_read_data(cursor->mc_db, cursor->mc_txn, leaf,
+					data)) != MDB_SUCCESS)
+		return rc;
+
+	return mdb_set_key(cursor->mc_db, mpp.mp_page, leaf, key);
+}
+
+static int mdb_cursor_last(MDB_cursor *cursor, MDB_val *key, MDB_val *data)
+{
+	int rc;
+	MDB_pageparent mpp;
+	MDB_ppage *top;
+	MDB_node *leaf;
+
+	rc = mdb_search_page(cursor->mc_db, cursor->mc_txn, NULL, cursor,
+			     MDB_PS_LAST, &mpp);
+	if (rc != MDB_SUCCESS)
+		return rc;
+	assert(IS_LEAF(mpp.mp_page));
+
+	top = CURSOR_TOP(cursor);
+	top->mp_ki = NUMKEYS(mpp.mp_page) - 1;
+	leaf = NODEPTR(mpp.mp_page, top->mp_ki);
+	cursor->mc_initialized = 1;
+	cursor->mc_eof = 0;
+
+	if (data && (rc = mdb_read_data(cursor->mc_db, cursor->mc_txn, leaf,
 					data)) != MDB_SUCCESS)
 		return rc;
 
@@ -1440,6 +2268,17 @@ int mdb_cursor_get(MDB_cursor *cursor, MDB_val *key, MDB_val *data,
 			cursor_pop_page(cursor);
 		rc = mdb_cursor_first(cursor, key, data);
 		break;
+	case MDB_PREV:
+		if (!cursor->mc_initialized)
+			rc = mdb_cursor_last(cursor, key, data);
+		else
+			rc = mdb_cursor_prev(cursor, key, data);
+		break;
+	case MDB_LAST:
+		while (CURSOR_TOP(cursor) != NULL)
+			cursor_pop_page(cursor);
+		rc = mdb_cursor_last(cursor, key, data);
+		break;
 	default:
 		DPRINTF("unhandled/unimplemented cursor operation %u", op);
 		rc = EINVAL;
@@ -1449,29 +2288,76 @@ int mdb_cursor_get(MDB_cursor *cursor, MDB_val *key, MDB_val *data,
 	return rc;
 }
 
+/* Return up to *count entries in one call, all from the same leaf page.
+ * op positions the cursor as for mdb_cursor_get(), using keys[0] as the
+ * search key for MDB_CURSOR and MDB_CURSOR_EXACT, and the batch then
+ * runs to the end of that leaf, or to its start for MDB_PREV and
+ * MDB_LAST. The cursor is left on the last entry returned, so the next
+ * MDB_NEXT or MDB_PREV call picks up the following leaf. Keys and data
+ * point into the map; data may be NULL if only keys are wanted.
+ */
+int mdb_cursor_get_multiple(MDB_cursor *cursor, MDB_val *keys, MDB_val *data,
+			    unsigned int *count, MDB_cursor_op op)
+{
+	MDB_ppage *top;
+	MDB_page *mp;
+	MDB_node *leaf;
+	unsigned int n, max;
+	int rc, backward;
+
+	if (cursor == NULL || keys == NULL || count == NULL || *count == 0)
+		return EINVAL;
+
+	max = *count;
+	*count = 0;
+	if ((rc = mdb_cursor_get(cursor, &keys[0], data, op)) != MDB_SUCCESS)
+		return rc;
+
+	backward = (op == MDB_PREV || op == MDB_LAST);
+	top = CURSOR_TOP(cursor);
+	mp = top->mp_page;
+	for (n = 1; n < max; n++) {
+		if (backward ? top->mp_ki == 0 : top->mp_ki + 1 >= NUMKEYS(mp))
+			break;
+		if (backward)
+			top->mp_ki--;
+		else
+			top->mp_ki++;
+		leaf = NODEPTR(mp, top->mp_ki);
+		if (data && (rc = mdb_read_data(cursor->mc_db, cursor->mc_txn,
+						leaf, &data[n])) != MDB_SUCCESS)
+			break;
+		mdb_set_key(cursor->mc_db, mp, leaf, &keys[n]);
+	}
+	*count = n;
+
+	return rc;
+}
+
 /* Allocate a page and initialize it
  */
-static MDB_dpage *mdbenv_new_page(MDB_env *env, uint32_t flags, int num)
+static MDB_dpage *mdb_new_page(MDB_db *db, uint32_t flags, int num)
 {
 	MDB_dpage *dp;
+	MDB_env *env = db->md_env;
 
 	assert(env != NULL);
 	assert(env->me_txn != NULL);
 
-	DPRINTF("allocating new mpage %lu, page size %u",
-		env->me_txn->mt_next_pgno, env->me_head.mh_psize);
 	if ((dp = mdb_newpage(env->me_txn, NULL, 0, num)) == NULL)
 		return NULL;
-	dp->p.mp_flags = flags;
+	DPRINTF("allocated new mpage %lu, page size %u", dp->p.mp_pgno,
+		env->me_head.mh_psize);
+	dp->p.mp_flags = flags | P_DIRTY;
 	dp->p.mp_lower = PAGEHDRSZ;
 	dp->p.mp_upper = env->me_head.mh_psize;
 
 	if (IS_BRANCH(&dp->p))
-		env->me_meta.mm_stat.ms_branch_pages++;
+		db->md_stat.ms_branch_pages++;
 	else if (IS_LEAF(&dp->p))
-		env->me_meta.mm_stat.ms_leaf_pages++;
+		db->md_stat.ms_leaf_pages++;
 	else if (IS_OVERFLOW(&dp->p)) {
-		env->me_meta.mm_stat.ms_overflow_pages += num;
+		db->md_stat.ms_overflow_pages += num;
 		dp->p.mp_pages = num;
 	}
 
@@ -1509,6 +2395,7 @@ static int mdb_add_node(MDB_db *db, MDB_page *mp, indx_t indx, MDB_val *key,
 			MDB_val *data, pgno_t pgno, uint8_t flags)
 {
 	unsigned int i;
+	int ovpages = 0;
 	size_t node_size = NODESIZE;
 	indx_t ofs;
 	MDB_node *node;
@@ -1532,18 +2419,14 @@ static int mdb_add_node(MDB_db *db, MDB_page *mp, indx_t indx, MDB_val *key,
 			node_size -= data->mv_size - sizeof(pgno_t);
 		} else if (data->mv_size >=
 			   db->md_env->me_head.mh_psize / MDB_MINKEYS) {
-			int ovpages = PAGEHDRSZ + data->mv_size +
-				      db->md_env->me_head.mh_psize - 1;
-			ovpages /= db->md_env->me_head.mh_psize;
 			/* Put data on overflow page. */
 			DPRINTF("data size is %zu, put on overflow page",
 				data->mv_size);
 			node_size -= data->mv_size - sizeof(pgno_t);
-			if ((ofp = mdbenv_new_page(db->md_env, P_OVERFLOW,
-						   ovpages)) == NULL)
-				return MDB_FAIL;
-			DPRINTF("allocated overflow page %lu", ofp->p.mp_pgno);
 			flags |= F_BIGDATA;
+			ovpages = PAGEHDRSZ + data->mv_size +
+				  db->md_env->me_head.mh_psize - 1;
+			ovpages /= db->md_env->me_head.mh_psize;
 		}
 	}
 
@@ -1556,6 +2439,15 @@ static int mdb_add_node(MDB_db *db, MDB_page *mp, indx_t indx, MDB_val *key,
 		return ENOSPC;
 	}
 
+	/* Only allocate the overflow page once the node is known to fit,
+	 * the caller splits and retries on ENOSPC.
+	 */
+	if (ovpages != 0) {
+		if ((ofp = mdb_new_page(db, P_OVERFLOW, ovpages)) == NULL)
+			return MDB_FAIL;
+		DPRINTF("allocated overflow page %lu", ofp->p.mp_pgno);
+	}
+
 	/* Move higher pointers up one slot. */
 	for (i = NUMKEYS(mp); i > indx; i--)
 		mp->mp_ptrs[i] = mp->mp_ptrs[i - 1];
@@ -1638,6 +2530,35 @@ static void mdb_del_node(MDB_db *db, MDB_page *mp, indx_t indx)
 	mp->mp_upper += sz;
 }
 
+/* The overflow pages of a deleted or replaced value are freed with
+ * the leaf. Ones written by this very txn are left alone, the caller
+ * may still hold a pointer into them.
+ */
+static int mdb_free_overflow(MDB_db *db, MDB_txn *txn, MDB_node *leaf)
+{
+	MDB_page *omp;
+	pgno_t pgno;
+	uint32_t i;
+	int rc;
+
+	if (!F_ISSET(leaf->mn_flags, F_BIGDATA))
+		return MDB_SUCCESS;
+
+	bcopy(NODEDATA(leaf), &pgno, sizeof(pgno));
+	if ((omp = mdbenv_get_page(db->md_env, txn, pgno)) == NULL)
+		return MDB_FAIL;
+	db->md_stat.ms_overflow_pages -= omp->mp_pages;
+	if (F_ISSET(omp->mp_flags, P_DIRTY)) {
+		mdb_drop_dirty(txn, omp);
+		return MDB_SUCCESS;
+	}
+	for (i = 0; i < omp->mp_pages; i++) {
+		if ((rc = mdb_pglist_add(&txn->mt_free_pgs, pgno + i)) != 0)
+			return rc;
+	}
+	return MDB_SUCCESS;
+}
+
 int mdb_cursor_open(MDB_db *db, MDB_txn *txn, MDB_cursor **ret)
 {
 	MDB_cursor *cursor;
@@ -1719,7 +2640,8 @@ static int mdb_move_node(MDB_db *bt, MDB_pageparent *src, indx_t srcindx,
 {
 	int rc;
 	MDB_node *srcnode;
-	MDB_val key, data;
+	MDB_val key, data, skey;
+	char kbuf[MAXKEYSIZE];
 
 	srcnode = NODEPTR(src->mp_page, srcindx);
 	DPRINTF("moving %s node %u [%.*s] on page %lu to node %u on page %lu",
@@ -1744,18 +2666,27 @@ static int mdb_move_node(MDB_db *bt, MDB_pageparent *src, indx_t srcindx,
 	if (rc != MDB_SUCCESS)
 		return rc;
 
+	/* The key lives in the source page, which mdb_del_node shifts.
+	 */
+	bcopy(key.mv_data, kbuf, key.mv_size);
+	key.mv_data = kbuf;
+
 	/* Delete the node from the source page.
 	 */
 	mdb_del_node(bt, src->mp_page, srcindx);
 
-	/* Update the parent separators.
+	/* Update the parent separators. The source page is now
+	 * separated by the key of its new first node.
 	 */
 	if (srcindx == 0 && src->mp_pi != 0) {
+		srcnode = NODEPTR(src->mp_page, 0);
+		skey.mv_size = srcnode->mn_ksize;
+		skey.mv_data = NODEKEY(srcnode);
 		DPRINTF("update separator for source page %lu to [%.*s]",
-			src->mp_page->mp_pgno, (int)key.mv_size,
-			(char *)key.mv_data);
+			src->mp_page->mp_pgno, (int)skey.mv_size,
+			(char *)skey.mv_data);
 		if ((rc = mdb_update_key(bt, src->mp_parent, src->mp_pi,
-					 &key)) != MDB_SUCCESS)
+					 &skey)) != MDB_SUCCESS)
 			return rc;
 	}
 
@@ -1836,9 +2767,11 @@ static int mdb_merge(MDB_db *bt, MDB_pageparent *src, MDB_pageparent *dst)
 	}
 
 	if (IS_LEAF(src->mp_page))
-		bt->md_env->me_meta.mm_stat.ms_leaf_pages--;
+		bt->md_stat.ms_leaf_pages--;
 	else
-		bt->md_env->me_meta.mm_stat.ms_branch_pages--;
+		bt->md_stat.ms_branch_pages--;
+	mdb_drop_dirty(bt->md_env->me_txn, src->mp_page);
+	src->mp_page = NULL;
 
 	mpp.mp_page = src->mp_parent;
 	dh = (MDB_dhead *)src->mp_parent;
@@ -1856,10 +2789,11 @@ static int mdb_rebalance(MDB_db *db, MDB_pageparent *mpp)
 	MDB_node *node;
 	MDB_page *root;
 	MDB_pageparent npp;
+	MDB_txn *txn = db->md_env->me_txn;
 	indx_t si = 0, di = 0;
 
 	assert(db != NULL);
-	assert(db->md_env->me_txn != NULL);
+	assert(txn != NULL);
 	assert(mpp != NULL);
 
 	DPRINTF("rebalancing %s page %lu (has %lu keys, %.1f%% full)",
@@ -1876,20 +2810,22 @@ static int mdb_rebalance(MDB_db *db, MDB_pageparent *mpp)
 	if (mpp->mp_parent == NULL) {
 		if (NUMKEYS(mpp->mp_page) == 0) {
 			DPRINTF("tree is completely empty");
-			db->md_env->me_txn->mt_root = P_INVALID;
-			db->md_env->me_meta.mm_stat.ms_depth--;
-			db->md_env->me_meta.mm_stat.ms_leaf_pages--;
+			TXN_ROOT(txn, db) = P_INVALID;
+			db->md_stat.ms_depth--;
+			db->md_stat.ms_leaf_pages--;
+			mdb_drop_dirty(txn, mpp->mp_page);
+			mpp->mp_page = NULL;
 		} else if (IS_BRANCH(mpp->mp_page) &&
 			   NUMKEYS(mpp->mp_page) == 1) {
 			DPRINTF("collapsing root page!");
-			db->md_env->me_txn->mt_root =
-				NODEPGNO(NODEPTR(mpp->mp_page, 0));
-			if ((root = mdbenv_get_page(
-				     db->md_env,
-				     db->md_env->me_txn->mt_root)) == NULL)
+			TXN_ROOT(txn, db) = NODEPGNO(NODEPTR(mpp->mp_page, 0));
+			if ((root = mdbenv_get_page(db->md_env, txn,
+						    TXN_ROOT(txn, db))) == NULL)
 				return MDB_FAIL;
-			db->md_env->me_meta.mm_stat.ms_depth--;
-			db->md_env->me_meta.mm_stat.ms_branch_pages--;
+			db->md_stat.ms_depth--;
+			db->md_stat.ms_branch_pages--;
+			mdb_drop_dirty(txn, mpp->mp_page);
+			mpp->mp_page = NULL;
 		} else
 			DPRINTF("root page doesn't need rebalancing");
 		return MDB_SUCCESS;
@@ -1912,7 +2848,7 @@ static int mdb_rebalance(MDB_db *db, MDB_pageparent *mpp)
 		 */
 		DPRINTF("reading right neighbor");
 		node = NODEPTR(mpp->mp_parent, mpp->mp_pi + 1);
-		if ((npp.mp_page = mdbenv_get_page(db->md_env,
+		if ((npp.mp_page = mdbenv_get_page(db->md_env, txn,
 						   NODEPGNO(node))) == NULL)
 			return MDB_FAIL;
 		npp.mp_pi = mpp->mp_pi + 1;
@@ -1923,7 +2859,7 @@ static int mdb_rebalance(MDB_db *db, MDB_pageparent *mpp)
 		 */
 		DPRINTF("reading left neighbor");
 		node = NODEPTR(mpp->mp_parent, mpp->mp_pi - 1);
-		if ((npp.mp_page = mdbenv_get_page(db->md_env,
+		if ((npp.mp_page = mdbenv_get_page(db->md_env, txn,
 						   NODEPGNO(node))) == NULL)
 			return MDB_FAIL;
 		npp.mp_pi = mpp->mp_pi - 1;
@@ -1979,7 +2915,8 @@ int mdb_del(MDB_db *bt, MDB_txn *txn, MDB_val *key, MDB_val *data)
 		return EINVAL;
 	}
 
-	if ((rc = mdb_search_page(bt, txn, key, NULL, 1, &mpp)) != MDB_SUCCESS)
+	rc = mdb_search_page(bt, txn, key, NULL, MDB_PS_MODIFY, &mpp);
+	if (rc != MDB_SUCCESS)
 		return rc;
 
 	leaf = mdb_search_node(bt, mpp.mp_page, key, &exact, &ki);
@@ -1987,11 +2924,13 @@ int mdb_del(MDB_db *bt, MDB_txn *txn, MDB_val *key, MDB_val *data)
 		return ENOENT;
 	}
 
-	if (data && (rc = mdb_read_data(bt, NULL, leaf, data)) != MDB_SUCCESS)
+	if (data && (rc = mdb_read_data(bt, txn, leaf, data)) != MDB_SUCCESS)
 		return rc;
 
+	if ((rc = mdb_free_overflow(bt, txn, leaf)) != MDB_SUCCESS)
+		return rc;
 	mdb_del_node(bt, mpp.mp_page, ki);
-	bt->md_env->me_meta.mm_stat.ms_entries--;
+	bt->md_stat.ms_entries--;
 	rc = mdb_rebalance(bt, &mpp);
 	if (rc != MDB_SUCCESS)
 		txn->mt_flags |= MDB_TXN_ERROR;
@@ -2031,13 +2970,13 @@ static int mdb_split(MDB_db *bt, MDB_page **mpp, unsigned int *newindxp,
 		(int)newkey->mv_size, (char *)newkey->mv_data, *newindxp);
 
 	if (mdp->h.md_parent == NULL) {
-		if ((pdp = mdbenv_new_page(bt->md_env, P_BRANCH, 1)) == NULL)
+		if ((pdp = mdb_new_page(bt, P_BRANCH, 1)) == NULL)
 			return MDB_FAIL;
 		mdp->h.md_pi = 0;
 		mdp->h.md_parent = &pdp->p;
-		bt->md_env->me_txn->mt_root = pdp->p.mp_pgno;
+		TXN_ROOT(bt->md_env->me_txn, bt) = pdp->p.mp_pgno;
 		DPRINTF("root split! new root = %lu", pdp->p.mp_pgno);
-		bt->md_env->me_meta.mm_stat.ms_depth++;
+		bt->md_stat.ms_depth++;
 
 		/* Add left (implicit) pointer. */
 		if (mdb_add_node(bt, &pdp->p, 0, NULL, NULL, mdp->p.mp_pgno,
@@ -2048,7 +2987,7 @@ static int mdb_split(MDB_db *bt, MDB_page **mpp, unsigned int *newindxp,
 	}
 
 	/* Create a right sibling. */
-	if ((rdp = mdbenv_new_page(bt->md_env, mdp->p.mp_flags, 1)) == NULL)
+	if ((rdp = mdb_new_page(bt, mdp->p.mp_flags, 1)) == NULL)
 		return MDB_FAIL;
 	rdp->h.md_parent = mdp->h.md_parent;
 	rdp->h.md_pi = mdp->h.md_pi + 1;
@@ -2188,7 +3127,7 @@ int mdb_put(MDB_db *bt, MDB_txn *txn, MDB_val *key, MDB_val *data,
 	DPRINTF("==> put key %.*s, size %zu, data size %zu", (int)key->mv_size,
 		(char *)key->mv_data, key->mv_size, data->mv_size);
 
-	rc = mdb_search_page(bt, txn, key, NULL, 1, &mpp);
+	rc = mdb_search_page(bt, txn, key, NULL, MDB_PS_MODIFY, &mpp);
 	if (rc == MDB_SUCCESS) {
 		leaf = mdb_search_node(bt, mpp.mp_page, key, &exact, &ki);
 		if (leaf && exact) {
@@ -2197,7 +3136,11 @@ int mdb_put(MDB_db *bt, MDB_txn *txn, MDB_val *key, MDB_val *data,
 					(char *)key->mv_data);
 				return EEXIST;
 			}
+			if ((rc = mdb_free_overflow(bt, txn, leaf)) !=
+			    MDB_SUCCESS)
+				return rc;
 			mdb_del_node(bt, mpp.mp_page, ki);
+			bt->md_stat.ms_entries--;
 		}
 		if (leaf == NULL) { /* append if not found */
 			ki = NUMKEYS(mpp.mp_page);
@@ -2207,12 +3150,12 @@ int mdb_put(MDB_db *bt, MDB_txn *txn, MDB_val *key, MDB_val *data,
 		MDB_dpage *dp;
 		/* new file, just write a root leaf page */
 		DPRINTF("allocating new root leaf page");
-		if ((dp = mdbenv_new_page(bt->md_env, P_LEAF, 1)) == NULL) {
+		if ((dp = mdb_new_page(bt, P_LEAF, 1)) == NULL) {
 			return ENOMEM;
 		}
 		mpp.mp_page = &dp->p;
-		txn->mt_root = mpp.mp_page->mp_pgno;
-		bt->md_env->me_meta.mm_stat.ms_depth++;
+		TXN_ROOT(txn, bt) = mpp.mp_page->mp_pgno;
+		bt->md_stat.ms_depth++;
 		ki = 0;
 	} else
 		goto done;
@@ -2231,7 +3174,7 @@ int mdb_put(MDB_db *bt, MDB_txn *txn, MDB_val *key, MDB_val *data,
 	if (rc != MDB_SUCCESS)
 		txn->mt_flags |= MDB_TXN_ERROR;
 	else
-		bt->md_env->me_meta.mm_stat.ms_entries++;
+		bt->md_stat.ms_entries++;
 
 done:
 	return rc;
@@ -2248,7 +3191,7 @@ static pgno_t mdbenv_compact_tree(MDB_env *env, pgno_t pgno, MDB_env *envc)
 
 	/* Get the page and make a copy of it.
 	 */
-	if ((mp = mdbenv_get_page(env, pgno)) == NULL)
+	if ((mp = mdbenv_get_page(env, NULL, pgno)) == NULL)
 		return P_INVALID;
 	if ((p = malloc(env->me_head.mh_psize)) == NULL)
 		return P_INVALID;
@@ -2286,7 +3229,8 @@ static pgno_t mdbenv_compact_tree(MDB_env *env, pgno_t pgno, MDB_env *envc)
 		assert(0);
 
 	pgno = p->mp_pgno = envc->me_txn->mt_next_pgno++;
-	rc = write(envc->me_fd, p, env->me_head.mh_psize);
+	rc = pwrite(envc->me_fd, p, env->me_head.mh_psize,
+		    (off_t)pgno * env->me_head.mh_psize);
 	free(p);
 	if (rc != (ssize_t)env->me_head.mh_psize)
 		return P_INVALID;
@@ -2295,7 +3239,9 @@ static pgno_t mdbenv_compact_tree(MDB_env *env, pgno_t pgno, MDB_env *envc)
 		if (mp->mp_pages > 1) {
 			size_t len = (mp->mp_pages - 1) * env->me_head.mh_psize;
 			envc->me_txn->mt_next_pgno += mp->mp_pages - 1;
-			rc = write(envc->me_fd, mp + 1, len);
+			rc = pwrite(envc->me_fd,
+				    (char *)mp + env->me_head.mh_psize, len,
+				    (off_t)(pgno + 1) * env->me_head.mh_psize);
 			if (rc != len)
 				return P_INVALID;
 		}
@@ -2306,7 +3252,7 @@ static pgno_t mdbenv_compact_tree(MDB_env *env, pgno_t pgno, MDB_env *envc)
 int mdbenv_compact(MDB_env *env)
 {
 	char *compact_path = NULL;
-	MDB_env *envc;
+	MDB_env *envc = NULL;
 	MDB_txn *txn, *txnc = NULL;
 	int fd, rc;
 	pgno_t root;
@@ -2341,20 +3287,26 @@ int mdbenv_compact(MDB_env *env)
 	if (rc)
 		goto failed;
 
-	bcopy(&env->me_meta, &envc->me_meta, sizeof(env->me_meta));
-	envc->me_meta.mm_stat.ms_revisions = 0;
-
 	rc = mdb_txn_begin(envc, 0, &txnc);
 	if (rc)
 		goto failed;
 
+	/* The new file starts without a freelist, and continues the txn
+	 * numbering so the shared reader table stays valid.
+	 */
+	bcopy(&env->me_meta.mm_stat, &envc->me_meta.mm_stat,
+	      sizeof(env->me_meta.mm_stat));
+	envc->me_meta.mm_stat.ms_revisions = 0;
+	txnc->mt_txnid = txn->mt_txnid;
+
+	root = P_INVALID;
 	if (env->me_meta.mm_root != P_INVALID) {
 		root = mdbenv_compact_tree(env, env->me_meta.mm_root, envc);
 		if (root == P_INVALID)
 			goto failed;
-		if ((rc = mdbenv_write_meta(envc, root, 0)) != MDB_SUCCESS)
-			goto failed;
 	}
+	if ((rc = mdbenv_write_meta(envc, root, 0)) != MDB_SUCCESS)
+		goto failed;
 
 	fsync(fd);
 
@@ -2369,6 +3321,10 @@ int mdbenv_compact(MDB_env *env)
 	 */
 	if (mdbenv_write_meta(env, P_INVALID, MDB_TOMBSTONE) != MDB_SUCCESS)
 		goto failed;
+	if (env->me_txns != NULL) {
+		__sync_synchronize();
+		env->me_txns->mti_txnid = txn->mt_txnid;
+	}
 
 	mdb_txn_abort(txn);
 	mdb_txn_abort(txnc);
@@ -2390,7 +3346,7 @@ int mdbenv_get_flags(MDB_env *env, unsigned int *arg)
 	if (!env || !arg)
 		return EINVAL;
 
-	*arg = (env->me_flags & ~MDB_FIXPADDING);
+	*arg = env->me_flags;
 	return MDB_SUCCESS;
 }
 
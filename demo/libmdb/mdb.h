@@ -29,8 +29,8 @@ typedef enum MDB_cursor_op {
 	MDB_CURSOR_EXACT, /* position at key, or fail */
 	MDB_FIRST,
 	MDB_NEXT,
-	MDB_LAST, /* not implemented */
-	MDB_PREV, /* not implemented */
+	MDB_LAST,
+	MDB_PREV,
 } MDB_cursor_op;
 
 /* return codes */
@@ -65,6 +65,8 @@ int mdbenv_get_flags(MDB_env *env, unsigned int *flags);
 int mdbenv_get_path(MDB_env *env, const char **path);
 int mdbenv_sync(MDB_env *env);
 int mdbenv_compact(MDB_env *env);
+int mdbenv_set_maxreaders(MDB_env *env, unsigned int readers);
+int mdbenv_get_maxreaders(MDB_env *env, unsigned int *readers);
 
 int mdb_txn_begin(MDB_env *env, int rdonly, MDB_txn **txn);
 int mdb_txn_commit(MDB_txn *txn);
@@ -84,6 +86,8 @@ int mdb_cursor_open(MDB_db *db, MDB_txn *txn, MDB_cursor **cursor);
 void mdb_cursor_close(MDB_cursor *cursor);
 int mdb_cursor_get(MDB_cursor *cursor, MDB_val *key, MDB_val *data,
 		   MDB_cursor_op op);
+int mdb_cursor_get_multiple(MDB_cursor *cursor, MDB_val *keys, MDB_val *data,
+			    unsigned int *count, MDB_cursor_op op);
 
 int mdb_cmp(MDB_db *db, const MDB_val *a, const MDB_val *b);
 
@@ -1,8 +1,318 @@
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 #include "mdb.h"
 
+#define BENCH_DB "./benchdb"
+#define BENCH_MAPSIZE (1UL << 30)
+#define BENCH_KEYS 100000
+#define BENCH_SECS 2
+
+static MDB_env *benv;
+static MDB_db *bdb;
+static volatile int bstop;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_key(char *buf, unsigned long i)
+{
+	sprintf(buf, "key%012lu", i);
+}
+
+static int bench_open(unsigned long nkeys)
+{
+	MDB_txn *txn;
+	MDB_val key, data;
+	char kbuf[32], vbuf[64];
+	unsigned long i;
+	int rc;
+
+	unlink(BENCH_DB);
+	unlink(BENCH_DB "-lock");
+	if ((rc = mdbenv_create(&benv, BENCH_MAPSIZE)) != 0 ||
+	    (rc = mdbenv_set_maxreaders(benv, 64)) != 0 ||
+	    (rc = mdbenv_open(benv, BENCH_DB, MDB_NOSYNC, 0664)) != 0 ||
+	    (rc = mdb_open(benv, NULL, NULL, 0, &bdb)) != 0)
+		return rc;
+
+	if ((rc = mdb_txn_begin(benv, 0, &txn)) != 0)
+		return rc;
+	memset(vbuf, 'v', sizeof(vbuf));
+	for (i = 0; i < nkeys; i++) {
+		bench_key(kbuf, i);
+		key.mv_size = strlen(kbuf);
+		key.mv_data = kbuf;
+		data.mv_size = sizeof(vbuf);
+		data.mv_data = vbuf;
+		if ((rc = mdb_put(bdb, txn, &key, &data, 0)) != 0) {
+			mdb_txn_abort(txn);
+			return rc;
+		}
+	}
+	return mdb_txn_commit(txn);
+}
+
+static void bench_close(void)
+{
+	mdb_close(bdb);
+	mdbenv_close(benv);
+	unlink(BENCH_DB);
+	unlink(BENCH_DB "-lock");
+}
+
+/* Rewrite n random keys in one transaction.
+ */
+static int bench_update(unsigned int *seed, unsigned long nkeys, int n)
+{
+	MDB_txn *txn;
+	MDB_val key, data;
+	char kbuf[32], vbuf[64];
+	int i, rc;
+
+	if ((rc = mdb_txn_begin(benv, 0, &txn)) != 0)
+		return rc;
+	for (i = 0; i < n; i++) {
+		bench_key(kbuf, rand_r(seed) % nkeys);
+		memset(vbuf, 'a' + rand_r(seed) % 26, sizeof(vbuf));
+		key.mv_size = strlen(kbuf);
+		key.mv_data = kbuf;
+		data.mv_size = sizeof(vbuf);
+		data.mv_data = vbuf;
+		if ((rc = mdb_put(bdb, txn, &key, &data, 0)) != 0) {
+			mdb_txn_abort(txn);
+			return rc;
+		}
+	}
+	return mdb_txn_commit(txn);
+}
+
+struct bench_thr {
+	pthread_t bt_tid;
+	unsigned int bt_seed;
+	unsigned long bt_ops;
+	int bt_rc;
+};
+
+static void *bench_writer(void *arg)
+{
+	struct bench_thr *bt = arg;
+
+	while (!bstop) {
+		if ((bt->bt_rc = bench_update(&bt->bt_seed, BENCH_KEYS, 10)))
+			break;
+		bt->bt_ops++;
+	}
+	return NULL;
+}
+
+/* Each read-only transaction looks up 100 random keys.
+ */
+static void *bench_reader(void *arg)
+{
+	struct bench_thr *bt = arg;
+	MDB_txn *txn;
+	MDB_val key, data;
+	char kbuf[32];
+	int i;
+
+	while (!bstop) {
+		if ((bt->bt_rc = mdb_txn_begin(benv, 1, &txn)) != 0)
+			break;
+		for (i = 0; i < 100; i++) {
+			bench_key(kbuf, rand_r(&bt->bt_seed) % BENCH_KEYS);
+			key.mv_size = strlen(kbuf);
+			key.mv_data = kbuf;
+			if ((bt->bt_rc = mdb_get(bdb, txn, &key, &data)) != 0)
+				break;
+		}
+		mdb_txn_abort(txn);
+		if (bt->bt_rc != 0)
+			break;
+		bt->bt_ops += i;
+	}
+	return NULL;
+}
+
+/* Read throughput for each reader thread count in list, with one
+ * writer committing small transactions the whole time.
+ */
+static int bench_readers(const char *list)
+{
+	struct bench_thr wr, *rd;
+	const char *p;
+	unsigned long ops;
+	double t0, t1;
+	int i, n, rc;
+
+	if ((rc = bench_open(BENCH_KEYS)) != 0) {
+		fprintf(stderr, "bench_open: %s\n", strerror(rc));
+		return 1;
+	}
+
+	printf("%8s %14s %14s %12s\n", "readers", "gets/s", "gets/s/thr",
+	       "commits/s");
+	for (p = list; *p != '\0'; p += strcspn(p, ","), p += *p == ',') {
+		if ((n = atoi(p)) <= 0 || n > 64)
+			continue;
+		rd = calloc(n, sizeof(*rd));
+		memset(&wr, 0, sizeof(wr));
+		wr.bt_seed = 1;
+		bstop = 0;
+		t0 = now();
+		pthread_create(&wr.bt_tid, NULL, bench_writer, &wr);
+		for (i = 0; i < n; i++) {
+			rd[i].bt_seed = i + 2;
+			pthread_create(&rd[i].bt_tid, NULL, bench_reader,
+				       &rd[i]);
+		}
+		sleep(BENCH_SECS);
+		bstop = 1;
+		pthread_join(wr.bt_tid, NULL);
+		ops = 0;
+		for (i = 0; i < n; i++) {
+			pthread_join(rd[i].bt_tid, NULL);
+			ops += rd[i].bt_ops;
+			if (rd[i].bt_rc != 0)
+				rc = rd[i].bt_rc;
+		}
+		t1 = now() - t0;
+		free(rd);
+		if (wr.bt_rc != 0)
+			rc = wr.bt_rc;
+		if (rc != 0) {
+			fprintf(stderr, "readers %d: %s\n", n, strerror(rc));
+			break;
+		}
+		printf("%8d %14.0f %14.0f %12.0f\n", n, ops / t1, ops / t1 / n,
+		       wr.bt_ops / t1);
+	}
+
+	bench_close();
+	return rc != 0;
+}
+
+static long file_size(const char *path)
+{
+	struct stat st;
+
+	return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+/* File size under n update transactions of 100 keys each, first with
+ * no readers and then with a read txn held open for the whole run.
+ */
+static int bench_growth(int n)
+{
+	MDB_txn *rtxn;
+	unsigned int seed;
+	int pass, i, rc = 0;
+
+	printf("%8s %8s %14s\n", "reader", "txns", "file bytes");
+	for (pass = 0; pass < 2 && rc == 0; pass++) {
+		if ((rc = bench_open(BENCH_KEYS / 10)) != 0)
+			break;
+		rtxn = NULL;
+		if (pass == 1 && (rc = mdb_txn_begin(benv, 1, &rtxn)) != 0)
+			break;
+		printf("%8s %8d %14ld\n", pass ? "held" : "none", 0,
+		       file_size(BENCH_DB));
+		seed = 1;
+		for (i = 1; i <= n && rc == 0; i++) {
+			rc = bench_update(&seed, BENCH_KEYS / 10, 100);
+			if (i % (n / 10 ? n / 10 : 1) == 0)
+				printf("%8s %8d %14ld\n", pass ? "held" : "none",
+				       i, file_size(BENCH_DB));
+		}
+		mdb_txn_abort(rtxn);
+		bench_close();
+	}
+	if (rc != 0)
+		fprintf(stderr, "bench_growth: %s\n", strerror(rc));
+	return rc != 0;
+}
+
+/* Full scans of n keys inside one read-only txn: one entry per call in
+ * each direction, then a leaf page per call.
+ */
+static int bench_scan(unsigned long n)
+{
+	static const struct {
+		const char *name;
+		MDB_cursor_op first, next;
+		int multiple;
+	} modes[] = {
+		{ "next", MDB_FIRST, MDB_NEXT, 0 },
+		{ "prev", MDB_LAST, MDB_PREV, 0 },
+		{ "next/multi", MDB_FIRST, MDB_NEXT, 1 },
+		{ "prev/multi", MDB_LAST, MDB_PREV, 1 },
+	};
+	MDB_txn *txn;
+	MDB_cursor *cursor;
+	MDB_val key, data, keys[512], vals[512];
+	MDB_cursor_op op;
+	unsigned long seen;
+	unsigned int count;
+	double t0, t1;
+	int m, rc;
+
+	if ((rc = bench_open(n)) != 0) {
+		fprintf(stderr, "bench_open: %s\n", strerror(rc));
+		return 1;
+	}
+
+	printf("%12s %12s %14s\n", "scan", "entries", "entries/s");
+	for (m = 0; m < 4 && rc == 0; m++) {
+		if ((rc = mdb_txn_begin(benv, 1, &txn)) != 0)
+			break;
+		if ((rc = mdb_cursor_open(bdb, txn, &cursor)) != 0) {
+			mdb_txn_abort(txn);
+			break;
+		}
+		seen = 0;
+		op = modes[m].first;
+		t0 = now();
+		if (modes[m].multiple) {
+			do {
+				count = 512;
+				rc = mdb_cursor_get_multiple(cursor, keys, vals,
+							     &count, op);
+				seen += count;
+				op = modes[m].next;
+			} while (rc == 0);
+		} else {
+			while ((rc = mdb_cursor_get(cursor, &key, &data, op)) ==
+			       0) {
+				seen++;
+				op = modes[m].next;
+			}
+		}
+		t1 = now() - t0;
+		mdb_cursor_close(cursor);
+		mdb_txn_abort(txn);
+		if (rc == ENOENT && seen == n)
+			rc = 0;
+		else if (rc == 0 || rc == ENOENT)
+			rc = EIO;
+		printf("%12s %12lu %14.0f\n", modes[m].name, seen, seen / t1);
+	}
+	if (rc != 0)
+		fprintf(stderr, "bench_scan: %s\n", strerror(rc));
+
+	bench_close();
+	return rc != 0;
+}
+
 int main(int argc, char *argv[])
 {
 	int i = 0, rc;
@@ -15,6 +325,13 @@ int main(int argc, char *argv[])
 	int *values;
 	char sval[32];
 
+	if (argc > 2 && strcmp(argv[1], "readers") == 0)
+		return bench_readers(argv[2]);
+	if (argc > 2 && strcmp(argv[1], "growth") == 0)
+		return bench_growth(atoi(argv[2]));
+	if (argc > 2 && strcmp(argv[1], "scan") == 0)
+		return bench_scan(strtoul(argv[2], NULL, 10));
+
 	srandom(time(NULL));
 
 	count = random() % 512;
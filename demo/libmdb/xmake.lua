@@ -4,3 +4,7 @@ target("libmdb_test")
     set_kind("binary")
     add_files("*.c")
     add_packages("openssl3")
+    add_syslinks("pthread")
+    if is_mode("debug") then
+        add_defines("DEBUG")
+    end
@@ -1,4 +1,5 @@
 #include "mpmc_queue.h"
+#include "queue_wait.h"
 
 #include <errno.h>
 #include <string.h>
@@ -52,8 +53,11 @@ struct mpmc_queue {
 	size_t size; // 每个元素的大小（包括item头）
 	size_t item_size; // 用户数据大小
 
+	// 读者挂在head上等它离开TAIL_IDX，写者挂在free的索引字上等它离开TAIL_IDX
 	ALIGNED(CACHE_LINE_SIZE) volatile aligned_uint32_t head;
+	volatile uint32_t read_waiters;
 	ALIGNED(CACHE_LINE_SIZE) volatile aligned_uint64_t free;
+	volatile uint32_t write_waiters;
 
 	char items[]; // 柔性数组，存储所有元素
 };
@@ -61,27 +65,12 @@ struct mpmc_queue {
 struct mpmc_queuebatch {
 	ALIGNED(CACHE_LINE_SIZE) volatile aligned_uint32_t wseq;
 	int qnum;
+	// 读者要扫描所有子队列，无法同时等待多个futex，改为等待这个提交序号
+	ALIGNED(CACHE_LINE_SIZE) volatile aligned_uint32_t rseq;
+	volatile uint32_t read_waiters;
 	struct mpmc_queue *queues[];
 };
 
-struct mpmc_queuebatch_reader {
-	struct mpmc_queuebatch *queuebatch;
-	uint32_t queueid;
-};
-
-struct mpmc_queuebatch_writer {
-	struct mpmc_queuebatch *queuebatch;
-	struct mpmc_queue *queue;
-};
-
-struct reader_result {
-	struct mpmc_queue *q;
-	struct item *header;
-	struct item *tail;
-	struct item *curr;
-	size_t nmemb;
-};
-
 // 辅助宏
 #define ITEM(q, i) ((struct item *)((q)->items + (i) * (q)->size))
 #define ITEM_IDX(q, ptr) (((char *)(ptr) - (q)->items) / (q)->size)
@@ -334,12 +323,17 @@ void mpmc_queue_writer_commit(struct mpmc_queue *q, void *ptr)
 
 		if (atomic_compare_exchange_weak(&q->head, &expected_head,
 						 desired_head)) {
-			write_barrier();
-			return;
+			break;
 		}
 
 		cpu_relax();
 	}
+
+	// 与mpmc_queue_reader_wait()的登记配对，没有读者挂起时不进内核
+	memory_barrier();
+	if (UNLIKELY(q->read_waiters != 0)) {
+		queue_wait_wake(&q->head, 1, false);
+	}
 }
 
 void mpmc_queuebatch_writer_commit(struct mpmc_queuebatch_writer *writer,
@@ -348,7 +342,53 @@ void mpmc_queuebatch_writer_commit(struct mpmc_queuebatch_writer *writer,
 	QUEUE_ASSERT(writer != NULL, "Writer is NULL");
 	QUEUE_ASSERT(writer->queue != NULL, "Writer queue is NULL");
 
+	struct mpmc_queuebatch *qs = writer->queuebatch;
+
+	// mpmc_queue_writer_commit()已经做了全屏障
 	mpmc_queue_writer_commit(writer->queue, ptr);
+	if (UNLIKELY(qs->read_waiters != 0)) {
+		__atomic_fetch_add(&qs->rseq, 1, __ATOMIC_SEQ_CST);
+		queue_wait_wake(&qs->rseq, 1, false);
+	}
+}
+
+void *mpmc_queue_writer_wait(struct mpmc_queue *q, int timeout_ms)
+{
+	QUEUE_ASSERT(q != NULL, "Queue is NULL");
+
+	struct queue_wait w;
+	void *ptr;
+	int rc;
+
+	queue_wait_init(&w, timeout_ms, false);
+	while ((ptr = mpmc_queue_writer_prepare(q)) == NULL) {
+		if (queue_wait_spin(&w)) {
+			continue;
+		}
+
+		// 空闲链表为空时free的索引字是TAIL_IDX，读者归还后必然变化
+		__atomic_fetch_add(&q->write_waiters, 1, __ATOMIC_SEQ_CST);
+		memory_barrier();
+		ptr = mpmc_queue_writer_prepare(q);
+		rc = ptr ? 0 : queue_wait_park(&w, QUEUE_WAIT_HI(&q->free), TAIL_IDX);
+		__atomic_fetch_sub(&q->write_waiters, 1, __ATOMIC_RELAXED);
+		if (ptr != NULL) {
+			break;
+		}
+		if (rc < 0) {
+			return NULL;
+		}
+	}
+	return ptr;
+}
+
+void *mpmc_queuebatch_writer_wait(struct mpmc_queuebatch_writer *writer,
+				  int timeout_ms)
+{
+	QUEUE_ASSERT(writer != NULL, "Writer is NULL");
+	QUEUE_ASSERT(writer->queue != NULL, "Writer queue is NULL");
+
+	return mpmc_queue_writer_wait(writer->queue, timeout_ms);
 }
 
 // 消费者遍历数据
@@ -460,6 +500,73 @@ size_t mpmc_queuebatch_reader_prepare(struct mpmc_queuebatch_reader *reader,
 	return 0;
 }
 
+size_t mpmc_queue_reader_wait(struct mpmc_queue *q, struct reader_result *ret,
+			      int timeout_ms)
+{
+	QUEUE_ASSERT(q != NULL, "Queue is NULL");
+	QUEUE_ASSERT(ret != NULL, "Result is NULL");
+
+	struct queue_wait w;
+	size_t n;
+	int rc;
+
+	queue_wait_init(&w, timeout_ms, false);
+	while ((n = mpmc_queue_reader_prepare(q, ret)) == 0) {
+		if (queue_wait_spin(&w)) {
+			continue;
+		}
+
+		// 空队列的head是TAIL_IDX，写者提交后必然变化
+		__atomic_fetch_add(&q->read_waiters, 1, __ATOMIC_SEQ_CST);
+		memory_barrier();
+		n = mpmc_queue_reader_prepare(q, ret);
+		rc = n ? 0 : queue_wait_park(&w, &q->head, TAIL_IDX);
+		__atomic_fetch_sub(&q->read_waiters, 1, __ATOMIC_RELAXED);
+		if (n > 0) {
+			break;
+		}
+		if (rc < 0) {
+			return 0;
+		}
+	}
+	return n;
+}
+
+size_t mpmc_queuebatch_reader_wait(struct mpmc_queuebatch_reader *reader,
+				   struct reader_result *ret, int timeout_ms)
+{
+	QUEUE_ASSERT(reader != NULL, "Reader is NULL");
+	QUEUE_ASSERT(reader->queuebatch != NULL, "Queue batch is NULL");
+
+	struct mpmc_queuebatch *qs = reader->queuebatch;
+	struct queue_wait w;
+	uint32_t seq;
+	size_t n;
+	int rc;
+
+	queue_wait_init(&w, timeout_ms, false);
+	while ((n = mpmc_queuebatch_reader_prepare(reader, ret)) == 0) {
+		if (queue_wait_spin(&w)) {
+			continue;
+		}
+
+		// 先取序号再扫描，扫描之后的提交都会让序号变化
+		__atomic_fetch_add(&qs->read_waiters, 1, __ATOMIC_SEQ_CST);
+		memory_barrier();
+		seq = atomic_load(&qs->rseq);
+		n = mpmc_queuebatch_reader_prepare(reader, ret);
+		rc = n ? 0 : queue_wait_park(&w, &qs->rseq, seq);
+		__atomic_fetch_sub(&qs->read_waiters, 1, __ATOMIC_RELAXED);
+		if (n > 0) {
+			break;
+		}
+		if (rc < 0) {
+			return 0;
+		}
+	}
+	return n;
+}
+
 // 消费者提交已处理的数据
 void mpmc_queue_reader_commit(struct mpmc_queue *q, struct reader_result *res)
 {
@@ -487,12 +594,18 @@ void mpmc_queue_reader_commit(struct mpmc_queue *q, struct reader_result *res)
 		newf = ((uint64_t)idx << 32) | (seq + 1);
 
 		if (atomic_compare_exchange_weak(&q->free, &oldf, newf)) {
-			write_barrier();
-			return;
+			break;
 		}
 
 		cpu_relax();
 	}
+
+	// 归还了nmemb个节点，最多能满足同样多的写者
+	memory_barrier();
+	if (UNLIKELY(q->write_waiters != 0)) {
+		queue_wait_wake(QUEUE_WAIT_HI(&q->free), (int)res->nmemb,
+				false);
+	}
 }
 
 void mpmc_queuebatch_reader_commit(struct mpmc_queuebatch_reader *reader,
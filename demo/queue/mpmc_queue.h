@@ -74,9 +74,26 @@ int get_cpunum(void);
 // 数据结构前向声明
 struct mpmc_queue;
 struct mpmc_queuebatch;
-struct mpmc_queuebatch_reader;
-struct mpmc_queuebatch_writer;
-struct reader_result;
+struct item;
+
+// 以下结构由调用方分配
+struct mpmc_queuebatch_reader {
+	struct mpmc_queuebatch *queuebatch;
+	uint32_t queueid;
+};
+
+struct mpmc_queuebatch_writer {
+	struct mpmc_queuebatch *queuebatch;
+	struct mpmc_queue *queue;
+};
+
+struct reader_result {
+	struct mpmc_queue *q;
+	struct item *header;
+	struct item *tail;
+	struct item *curr;
+	size_t nmemb;
+};
 
 // 基本队列操作
 struct mpmc_queue *mpmc_queue_create(size_t nmemb, size_t size);
@@ -88,6 +105,12 @@ size_t mpmc_queue_reader_prepare(struct mpmc_queue *q,
 void *mpmc_queue_reader_next(struct reader_result *res);
 void mpmc_queue_reader_commit(struct mpmc_queue *q, struct reader_result *res);
 
+// 阻塞版本：自旋、让出CPU后挂在futex上，timeout_ms<0一直等待，
+// 超时返回NULL/0并置errno为ETIMEDOUT
+void *mpmc_queue_writer_wait(struct mpmc_queue *q, int timeout_ms);
+size_t mpmc_queue_reader_wait(struct mpmc_queue *q, struct reader_result *ret,
+			      int timeout_ms);
+
 // 批量队列操作
 struct mpmc_queuebatch *mpmc_queuebatch_create(size_t nmemb, size_t size);
 void mpmc_queuebatch_destroy(struct mpmc_queuebatch *qs);
@@ -103,6 +126,10 @@ size_t mpmc_queuebatch_reader_prepare(struct mpmc_queuebatch_reader *reader,
 void *mpmc_queuebatch_reader_next(struct reader_result *res);
 void mpmc_queuebatch_reader_commit(struct mpmc_queuebatch_reader *reader,
 				   struct reader_result *res);
+void *mpmc_queuebatch_writer_wait(struct mpmc_queuebatch_writer *writer,
+				  int timeout_ms);
+size_t mpmc_queuebatch_reader_wait(struct mpmc_queuebatch_reader *reader,
+				   struct reader_result *ret, int timeout_ms);
 
 // 工具函数
 bool mpmc_queue_empty(struct mpmc_queue *q);
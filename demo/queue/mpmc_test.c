@@ -32,8 +32,7 @@ void *read_thread(void *arg)
 	do {
 		size_t n = 0, i;
 		struct reader_result res;
-		if ((n = mpmc_queuebatch_reader_prepare(r, &res)) == 0) {
-			usleep(10);
+		if ((n = mpmc_queuebatch_reader_wait(r, &res, -1)) == 0) {
 			continue;
 		}
 
@@ -70,9 +69,8 @@ void *write_thread(void *ptr)
 	mpmc_queuebatch_writer_init(w, ring);
 
 	for (;;) {
-		if ((entry = (entry_t *)mpmc_queuebatch_writer_prepare(w)) ==
+		if ((entry = (entry_t *)mpmc_queuebatch_writer_wait(w, -1)) ==
 		    NULL) {
-			usleep(1);
 			continue;
 		}
 
@@ -0,0 +1,700 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "queue_bench.h"
+
+#define MAX_THREADS 64
+#define SPIN_LIMIT 128
+
+// 编译器优化
+#if defined(__GNUC__) || defined(__clang__)
+#define LIKELY(e) __builtin_expect(!!(e), 1)
+#define UNLIKELY(e) __builtin_expect(!!(e), 0)
+#else
+#define LIKELY(e) (e)
+#define UNLIKELY(e) (e)
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __asm__ volatile("pause\n" ::: "memory")
+#elif defined(__aarch64__) || defined(__arm__)
+#define cpu_relax() __asm__ volatile("yield\n" ::: "memory")
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+struct qmsg {
+	uint64_t tsc; // 发送时刻
+	uint32_t producer;
+	uint32_t seq;
+	char payload[];
+};
+
+struct config {
+	const struct qbench_ops *ops;
+	int producers;
+	int consumers;
+	size_t msg_size;
+	size_t batch; // 消费者每次最多读几条，0表示有多少读多少
+	size_t queue_size;
+	long msgs; // 每个生产者发送的条数
+	int rtt; // 0: 吞吐模式, 1: 往返延迟模式
+	int cpus[MAX_THREADS * 2];
+	int ncpus;
+	int json;
+};
+
+/* 对数-线性直方图：值的最高位决定组，组内再按随后5位均分，
+ * 相对误差不超过1/32。 */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+static int hist_index(uint64_t v)
+{
+	int e;
+
+	if (v < HIST_SUB) {
+		return (int)v;
+	}
+	e = 63 - __builtin_clzll(v);
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+	       (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_value(int idx)
+{
+	int e;
+
+	if (idx < HIST_SUB) {
+		return idx;
+	}
+	e = (idx >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	return (uint64_t)(HIST_SUB + (idx & (HIST_SUB - 1)))
+	       << (e - HIST_SUB_BITS);
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+	h->buckets[hist_index(v)]++;
+	h->count++;
+	if (v > h->max) {
+		h->max = v;
+	}
+}
+
+static void hist_merge(struct hist *dst, const struct hist *src)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+	dst->count += src->count;
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+}
+
+static uint64_t hist_percentile(const struct hist *h, double pct)
+{
+	uint64_t want = (uint64_t)(h->count * pct / 100.0), seen = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > want) {
+			return hist_value(i);
+		}
+	}
+	return h->max;
+}
+
+// 时间戳计数器，非x86平台用单调时钟的纳秒代替
+static inline uint64_t ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 每纳秒的tick数
+static double ticks_per_ns(void)
+{
+	static double ratio;
+	struct timespec nap = { 0, 20000000 };
+	uint64_t c0;
+	double t0;
+
+	if (ratio == 0) {
+		t0 = now();
+		c0 = ticks();
+		nanosleep(&nap, NULL);
+		ratio = (ticks() - c0) / ((now() - t0) * 1e9);
+	}
+	return ratio;
+}
+
+static inline void relax(int *spins)
+{
+	if (++*spins < SPIN_LIMIT) {
+		cpu_relax();
+	} else {
+		sched_yield();
+	}
+}
+
+/* 进程级的缓存未命中计数，inherit让之后创建的线程也计入，
+ * 线程退出时计数合并回来。没有权限时返回-1，结果里记为null。 */
+struct counters {
+	int fd[2]; // cache-misses, cache-references
+};
+
+static void counters_open(struct counters *c)
+{
+#ifdef __linux__
+	static const uint64_t cfg[2] = { PERF_COUNT_HW_CACHE_MISSES,
+					 PERF_COUNT_HW_CACHE_REFERENCES };
+	struct perf_event_attr attr;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = cfg[i];
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		c->fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+					0);
+		if (c->fd[i] >= 0) {
+			ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+#else
+	c->fd[0] = c->fd[1] = -1;
+#endif
+}
+
+static void counters_close(struct counters *c, long long *val)
+{
+	uint64_t v;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		val[i] = -1;
+		if (c->fd[i] < 0) {
+			continue;
+		}
+#ifdef __linux__
+		ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+#endif
+		if (read(c->fd[i], &v, sizeof(v)) == sizeof(v)) {
+			val[i] = (long long)v;
+		}
+		close(c->fd[i]);
+	}
+}
+
+struct thr {
+	pthread_t tid;
+	struct config *cfg;
+	void *q; // 吞吐模式的队列，往返模式的请求队列
+	void *q2; // 往返模式的回复队列
+	void *w2; // 往返模式里回复队列的写句柄
+	int id;
+	long got; // 消费者读到的条数
+	uint64_t sum; // 消费者读到的seq之和，用来校验
+	struct hist hist;
+	pthread_barrier_t *start;
+};
+
+static volatile long consumed; // 所有消费者读到的条数
+
+static void fill(struct qmsg *m, struct thr *t, uint32_t seq)
+{
+	size_t len = t->cfg->msg_size - sizeof(*m);
+
+	m->producer = t->id;
+	m->seq = seq;
+	if (len > 0) {
+		memset(m->payload, (char)seq, len);
+	}
+	m->tsc = ticks();
+}
+
+static void *producer(void *arg)
+{
+	struct thr *t = arg;
+	const struct qbench_ops *ops = t->cfg->ops;
+	void *w = ops->writer(t->q);
+	struct qmsg *m;
+	long i;
+	int spins;
+
+	pthread_barrier_wait(t->start);
+	for (i = 0; i < t->cfg->msgs; i++) {
+		spins = 0;
+		while ((m = ops->prepare(w, t->cfg->msg_size)) == NULL) {
+			relax(&spins);
+		}
+		fill(m, t, (uint32_t)i);
+		ops->commit(w, m);
+	}
+	if (ops->release) {
+		ops->release(w);
+	}
+	return NULL;
+}
+
+static void on_msg(void *msg, void *arg)
+{
+	struct thr *t = arg;
+	struct qmsg *m = msg;
+
+	hist_add(&t->hist, ticks() - m->tsc);
+	t->sum += m->seq;
+	t->got++;
+}
+
+static void *consumer(void *arg)
+{
+	struct thr *t = arg;
+	const struct qbench_ops *ops = t->cfg->ops;
+	long total = t->cfg->msgs * t->cfg->producers;
+	void *r = ops->reader(t->q);
+	size_t n;
+	int spins = 0;
+
+	pthread_barrier_wait(t->start);
+	while (__atomic_load_n(&consumed, __ATOMIC_RELAXED) < total) {
+		if ((n = ops->read(r, t->cfg->batch, on_msg, t)) == 0) {
+			relax(&spins);
+			continue;
+		}
+		spins = 0;
+		__atomic_fetch_add(&consumed, (long)n, __ATOMIC_RELAXED);
+	}
+	if (ops->release) {
+		ops->release(r);
+	}
+	return NULL;
+}
+
+// 往返模式：发送方的消息原样带着时间戳从回复队列回来
+static void on_ping(void *msg, void *arg)
+{
+	struct thr *t = arg;
+	const struct qbench_ops *ops = t->cfg->ops;
+	struct qmsg *m = msg, *echo;
+	int spins = 0;
+
+	while ((echo = ops->prepare(t->w2, t->cfg->msg_size)) == NULL) {
+		relax(&spins);
+	}
+	memcpy(echo, m, t->cfg->msg_size);
+	ops->commit(t->w2, echo);
+	t->got++;
+}
+
+static void *echo_thread(void *arg)
+{
+	struct thr *t = arg;
+	const struct qbench_ops *ops = t->cfg->ops;
+	void *r = ops->reader(t->q);
+	int spins = 0;
+
+	t->w2 = ops->writer(t->q2);
+	pthread_barrier_wait(t->start);
+	while (t->got < t->cfg->msgs) {
+		if (ops->read(r, t->cfg->batch, on_ping, t) == 0) {
+			relax(&spins);
+		} else {
+			spins = 0;
+		}
+	}
+	if (ops->release) {
+		ops->release(r);
+		ops->release(t->w2);
+	}
+	return NULL;
+}
+
+static void *ping_thread(void *arg)
+{
+	struct thr *t = arg;
+	const struct qbench_ops *ops = t->cfg->ops;
+	void *w = ops->writer(t->q), *r = ops->reader(t->q2);
+	struct qmsg *m;
+	long i;
+	int spins;
+
+	pthread_barrier_wait(t->start);
+	for (i = 0; i < t->cfg->msgs; i++) {
+		spins = 0;
+		while ((m = ops->prepare(w, t->cfg->msg_size)) == NULL) {
+			relax(&spins);
+		}
+		fill(m, t, (uint32_t)i);
+		ops->commit(w, m);
+
+		spins = 0;
+		while (ops->read(r, 1, on_msg, t) == 0) {
+			relax(&spins);
+		}
+	}
+	if (ops->release) {
+		ops->release(w);
+		ops->release(r);
+	}
+	return NULL;
+}
+
+static int spawn(struct thr *t, void *(*fn)(void *), struct config *cfg,
+		 int slot)
+{
+	pthread_attr_t attr;
+	int rc;
+
+	pthread_attr_init(&attr);
+#ifdef __linux__
+	if (cfg->ncpus > 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cfg->cpus[slot % cfg->ncpus], &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+#else
+	(void)slot;
+#endif
+	rc = pthread_create(&t->tid, &attr, fn, t);
+	pthread_attr_destroy(&attr);
+	return rc;
+}
+
+static void report(struct config *cfg, double secs, long msgs,
+		   struct hist *h, long long *cnt, long errors)
+{
+	static int header;
+	double tpn = ticks_per_ns();
+	const char *mode = cfg->rtt ? "rtt" : "tput";
+	int prod = cfg->rtt ? 1 : cfg->producers;
+	int cons = cfg->rtt ? 1 : cfg->consumers;
+
+	if (cfg->json) {
+		printf("{\"queue\":\"%s\",\"mode\":\"%s\",\"producers\":%d,"
+		       "\"consumers\":%d,\"msg_size\":%zu,\"batch\":%zu,"
+		       "\"queue_size\":%zu,\"msgs\":%ld,\"seconds\":%.6f,"
+		       "\"msgs_per_sec\":%.0f,\"lat_p50_ns\":%.0f,"
+		       "\"lat_p99_ns\":%.0f,\"lat_p999_ns\":%.0f,"
+		       "\"lat_max_ns\":%.0f,",
+		       cfg->ops->name, mode, prod, cons,
+		       cfg->msg_size, cfg->batch, cfg->queue_size, msgs, secs,
+		       msgs / secs, hist_percentile(h, 50) / tpn,
+		       hist_percentile(h, 99) / tpn,
+		       hist_percentile(h, 99.9) / tpn, h->max / tpn);
+		if (cnt[0] >= 0) {
+			printf("\"cache_misses\":%lld,", cnt[0]);
+		} else {
+			printf("\"cache_misses\":null,");
+		}
+		if (cnt[1] >= 0) {
+			printf("\"cache_refs\":%lld,", cnt[1]);
+		} else {
+			printf("\"cache_refs\":null,");
+		}
+		printf("\"errors\":%ld}\n", errors);
+		return;
+	}
+
+	if (!header++) {
+		printf("%6s %5s %4s %4s %6s %5s %12s %9s %9s %9s %9s %10s %6s\n",
+		       "queue", "mode", "prod", "cons", "size", "batch",
+		       "msgs/s", "p50 ns", "p99 ns", "p999 ns", "max ns",
+		       "miss/msg", "errors");
+	}
+	printf("%6s %5s %4d %4d %6zu %5zu %12.0f %9.0f %9.0f %9.0f %9.0f ",
+	       cfg->ops->name, mode, prod, cons,
+	       cfg->msg_size, cfg->batch, msgs / secs,
+	       hist_percentile(h, 50) / tpn, hist_percentile(h, 99) / tpn,
+	       hist_percentile(h, 99.9) / tpn, h->max / tpn);
+	if (cnt[0] >= 0) {
+		printf("%10.2f ", (double)cnt[0] / msgs);
+	} else {
+		printf("%10s ", "n/a");
+	}
+	printf("%6ld\n", errors);
+}
+
+static int run(struct config *cfg)
+{
+	const struct qbench_ops *ops = cfg->ops;
+	int nthr = cfg->rtt ? 2 : cfg->producers + cfg->consumers;
+	struct thr *thr = calloc(nthr, sizeof(*thr));
+	struct hist *total = calloc(1, sizeof(*total));
+	pthread_barrier_t start;
+	struct counters ctr;
+	long long cnt[2];
+	void *q, *q2 = NULL;
+	long msgs, errors = 0;
+	uint64_t sum = 0, want;
+	double t0, t1;
+	int i;
+
+	q = ops->create(cfg->queue_size, cfg->msg_size);
+	if (cfg->rtt) {
+		q2 = ops->create(cfg->queue_size, cfg->msg_size);
+	}
+	if (thr == NULL || total == NULL || q == NULL ||
+	    (cfg->rtt && q2 == NULL)) {
+		perror(ops->name);
+		return 1;
+	}
+
+	consumed = 0;
+	pthread_barrier_init(&start, NULL, nthr + 1);
+	counters_open(&ctr);
+	for (i = 0; i < nthr; i++) {
+		thr[i].cfg = cfg;
+		thr[i].q = q;
+		thr[i].q2 = q2;
+		thr[i].start = &start;
+		if (cfg->rtt) {
+			thr[i].id = 0;
+			spawn(&thr[i], i == 0 ? ping_thread : echo_thread, cfg,
+			      i);
+		} else {
+			thr[i].id = i < cfg->producers ? i : i - cfg->producers;
+			spawn(&thr[i], i < cfg->producers ? producer : consumer,
+			      cfg, i);
+		}
+	}
+	pthread_barrier_wait(&start);
+	t0 = now();
+	for (i = 0; i < nthr; i++) {
+		pthread_join(thr[i].tid, NULL);
+	}
+	t1 = now() - t0;
+	counters_close(&ctr, cnt);
+	pthread_barrier_destroy(&start);
+
+	// 吞吐模式的延迟是单程的，往返模式只统计发送方收到的回复
+	if (cfg->rtt) {
+		msgs = cfg->msgs;
+		hist_merge(total, &thr[0].hist);
+		sum = thr[0].sum;
+		want = (uint64_t)msgs * (msgs - 1) / 2;
+		errors = thr[0].got != msgs;
+	} else {
+		msgs = cfg->msgs * cfg->producers;
+		for (i = cfg->producers; i < nthr; i++) {
+			hist_merge(total, &thr[i].hist);
+			sum += thr[i].sum;
+			errors += thr[i].got;
+		}
+		errors = errors != msgs;
+		want = (uint64_t)cfg->producers * cfg->msgs * (cfg->msgs - 1) /
+		       2;
+	}
+	if (sum != want) {
+		errors++;
+	}
+	report(cfg, t1, msgs, total, cnt, errors);
+
+	ops->destroy(q);
+	if (q2) {
+		ops->destroy(q2);
+	}
+	free(total);
+	free(thr);
+	return errors != 0;
+}
+
+static const struct qbench_ops *find_ops(const char *name, size_t len)
+{
+	static const struct qbench_ops *all[] = {
+		&qbench_spsc, &qbench_mpmc, &qbench_mpmc_batch, &qbench_ring
+	};
+	int i;
+
+	for (i = 0; i < (int)(sizeof(all) / sizeof(all[0])); i++) {
+		if (strlen(all[i]->name) == len &&
+		    strncmp(all[i]->name, name, len) == 0) {
+			return all[i];
+		}
+	}
+	return NULL;
+}
+
+// "0,2,4-7"
+static int parse_cpus(struct config *cfg, const char *s)
+{
+	char *end;
+	long a, b;
+
+	cfg->ncpus = 0;
+	while (*s != '\0') {
+		a = strtol(s, &end, 10);
+		b = a;
+		if (*end == '-') {
+			b = strtol(end + 1, &end, 10);
+		}
+		if (end == s || a < 0 || b < a) {
+			return -1;
+		}
+		for (; a <= b && cfg->ncpus < MAX_THREADS * 2; a++) {
+			cfg->cpus[cfg->ncpus++] = (int)a;
+		}
+		s = *end == ',' ? end + 1 : end;
+		if (*end != ',' && *end != '\0') {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-q queues] [-m tput|rtt|both] [-p producers] "
+		"[-c consumers]\n"
+		"          [-s msg size] [-b batch] [-Q queue size] "
+		"[-n msgs] [-C cpus] [-j]\n"
+		"  -q  spsc,mpmc,mpmcb,ring or all (default all)\n"
+		"  -b  max messages per reader_prepare, 0 = all available\n"
+		"  -n  messages per producer (default 1000000)\n"
+		"  -C  pin threads round-robin to a cpu list, e.g. 0,2,4-7\n"
+		"  -j  one JSON object per run instead of a table\n",
+		prog);
+}
+
+/* 每种队列跑一遍吞吐模式和/或往返模式。spsc和ring只支持单生产者
+ * 单消费者，给了更多线程时跳过。 */
+int main(int argc, char *argv[])
+{
+	struct config cfg;
+	const char *queues = "all", *mode = "both", *p;
+	int opt, rc = 0, m;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.producers = 1;
+	cfg.consumers = 1;
+	cfg.msg_size = 64;
+	cfg.queue_size = 4096;
+	cfg.msgs = 1000000;
+
+	while ((opt = getopt(argc, argv, "q:m:p:c:s:b:Q:n:C:jh")) != -1) {
+		switch (opt) {
+		case 'q':
+			queues = optarg;
+			break;
+		case 'm':
+			mode = optarg;
+			break;
+		case 'p':
+			cfg.producers = atoi(optarg);
+			break;
+		case 'c':
+			cfg.consumers = atoi(optarg);
+			break;
+		case 's':
+			cfg.msg_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			cfg.batch = strtoul(optarg, NULL, 10);
+			break;
+		case 'Q':
+			cfg.queue_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			cfg.msgs = atol(optarg);
+			break;
+		case 'C':
+			if (parse_cpus(&cfg, optarg) != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'j':
+			cfg.json = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt != 'h';
+		}
+	}
+	if (cfg.producers < 1 || cfg.consumers < 1 ||
+	    cfg.producers + cfg.consumers > MAX_THREADS ||
+	    cfg.msg_size < sizeof(struct qmsg) || cfg.queue_size < 2 ||
+	    cfg.msgs < 1 || cfg.msgs > UINT32_MAX ||
+	    (strcmp(mode, "tput") && strcmp(mode, "rtt") &&
+	     strcmp(mode, "both"))) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (strcmp(queues, "all") == 0) {
+		queues = "spsc,mpmc,mpmcb,ring";
+	}
+
+	ticks_per_ns();
+	for (p = queues; *p != '\0'; p += strcspn(p, ","), p += *p == ',') {
+		cfg.ops = find_ops(p, strcspn(p, ","));
+		if (cfg.ops == NULL) {
+			fprintf(stderr, "unknown queue: %.*s\n",
+				(int)strcspn(p, ","), p);
+			return 1;
+		}
+		for (m = 0; m < 2; m++) {
+			if ((m == 0 && strcmp(mode, "rtt") == 0) ||
+			    (m == 1 && strcmp(mode, "tput") == 0)) {
+				continue;
+			}
+			if (m == 0 && ((cfg.producers > 1 &&
+					!cfg.ops->multi_producer) ||
+				       (cfg.consumers > 1 &&
+					!cfg.ops->multi_consumer))) {
+				continue;
+			}
+			cfg.rtt = m;
+			rc |= run(&cfg);
+		}
+	}
+	return rc;
+}
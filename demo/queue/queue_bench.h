@@ -0,0 +1,40 @@
+/**
+ * 统一的队列基准测试接口
+ *
+ * 三种队列的头文件各自定义了struct reader_result，不能放进同一个编译单元，
+ * 每种队列在自己的queue_bench_*.c里实现一组qbench_ops，驱动程序只看到这里
+ * 的void *接口。
+ */
+#ifndef QUEUE_BENCH_H
+#define QUEUE_BENCH_H
+
+#include <stddef.h>
+
+typedef void (*qbench_fn)(void *msg, void *arg);
+
+struct qbench_ops {
+	const char *name;
+	int multi_producer; // 是否允许多个生产者
+	int multi_consumer; // 是否允许多个消费者
+
+	void *(*create)(size_t nmemb, size_t msg_size);
+	void (*destroy)(void *q);
+
+	// 每个线程的读写句柄，release为NULL时句柄就是队列本身
+	void *(*writer)(void *q);
+	void *(*reader)(void *q);
+	void (*release)(void *handle);
+
+	// 队列满时返回NULL
+	void *(*prepare)(void *writer, size_t size);
+	void (*commit)(void *writer, void *ptr);
+	// 最多读batch条（0表示不限），每条调用一次fn，返回读到的条数
+	size_t (*read)(void *reader, size_t batch, qbench_fn fn, void *arg);
+};
+
+extern const struct qbench_ops qbench_spsc;
+extern const struct qbench_ops qbench_mpmc;
+extern const struct qbench_ops qbench_mpmc_batch;
+extern const struct qbench_ops qbench_ring;
+
+#endif // QUEUE_BENCH_H
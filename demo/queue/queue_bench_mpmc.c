@@ -0,0 +1,130 @@
+#include <stdlib.h>
+
+#include "mpmc_queue.h"
+#include "queue_bench.h"
+
+static void *mpmc_create(size_t nmemb, size_t msg_size)
+{
+	return mpmc_queue_create(nmemb, msg_size);
+}
+
+static void mpmc_destroy(void *q)
+{
+	mpmc_queue_destroy(q);
+}
+
+static void *mpmc_handle(void *q)
+{
+	return q;
+}
+
+static void *mpmc_prepare(void *w, size_t size)
+{
+	(void)size;
+	return mpmc_queue_writer_prepare(w);
+}
+
+static void mpmc_commit(void *w, void *ptr)
+{
+	mpmc_queue_writer_commit(w, ptr);
+}
+
+// 读者一次摘走整条链表，提交时整条还给空闲链表，batch对它不起作用
+static size_t mpmc_read(void *r, size_t batch, qbench_fn fn, void *arg)
+{
+	struct reader_result res;
+	size_t n, i;
+
+	(void)batch;
+	if ((n = mpmc_queue_reader_prepare(r, &res)) == 0) {
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		fn(mpmc_queue_reader_next(&res), arg);
+	}
+	mpmc_queue_reader_commit(r, &res);
+	return n;
+}
+
+const struct qbench_ops qbench_mpmc = {
+	.name = "mpmc",
+	.multi_producer = 1,
+	.multi_consumer = 1,
+	.create = mpmc_create,
+	.destroy = mpmc_destroy,
+	.writer = mpmc_handle,
+	.reader = mpmc_handle,
+	.release = NULL,
+	.prepare = mpmc_prepare,
+	.commit = mpmc_commit,
+	.read = mpmc_read,
+};
+
+static void *batch_create(size_t nmemb, size_t msg_size)
+{
+	return mpmc_queuebatch_create(nmemb, msg_size);
+}
+
+static void batch_destroy(void *q)
+{
+	mpmc_queuebatch_destroy(q);
+}
+
+static void *batch_writer(void *q)
+{
+	struct mpmc_queuebatch_writer *w = malloc(sizeof(*w));
+	if (w != NULL) {
+		mpmc_queuebatch_writer_init(w, q);
+	}
+	return w;
+}
+
+static void *batch_reader(void *q)
+{
+	struct mpmc_queuebatch_reader *r = malloc(sizeof(*r));
+	if (r != NULL) {
+		mpmc_queuebatch_reader_init(r, q);
+	}
+	return r;
+}
+
+static void *batch_prepare(void *w, size_t size)
+{
+	(void)size;
+	return mpmc_queuebatch_writer_prepare(w);
+}
+
+static void batch_commit(void *w, void *ptr)
+{
+	mpmc_queuebatch_writer_commit(w, ptr);
+}
+
+static size_t batch_read(void *r, size_t batch, qbench_fn fn, void *arg)
+{
+	struct reader_result res;
+	size_t n, i;
+
+	(void)batch;
+	if ((n = mpmc_queuebatch_reader_prepare(r, &res)) == 0) {
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		fn(mpmc_queuebatch_reader_next(&res), arg);
+	}
+	mpmc_queuebatch_reader_commit(r, &res);
+	return n;
+}
+
+const struct qbench_ops qbench_mpmc_batch = {
+	.name = "mpmcb",
+	.multi_producer = 1,
+	.multi_consumer = 1,
+	.create = batch_create,
+	.destroy = batch_destroy,
+	.writer = batch_writer,
+	.reader = batch_reader,
+	.release = free,
+	.prepare = batch_prepare,
+	.commit = batch_commit,
+	.read = batch_read,
+};
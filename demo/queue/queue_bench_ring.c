@@ -0,0 +1,62 @@
+#include "ringbuffer.h"
+#include "queue_bench.h"
+
+// 每条消息在环里占用对齐到缓存行的空间，按nmemb条最大消息分配
+static void *ring_create(size_t nmemb, size_t msg_size)
+{
+	size_t slot = (msg_size + sizeof(uint32_t) + CACHE_LINE_SIZE - 1) &
+		      ~(size_t)(CACHE_LINE_SIZE - 1);
+	return ringbuffer_create(nmemb * slot, msg_size);
+}
+
+static void ring_destroy(void *q)
+{
+	ringbuffer_destroy(q);
+}
+
+static void *ring_handle(void *q)
+{
+	return q;
+}
+
+static void *ring_prepare(void *w, size_t size)
+{
+	return ringbuffer_writer_prepare(w, size);
+}
+
+static void ring_commit(void *w, void *ptr)
+{
+	ringbuffer_writer_commit(w, ptr);
+}
+
+static size_t ring_read(void *r, size_t batch, qbench_fn fn, void *arg)
+{
+	struct reader_result res;
+	size_t n = 0;
+	void *msg;
+
+	if (!ringbuffer_reader_prepare(r, &res)) {
+		return 0;
+	}
+	while ((batch == 0 || n < batch) &&
+	       (msg = ringbuffer_result_next(&res, NULL)) != NULL) {
+		fn(msg, arg);
+		n++;
+	}
+	ringbuffer_reader_commit(r, &res);
+	return n;
+}
+
+const struct qbench_ops qbench_ring = {
+	.name = "ring",
+	.multi_producer = 0,
+	.multi_consumer = 0,
+	.create = ring_create,
+	.destroy = ring_destroy,
+	.writer = ring_handle,
+	.reader = ring_handle,
+	.release = NULL,
+	.prepare = ring_prepare,
+	.commit = ring_commit,
+	.read = ring_read,
+};
@@ -0,0 +1,61 @@
+#include "spsc_queue.h"
+#include "queue_bench.h"
+
+static void *spsc_create(size_t nmemb, size_t msg_size)
+{
+	return squeue_create(nmemb, msg_size);
+}
+
+static void spsc_destroy(void *q)
+{
+	squeue_destroy(q);
+}
+
+static void *spsc_handle(void *q)
+{
+	return q;
+}
+
+static void *spsc_prepare(void *w, size_t size)
+{
+	(void)size;
+	return squeue_writer_prepare(w);
+}
+
+static void spsc_commit(void *w, void *ptr)
+{
+	squeue_writer_commit(w, ptr);
+}
+
+static size_t spsc_read(void *r, size_t batch, qbench_fn fn, void *arg)
+{
+	struct reader_result res;
+	size_t n, i;
+
+	if ((n = squeue_reader_prepare(r, &res)) == 0) {
+		return 0;
+	}
+	// 只提交读过的部分，剩下的下次再读
+	if (batch > 0 && n > batch) {
+		n = batch;
+	}
+	for (i = 0; i < n; i++) {
+		fn(squeue_result_next(&res), arg);
+	}
+	squeue_reader_commit(r, &res);
+	return n;
+}
+
+const struct qbench_ops qbench_spsc = {
+	.name = "spsc",
+	.multi_producer = 0,
+	.multi_consumer = 0,
+	.create = spsc_create,
+	.destroy = spsc_destroy,
+	.writer = spsc_handle,
+	.reader = spsc_handle,
+	.release = NULL,
+	.prepare = spsc_prepare,
+	.commit = spsc_commit,
+	.read = spsc_read,
+};
@@ -0,0 +1,135 @@
+/**
+ * 跨进程队列的共享内存映射和对端进程检测
+ *
+ * 队列控制块里只有位置计数和偏移，没有指针，整个队列可以直接放进
+ * memfd_create()/shm_open()得到的映射里，各进程映射到不同地址也能用。
+ * 控制块记录两端进程的pid，0表示还没有连上，-1表示已经正常断开。
+ * pid可能被复用，kill(pid, 0)只能发现对端已经不在，不能证明它还在。
+ */
+#ifndef QUEUE_SHM_H
+#define QUEUE_SHM_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#define QUEUE_SHM_DETACHED (-1)
+
+#ifndef _WIN32
+// 映射fd，create时先把文件扩展到size，否则size为0时取文件大小
+static inline void *queue_shm_map(int fd, size_t *size, bool create)
+{
+	struct stat st;
+	void *ptr;
+
+	if (create) {
+		if (ftruncate(fd, (off_t)*size) != 0) {
+			return NULL;
+		}
+	} else {
+		if (fstat(fd, &st) != 0) {
+			return NULL;
+		}
+		*size = (size_t)st.st_size;
+		if (*size == 0) {
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+	ptr = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static inline void queue_shm_unmap(void *ptr, size_t size)
+{
+	munmap(ptr, size);
+}
+
+static inline bool queue_shm_pid_alive(int32_t pid)
+{
+	if (pid == 0) {
+		return true; // 还没连上，不算断开
+	}
+	if (pid < 0) {
+		return false;
+	}
+	if (kill((pid_t)pid, 0) != 0 && errno != EPERM) {
+		return false;
+	}
+#ifdef __linux__
+	// 父进程还没回收的僵尸进程kill()仍然成功，从/proc里看状态
+	char path[32], buf[256], *p;
+	FILE *fp;
+	size_t n;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if ((fp = fopen(path, "r")) != NULL) {
+		n = fread(buf, 1, sizeof(buf) - 1, fp);
+		fclose(fp);
+		buf[n] = '\0';
+		// 进程名可能含空格和括号，状态在最后一个')'之后
+		if ((p = strrchr(buf, ')')) != NULL && p[1] == ' ' &&
+		    (p[2] == 'Z' || p[2] == 'X')) {
+			return false;
+		}
+	}
+#endif
+	return true;
+}
+
+// 占用一端，原来的进程已经退出时允许接管
+static inline int queue_shm_claim(volatile int32_t *slot)
+{
+	int32_t old = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	int32_t self = (int32_t)getpid();
+
+	for (;;) {
+		if (old > 0 && old != self && queue_shm_pid_alive(old)) {
+			errno = EBUSY;
+			return -1;
+		}
+		if (__atomic_compare_exchange_n(slot, &old, self, 0,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			return 0;
+		}
+	}
+}
+
+// 对端：本进程占用的是哪一端就检查另一端，同一进程占两端时检查读端
+static inline bool queue_shm_peer_alive(volatile int32_t *pids)
+{
+	int32_t self = (int32_t)getpid();
+	int32_t peer = __atomic_load_n(&pids[0], __ATOMIC_ACQUIRE) == self ?
+			       __atomic_load_n(&pids[1], __ATOMIC_ACQUIRE) :
+			       __atomic_load_n(&pids[0], __ATOMIC_ACQUIRE);
+
+	return queue_shm_pid_alive(peer);
+}
+
+static inline void queue_shm_release(volatile int32_t *pids)
+{
+	int32_t self = (int32_t)getpid();
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		int32_t expected = self;
+		__atomic_compare_exchange_n(&pids[i], &expected,
+					    QUEUE_SHM_DETACHED, 0,
+					    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	}
+}
+#endif
+
+#endif // QUEUE_SHM_H
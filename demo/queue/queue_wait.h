@@ -0,0 +1,172 @@
+/**
+ * 队列的自适应等待 - 先自旋，再让出CPU，最后挂在futex上睡眠
+ *
+ * 等待方在挂起前登记waiters计数并复查队列状态，提交方更新位置后
+ * 只有看到waiters非零才发起唤醒系统调用。futex等待的是队列自身的
+ * 位置字（64位位置取低32位），位置一旦变化内核就不会让等待方睡下去。
+ */
+#ifndef QUEUE_WAIT_H
+#define QUEUE_WAIT_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sched.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// 自旋次数，超过后改为sched_yield()
+#ifndef QUEUE_SPIN_COUNT
+#define QUEUE_SPIN_COUNT 128
+#endif
+
+// 让出CPU的次数，超过后挂起
+#ifndef QUEUE_YIELD_COUNT
+#define QUEUE_YIELD_COUNT 4
+#endif
+
+#ifndef cpu_relax
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __asm__ volatile("pause\n" ::: "memory")
+#elif defined(__aarch64__) || defined(__arm__)
+#define cpu_relax() __asm__ volatile("yield\n" ::: "memory")
+#else
+#define cpu_relax() ((void)0)
+#endif
+#endif
+
+// 64位位置计数器的低/高32位，futex只能等待32位的字
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define QUEUE_WAIT_LO(pos) ((volatile uint32_t *)(pos) + 1)
+#define QUEUE_WAIT_HI(pos) ((volatile uint32_t *)(pos))
+#else
+#define QUEUE_WAIT_LO(pos) ((volatile uint32_t *)(pos))
+#define QUEUE_WAIT_HI(pos) ((volatile uint32_t *)(pos) + 1)
+#endif
+
+// 跨进程队列每次最多睡这么久，醒来检查对端进程是否还活着
+#ifndef QUEUE_WAIT_SLICE_MS
+#define QUEUE_WAIT_SLICE_MS 100
+#endif
+
+struct queue_wait {
+	int spins;
+	int timeout_ms; // <0 表示一直等待
+	bool shared; // 队列在跨进程共享内存中
+	struct timespec deadline;
+};
+
+static inline void queue_wait_init(struct queue_wait *w, int timeout_ms,
+				   bool shared)
+{
+	w->spins = 0;
+	w->timeout_ms = timeout_ms;
+	w->shared = shared;
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &w->deadline);
+		w->deadline.tv_sec += timeout_ms / 1000;
+		w->deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+		if (w->deadline.tv_nsec >= 1000000000) {
+			w->deadline.tv_sec++;
+			w->deadline.tv_nsec -= 1000000000;
+		}
+	}
+}
+
+// 自旋/让出阶段返回true，调用方应重新检查队列；返回false时该挂起了
+static inline bool queue_wait_spin(struct queue_wait *w)
+{
+	if (w->timeout_ms == 0) {
+		return false;
+	}
+	if (w->spins < QUEUE_SPIN_COUNT) {
+		cpu_relax();
+	} else if (w->spins < QUEUE_SPIN_COUNT + QUEUE_YIELD_COUNT) {
+		sched_yield();
+	} else {
+		return false;
+	}
+	w->spins++;
+	return true;
+}
+
+// 剩余等待时间，已超时返回false
+static inline bool queue_wait_remain(struct queue_wait *w,
+				     struct timespec *ts)
+{
+	struct timespec now;
+
+	if (w->timeout_ms == 0) {
+		return false;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ts->tv_sec = w->deadline.tv_sec - now.tv_sec;
+	ts->tv_nsec = w->deadline.tv_nsec - now.tv_nsec;
+	if (ts->tv_nsec < 0) {
+		ts->tv_sec--;
+		ts->tv_nsec += 1000000000;
+	}
+	return ts->tv_sec >= 0;
+}
+
+// *word仍等于val时睡眠，被唤醒、值已变化或被信号打断返回0，超时返回-1
+static inline int queue_wait_park(struct queue_wait *w,
+				  volatile uint32_t *word, uint32_t val)
+{
+	struct timespec ts, *tsp = NULL;
+	bool sliced = false;
+
+	if (w->timeout_ms >= 0) {
+		if (!queue_wait_remain(w, &ts)) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		tsp = &ts;
+	}
+	if (w->shared &&
+	    (tsp == NULL ||
+	     ts.tv_sec * 1000 + ts.tv_nsec / 1000000 >= QUEUE_WAIT_SLICE_MS)) {
+		ts.tv_sec = QUEUE_WAIT_SLICE_MS / 1000;
+		ts.tv_nsec = (long)(QUEUE_WAIT_SLICE_MS % 1000) * 1000000;
+		tsp = &ts;
+		sliced = true;
+	}
+#ifdef __linux__
+	if (syscall(SYS_futex, word, w->shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE,
+		    val, tsp, NULL, 0) == -1 &&
+	    errno == ETIMEDOUT && !sliced) {
+		return -1;
+	}
+#else
+	// 没有futex的平台退化为短暂睡眠后重新检查
+	struct timespec nap = { 0, 50000 };
+	(void)word;
+	(void)val;
+	(void)sliced;
+	if (tsp != NULL && tsp->tv_sec == 0 && tsp->tv_nsec < nap.tv_nsec) {
+		nap.tv_nsec = tsp->tv_nsec;
+	}
+	nanosleep(&nap, NULL);
+#endif
+	return 0;
+}
+
+static inline void queue_wait_wake(volatile uint32_t *word, int n,
+				   bool shared)
+{
+#ifdef __linux__
+	syscall(SYS_futex, word, shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, n,
+		NULL, NULL, 0);
+#else
+	(void)word;
+	(void)n;
+	(void)shared;
+#endif
+}
+
+#endif // QUEUE_WAIT_H
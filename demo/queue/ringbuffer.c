@@ -1,4 +1,6 @@
 #include "ringbuffer.h"
+#include "queue_shm.h"
+#include "queue_wait.h"
 
 #include <string.h>
 #include <errno.h>
@@ -24,24 +26,24 @@ struct item {
 	char contents[];
 };
 
+#define RINGBUFFER_SHM_MAGIC 0x52494e47 // "RING"
+
 struct ringbuffer {
+	uint32_t magic; // 共享内存缓冲区为RINGBUFFER_SHM_MAGIC，进程内为0
+	volatile int32_t pids[2]; // 共享缓冲区两端的进程
+	size_t map_size; // 共享映射的大小
 	size_t size; // 缓冲区总大小（必须是2的幂）
 	size_t max_msg_size; // 最大消息大小
 	size_t mask; // 用于模运算的掩码
 
 	ALIGNED(CACHE_LINE_SIZE) volatile aligned_uint64_t write_pos;
+	volatile uint32_t read_waiters; // 挂在write_pos上的读者数
 	ALIGNED(CACHE_LINE_SIZE) volatile aligned_uint64_t read_pos;
+	volatile uint32_t write_waiters; // 挂在read_pos上的写者数
 
 	char buffer[]; // 柔性数组，实际缓冲区
 };
 
-struct reader_result {
-	struct ringbuffer *ring;
-	uint64_t start_pos;
-	uint64_t end_pos;
-	uint64_t current_pos;
-};
-
 // 工具函数：计算大于等于输入的最小2的幂
 static FORCE_INLINE uint32_t next_power_of_2(uint32_t n)
 {
@@ -74,31 +76,54 @@ static FORCE_INLINE size_t total_message_size(size_t data_size)
 #define ITEM_AT_POS(ring, pos) \
 	((struct item *)((ring)->buffer + WRAP_POSITION(ring, pos)))
 
-struct ringbuffer *ringbuffer_create(size_t size, size_t max_msg_size)
+// 检查参数并计算总大小，失败返回0并设置errno
+static size_t ringbuffer_total_size(size_t *size, size_t max_msg_size)
 {
-	struct ringbuffer *ring = NULL;
 	size_t total_size, buffer_size;
 
 	// 参数检查
-	if (size == 0 || max_msg_size == 0) {
+	if (*size == 0 || max_msg_size == 0) {
 		errno = EINVAL;
-		return NULL;
+		return 0;
 	}
 
 	// 确保缓冲区大小是2的幂
-	size = next_power_of_2(size);
-	if (size < max_msg_size + sizeof(struct item)) {
+	*size = next_power_of_2(*size);
+	if (*size < max_msg_size + sizeof(struct item)) {
 		errno = EINVAL; // 缓冲区太小
-		return NULL;
+		return 0;
 	}
 
 	// 计算总分配大小
-	buffer_size = align_to_cache_line(size);
-	total_size = sizeof(*ring) + buffer_size;
+	buffer_size = align_to_cache_line(*size);
+	total_size = sizeof(struct ringbuffer) + buffer_size;
 
 	// 检查溢出
-	if (total_size < sizeof(*ring)) {
+	if (total_size < sizeof(struct ringbuffer)) {
 		errno = EOVERFLOW;
+		return 0;
+	}
+	return total_size;
+}
+
+static void ringbuffer_init(struct ringbuffer *ring, size_t size,
+			    size_t max_msg_size)
+{
+	ring->size = size;
+	ring->max_msg_size = max_msg_size;
+	ring->mask = size - 1;
+
+	atomic_store(&ring->write_pos, 0);
+	atomic_store(&ring->read_pos, 0);
+}
+
+struct ringbuffer *ringbuffer_create(size_t size, size_t max_msg_size)
+{
+	struct ringbuffer *ring = NULL;
+	size_t total_size;
+
+	total_size = ringbuffer_total_size(&size, max_msg_size);
+	if (total_size == 0) {
 		return NULL;
 	}
 
@@ -109,22 +134,101 @@ struct ringbuffer *ringbuffer_create(size_t size, size_t max_msg_size)
 		return NULL;
 	}
 
-	ring->size = size;
-	ring->max_msg_size = max_msg_size;
-	ring->mask = size - 1;
-
-	atomic_store(&ring->write_pos, 0);
-	atomic_store(&ring->read_pos, 0);
+	ringbuffer_init(ring, size, max_msg_size);
 
 	memory_barrier();
 	return ring;
 }
 
+#ifndef _WIN32
+struct ringbuffer *ringbuffer_create_shm(int fd, size_t size,
+					 size_t max_msg_size, int role)
+{
+	struct ringbuffer *ring;
+	size_t total_size;
+
+	if (role != RINGBUFFER_WRITER && role != RINGBUFFER_READER) {
+		errno = EINVAL;
+		return NULL;
+	}
+	total_size = ringbuffer_total_size(&size, max_msg_size);
+	if (total_size == 0) {
+		return NULL;
+	}
+
+	// ftruncate()扩展出来的部分全是0，不用再清零
+	ring = (struct ringbuffer *)queue_shm_map(fd, &total_size, true);
+	if (UNLIKELY(ring == NULL)) {
+		return NULL;
+	}
+
+	ringbuffer_init(ring, size, max_msg_size);
+	ring->map_size = total_size;
+	ring->pids[role] = (int32_t)getpid();
+
+	// 魔数最后写入，对端看到魔数时其余字段已经就绪
+	__atomic_store_n(&ring->magic, RINGBUFFER_SHM_MAGIC, __ATOMIC_RELEASE);
+	return ring;
+}
+
+struct ringbuffer *ringbuffer_attach_shm(int fd, int role)
+{
+	struct ringbuffer *ring;
+	size_t map_size = 0;
+
+	if (role != RINGBUFFER_WRITER && role != RINGBUFFER_READER) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ring = (struct ringbuffer *)queue_shm_map(fd, &map_size, false);
+	if (UNLIKELY(ring == NULL)) {
+		return NULL;
+	}
+
+	// 校验控制块，防止映射到不相干的文件或者还没初始化完的缓冲区
+	if (map_size < sizeof(*ring) ||
+	    __atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) !=
+		    RINGBUFFER_SHM_MAGIC ||
+	    ring->map_size != map_size ||
+	    sizeof(*ring) + align_to_cache_line(ring->size) > map_size) {
+		queue_shm_unmap(ring, map_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (queue_shm_claim(&ring->pids[role]) != 0) {
+		queue_shm_unmap(ring, map_size);
+		return NULL;
+	}
+	return ring;
+}
+
+bool ringbuffer_peer_alive(struct ringbuffer *ring)
+{
+	RINGBUF_ASSERT(ring != NULL, "RingBuffer is NULL");
+
+	if (ring->magic != RINGBUFFER_SHM_MAGIC) {
+		return true;
+	}
+	return queue_shm_peer_alive(ring->pids);
+}
+#endif
+
 void ringbuffer_destroy(struct ringbuffer *ring)
 {
-	if (ring) {
-		free(ring);
+	if (ring == NULL) {
+		return;
 	}
+#ifndef _WIN32
+	// 共享缓冲区只解除映射，内存随fd的最后一个引用释放
+	if (ring->magic == RINGBUFFER_SHM_MAGIC) {
+		queue_shm_release(ring->pids);
+		queue_shm_unmap(ring, ring->map_size);
+		return;
+	}
+#endif
+	free(ring);
 }
 
 void *ringbuffer_writer_prepare(struct ringbuffer *ring, size_t size)
@@ -176,7 +280,7 @@ void *ringbuffer_writer_prepare(struct ringbuffer *ring, size_t size)
 		if (space_until_wrap < required_size) {
 			// 需要包装，先插入填充项
 			struct item *padding = ITEM_AT_POS(ring, write_pos);
-			padding->size = space_until_wrap; // 填充剩余空间
+			padding->size = 0; // 填充项，读者据此跳到缓冲区开头
 
 			write_pos = (write_pos + space_until_wrap) &
 				    ~ring->mask;
@@ -209,7 +313,57 @@ void ringbuffer_writer_commit(struct ringbuffer *ring, void *ptr)
 	// 更新写入位置
 	uint64_t new_pos = current_pos + item_size;
 	atomic_store(&ring->write_pos, new_pos);
-	write_barrier();
+
+	// 与ringbuffer_reader_wait()的登记配对，没有读者挂起时不进内核
+	memory_barrier();
+	if (UNLIKELY(ring->read_waiters != 0)) {
+		queue_wait_wake(QUEUE_WAIT_LO(&ring->write_pos), 1,
+				ring->magic != 0);
+	}
+}
+
+void *ringbuffer_writer_wait(struct ringbuffer *ring, size_t size,
+			     int timeout_ms)
+{
+	RINGBUF_ASSERT(ring != NULL, "RingBuffer is NULL");
+
+	struct queue_wait w;
+	uint64_t read_pos;
+	void *ptr;
+	int rc;
+
+	queue_wait_init(&w, timeout_ms, ring->magic != 0);
+	while ((ptr = ringbuffer_writer_prepare(ring, size)) == NULL) {
+		if (errno != ENOSPC) {
+			return NULL;
+		}
+		if (queue_wait_spin(&w)) {
+			continue;
+		}
+#ifndef _WIN32
+		// 对端进程已经退出，不会再有人唤醒
+		if (UNLIKELY(!ringbuffer_peer_alive(ring))) {
+			errno = EPIPE;
+			return NULL;
+		}
+#endif
+
+		__atomic_fetch_add(&ring->write_waiters, 1, __ATOMIC_SEQ_CST);
+		memory_barrier();
+		read_pos = atomic_load(&ring->read_pos);
+		ptr = ringbuffer_writer_prepare(ring, size);
+		rc = ptr ? 0 :
+			   queue_wait_park(&w, QUEUE_WAIT_LO(&ring->read_pos),
+					   (uint32_t)read_pos);
+		__atomic_fetch_sub(&ring->write_waiters, 1, __ATOMIC_RELAXED);
+		if (ptr != NULL) {
+			break;
+		}
+		if (rc < 0) {
+			return NULL;
+		}
+	}
+	return ptr;
 }
 
 int ringbuffer_reader_prepare(struct ringbuffer *ring,
@@ -304,7 +458,55 @@ void ringbuffer_reader_commit(struct ringbuffer *ring,
 
 	// 更新读取位置
 	atomic_store(&ring->read_pos, res->current_pos);
-	write_barrier();
+
+	// 与ringbuffer_writer_wait()的登记配对
+	memory_barrier();
+	if (UNLIKELY(ring->write_waiters != 0)) {
+		queue_wait_wake(QUEUE_WAIT_LO(&ring->read_pos), 1,
+				ring->magic != 0);
+	}
+}
+
+int ringbuffer_reader_wait(struct ringbuffer *ring, struct reader_result *res,
+			   int timeout_ms)
+{
+	RINGBUF_ASSERT(ring != NULL, "RingBuffer is NULL");
+	RINGBUF_ASSERT(res != NULL, "Result is NULL");
+
+	struct queue_wait w;
+	uint64_t read_pos;
+	int n, rc;
+
+	queue_wait_init(&w, timeout_ms, ring->magic != 0);
+	while ((n = ringbuffer_reader_prepare(ring, res)) == 0) {
+		if (queue_wait_spin(&w)) {
+			continue;
+		}
+#ifndef _WIN32
+		// 对端进程已经退出，不会再有人唤醒
+		if (UNLIKELY(!ringbuffer_peer_alive(ring))) {
+			errno = EPIPE;
+			return 0;
+		}
+#endif
+
+		// 先登记再复查，缓冲区为空时write_pos等于read_pos
+		__atomic_fetch_add(&ring->read_waiters, 1, __ATOMIC_SEQ_CST);
+		memory_barrier();
+		read_pos = atomic_load(&ring->read_pos);
+		n = ringbuffer_reader_prepare(ring, res);
+		rc = n ? 0 :
+			 queue_wait_park(&w, QUEUE_WAIT_LO(&ring->write_pos),
+					 (uint32_t)read_pos);
+		__atomic_fetch_sub(&ring->read_waiters, 1, __ATOMIC_RELAXED);
+		if (n > 0) {
+			break;
+		}
+		if (rc < 0) {
+			return 0;
+		}
+	}
+	return n;
 }
 
 // 工具函数
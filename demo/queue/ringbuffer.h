@@ -64,12 +64,29 @@ extern "C" {
 
 // 前向声明
 struct ringbuffer;
-struct reader_result;
+
+// 读者批次，由调用方分配
+struct reader_result {
+	struct ringbuffer *ring;
+	uint64_t start_pos;
+	uint64_t end_pos;
+	uint64_t current_pos;
+};
 
 // 环形缓冲区操作
 struct ringbuffer *ringbuffer_create(size_t size, size_t max_msg_size);
 void ringbuffer_destroy(struct ringbuffer *ring);
 
+// 跨进程环形缓冲区：控制块和数据都放在fd（memfd_create/shm_open）的映射里。
+// 一端create并占用role，另一端attach占用另一个role，ringbuffer_destroy()
+// 解除映射。对端退出后阻塞等待返回NULL/0并置errno为EPIPE
+#define RINGBUFFER_WRITER 0
+#define RINGBUFFER_READER 1
+struct ringbuffer *ringbuffer_create_shm(int fd, size_t size,
+					 size_t max_msg_size, int role);
+struct ringbuffer *ringbuffer_attach_shm(int fd, int role);
+bool ringbuffer_peer_alive(struct ringbuffer *ring);
+
 void *ringbuffer_writer_prepare(struct ringbuffer *ring, size_t size);
 void ringbuffer_writer_commit(struct ringbuffer *ring, void *ptr);
 
@@ -79,6 +96,13 @@ void *ringbuffer_result_next(struct reader_result *res, size_t *size);
 void ringbuffer_reader_commit(struct ringbuffer *ring,
 			      struct reader_result *res);
 
+// 阻塞版本：自旋、让出CPU后挂在futex上，timeout_ms<0一直等待，
+// 超时返回NULL/0并置errno为ETIMEDOUT
+void *ringbuffer_writer_wait(struct ringbuffer *ring, size_t size,
+			     int timeout_ms);
+int ringbuffer_reader_wait(struct ringbuffer *ring, struct reader_result *res,
+			   int timeout_ms);
+
 // 工具函数
 bool ringbuffer_empty(struct ringbuffer *ring);
 bool ringbuffer_full(struct ringbuffer *ring);
@@ -0,0 +1,339 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// 同一个程序编译两次，分别测spsc和ringbuffer，两个头文件不能同时包含
+#ifdef SHM_BENCH_RING
+#include "ringbuffer.h"
+#define QUEUE_NAME "ring"
+#define QUEUE_SIZE(payload) (1 << 20)
+typedef struct ringbuffer queue_t;
+#define queue_create(fd, size, role) \
+	ringbuffer_create_shm(fd, QUEUE_SIZE(size), size, role)
+#define queue_attach(fd, role) ringbuffer_attach_shm(fd, role)
+#define queue_destroy(q) ringbuffer_destroy(q)
+#define queue_writer_wait(q, size) ringbuffer_writer_wait(q, size, -1)
+#define queue_writer_commit(q, p) ringbuffer_writer_commit(q, p)
+#define queue_reader_wait(q, r) ringbuffer_reader_wait(q, r, -1)
+#define queue_result_next(r) ringbuffer_result_next(r, NULL)
+#define queue_reader_commit(q, r) ringbuffer_reader_commit(q, r)
+#define QUEUE_WRITER RINGBUFFER_WRITER
+#define QUEUE_READER RINGBUFFER_READER
+#else
+#include "spsc_queue.h"
+#define QUEUE_NAME "spsc"
+#define QUEUE_SIZE(payload) 1024
+typedef struct squeue queue_t;
+#define queue_create(fd, size, role) \
+	squeue_create_shm(fd, QUEUE_SIZE(size), size, role)
+#define queue_attach(fd, role) squeue_attach_shm(fd, role)
+#define queue_destroy(q) squeue_destroy(q)
+#define queue_writer_wait(q, size) squeue_writer_wait(q, -1)
+#define queue_writer_commit(q, p) squeue_writer_commit(q, p)
+#define queue_reader_wait(q, r) squeue_reader_wait(q, r, -1)
+#define queue_result_next(r) squeue_result_next(r)
+#define queue_reader_commit(q, r) squeue_reader_commit(q, r)
+#define QUEUE_WRITER SQUEUE_WRITER
+#define QUEUE_READER SQUEUE_READER
+#endif
+
+#define BENCH_SECS 0.5
+#define BENCH_MAX_PAYLOAD 65536
+
+struct msg {
+	uint64_t ts; // 发送时刻，纳秒
+	uint64_t seq;
+	uint32_t len; // 负载长度
+	char payload[];
+};
+
+// 消费者子进程通过这块匿名共享内存把结果交回父进程
+struct result {
+	long errors;
+	double wall;
+	uint64_t lat[];
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void pace(uint64_t start, long i, long rate)
+{
+	struct timespec ts;
+	uint64_t at;
+
+	if (rate > 0) {
+		at = start + (uint64_t)i * 1000000000 / rate;
+		ts.tv_sec = at / 1000000000;
+		ts.tv_nsec = at % 1000000000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+}
+
+static void fill(struct msg *m, long i, size_t len)
+{
+	memset(m->payload, (char)i, len);
+	m->seq = i;
+	m->len = len;
+	m->ts = now_ns();
+}
+
+static void check(struct result *r, const struct msg *m, long got)
+{
+	r->lat[got] = now_ns() - m->ts;
+	if (m->seq != (uint64_t)got ||
+	    (m->len > 0 && (m->payload[0] != (char)got ||
+			    m->payload[m->len - 1] != (char)got))) {
+		r->errors++;
+	}
+}
+
+static void queue_consumer(int fd, long msgs, struct result *r)
+{
+	queue_t *q = queue_attach(fd, QUEUE_READER);
+	struct reader_result res;
+	uint64_t t0 = now_ns();
+	struct msg *m;
+	long got = 0;
+
+	if (q == NULL) {
+		r->errors = -1;
+		return;
+	}
+	while (got < msgs) {
+		if (queue_reader_wait(q, &res) == 0) {
+			r->errors = -1;
+			break;
+		}
+		while ((m = queue_result_next(&res)) != NULL) {
+			check(r, m, got++);
+		}
+		queue_reader_commit(q, &res);
+	}
+	r->wall = (now_ns() - t0) / 1e9;
+	queue_destroy(q);
+}
+
+static int queue_producer(queue_t *q, long msgs, size_t len, long rate)
+{
+	uint64_t start = now_ns();
+	struct msg *m;
+	long i;
+
+	for (i = 0; i < msgs; i++) {
+		pace(start, i, rate);
+		if ((m = queue_writer_wait(q, sizeof(*m) + len)) == NULL) {
+			return -1;
+		}
+		fill(m, i, len);
+		queue_writer_commit(q, m);
+	}
+	return 0;
+}
+
+static void sock_consumer(int fd, long msgs, size_t len, struct result *r)
+{
+	struct msg *m = malloc(sizeof(*m) + len);
+	ssize_t size = sizeof(*m) + len;
+	uint64_t t0 = now_ns();
+	long got;
+
+	for (got = 0; got < msgs; got++) {
+		if (recv(fd, m, size, 0) != size) {
+			r->errors = -1;
+			break;
+		}
+		check(r, m, got);
+	}
+	r->wall = (now_ns() - t0) / 1e9;
+	free(m);
+}
+
+static int sock_producer(int fd, long msgs, size_t len, long rate)
+{
+	struct msg *m = malloc(sizeof(*m) + len);
+	ssize_t size = sizeof(*m) + len;
+	uint64_t start = now_ns();
+	long i;
+
+	for (i = 0; i < msgs; i++) {
+		pace(start, i, rate);
+		fill(m, i, len);
+		if (send(fd, m, size, 0) != size) {
+			free(m);
+			return -1;
+		}
+	}
+	free(m);
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* 父进程写、子进程读，分别走共享内存队列和AF_UNIX SOCK_SEQPACKET。 */
+static int bench_run(size_t len, long rate, long max_msgs)
+{
+	static const char *names[] = { QUEUE_NAME, "socket" };
+	long msgs = rate > 0 ? (long)(rate * BENCH_SECS) : max_msgs;
+	size_t rsize = sizeof(struct result) + msgs * sizeof(uint64_t);
+	struct result *r;
+	queue_t *q = NULL;
+	int t, fd, sv[2], status, rc = 0;
+	char name[32];
+	pid_t pid;
+
+	for (t = 0; t < 2 && rc == 0; t++) {
+		r = mmap(NULL, rsize, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (r == MAP_FAILED) {
+			perror("mmap");
+			return 1;
+		}
+		if (t == 0) {
+			fd = memfd_create("shm_bench", 0);
+			q = fd < 0 ? NULL :
+				     queue_create(fd, sizeof(struct msg) + len,
+						  QUEUE_WRITER);
+			if (q == NULL) {
+				perror("queue_create");
+				return 1;
+			}
+		} else if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) != 0) {
+			perror("socketpair");
+			return 1;
+		}
+
+		pid = fork();
+		if (pid == 0) {
+			if (t == 0) {
+				queue_consumer(fd, msgs, r);
+			} else {
+				close(sv[0]);
+				sock_consumer(sv[1], msgs, len, r);
+			}
+			_exit(0);
+		}
+		if (t == 0) {
+			rc = queue_producer(q, msgs, len, rate);
+		} else {
+			close(sv[1]);
+			rc = sock_producer(sv[0], msgs, len, rate);
+			close(sv[0]);
+		}
+		waitpid(pid, &status, 0);
+		if (t == 0) {
+			queue_destroy(q);
+			close(fd);
+		}
+
+		if (rc != 0 || r->errors != 0) {
+			fprintf(stderr, "%s: %ld errors\n", names[t], r->errors);
+			rc = 1;
+		} else {
+			qsort(r->lat, msgs, sizeof(uint64_t), cmp_u64);
+			if (rate > 0) {
+				snprintf(name, sizeof(name), "%ld", rate);
+			} else {
+				strcpy(name, "max");
+			}
+			printf("%8s %8zu %8s %12.0f %10.1f %10.1f %10.1f %10.1f\n",
+			       names[t], len, name, msgs / r->wall,
+			       msgs * (sizeof(struct msg) + len) / r->wall / 1e6,
+			       r->lat[msgs / 2] / 1e3, r->lat[msgs * 99 / 100] / 1e3,
+			       r->lat[msgs - 1] / 1e3);
+		}
+		munmap(r, rsize);
+	}
+	return rc;
+}
+
+/* 写端子进程写几条消息后被SIGKILL，读端应先读完已提交的消息，
+ * 再从阻塞等待中返回EPIPE。 */
+static int bench_crash(void)
+{
+	struct reader_result res;
+	int fd = memfd_create("shm_crash", 0), status, got = 0;
+	queue_t *q;
+	uint64_t t0;
+	pid_t pid;
+
+	q = fd < 0 ? NULL : queue_create(fd, sizeof(struct msg), QUEUE_READER);
+	if (q == NULL) {
+		perror("queue_create");
+		return 1;
+	}
+	pid = fork();
+	if (pid == 0) {
+		queue_t *w = queue_attach(fd, QUEUE_WRITER);
+		struct msg *m;
+		int i;
+		for (i = 0; w != NULL && i < 10; i++) {
+			m = queue_writer_wait(w, sizeof(*m));
+			fill(m, i, 0);
+			queue_writer_commit(w, m);
+		}
+		raise(SIGKILL);
+	}
+
+	// 读完之前不回收子进程，对端是僵尸时也要能发现
+	t0 = now_ns();
+	while (queue_reader_wait(q, &res) > 0) {
+		while (queue_result_next(&res) != NULL) {
+			got++;
+		}
+		queue_reader_commit(q, &res);
+	}
+	printf("peer killed: drained %d msgs, then %s after %.1f ms\n", got,
+	       strerror(errno), (now_ns() - t0) / 1e6);
+	waitpid(pid, &status, 0);
+	queue_destroy(q);
+	close(fd);
+	return got == 10 && errno == EPIPE ? 0 : 1;
+}
+
+/* Usage: shm_bench [payload,...] [rate,...] [msgs at max rate]
+ * 速率0表示生产者不限速。 */
+int main(int argc, char *argv[])
+{
+	const char *sizes = argc > 1 ? argv[1] : "64,1024,16384";
+	const char *rates = argc > 2 ? argv[2] : "20000,0";
+	long max_msgs = argc > 3 ? atol(argv[3]) : 200000;
+	const char *p, *q;
+	int rc = 0;
+
+	if (max_msgs <= 0) {
+		fprintf(stderr, "usage: %s [payload,...] [rate,...] [msgs]\n",
+			argv[0]);
+		return 1;
+	}
+	printf("%8s %8s %8s %12s %10s %10s %10s %10s\n", "channel", "payload",
+	       "rate", "msgs/s", "MB/s", "p50 us", "p99 us", "max us");
+	for (p = sizes; *p != '\0' && rc == 0; p += strcspn(p, ","),
+	    p += *p == ',') {
+		size_t len = strtoul(p, NULL, 10);
+		if (len > BENCH_MAX_PAYLOAD) {
+			continue;
+		}
+		for (q = rates; *q != '\0' && rc == 0; q += strcspn(q, ","),
+		    q += *q == ',') {
+			rc = bench_run(len, atol(q), max_msgs);
+		}
+	}
+	return rc ? rc : bench_crash();
+}
@@ -1,4 +1,6 @@
 #include "spsc_queue.h"
+#include "queue_shm.h"
+#include "queue_wait.h"
 
 #include <string.h>
 #include <errno.h>
@@ -22,24 +24,25 @@
 // 对齐的类型定义
 typedef uint64_t ALIGNED(CACHE_LINE_SIZE) aligned_uint64_t;
 
+#define SQUEUE_SHM_MAGIC 0x53515545 // "SQUE"
+
 struct squeue {
+	uint32_t magic; // 共享内存队列为SQUEUE_SHM_MAGIC，进程内队列为0
+	volatile int32_t pids[2]; // 共享队列两端的进程，按SQUEUE_WRITER/READER索引
+	size_t map_size; // 共享映射的大小
 	size_t capacity; // 实际容量（2的幂次-1）
 	size_t mask; // 用于掩码操作的掩码
 	size_t element_size; // 每个元素的大小
 
+	// 等待者计数与对方的位置放在同一缓存行，提交方检查时不多一次缓存未命中
 	ALIGNED(CACHE_LINE_SIZE) volatile aligned_uint64_t write_pos;
+	volatile uint32_t read_waiters; // 挂在write_pos上的读者数
 	ALIGNED(CACHE_LINE_SIZE) volatile aligned_uint64_t read_pos;
+	volatile uint32_t write_waiters; // 挂在read_pos上的写者数
 
 	char buffer[]; // 柔性数组，存储元素数据
 };
 
-struct reader_result {
-	struct squeue *queue;
-	uint64_t start_pos;
-	uint64_t current_pos;
-	uint64_t end_pos;
-};
-
 // 工具函数：计算大于等于输入的最小2的幂
 static FORCE_INLINE uint32_t next_power_of_2(uint32_t n)
 {
@@ -111,30 +114,58 @@ static FORCE_INLINE bool validate_pointer(struct squeue *queue, void *ptr)
 	return ptr_char >= buffer_start && ptr_char < buffer_end;
 }
 
-struct squeue *squeue_create(size_t nmemb, size_t element_size)
+// 计算队列总大小，失败返回0并设置errno
+static size_t squeue_total_size(size_t nmemb, size_t element_size,
+				size_t *capacity)
 {
-	struct squeue *queue = NULL;
 	size_t total_size, actual_capacity;
 
 	// 参数检查
 	if (nmemb == 0 || element_size == 0) {
 		errno = EINVAL;
-		return NULL;
+		return 0;
 	}
 
 	// 确保容量是2的幂次减1，便于使用掩码操作
 	actual_capacity = next_power_of_2(nmemb) - 1;
 	if (actual_capacity < 1) {
 		errno = EINVAL;
-		return NULL;
+		return 0;
 	}
 
 	// 计算总大小
-	total_size = sizeof(*queue) + (actual_capacity + 1) * element_size;
+	total_size = sizeof(struct squeue) + (actual_capacity + 1) * element_size;
 
 	// 检查溢出
-	if (total_size < sizeof(*queue)) {
+	if (total_size < sizeof(struct squeue)) {
 		errno = EOVERFLOW;
+		return 0;
+	}
+
+	*capacity = actual_capacity;
+	return total_size;
+}
+
+static void squeue_init(struct squeue *queue, size_t total_size,
+			size_t capacity, size_t element_size)
+{
+	// 初始化队列结构
+	memset(queue, 0, total_size);
+	queue->capacity = capacity;
+	queue->mask = capacity;
+	queue->element_size = element_size;
+
+	atomic_store(&queue->write_pos, 0);
+	atomic_store(&queue->read_pos, 0);
+}
+
+struct squeue *squeue_create(size_t nmemb, size_t element_size)
+{
+	struct squeue *queue = NULL;
+	size_t total_size, actual_capacity;
+
+	total_size = squeue_total_size(nmemb, element_size, &actual_capacity);
+	if (total_size == 0) {
 		return NULL;
 	}
 
@@ -145,24 +176,102 @@ struct squeue *squeue_create(size_t nmemb, size_t element_size)
 		return NULL;
 	}
 
-	// 初始化队列结构
-	memset(queue, 0, total_size);
-	queue->capacity = actual_capacity;
-	queue->mask = actual_capacity;
-	queue->element_size = element_size;
-
-	atomic_store(&queue->write_pos, 0);
-	atomic_store(&queue->read_pos, 0);
+	squeue_init(queue, total_size, actual_capacity, element_size);
 
 	memory_barrier();
 	return queue;
 }
 
+#ifndef _WIN32
+struct squeue *squeue_create_shm(int fd, size_t nmemb, size_t element_size,
+				 int role)
+{
+	struct squeue *queue;
+	size_t total_size, actual_capacity;
+
+	if (role != SQUEUE_WRITER && role != SQUEUE_READER) {
+		errno = EINVAL;
+		return NULL;
+	}
+	total_size = squeue_total_size(nmemb, element_size, &actual_capacity);
+	if (total_size == 0) {
+		return NULL;
+	}
+	total_size = (total_size + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+
+	queue = (struct squeue *)queue_shm_map(fd, &total_size, true);
+	if (UNLIKELY(queue == NULL)) {
+		return NULL;
+	}
+
+	squeue_init(queue, total_size, actual_capacity, element_size);
+	queue->map_size = total_size;
+	queue->pids[role] = (int32_t)getpid();
+
+	// 魔数最后写入，对端看到魔数时其余字段已经就绪
+	__atomic_store_n(&queue->magic, SQUEUE_SHM_MAGIC, __ATOMIC_RELEASE);
+	return queue;
+}
+
+struct squeue *squeue_attach_shm(int fd, int role)
+{
+	struct squeue *queue;
+	size_t map_size = 0;
+
+	if (role != SQUEUE_WRITER && role != SQUEUE_READER) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	queue = (struct squeue *)queue_shm_map(fd, &map_size, false);
+	if (UNLIKELY(queue == NULL)) {
+		return NULL;
+	}
+
+	// 校验控制块，防止映射到不相干的文件或者还没初始化完的队列
+	if (map_size < sizeof(*queue) ||
+	    __atomic_load_n(&queue->magic, __ATOMIC_ACQUIRE) !=
+		    SQUEUE_SHM_MAGIC ||
+	    queue->map_size != map_size ||
+	    sizeof(*queue) + (queue->capacity + 1) * queue->element_size >
+		    map_size) {
+		queue_shm_unmap(queue, map_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (queue_shm_claim(&queue->pids[role]) != 0) {
+		queue_shm_unmap(queue, map_size);
+		return NULL;
+	}
+	return queue;
+}
+
+bool squeue_peer_alive(struct squeue *queue)
+{
+	SQUEUE_ASSERT(queue != NULL, "Queue is NULL");
+
+	if (queue->magic != SQUEUE_SHM_MAGIC) {
+		return true;
+	}
+	return queue_shm_peer_alive(queue->pids);
+}
+#endif
+
 void squeue_destroy(struct squeue *queue)
 {
-	if (queue) {
-		aligned_free_page(queue);
+	if (queue == NULL) {
+		return;
+	}
+#ifndef _WIN32
+	// 共享队列只解除映射，内存随fd的最后一个引用释放
+	if (queue->magic == SQUEUE_SHM_MAGIC) {
+		queue_shm_release(queue->pids);
+		queue_shm_unmap(queue, queue->map_size);
+		return;
 	}
+#endif
+	aligned_free_page(queue);
 }
 
 void *squeue_writer_prepare(struct squeue *queue)
@@ -209,7 +318,54 @@ void squeue_writer_commit(struct squeue *queue, void *ptr)
 
 	// 更新写入位置
 	atomic_store(&queue->write_pos, current_write_pos + 1);
-	write_barrier();
+
+	// 与squeue_reader_wait()的登记配对：要么读者复查时看到新位置，
+	// 要么这里看到读者已登记，只有后者才需要唤醒
+	memory_barrier();
+	if (UNLIKELY(queue->read_waiters != 0)) {
+		queue_wait_wake(QUEUE_WAIT_LO(&queue->write_pos), 1,
+				queue->magic != 0);
+	}
+}
+
+void *squeue_writer_wait(struct squeue *queue, int timeout_ms)
+{
+	SQUEUE_ASSERT(queue != NULL, "Queue is NULL");
+
+	struct queue_wait w;
+	uint64_t read_pos;
+	void *ptr;
+	int rc;
+
+	queue_wait_init(&w, timeout_ms, queue->magic != 0);
+	while ((ptr = squeue_writer_prepare(queue)) == NULL) {
+		if (queue_wait_spin(&w)) {
+			continue;
+		}
+#ifndef _WIN32
+		// 对端进程已经退出，不会再有人唤醒
+		if (UNLIKELY(!squeue_peer_alive(queue))) {
+			errno = EPIPE;
+			return NULL;
+		}
+#endif
+
+		__atomic_fetch_add(&queue->write_waiters, 1, __ATOMIC_SEQ_CST);
+		memory_barrier();
+		read_pos = atomic_load(&queue->read_pos);
+		ptr = squeue_writer_prepare(queue);
+		rc = ptr ? 0 :
+			   queue_wait_park(&w, QUEUE_WAIT_LO(&queue->read_pos),
+					   (uint32_t)read_pos);
+		__atomic_fetch_sub(&queue->write_waiters, 1, __ATOMIC_RELAXED);
+		if (ptr != NULL) {
+			break;
+		}
+		if (rc < 0) {
+			return NULL;
+		}
+	}
+	return ptr;
 }
 
 size_t squeue_reader_prepare(struct squeue *queue, struct reader_result *res)
@@ -268,7 +424,57 @@ void squeue_reader_commit(struct squeue *queue, struct reader_result *res)
 	// 直接更新位置，相信 squeue_result_next() 的逻辑正确性
 	// 移除了有问题的位置检查，因为回绕情况下检查逻辑复杂且容易出错
 	atomic_store(&queue->read_pos, res->current_pos);
-	write_barrier();
+
+	// 与squeue_writer_wait()的登记配对
+	memory_barrier();
+	if (UNLIKELY(queue->write_waiters != 0)) {
+		queue_wait_wake(QUEUE_WAIT_LO(&queue->read_pos), 1,
+				queue->magic != 0);
+	}
+}
+
+size_t squeue_reader_wait(struct squeue *queue, struct reader_result *res,
+			  int timeout_ms)
+{
+	SQUEUE_ASSERT(queue != NULL, "Queue is NULL");
+	SQUEUE_ASSERT(res != NULL, "Result is NULL");
+
+	struct queue_wait w;
+	uint64_t read_pos;
+	size_t n;
+	int rc;
+
+	queue_wait_init(&w, timeout_ms, queue->magic != 0);
+	while ((n = squeue_reader_prepare(queue, res)) == 0) {
+		if (queue_wait_spin(&w)) {
+			continue;
+		}
+#ifndef _WIN32
+		// 对端进程已经退出，不会再有人唤醒
+		if (UNLIKELY(!squeue_peer_alive(queue))) {
+			errno = EPIPE;
+			return 0;
+		}
+#endif
+
+		// 先登记再复查，队列为空时write_pos等于read_pos，
+		// 写者提交后低32位必然变化，futex不会错过这次提交
+		__atomic_fetch_add(&queue->read_waiters, 1, __ATOMIC_SEQ_CST);
+		memory_barrier();
+		read_pos = atomic_load(&queue->read_pos);
+		n = squeue_reader_prepare(queue, res);
+		rc = n ? 0 :
+			 queue_wait_park(&w, QUEUE_WAIT_LO(&queue->write_pos),
+					 (uint32_t)read_pos);
+		__atomic_fetch_sub(&queue->read_waiters, 1, __ATOMIC_RELAXED);
+		if (n > 0) {
+			break;
+		}
+		if (rc < 0) {
+			return 0;
+		}
+	}
+	return n;
 }
 
 // 工具函数
@@ -63,12 +63,28 @@ extern "C" {
 
 // 前向声明
 struct squeue;
-struct reader_result;
+
+// 读者批次，由调用方分配
+struct reader_result {
+	struct squeue *queue;
+	uint64_t start_pos;
+	uint64_t current_pos;
+	uint64_t end_pos;
+};
 
 // 队列操作
 struct squeue *squeue_create(size_t nmemb, size_t size);
 void squeue_destroy(struct squeue *queue);
 
+// 跨进程队列：控制块和数据都放在fd（memfd_create/shm_open）的映射里。
+// 一端create并占用role，另一端attach占用另一个role，squeue_destroy()
+// 解除映射。对端退出后阻塞等待返回NULL/0并置errno为EPIPE
+#define SQUEUE_WRITER 0
+#define SQUEUE_READER 1
+struct squeue *squeue_create_shm(int fd, size_t nmemb, size_t size, int role);
+struct squeue *squeue_attach_shm(int fd, int role);
+bool squeue_peer_alive(struct squeue *queue);
+
 void *squeue_writer_prepare(struct squeue *queue);
 void squeue_writer_commit(struct squeue *queue, void *ptr);
 
@@ -76,6 +92,12 @@ size_t squeue_reader_prepare(struct squeue *queue, struct reader_result *res);
 void *squeue_result_next(struct reader_result *res);
 void squeue_reader_commit(struct squeue *queue, struct reader_result *res);
 
+// 阻塞版本：自旋、让出CPU后挂在futex上，timeout_ms<0一直等待，
+// 超时返回NULL/0并置errno为ETIMEDOUT
+void *squeue_writer_wait(struct squeue *queue, int timeout_ms);
+size_t squeue_reader_wait(struct squeue *queue, struct reader_result *res,
+			  int timeout_ms);
+
 // 工具函数
 bool squeue_empty(struct squeue *queue);
 bool squeue_full(struct squeue *queue);
@@ -0,0 +1,199 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// 同一个程序编译两次，分别测spsc和mpmc，两个头文件不能同时包含
+#ifdef WAIT_BENCH_MPMC
+#include "mpmc_queue.h"
+#define QUEUE_NAME "mpmc"
+typedef struct mpmc_queue queue_t;
+#define queue_create(n, size) mpmc_queue_create(n, size)
+#define queue_destroy(q) mpmc_queue_destroy(q)
+#define queue_writer_prepare(q) mpmc_queue_writer_prepare(q)
+#define queue_writer_wait(q) mpmc_queue_writer_wait(q, -1)
+#define queue_writer_commit(q, p) mpmc_queue_writer_commit(q, p)
+#define queue_reader_prepare(q, r) mpmc_queue_reader_prepare(q, r)
+#define queue_reader_wait(q, r) mpmc_queue_reader_wait(q, r, -1)
+#define queue_result_next(r) mpmc_queue_reader_next(r)
+#define queue_reader_commit(q, r) mpmc_queue_reader_commit(q, r)
+#else
+#include "spsc_queue.h"
+#define QUEUE_NAME "spsc"
+typedef struct squeue queue_t;
+#define queue_create(n, size) squeue_create(n, size)
+#define queue_destroy(q) squeue_destroy(q)
+#define queue_writer_prepare(q) squeue_writer_prepare(q)
+#define queue_writer_wait(q) squeue_writer_wait(q, -1)
+#define queue_writer_commit(q, p) squeue_writer_commit(q, p)
+#define queue_reader_prepare(q, r) squeue_reader_prepare(q, r)
+#define queue_reader_wait(q, r) squeue_reader_wait(q, r, -1)
+#define queue_result_next(r) squeue_result_next(r)
+#define queue_reader_commit(q, r) squeue_reader_commit(q, r)
+#endif
+#include "queue_wait.h"
+
+#define BENCH_QUEUE_SIZE 1024
+#define BENCH_SECS 0.5
+
+struct msg {
+	uint64_t ts; // 发送时刻，纳秒
+	uint64_t seq;
+};
+
+struct bench {
+	queue_t *q;
+	int wait; // 0: 纯自旋轮询, 1: 自适应等待
+	long rate; // 每秒消息数，0表示不限速
+	long msgs;
+	uint64_t *lat; // 每条消息的延迟
+	double cpu; // 消费者线程CPU时间
+	double wall; // 消费者线程墙钟时间
+	long errors;
+};
+
+static uint64_t now_ns(clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *producer(void *arg)
+{
+	struct bench *b = arg;
+	struct timespec ts;
+	uint64_t start = now_ns(CLOCK_MONOTONIC), at;
+	struct msg *m;
+	long i;
+
+	for (i = 0; i < b->msgs; i++) {
+		if (b->rate > 0) {
+			at = start + (uint64_t)i * 1000000000 / b->rate;
+			ts.tv_sec = at / 1000000000;
+			ts.tv_nsec = at % 1000000000;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+					NULL);
+		}
+		if (b->wait) {
+			m = queue_writer_wait(b->q);
+		} else {
+			while ((m = queue_writer_prepare(b->q)) == NULL) {
+				cpu_relax();
+			}
+		}
+		m->seq = i;
+		m->ts = now_ns(CLOCK_MONOTONIC);
+		queue_writer_commit(b->q, m);
+	}
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	struct bench *b = arg;
+	uint64_t cpu0 = now_ns(CLOCK_THREAD_CPUTIME_ID);
+	uint64_t wall0 = now_ns(CLOCK_MONOTONIC);
+	struct reader_result res;
+	struct msg *m;
+	long got = 0;
+	size_t n, i;
+
+	while (got < b->msgs) {
+		if (b->wait) {
+			n = queue_reader_wait(b->q, &res);
+		} else {
+			while ((n = queue_reader_prepare(b->q, &res)) == 0) {
+				cpu_relax();
+			}
+		}
+		for (i = 0; i < n; i++) {
+			m = queue_result_next(&res);
+			b->lat[got] = now_ns(CLOCK_MONOTONIC) - m->ts;
+			if (m->seq != (uint64_t)got) {
+				b->errors++;
+			}
+			got++;
+		}
+		queue_reader_commit(b->q, &res);
+	}
+	b->cpu = (now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu0) / 1e9;
+	b->wall = (now_ns(CLOCK_MONOTONIC) - wall0) / 1e9;
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* 每个速率下分别用纯自旋和自适应等待跑一遍，报告端到端延迟分位数
+ * 和消费者线程的CPU占用。 */
+static int bench_run(long rate, long max_msgs)
+{
+	struct bench b;
+	pthread_t tp, tc;
+	char name[32];
+
+	for (b.wait = 0; b.wait <= 1; b.wait++) {
+		b.q = queue_create(BENCH_QUEUE_SIZE, sizeof(struct msg));
+		b.rate = rate;
+		b.msgs = rate > 0 ? (long)(rate * BENCH_SECS) : max_msgs;
+		b.lat = malloc(b.msgs * sizeof(*b.lat));
+		b.errors = 0;
+		if (b.q == NULL || b.lat == NULL) {
+			perror("bench_run");
+			return 1;
+		}
+
+		pthread_create(&tc, NULL, consumer, &b);
+		pthread_create(&tp, NULL, producer, &b);
+		pthread_join(tp, NULL);
+		pthread_join(tc, NULL);
+
+		qsort(b.lat, b.msgs, sizeof(*b.lat), cmp_u64);
+		if (rate > 0) {
+			snprintf(name, sizeof(name), "%ld", rate);
+		} else {
+			strcpy(name, "max");
+		}
+		printf("%6s %6s %10s %12.0f %10.1f %10.1f %10.1f %8.1f%% %8ld\n",
+		       QUEUE_NAME, b.wait ? "wait" : "spin", name,
+		       b.msgs / b.wall, b.lat[b.msgs / 2] / 1e3,
+		       b.lat[b.msgs * 99 / 100] / 1e3,
+		       b.lat[b.msgs - 1] / 1e3, 100 * b.cpu / b.wall,
+		       b.errors);
+		free(b.lat);
+		queue_destroy(b.q);
+		if (b.errors != 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Usage: wait_bench [rate,...] [msgs at max rate]
+ * 速率0表示生产者不限速。 */
+int main(int argc, char *argv[])
+{
+	const char *list = argc > 1 ? argv[1] : "1000,100000,0";
+	long max_msgs = argc > 2 ? atol(argv[2]) : 1000000;
+	const char *p;
+	int rc = 0;
+
+	if (max_msgs <= 0) {
+		fprintf(stderr, "usage: %s [rate,...] [msgs]\n", argv[0]);
+		return 1;
+	}
+	printf("%6s %6s %10s %12s %10s %10s %10s %9s %8s\n", "queue", "mode",
+	       "rate", "msgs/s", "p50 us", "p99 us", "max us", "cons cpu",
+	       "errors");
+	for (p = list; *p != '\0' && rc == 0; p += strcspn(p, ","),
+	    p += *p == ',') {
+		rc = bench_run(atol(p), max_msgs);
+	}
+	return rc;
+}
@@ -0,0 +1,196 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "ws_deque.h"
+
+#define MAX_WORKERS 64
+
+// fib(n)按n-1/n-2分叉成任务树，n小于cutoff时串行计算
+struct task {
+	int n;
+	volatile int pending; // 还没完成的子任务数
+	long result;
+	struct task *parent;
+};
+
+struct worker {
+	pthread_t tid;
+	unsigned int seed;
+	struct ws_deque *dq;
+	long tasks;
+	long steals;
+	long aborts; // steal竞争失败
+	long misses; // 一轮所有队列都偷不到
+} ALIGNED(CACHE_LINE_SIZE);
+
+static struct worker workers[MAX_WORKERS];
+static int nworkers;
+static int cutoff;
+static volatile int done;
+static long answer;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long fib_seq(int n)
+{
+	return n < 2 ? n : fib_seq(n - 1) + fib_seq(n - 2);
+}
+
+static struct task *task_new(int n, struct task *parent)
+{
+	struct task *t = malloc(sizeof(*t));
+	t->n = n;
+	t->pending = 0;
+	t->result = 0;
+	t->parent = parent;
+	return t;
+}
+
+// 任务完成后把结果加到父任务上，最后一个完成的子任务接着完成父任务
+static void task_complete(struct task *t)
+{
+	struct task *p;
+	long r;
+
+	for (;;) {
+		p = t->parent;
+		r = t->result;
+		free(t);
+		if (p == NULL) {
+			answer = r;
+			__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+			return;
+		}
+		__atomic_fetch_add(&p->result, r, __ATOMIC_RELAXED);
+		if (__atomic_sub_fetch(&p->pending, 1, __ATOMIC_ACQ_REL) != 0) {
+			return;
+		}
+		t = p;
+	}
+}
+
+static void task_run(struct worker *w, struct task *t)
+{
+	w->tasks++;
+	if (t->n < cutoff) {
+		t->result = fib_seq(t->n);
+		task_complete(t);
+		return;
+	}
+	t->pending = 2;
+	ws_deque_push(w->dq, task_new(t->n - 2, t));
+	ws_deque_push(w->dq, task_new(t->n - 1, t));
+}
+
+static struct task *steal_any(struct worker *w)
+{
+	int i, start = rand_r(&w->seed) % nworkers;
+	struct task *t;
+
+	for (i = 0; i < nworkers; i++) {
+		struct worker *v = &workers[(start + i) % nworkers];
+		if (v == w) {
+			continue;
+		}
+		if ((t = ws_deque_steal(v->dq)) != NULL) {
+			w->steals++;
+			return t;
+		}
+		if (errno == EAGAIN) {
+			w->aborts++;
+		}
+	}
+	w->misses++;
+	return NULL;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct task *t;
+
+	while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		if ((t = ws_deque_pop(w->dq)) == NULL &&
+		    (t = steal_any(w)) == NULL) {
+			sched_yield();
+			continue;
+		}
+		task_run(w, t);
+	}
+	return NULL;
+}
+
+/* Usage: ws_bench [threads,...] [n] [cutoff]
+ * 每个线程一个deque，fib(n)的任务树从0号线程的队列开始向外扩散，
+ * 报告任务吞吐、成功/失败的steal次数和相对单线程的加速比。 */
+int main(int argc, char *argv[])
+{
+	const char *list = argc > 1 ? argv[1] : "1,2,4,8,16,32,64";
+	int n = argc > 2 ? atoi(argv[2]) : 38;
+	long want, tasks, steals, aborts, misses;
+	double t0, t1, base = 0;
+	const char *p;
+	int i, rc = 0;
+
+	cutoff = argc > 3 ? atoi(argv[3]) : 12;
+	if (n <= 0 || cutoff < 2) {
+		fprintf(stderr, "usage: %s [threads,...] [n] [cutoff]\n",
+			argv[0]);
+		return 1;
+	}
+	want = fib_seq(n);
+
+	printf("%8s %10s %14s %14s %12s %12s %8s\n", "threads", "seconds",
+	       "tasks/s", "steals/s", "aborts", "misses", "speedup");
+	for (p = list; *p != '\0'; p += strcspn(p, ","), p += *p == ',') {
+		nworkers = atoi(p);
+		if (nworkers <= 0 || nworkers > MAX_WORKERS) {
+			continue;
+		}
+		memset(workers, 0, sizeof(workers));
+		for (i = 0; i < nworkers; i++) {
+			workers[i].seed = i + 1;
+			workers[i].dq = ws_deque_create(64);
+		}
+		done = 0;
+		answer = 0;
+		ws_deque_push(workers[0].dq, task_new(n, NULL));
+
+		t0 = now();
+		for (i = 0; i < nworkers; i++) {
+			pthread_create(&workers[i].tid, NULL, worker_thread,
+				       &workers[i]);
+		}
+		tasks = steals = aborts = misses = 0;
+		for (i = 0; i < nworkers; i++) {
+			pthread_join(workers[i].tid, NULL);
+			tasks += workers[i].tasks;
+			steals += workers[i].steals;
+			aborts += workers[i].aborts;
+			misses += workers[i].misses;
+			ws_deque_destroy(workers[i].dq);
+		}
+		t1 = now() - t0;
+		if (base == 0) {
+			base = t1;
+		}
+
+		printf("%8d %10.3f %14.0f %14.0f %12ld %12ld %8.2f\n", nworkers,
+		       t1, tasks / t1, steals / t1, aborts, misses, base / t1);
+		if (answer != want) {
+			fprintf(stderr, "fib(%d) = %ld, want %ld\n", n, answer,
+				want);
+			rc = 1;
+		}
+	}
+	return rc;
+}
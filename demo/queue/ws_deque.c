@@ -0,0 +1,212 @@
+#include "ws_deque.h"
+
+#include <errno.h>
+#include <string.h>
+
+// 原子操作包装
+#define atomic_load(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define atomic_store(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define relaxed_load(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#define relaxed_store(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELAXED)
+#define atomic_compare_exchange_strong(ptr, expected, desired) \
+	__atomic_compare_exchange_n(ptr, expected, desired, 0,  \
+				    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)
+
+// 内存屏障
+#define write_barrier() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define memory_barrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+// 对齐的类型定义
+typedef int64_t ALIGNED(CACHE_LINE_SIZE) aligned_int64_t;
+
+struct ws_array {
+	size_t mask; // 容量-1，容量是2的幂
+	struct ws_array *prev; // 扩容前的旧数组，销毁时一起释放
+	void *items[];
+};
+
+struct ws_deque {
+	// top被窃取者CAS，bottom只有所有者写，分开放避免伪共享
+	ALIGNED(CACHE_LINE_SIZE) volatile aligned_int64_t top;
+	ALIGNED(CACHE_LINE_SIZE) volatile aligned_int64_t bottom;
+	ALIGNED(CACHE_LINE_SIZE) struct ws_array *volatile array;
+};
+
+// 工具函数：计算大于等于输入的最小2的幂
+static FORCE_INLINE size_t next_power_of_2(size_t n)
+{
+	size_t p = 1;
+	while (p < n)
+		p <<= 1;
+	return p;
+}
+
+static struct ws_array *ws_array_create(size_t size)
+{
+	struct ws_array *a;
+
+	a = (struct ws_array *)malloc(sizeof(*a) + size * sizeof(void *));
+	if (UNLIKELY(a == NULL)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	a->mask = size - 1;
+	a->prev = NULL;
+	return a;
+}
+
+#define ITEM_GET(a, i) relaxed_load(&(a)->items[(i) & (a)->mask])
+#define ITEM_SET(a, i, x) relaxed_store(&(a)->items[(i) & (a)->mask], x)
+
+struct ws_deque *ws_deque_create(size_t nmemb)
+{
+	struct ws_deque *dq;
+
+	if (nmemb == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (posix_memalign((void **)&dq, CACHE_LINE_SIZE, sizeof(*dq)) != 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(dq, 0, sizeof(*dq));
+
+	dq->array = ws_array_create(next_power_of_2(nmemb));
+	if (UNLIKELY(dq->array == NULL)) {
+		free(dq);
+		return NULL;
+	}
+
+	memory_barrier();
+	return dq;
+}
+
+void ws_deque_destroy(struct ws_deque *dq)
+{
+	struct ws_array *a, *prev;
+
+	if (dq == NULL) {
+		return;
+	}
+	for (a = dq->array; a != NULL; a = prev) {
+		prev = a->prev;
+		free(a);
+	}
+	free(dq);
+}
+
+// 容量翻倍，复制[top, bottom)。窃取者可能还拿着旧数组读top处的元素，
+// 旧数组里这些槽位不会再被改写，所以读到的仍是正确的值
+static struct ws_array *ws_deque_grow(struct ws_deque *dq,
+				      struct ws_array *a, int64_t top,
+				      int64_t bottom)
+{
+	struct ws_array *na = ws_array_create((a->mask + 1) * 2);
+	int64_t i;
+
+	if (UNLIKELY(na == NULL)) {
+		return NULL;
+	}
+	for (i = top; i < bottom; i++) {
+		ITEM_SET(na, i, ITEM_GET(a, i));
+	}
+	na->prev = a;
+	atomic_store(&dq->array, na);
+	return na;
+}
+
+int ws_deque_push(struct ws_deque *dq, void *task)
+{
+	WS_ASSERT(dq != NULL, "Deque is NULL");
+	WS_ASSERT(task != NULL, "Task is NULL");
+
+	int64_t b = relaxed_load(&dq->bottom);
+	int64_t t = atomic_load(&dq->top);
+	struct ws_array *a = relaxed_load(&dq->array);
+
+	if (UNLIKELY(b - t > (int64_t)a->mask)) {
+		a = ws_deque_grow(dq, a, t, b);
+		if (a == NULL) {
+			return -1;
+		}
+	}
+	ITEM_SET(a, b, task);
+
+	// 元素先于bottom可见
+	write_barrier();
+	relaxed_store(&dq->bottom, b + 1);
+	return 0;
+}
+
+void *ws_deque_pop(struct ws_deque *dq)
+{
+	WS_ASSERT(dq != NULL, "Deque is NULL");
+
+	int64_t b = relaxed_load(&dq->bottom) - 1;
+	struct ws_array *a = relaxed_load(&dq->array);
+	int64_t t;
+	void *task;
+
+	// 先占住bottom-1，再看top，和窃取者的top/bottom读取构成Dekker式同步
+	relaxed_store(&dq->bottom, b);
+	memory_barrier();
+	t = relaxed_load(&dq->top);
+
+	if (t > b) {
+		// 队列为空
+		relaxed_store(&dq->bottom, b + 1);
+		return NULL;
+	}
+
+	task = ITEM_GET(a, b);
+	if (t == b) {
+		// 只剩最后一个，和窃取者抢top
+		if (!atomic_compare_exchange_strong(&dq->top, &t, t + 1)) {
+			task = NULL;
+		}
+		relaxed_store(&dq->bottom, b + 1);
+	}
+	return task;
+}
+
+void *ws_deque_steal(struct ws_deque *dq)
+{
+	WS_ASSERT(dq != NULL, "Deque is NULL");
+
+	int64_t t = atomic_load(&dq->top);
+	int64_t b;
+	struct ws_array *a;
+	void *task;
+
+	memory_barrier();
+	b = atomic_load(&dq->bottom);
+	if (t >= b) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	a = atomic_load(&dq->array);
+	task = ITEM_GET(a, t);
+	if (!atomic_compare_exchange_strong(&dq->top, &t, t + 1)) {
+		errno = EAGAIN;
+		return NULL;
+	}
+	return task;
+}
+
+// 工具函数
+size_t ws_deque_size(struct ws_deque *dq)
+{
+	if (UNLIKELY(dq == NULL))
+		return 0;
+	int64_t b = atomic_load(&dq->bottom);
+	int64_t t = atomic_load(&dq->top);
+	return b > t ? (size_t)(b - t) : 0;
+}
+
+size_t ws_deque_capacity(struct ws_deque *dq)
+{
+	return dq ? atomic_load(&dq->array)->mask + 1 : 0;
+}
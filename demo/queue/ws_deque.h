@@ -0,0 +1,87 @@
+/**
+ * Chase-Lev 工作窃取双端队列
+ *
+ * 所有者线程在底部push/pop，其他线程从顶部steal。数组满了由所有者
+ * 扩容一倍，旧数组可能还有窃取者在读，挂在新数组上直到销毁时才释放，
+ * 总内存不超过最终容量的两倍。元素是任意指针，不能是NULL。
+ */
+#ifndef WS_DEQUE_H
+#define WS_DEQUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 编译器检测
+#if defined(__GNUC__) || defined(__clang__)
+#define LIKELY(e) __builtin_expect(!!(e), 1)
+#define UNLIKELY(e) __builtin_expect(!!(e), 0)
+#define FORCE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define LIKELY(e) (e)
+#define UNLIKELY(e) (e)
+#define FORCE_INLINE __forceinline
+#else
+#define LIKELY(e) (e)
+#define UNLIKELY(e) (e)
+#define FORCE_INLINE inline
+#endif
+
+// 缓存行大小
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+// 内存对齐宏
+#if defined(__GNUC__) || defined(__clang__)
+#define ALIGNED(n) __attribute__((aligned(n)))
+#elif defined(_MSC_VER)
+#define ALIGNED(n) __declspec(align(n))
+#else
+#define ALIGNED(n)
+#endif
+
+// 调试断言
+#ifdef NDEBUG
+#define WS_ASSERT(cond, msg) ((void)0)
+#else
+#include <stdio.h>
+#include <stdlib.h>
+#define WS_ASSERT(cond, msg)                                                  \
+	do {                                                                  \
+		if (!(cond)) {                                                \
+			fprintf(stderr,                                       \
+				"WSDeque assertion failed: %s at %s:%d\n",    \
+				msg, __FILE__, __LINE__);                     \
+			abort();                                              \
+		}                                                             \
+	} while (0)
+#endif
+
+struct ws_deque;
+
+struct ws_deque *ws_deque_create(size_t nmemb);
+void ws_deque_destroy(struct ws_deque *dq);
+
+// 所有者线程调用，扩容失败返回-1并置errno为ENOMEM
+int ws_deque_push(struct ws_deque *dq, void *task);
+// 所有者线程调用，取最近push的元素，队列为空返回NULL
+void *ws_deque_pop(struct ws_deque *dq);
+// 任意线程调用，取最早push的元素。队列为空返回NULL并置errno为ENOENT，
+// 与其他线程竞争失败返回NULL并置errno为EAGAIN，可以换个队列再试
+void *ws_deque_steal(struct ws_deque *dq);
+
+// 工具函数
+size_t ws_deque_size(struct ws_deque *dq);
+size_t ws_deque_capacity(struct ws_deque *dq);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // WS_DEQUE_H
@@ -0,0 +1,128 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include "ws_deque.h"
+
+#define MAX_THIEVES 64
+
+static struct ws_deque *dq;
+static unsigned char *seen; // 每个元素被取到的次数
+static long nitems;
+static long dups;
+static volatile int owner_done;
+
+struct thief {
+	pthread_t tid;
+	long stolen;
+	long aborts;
+};
+
+static void take(void *task, long *dups)
+{
+	long i = (long)(uintptr_t)task;
+	if (i < 1 || i > nitems ||
+	    __atomic_fetch_add(&seen[i], 1, __ATOMIC_RELAXED) != 0) {
+		(*dups)++;
+	}
+}
+
+static void *thief_thread(void *arg)
+{
+	struct thief *t = arg;
+	long my_dups = 0;
+	void *task;
+
+	for (;;) {
+		if ((task = ws_deque_steal(dq)) != NULL) {
+			take(task, &my_dups);
+			t->stolen++;
+		} else if (errno == EAGAIN) {
+			t->aborts++;
+		} else if (__atomic_load_n(&owner_done, __ATOMIC_ACQUIRE)) {
+			// 所有者已经退出，再确认一次队列确实空了
+			if (ws_deque_size(dq) == 0)
+				break;
+		} else {
+			sched_yield();
+		}
+	}
+	__atomic_fetch_add(&dups, my_dups, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/* 所有者按随机比例push/pop，窃取者不停steal，每个元素必须恰好被取到一次。
+ * 初始容量为2，push的过程中会反复扩容。 */
+static int run(int nthieves, long n, unsigned int seed)
+{
+	struct thief th[MAX_THIEVES];
+	long next = 1, popped = 0, stolen = 0, aborts = 0, missing = 0;
+	long my_dups = 0, i;
+	void *task;
+
+	nitems = n;
+	seen = calloc(n + 1, 1);
+	dq = ws_deque_create(2);
+	owner_done = 0;
+	dups = 0;
+	memset(th, 0, sizeof(th));
+
+	for (i = 0; i < nthieves; i++)
+		pthread_create(&th[i].tid, NULL, thief_thread, &th[i]);
+
+	while (next <= n) {
+		int burst = rand_r(&seed) % 64 + 1;
+		while (burst-- > 0 && next <= n) {
+			if (ws_deque_push(dq, (void *)(uintptr_t)next++) != 0) {
+				perror("ws_deque_push");
+				return 1;
+			}
+		}
+		burst = rand_r(&seed) % 48;
+		while (burst-- > 0 && (task = ws_deque_pop(dq)) != NULL) {
+			take(task, &my_dups);
+			popped++;
+		}
+	}
+	while ((task = ws_deque_pop(dq)) != NULL) {
+		take(task, &my_dups);
+		popped++;
+	}
+	__atomic_store_n(&owner_done, 1, __ATOMIC_RELEASE);
+
+	for (i = 0; i < nthieves; i++) {
+		pthread_join(th[i].tid, NULL);
+		stolen += th[i].stolen;
+		aborts += th[i].aborts;
+	}
+	for (i = 1; i <= n; i++) {
+		if (seen[i] == 0)
+			missing++;
+	}
+	dups += my_dups;
+
+	printf("thieves=%2d items=%ld popped=%ld stolen=%ld aborts=%ld "
+	       "capacity=%zu missing=%ld dups=%ld\n",
+	       nthieves, n, popped, stolen, aborts, ws_deque_capacity(dq),
+	       missing, dups);
+
+	ws_deque_destroy(dq);
+	free(seen);
+	return missing != 0 || dups != 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int thieves[] = { 0, 1, 2, 4, 8 };
+	long n = argc > 1 ? atol(argv[1]) : 1000000;
+	int i, rc = 0;
+
+	for (i = 0; i < (int)(sizeof(thieves) / sizeof(thieves[0])); i++)
+		rc |= run(thieves[i], n, i + 1);
+
+	printf("%s\n", rc ? "FAILED" : "OK");
+	return rc;
+}
@@ -10,6 +10,10 @@
 --     set_kind("static")
 --     add_files("spsc_queue.c")
 --
+-- target("ws_deque")
+--     set_kind("static")
+--     add_files("ws_deque.c")
+--
 -- target("queue_mpmc_test")
 --     set_kind("binary")
 --     add_files("mpmc_test.c")
@@ -24,3 +28,40 @@
 --     set_kind("binary")
 --     add_files("spsc_test.c")
 --     add_deps("spsc_queue")
+
+-- target("queue_wait_bench")
+--     set_kind("binary")
+--     add_files("wait_bench.c")
+--     add_deps("spsc_queue")
+
+-- target("queue_wait_bench_mpmc")
+--     set_kind("binary")
+--     add_files("wait_bench.c")
+--     add_defines("WAIT_BENCH_MPMC")
+--     add_deps("mpmc_queue")
+
+-- target("queue_shm_bench")
+--     set_kind("binary")
+--     add_files("shm_bench.c")
+--     add_deps("spsc_queue")
+
+-- target("queue_shm_bench_ring")
+--     set_kind("binary")
+--     add_files("shm_bench.c")
+--     add_defines("SHM_BENCH_RING")
+--     add_deps("ringbuffer")
+
+-- target("queue_ws_test")
+--     set_kind("binary")
+--     add_files("ws_test.c")
+--     add_deps("ws_deque")
+
+-- target("queue_ws_bench")
+--     set_kind("binary")
+--     add_files("ws_bench.c")
+--     add_deps("ws_deque")
+
+-- target("queue_bench")
+--     set_kind("binary")
+--     add_files("queue_bench.c", "queue_bench_spsc.c", "queue_bench_mpmc.c", "queue_bench_ring.c")
+--     add_deps("spsc_queue", "mpmc_queue", "ringbuffer")